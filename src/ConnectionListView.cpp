@@ -26,6 +26,7 @@
 
 #include "ConnectionViewer.h"
 #include <algorithm>
+#include <unordered_set>
 #include "ConnectionListView.h"
 #include "Utility.h"
 #include "resource.h"
@@ -57,6 +58,8 @@ LPCTSTR ConnectionListView::GetColumnName(int Column)
 		TEXT("OutBandwidth"),
 		TEXT("MaxInBandwidth"),
 		TEXT("MaxOutBandwidth"),
+		TEXT("ASNumber"),
+		TEXT("Organization"),
 	};
 
 	cvStaticAssert(cvLengthOf(ColumnNameList) == NUM_COLUMN_TYPES);
@@ -93,6 +96,8 @@ ConnectionListView::ConnectionListView(const ProgramCore &Core, const Connection
 		{COLUMN_COUNTRY,				COLUMN_ALIGN_LEFT,		true,	2},
 		{COLUMN_CITY,					COLUMN_ALIGN_LEFT,		true,	8},
 		{COLUMN_LOCATION,				COLUMN_ALIGN_LEFT,		false,	8},
+		{COLUMN_AS_NUMBER,				COLUMN_ALIGN_LEFT,		false,	5},
+		{COLUMN_ORGANIZATION,			COLUMN_ALIGN_LEFT,		false,	12},
 		{COLUMN_STATE,					COLUMN_ALIGN_LEFT,		true,	8},
 		{COLUMN_DURATION,				COLUMN_ALIGN_LEFT,		true,	5},
 		{COLUMN_IN_BANDWIDTH,			COLUMN_ALIGN_RIGHT,		true,	5},
@@ -198,14 +203,15 @@ void ConnectionListView::OnListUpdated()
 	Redraw();
 }
 
-void ConnectionListView::OnHostNameFound(const IPAddress &Address)
+void ConnectionListView::OnHostNamesFound(const std::vector<IPAddress> &AddressList)
 {
-	for (int i = m_ScrollTop; i < m_NumVisibleItems; i++) {
-		ItemInfo &Item = m_ItemList[i];
+	const std::unordered_set<IPAddress, HostManager::AddressHash> AddressSet(AddressList.begin(), AddressList.end());
+	int First, Last;
 
-		if (Item.Iterator->Info.RemoteAddress == Address) {
+	GetVisibleItemRange(&First, &Last);
+	for (int i = First; i < Last; i++) {
+		if (AddressSet.find(m_ItemList[i].Iterator->Info.RemoteAddress) != AddressSet.end())
 			RedrawItem(i);
-		}
 	}
 }
 
@@ -340,6 +346,16 @@ bool ConnectionListView::GetItemText(int Row, int Column, LPTSTR pText, int MaxT
 			FormatInt64(Item.MaxOutBitsPerSecond / 8, pText, MaxTextLength);
 		break;
 
+	case COLUMN_AS_NUMBER:
+		if (Item.ASNumber != 0)
+			FormatString(pText, MaxTextLength, TEXT("AS%u"), Item.ASNumber);
+		break;
+
+	case COLUMN_ORGANIZATION:
+		if (Item.pASOrganization != nullptr)
+			::lstrcpyn(pText, Item.pASOrganization, MaxTextLength);
+		break;
+
 	default:
 		cvDebugBreak();
 		return false;
@@ -373,6 +389,15 @@ bool ConnectionListView::GetItemLongText(int Row, int Column, LPTSTR pText, int
 						 Item.CityInfo.Longitude);
 		break;
 
+	case COLUMN_AS_NUMBER:
+		if (Item.ASNumber != 0 && Item.pASOrganization != nullptr)
+			FormatString(pText, MaxTextLength, TEXT("AS%u (%s)"),
+						 Item.ASNumber,
+						 Item.pASOrganization);
+		else
+			return GetItemText(Row, Column, pText, MaxTextLength);
+		break;
+
 	case COLUMN_IN_BYTES:
 		if (Item.EnableStatistics
 				&& (Item.Statistics.Mask & ConnectionStatistics::MASK_BYTES) != 0)
@@ -544,13 +569,16 @@ template<typename T> int CompareValue(T Value1, T Value2)
 
 class ListItemCompare
 {
+	const ConnectionLog &m_Log;
 	const std::vector<int> &m_SortOrder;
 	const bool m_Ascending;
 	const ULONGLONG m_UpdatedTime;
 
 public:
-	ListItemCompare(const std::vector<int> &SortOrder, bool Ascending, ULONGLONG UpdatedTime)
-		: m_SortOrder(SortOrder)
+	ListItemCompare(const ConnectionLog &Log, const std::vector<int> &SortOrder,
+					bool Ascending, ULONGLONG UpdatedTime)
+		: m_Log(Log)
+		, m_SortOrder(SortOrder)
 		, m_Ascending(Ascending)
 		, m_UpdatedTime(UpdatedTime)
 	{
@@ -575,7 +603,8 @@ public:
 			case ConnectionListView::COLUMN_PROCESS_NAME:
 				if (Item1.pProcessName != nullptr) {
 					if (Item2.pProcessName != nullptr)
-						Cmp = ::lstrcmpi(Item1.pProcessName, Item2.pProcessName);
+						Cmp = CompareValue(m_Log.GetCollationRank(Item1.pProcessName),
+										   m_Log.GetCollationRank(Item2.pProcessName));
 					else
 						Cmp = -1;
 				} else if (Item2.pProcessName != nullptr)
@@ -585,7 +614,8 @@ public:
 			case ConnectionListView::COLUMN_PROCESS_PATH:
 				if (Item1.pProcessPath != nullptr) {
 					if (Item2.pProcessPath != nullptr)
-						Cmp = ::lstrcmpi(Item1.pProcessPath, Item2.pProcessPath);
+						Cmp = CompareValue(m_Log.GetCollationRank(Item1.pProcessPath),
+										   m_Log.GetCollationRank(Item2.pProcessPath));
 					else
 						Cmp = -1;
 				} else if (Item2.pProcessPath != nullptr)
@@ -625,7 +655,8 @@ public:
 			case ConnectionListView::COLUMN_REMOTE_HOST:
 				if (Item1.pRemoteHostName != nullptr) {
 					if (Item2.pRemoteHostName != nullptr)
-						Cmp = ::lstrcmpi(Item1.pRemoteHostName, Item2.pRemoteHostName);
+						Cmp = CompareValue(m_Log.GetCollationRank(Item1.pRemoteHostName),
+										   m_Log.GetCollationRank(Item2.pRemoteHostName));
 					else
 						Cmp = -1;
 				} else if (Item2.pRemoteHostName != nullptr)
@@ -778,6 +809,27 @@ public:
 				} else if (Item2.MaxOutBitsPerSecond >= 0)
 					Cmp = 1;
 				break;
+
+			case ConnectionListView::COLUMN_AS_NUMBER:
+				if (Item1.ASNumber != 0) {
+					if (Item2.ASNumber != 0)
+						Cmp = CompareValue(Item1.ASNumber, Item2.ASNumber);
+					else
+						Cmp = -1;
+				} else if (Item2.ASNumber != 0)
+					Cmp = 1;
+				break;
+
+			case ConnectionListView::COLUMN_ORGANIZATION:
+				if (Item1.pASOrganization != nullptr) {
+					if (Item2.pASOrganization != nullptr)
+						Cmp = CompareValue(m_Log.GetCollationRank(Item1.pASOrganization),
+										   m_Log.GetCollationRank(Item2.pASOrganization));
+					else
+						Cmp = -1;
+				} else if (Item2.pASOrganization != nullptr)
+					Cmp = 1;
+				break;
 			}
 
 			if (Cmp != 0)
@@ -791,7 +843,7 @@ public:
 bool ConnectionListView::SortItems()
 {
 	std::sort(m_ItemList.begin(), m_ItemList.end(),
-			  ListItemCompare(m_SortOrder, m_SortAscending, m_UpdatedTime.Tick));
+			  ListItemCompare(m_Log, m_SortOrder, m_SortAscending, m_UpdatedTime.Tick));
 
 	m_SelectedItem = -1;
 	for (size_t i = 0; i < m_ItemList.size(); i++) {
@@ -60,6 +60,8 @@ public:
 		COLUMN_OUT_BANDWIDTH,
 		COLUMN_MAX_IN_BANDWIDTH,
 		COLUMN_MAX_OUT_BANDWIDTH,
+		COLUMN_AS_NUMBER,
+		COLUMN_ORGANIZATION,
 		COLUMN_TRAILER
 	};
 	enum { NUM_COLUMN_TYPES = COLUMN_TRAILER };
@@ -69,7 +71,7 @@ public:
 	ConnectionListView(const ProgramCore &Core, const ConnectionLog &Log);
 	~ConnectionListView();
 	void OnListUpdated();
-	void OnHostNameFound(const IPAddress &Address);
+	void OnHostNamesFound(const std::vector<IPAddress> &AddressList);
 	int NumItems() const override;
 	bool GetItemText(int Row, int Column, LPTSTR pText, int MaxTextLength) const override;
 	bool GetItemLongText(int Row, int Column, LPTSTR pText, int MaxTextLength) const override;
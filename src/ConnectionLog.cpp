@@ -25,7 +25,12 @@
 
 
 #include "ConnectionViewer.h"
+#include <algorithm>
+#include <unordered_map>
 #include "ProgramCore.h"
+#include "zlib/zlib.h"
+
+#pragma comment(lib, "zlib.lib")
 
 
 namespace CV
@@ -36,16 +41,40 @@ ConnectionLog::ConnectionLog(const ProgramCore &Core)
 	, m_MaxLog(1000)
 	, m_IDCount(0)
 	, m_NumCurrentConnections(0)
+	, m_StringPool(true)
+	, m_CoalesceWindow(0)
+	, m_MergeThreads(0)
+	, m_NumMergeWorkers(0)
+	, m_MergeAbort(false)
+	, m_ColdAge(0)
+	, m_NumColdItems(0)
+	, m_ColdDataSize(0)
+	, m_ColdBlockSerial(0)
+	, m_ColdCacheClock(0)
 {
+	for (int i = 0; i < COLD_CACHE_BLOCKS; i++) {
+		m_ColdCache[i].Serial = 0;
+		m_ColdCache[i].LastUsed = 0;
+	}
 }
 
 ConnectionLog::~ConnectionLog()
 {
+	EndMergeWorkers();
 }
 
 void ConnectionLog::Clear()
 {
+	// The strings are freed at once, so the references are not released one by one
 	m_ItemList.clear();
+	m_AddressIndex.clear();
+	m_ColdBlockList.clear();
+	m_NumColdItems = 0;
+	m_ColdDataSize = 0;
+	for (int i = 0; i < COLD_CACHE_BLOCKS; i++) {
+		m_ColdCache[i].Serial = 0;
+		m_ColdCache[i].ItemList.clear();
+	}
 	m_StringPool.Clear();
 	m_NumCurrentConnections = 0;
 }
@@ -56,8 +85,7 @@ void ConnectionLog::SetMaxLog(size_t Max)
 		m_MaxLog = Max;
 		if (Max < m_NumCurrentConnections)
 			Max = m_NumCurrentConnections;
-		while (m_ItemList.size() > Max)
-			m_ItemList.pop_back();
+		TrimItems(Max);
 	}
 }
 
@@ -68,7 +96,7 @@ size_t ConnectionLog::GetMaxLog() const
 
 size_t ConnectionLog::NumItems() const
 {
-	return m_ItemList.size();
+	return m_ItemList.size() + m_NumColdItems;
 }
 
 size_t ConnectionLog::NumCurrentConnections() const
@@ -76,146 +104,382 @@ size_t ConnectionLog::NumCurrentConnections() const
 	return m_NumCurrentConnections;
 }
 
+size_t ConnectionLog::NumHotItems() const
+{
+	return m_ItemList.size();
+}
+
+size_t ConnectionLog::NumColdItems() const
+{
+	return m_NumColdItems;
+}
+
+size_t ConnectionLog::GetColdDataSize() const
+{
+	return m_ColdDataSize;
+}
+
+void ConnectionLog::SetColdAge(DWORD Age)
+{
+	m_ColdAge = Age;
+}
+
+DWORD ConnectionLog::GetColdAge() const
+{
+	return m_ColdAge;
+}
+
+void ConnectionLog::SetCoalesceWindow(DWORD Window)
+{
+	m_CoalesceWindow = Window;
+}
+
+DWORD ConnectionLog::GetCoalesceWindow() const
+{
+	return m_CoalesceWindow;
+}
+
+// 0 uses as many threads as processors
+void ConnectionLog::SetMergeThreads(int Threads)
+{
+	m_MergeThreads = Threads;
+}
+
+int ConnectionLog::GetMergeThreads() const
+{
+	return m_MergeThreads;
+}
+
+// Uncompressed items only; use GetItemInfo() to reach compressed ones.
 const ConnectionLog::ItemList &ConnectionLog::GetItemList() const
 {
 	return m_ItemList;
 }
 
+// Items at NumHotItems() and after are compressed. A reference to such an
+// item stays valid only until a few other cold blocks have been accessed.
 const ConnectionLog::ItemInfo &ConnectionLog::GetItemInfo(size_t Index) const
 {
-	return m_ItemList[Index];
+	if (Index < m_ItemList.size())
+		return m_ItemList[Index];
+
+	Index -= m_ItemList.size();
+	const ColdBlock &Block = m_ColdBlockList[Index / COLD_BLOCK_ITEMS];
+	return GetColdItemList(Block)[Index % COLD_BLOCK_ITEMS];
 }
 
-void ConnectionLog::OnListUpdated()
+size_t ConnectionLog::GetLiveStringSize() const
 {
-	if (m_MaxLog == 0)
-		return;
+	return m_StringPool.GetLiveSize();
+}
 
-	const TimeAndTick CurTime = m_Core.GetUpdatedTime();
-	const int NumConnections = m_Core.NumConnections();
+size_t ConnectionLog::GetDeadStringSize() const
+{
+	return m_StringPool.GetDeadSize();
+}
+
+size_t ConnectionLog::GetStringPoolSize() const
+{
+	return m_StringPool.GetDataSize();
+}
+
+// Strings of the items can be ordered by comparing the ranks instead of lstrcmpi()
+UINT ConnectionLog::GetCollationRank(LPCTSTR pString) const
+{
+	return m_StringPool.GetCollationRank(pString);
+}
+
+// The returned string is not referenced, and is valid until the next update
+// unless it is referenced by RestoreItem().
+LPCTSTR ConnectionLog::InternString(LPCTSTR pString)
+{
+	LPCTSTR pPooledString = m_StringPool.Acquire(pString);
+	m_StringPool.Release(pPooledString);
+	return pPooledString;
+}
+
+// Appends an item restored from a saved log as the oldest one.
+// String members must be interned with InternString().
+bool ConnectionLog::RestoreItem(const ItemInfo &Item)
+{
+	if (NumItems() >= m_MaxLog || !m_ColdBlockList.empty())
+		return false;
+
+	m_ItemList.push_back(Item);
+	IndexItem(m_ItemList.back());
+	m_StringPool.AddRef(Item.pProcessName);
+	m_StringPool.AddRef(Item.pProcessPath);
+	m_StringPool.AddRef(Item.pRemoteHostName);
+	m_StringPool.AddRef(Item.pASOrganization);
+	if (Item.ID > m_IDCount)
+		m_IDCount = Item.ID;
+
+	return true;
+}
+
+bool ConnectionLog::GetColdItemPosition(size_t ColdIndex, ULONGLONG *pSerial, size_t *pOffset) const
+{
+	if (ColdIndex >= m_NumColdItems)
+		return false;
+	*pSerial = m_ColdBlockList[ColdIndex / COLD_BLOCK_ITEMS].Serial;
+	*pOffset = ColdIndex % COLD_BLOCK_ITEMS;
+	return true;
+}
+
+bool ConnectionLog::FindColdItem(ULONGLONG Serial, size_t Offset, size_t *pColdIndex) const
+{
+	// Blocks are ordered by descending serial number.
+	if (m_ColdBlockList.empty() || Serial > m_ColdBlockList.front().Serial)
+		return false;
+	const size_t Block = (size_t)(m_ColdBlockList.front().Serial - Serial);
+	if (Block >= m_ColdBlockList.size()
+			|| m_ColdBlockList[Block].Serial != Serial
+			|| Offset >= m_ColdBlockList[Block].NumItems)
+		return false;
+	*pColdIndex = Block * COLD_BLOCK_ITEMS + Offset;
+	return true;
+}
+
+size_t ConnectionLog::NumColdBlocks() const
+{
+	return m_ColdBlockList.size();
+}
+
+// Copies the compressed items of a block, so that they can be decompressed on another thread.
+// The items point to the strings in the list, which are valid only until the next update.
+void ConnectionLog::GetColdBlock(size_t Index, size_t *pNumItems, std::vector<BYTE> *pData,
+								 const std::vector<LPCTSTR> **ppStringList) const
+{
+	const ColdBlock &Block = m_ColdBlockList[Index];
+
+	*pNumItems = Block.NumItems;
+	pData->assign(Block.Data.begin(), Block.Data.end());
+	*ppStringList = &Block.StringList;
+}
+
+// The block always decompresses to COLD_BLOCK_ITEMS items, of which the first NumItems are valid
+bool ConnectionLog::DecompressColdBlock(const std::vector<BYTE> &Data, std::vector<ItemInfo> *pItemList)
+{
+	pItemList->resize(COLD_BLOCK_ITEMS);
+	uLongf Size = (uLongf)(COLD_BLOCK_ITEMS * sizeof(ItemInfo));
+	return ::uncompress(reinterpret_cast<Bytef*>(pItemList->data()), &Size,
+						Data.data(), (uLong)Data.size()) == Z_OK;
+}
+
+void ConnectionLog::OnListUpdated(const ConnectionSnapshot &Snapshot)
+{
+	if (m_MaxLog != 0)
+		AddSnapshot(Snapshot);
+}
+
+static UINT HashConnection(const ConnectionInfo &Info)
+{
+	UINT Hash = 2166136261U;
+
+	Hash = (Hash ^ Info.PID) * 16777619U;
+	Hash = (Hash ^ (((UINT)Info.LocalPort << 16) | Info.RemotePort)) * 16777619U;
+	Hash = (Hash ^ (UINT)Info.Protocol) * 16777619U;
+	if (Info.RemoteAddress.Type == IP_ADDRESS_V4) {
+		Hash = (Hash ^ Info.RemoteAddress.V4.Address) * 16777619U;
+	} else {
+		for (int i = 0; i < 4; i++)
+			Hash = (Hash ^ Info.RemoteAddress.V6.DWords[i]) * 16777619U;
+	}
+	Hash = (Hash ^ (UINT)Info.CreateTimestamp) * 16777619U;
+	Hash = (Hash ^ (UINT)(Info.CreateTimestamp >> 32)) * 16777619U;
+
+	return Hash;
+}
+
+static bool IsSameConnection(const ConnectionLog::ItemInfo &Item,
+							 const ConnectionSnapshot::ItemInfo &NewItem)
+{
+	return Item.Info.PID == NewItem.Info.PID
+		&& Item.Info.RemotePort == NewItem.Info.RemotePort
+		&& Item.Info.LocalPort == NewItem.Info.LocalPort
+		&& Item.Info.Protocol == NewItem.Info.Protocol
+		&& Item.Info.RemoteAddress == NewItem.Info.RemoteAddress
+		&& Item.Info.LocalAddress == NewItem.Info.LocalAddress
+		&& Item.Info.CreateTimestamp == NewItem.Info.CreateTimestamp
+		&& ((Item.Statistics.Mask & ConnectionStatistics::MASK_BYTES) == 0
+			|| (NewItem.Statistics.Mask & ConnectionStatistics::MASK_BYTES) == 0
+			|| (NewItem.Statistics.OutBytes >= Item.Statistics.OutBytes
+				&& NewItem.Statistics.InBytes >= Item.Statistics.InBytes));
+}
+
+static void UpdateItem(ConnectionLog::ItemInfo &Item,
+					   const ConnectionSnapshot::ItemInfo &NewItem, const TimeAndTick &CurTime)
+{
+	Item.Info.State = NewItem.Info.State;
+	if (NewItem.EnableStatistics
+			&& (NewItem.Statistics.Mask & ConnectionStatistics::MASK_BYTES) != 0) {
+		Item.Statistics.OutBytes = NewItem.Statistics.OutBytes;
+		Item.Statistics.InBytes = NewItem.Statistics.InBytes;
+	}
+	if (NewItem.EnableStatistics
+			&& (NewItem.Statistics.Mask & ConnectionStatistics::MASK_BANDWIDTH) != 0) {
+		if ((Item.Statistics.Mask & ConnectionStatistics::MASK_BANDWIDTH) != 0) {
+			ULONGLONG Diff1 = Item.UpdatedTime.Tick - Item.CreatedTime.Tick;
+			ULONGLONG Diff2 = CurTime.Tick - Item.UpdatedTime.Tick;
+
+			if (Diff1 == 0) {
+				if (Diff2 == 0)
+					Diff1 = Diff2 = 1;
+				else
+					Diff1 = Diff2;
+			}
+			Item.Statistics.OutBitsPerSecond =
+				((Item.Statistics.OutBitsPerSecond * Diff1) +
+				 (NewItem.Statistics.OutBitsPerSecond * Diff2)) / (Diff1 + Diff2);
+			Item.Statistics.InBitsPerSecond =
+				((Item.Statistics.InBitsPerSecond * Diff1) +
+				 (NewItem.Statistics.InBitsPerSecond * Diff2)) / (Diff1 + Diff2);
+		} else {
+			Item.Statistics.OutBitsPerSecond = NewItem.Statistics.OutBitsPerSecond;
+			Item.Statistics.InBitsPerSecond = NewItem.Statistics.InBitsPerSecond;
+		}
+		if (Item.MaxInBitsPerSecond < (LONGLONG)NewItem.Statistics.InBitsPerSecond)
+			Item.MaxInBitsPerSecond = (LONGLONG)NewItem.Statistics.InBitsPerSecond;
+		if (Item.MaxOutBitsPerSecond < (LONGLONG)NewItem.Statistics.OutBitsPerSecond)
+			Item.MaxOutBitsPerSecond = (LONGLONG)NewItem.Statistics.OutBitsPerSecond;
+	}
+	Item.UpdatedTime = CurTime;
+}
+
+class UpdatedItemPredicate
+{
+	ULONGLONG m_Tick;
+
+public:
+	UpdatedItemPredicate(ULONGLONG Tick) : m_Tick(Tick) {}
+	bool operator()(const ConnectionLog::ItemInfo &Item) const
+	{
+		return Item.UpdatedTime.Tick == m_Tick;
+	}
+};
+
+void ConnectionLog::AddSnapshot(const ConnectionSnapshot &Snapshot)
+{
+	const TimeAndTick CurTime = Snapshot.Time;
+	const int NumConnections = (int)Snapshot.ItemList.size();
+
+	// The items of the previous update are at the front of the list
+	size_t NumPrevItems = 0;
+	while (NumPrevItems < m_ItemList.size()
+			&& m_ItemList[NumPrevItems].UpdatedTime.Tick == m_UpdatedTime.Tick)
+		NumPrevItems++;
+
+	MatchItems(Snapshot, NumPrevItems);
+
+	// Move the closed connections behind the ones still alive
+	size_t FirstClosed = 0;
+	while (FirstClosed < NumPrevItems
+			&& m_ItemList[FirstClosed].UpdatedTime.Tick == CurTime.Tick)
+		FirstClosed++;
+	if (FirstClosed < NumPrevItems) {
+		UnindexItems(FirstClosed, NumPrevItems);
+		std::stable_partition(m_ItemList.begin() + FirstClosed, m_ItemList.begin() + NumPrevItems,
+							  UpdatedItemPredicate(CurTime.Tick));
+		IndexItems(FirstClosed, NumPrevItems);
+	}
 
 	for (int i = 0; i < NumConnections; i++) {
+		if (m_MatchList[i] >= 0)
+			continue;
+
 		ItemInfo NewItem;
 
-		m_Core.GetConnectionInfo(i, &NewItem.Info);
-		NewItem.EnableStatistics = m_Core.GetConnectionStatistics(i, &NewItem.Statistics);
-		bool Exists = false;
-		ItemList::iterator j = m_ItemList.begin();
-		for (j += i; j != m_ItemList.end(); j++) {
-			ItemInfo &Item = *j;
+		NewItem.Info = Snapshot.ItemList[i].Info;
+		NewItem.EnableStatistics = Snapshot.ItemList[i].EnableStatistics;
+		NewItem.Statistics = Snapshot.ItemList[i].Statistics;
 
-			if (Item.UpdatedTime.Tick != m_UpdatedTime.Tick)
-				break;
-			if (Item.Info.PID == NewItem.Info.PID
-					&& Item.Info.RemotePort == NewItem.Info.RemotePort
-					&& Item.Info.LocalPort == NewItem.Info.LocalPort
-					&& Item.Info.Protocol == NewItem.Info.Protocol
-					&& Item.Info.RemoteAddress == NewItem.Info.RemoteAddress
-					&& Item.Info.LocalAddress == NewItem.Info.LocalAddress
-					&& Item.Info.CreateTimestamp == NewItem.Info.CreateTimestamp
-					&& ((Item.Statistics.Mask & ConnectionStatistics::MASK_BYTES) == 0
-						|| (NewItem.Statistics.Mask & ConnectionStatistics::MASK_BYTES) == 0
-						|| (NewItem.Statistics.OutBytes >= Item.Statistics.OutBytes
-							&& NewItem.Statistics.InBytes >= Item.Statistics.InBytes))) {
-				Item.Info.State = NewItem.Info.State;
-				if (NewItem.EnableStatistics
-						&& (NewItem.Statistics.Mask & ConnectionStatistics::MASK_BYTES) != 0) {
-					Item.Statistics.OutBytes = NewItem.Statistics.OutBytes;
-					Item.Statistics.InBytes = NewItem.Statistics.InBytes;
-				}
-				if (NewItem.EnableStatistics
-						&& (NewItem.Statistics.Mask & ConnectionStatistics::MASK_BANDWIDTH) != 0) {
-					if ((Item.Statistics.Mask & ConnectionStatistics::MASK_BANDWIDTH) != 0) {
-						ULONGLONG Diff1 = Item.UpdatedTime.Tick - Item.CreatedTime.Tick;
-						ULONGLONG Diff2 = CurTime.Tick - Item.UpdatedTime.Tick;
-
-						if (Diff1 == 0) {
-							if (Diff2 == 0)
-								Diff1 = Diff2 = 1;
-							else
-								Diff1 = Diff2;
-						}
-						Item.Statistics.OutBitsPerSecond =
-							((Item.Statistics.OutBitsPerSecond * Diff1) +
-							 (NewItem.Statistics.OutBitsPerSecond * Diff2)) / (Diff1 + Diff2);
-						Item.Statistics.InBitsPerSecond =
-							((Item.Statistics.InBitsPerSecond * Diff1) +
-							 (NewItem.Statistics.InBitsPerSecond * Diff2)) / (Diff1 + Diff2);
-					} else {
-						Item.Statistics.OutBitsPerSecond = NewItem.Statistics.OutBitsPerSecond;
-						Item.Statistics.InBitsPerSecond = NewItem.Statistics.InBitsPerSecond;
-					}
-					if (Item.MaxInBitsPerSecond < (LONGLONG)NewItem.Statistics.InBitsPerSecond)
-						Item.MaxInBitsPerSecond = (LONGLONG)NewItem.Statistics.InBitsPerSecond;
-					if (Item.MaxOutBitsPerSecond < (LONGLONG)NewItem.Statistics.OutBitsPerSecond)
-						Item.MaxOutBitsPerSecond = (LONGLONG)NewItem.Statistics.OutBitsPerSecond;
-				}
-				Item.UpdatedTime = CurTime;
-				if (j != m_ItemList.begin()) {
-					NewItem = Item;
-					j = m_ItemList.erase(j);
-					m_ItemList.push_front(NewItem);
-				}
-				Exists = true;
-				break;
-			}
+		NewItem.ID = ++m_IDCount;
+		NewItem.CreatedTime = CurTime;
+		NewItem.UpdatedTime = CurTime;
+		if (NewItem.Info.CreateTimestamp > 0)
+			NewItem.ConnectionCreateTickCount = (LONGLONG)CurTime.Tick -
+												((LONGLONG)FileTimeToUInt64(CurTime.Time) - NewItem.Info.CreateTimestamp) / 10000;
+
+		if ((NewItem.Statistics.Mask & ConnectionStatistics::MASK_BANDWIDTH) != 0) {
+			NewItem.MaxInBitsPerSecond = (LONGLONG)NewItem.Statistics.InBitsPerSecond;
+			NewItem.MaxOutBitsPerSecond = (LONGLONG)NewItem.Statistics.OutBitsPerSecond;
+		} else {
+			NewItem.MaxInBitsPerSecond = -1;
+			NewItem.MaxOutBitsPerSecond = -1;
 		}
 
-		if (!Exists) {
-			NewItem.ID = ++m_IDCount;
-			NewItem.CreatedTime = CurTime;
-			NewItem.UpdatedTime = CurTime;
-			if (NewItem.Info.CreateTimestamp > 0)
-				NewItem.ConnectionCreateTickCount = (LONGLONG)CurTime.Tick -
-													((LONGLONG)FileTimeToUInt64(CurTime.Time) - NewItem.Info.CreateTimestamp) / 10000;
+		ProcessList::ProcessInfoP ProcessInfo;
+		if (m_Core.GetProcessInfo(NewItem.Info.PID, &ProcessInfo)) {
+			NewItem.pProcessName = m_StringPool.Acquire(ProcessInfo.pFileName);
+			NewItem.pProcessPath = m_StringPool.Acquire(ProcessInfo.pFilePath);
+			NewItem.hProcessIcon = ProcessInfo.hIcon;
+		} else {
+			NewItem.pProcessName = nullptr;
+			NewItem.pProcessPath = nullptr;
+			NewItem.hProcessIcon = nullptr;
+		}
+		NewItem.pRemoteHostName = nullptr;
+		NewItem.EnableCityInfo = false;
 
-			if ((NewItem.Statistics.Mask & ConnectionStatistics::MASK_BANDWIDTH) != 0) {
-				NewItem.MaxInBitsPerSecond = (LONGLONG)NewItem.Statistics.InBitsPerSecond;
-				NewItem.MaxOutBitsPerSecond = (LONGLONG)NewItem.Statistics.OutBitsPerSecond;
-			} else {
-				NewItem.MaxInBitsPerSecond = -1;
-				NewItem.MaxOutBitsPerSecond = -1;
-			}
+		// The AS database is cached by network block, so it is looked up one by one
+		GeoIPManager::ASInfo AS;
+		if (NewItem.Info.Protocol == ConnectionProtocol::TCP
+				&& m_Core.GetGeoIPASInfo(NewItem.Info.RemoteAddress, &AS)) {
+			NewItem.ASNumber = AS.Number;
+			NewItem.pASOrganization =
+				AS.Organization[0] != _T('\0') ? m_StringPool.Acquire(AS.Organization) : nullptr;
+		} else {
+			NewItem.ASNumber = 0;
+			NewItem.pASOrganization = nullptr;
+		}
 
-			ProcessList::ProcessInfoP ProcessInfo;
-			if (m_Core.GetProcessInfo(NewItem.Info.PID, &ProcessInfo)) {
-				NewItem.pProcessName = m_StringPool.Set(ProcessInfo.pFileName);
-				NewItem.pProcessPath = m_StringPool.Set(ProcessInfo.pFilePath);
-				NewItem.hProcessIcon = ProcessInfo.hIcon;
-			} else {
-				NewItem.pProcessName = nullptr;
-				NewItem.pProcessPath = nullptr;
-				NewItem.hProcessIcon = nullptr;
-			}
-			NewItem.pRemoteHostName = nullptr;
+		NewItem.NumConnections = 1;
+		::ZeroMemory(NewItem.DurationHistogram, sizeof(NewItem.DurationHistogram));
 
-			NewItem.EnableCityInfo =
-				NewItem.Info.Protocol == ConnectionProtocol::TCP
-				&& m_Core.GetGeoIPCityInfo(NewItem.Info.RemoteAddress, &NewItem.CityInfo);
+		m_ItemList.push_front(NewItem);
+		ItemInfo &Item = m_ItemList.front();
+		IndexItem(Item);
 
-			m_ItemList.push_front(NewItem);
+		// The locations of the new items are looked up together after all are added
+		if (Item.Info.Protocol == ConnectionProtocol::TCP) {
+			m_CityAddressList.push_back(Item.Info.RemoteAddress);
+			m_CityInfoList.push_back(&Item.CityInfo);
+			m_CityFoundList.push_back(&Item.EnableCityInfo);
 		}
 	}
 
-	const size_t MaxLog = max(m_MaxLog, (size_t)NumConnections);
-	while (m_ItemList.size() > MaxLog)
-		m_ItemList.pop_back();
+	if (!m_CityAddressList.empty()) {
+		m_Core.GetGeoIPCityInfoBatch(m_CityAddressList.data(), m_CityAddressList.size(),
+									 m_CityInfoList.data(), m_CityFoundList.data());
+		m_CityAddressList.clear();
+		m_CityInfoList.clear();
+		m_CityFoundList.clear();
+	}
+
+	if (m_CoalesceWindow != 0 && m_UpdatedTime.Tick != 0)
+		CoalesceClosedItems(NumConnections, CurTime.Tick);
+
+	TrimItems(max(m_MaxLog, (size_t)NumConnections));
 
 	for (ItemList::iterator i = m_ItemList.begin(); i != m_ItemList.end(); i++) {
 		if (CurTime.Tick - i->UpdatedTime.Tick >= 30 * 1000)
 			break;
 		if (i->pRemoteHostName == nullptr
 				&& CurTime.Tick - i->CreatedTime.Tick < 30 * 1000) {
-			TCHAR szHostName[256];
+			LPCTSTR pHostName = m_Core.FindHostName(i->Info.RemoteAddress);
 
-			if (m_Core.GetHostName(i->Info.RemoteAddress,
-								   szHostName, cvLengthOf(szHostName)))
-				i->pRemoteHostName = m_StringPool.Set(szHostName);
+			if (pHostName != nullptr)
+				i->pRemoteHostName = m_StringPool.Acquire(pHostName);
 		}
 	}
 
 	m_NumCurrentConnections = NumConnections;
 	m_UpdatedTime = CurTime;
+
+	if (m_ColdAge != 0)
+		CompressAgedItems(CurTime.Tick);
+
+	m_StringPool.Reclaim(RECLAIM_CHUNKS_PER_UPDATE);
 }
 
 ULONGLONG ConnectionLog::GetUpdatedTickCount() const
@@ -228,27 +492,555 @@ const TimeAndTick &ConnectionLog::GetUpdatedTime() const
 	return m_UpdatedTime;
 }
 
-bool ConnectionLog::OnHostNameFound(const IPAddress &Address)
+// The names of a batch of addresses are set to all the hot items with the addresses.
+// pFoundList receives the addresses that were set to any item.
+void ConnectionLog::OnHostNamesFound(const std::vector<IPAddress> &AddressList,
+									 std::vector<IPAddress> *pFoundList)
 {
-	TCHAR szHostName[256];
+	struct FoundHost
+	{
+		LPCTSTR pHostName;
+		bool Used;
+	};
 
-	if (!m_Core.GetHostName(Address, szHostName, cvLengthOf(szHostName)))
-		return false;
+	typedef std::unordered_map<IPAddress, FoundHost, HostManager::AddressHash> FoundHostMap;
 
-	LPCTSTR pHostName = nullptr;
-	for (ItemList::iterator i = m_ItemList.begin(); i != m_ItemList.end(); i++) {
-		ItemInfo &Item = *i;
+	FoundHostMap HostMap;
+	HostMap.reserve(AddressList.size());
+
+	// The names hold a reference until the pass ends
+	for (std::vector<IPAddress>::const_iterator i = AddressList.begin(); i != AddressList.end(); i++) {
+		if (HostMap.find(*i) != HostMap.end())
+			continue;
+
+		LPCTSTR pHostName = m_Core.FindHostName(*i);
+		if (pHostName != nullptr) {
+			FoundHost Host;
+			Host.pHostName = m_StringPool.Acquire(pHostName);
+			Host.Used = false;
+			HostMap.insert(std::pair<IPAddress, FoundHost>(*i, Host));
+		}
+	}
+	if (HostMap.empty())
+		return;
+
+	for (FoundHostMap::iterator itHost = HostMap.begin(); itHost != HostMap.end(); itHost++) {
+		std::pair<AddressIndex::iterator, AddressIndex::iterator> Range =
+			m_AddressIndex.equal_range(itHost->first);
+
+		for (AddressIndex::iterator i = Range.first; i != Range.second; i++) {
+			ItemInfo &Item = *i->second;
+
+			if (Item.pRemoteHostName != itHost->second.pHostName) {
+				m_StringPool.AddRef(itHost->second.pHostName);
+				m_StringPool.Release(Item.pRemoteHostName);
+				Item.pRemoteHostName = itHost->second.pHostName;
+				itHost->second.Used = true;
+			}
+		}
+	}
+
+	for (FoundHostMap::iterator i = HostMap.begin(); i != HostMap.end(); i++) {
+		if (i->second.Used)
+			pFoundList->push_back(i->first);
+		m_StringPool.Release(i->second.pHostName);
+	}
+}
+
+// Finds the items of the previous update that continue in the snapshot and
+// updates them. m_MatchList receives the index of the matched item for each
+// connection, or -1 for a new connection.
+// Large snapshots are partitioned by the hash of the connection identity and
+// matched on several threads. Each thread owns the index of its own partition,
+// so no locking is needed.
+void ConnectionLog::MatchItems(const ConnectionSnapshot &Snapshot, size_t NumPrevItems)
+{
+	const size_t NumConnections = Snapshot.ItemList.size();
+
+	m_MatchList.assign(NumConnections, -1);
+	if (NumPrevItems == 0 || NumConnections == 0)
+		return;
+
+	m_PrevHashList.resize(NumPrevItems);
+	m_NewHashList.resize(NumConnections);
+
+	int NumThreads = 1;
+	if (NumPrevItems + NumConnections >= PARALLEL_MERGE_THRESHOLD) {
+		NumThreads = m_MergeThreads;
+		if (NumThreads <= 0) {
+			SYSTEM_INFO si;
+			::GetSystemInfo(&si);
+			NumThreads = (int)si.dwNumberOfProcessors;
+		}
+		if (NumThreads > MAX_MERGE_THREADS)
+			NumThreads = MAX_MERGE_THREADS;
+		else if (NumThreads < 1)
+			NumThreads = 1;
+	}
+
+	MergeContext ContextList[MAX_MERGE_THREADS];
+	for (int i = 0; i < NumThreads; i++) {
+		ContextList[i].pThis = this;
+		ContextList[i].pSnapshot = &Snapshot;
+		ContextList[i].NumPrevItems = NumPrevItems;
+		ContextList[i].NumShards = NumThreads;
+		ContextList[i].Shard = i;
+	}
+
+	RunMergePhase(ContextList, NumThreads, MERGE_PHASE_HASH);
+	RunMergePhase(ContextList, NumThreads, MERGE_PHASE_MATCH);
+}
+
+void ConnectionLog::RunMergePhase(MergeContext *pContextList, int NumThreads, MergePhase Phase)
+{
+	HANDLE hDoneList[MAX_MERGE_THREADS];
+	int NumStarted = 0;
+
+	for (int i = 0; i < NumThreads; i++)
+		pContextList[i].Phase = Phase;
+
+	// The first partition is processed on the calling thread
+	for (int i = 1; i < NumThreads; i++) {
+		MergeWorker *pWorker = GetMergeWorker(i - 1);
+		if (pWorker != nullptr) {
+			pWorker->pContext = &pContextList[i];
+			::SetEvent(pWorker->hStartEvent);
+			hDoneList[NumStarted++] = pWorker->hDoneEvent;
+		} else {
+			ProcessMergeContext(pContextList[i]);
+		}
+	}
+	ProcessMergeContext(pContextList[0]);
+
+	if (NumStarted > 0)
+		::WaitForMultipleObjects(NumStarted, hDoneList, TRUE, INFINITE);
+}
+
+void ConnectionLog::ProcessMergeContext(const MergeContext &Context)
+{
+	if (Context.Phase == MERGE_PHASE_HASH)
+		HashItems(Context);
+	else
+		MatchShard(Context);
+}
+
+// Returns nullptr if the worker can't be created
+ConnectionLog::MergeWorker *ConnectionLog::GetMergeWorker(int Index)
+{
+	while (m_NumMergeWorkers <= Index) {
+		MergeWorker &Worker = m_MergeWorkerList[m_NumMergeWorkers];
+
+		Worker.pThis = this;
+		Worker.pContext = nullptr;
+		Worker.hStartEvent = ::CreateEvent(nullptr, FALSE, FALSE, nullptr);
+		Worker.hDoneEvent = ::CreateEvent(nullptr, FALSE, FALSE, nullptr);
+		Worker.hThread = nullptr;
+		if (Worker.hStartEvent != nullptr && Worker.hDoneEvent != nullptr)
+			Worker.hThread = ::CreateThread(nullptr, 0, MergeThread, &Worker, 0, nullptr);
+		if (Worker.hThread == nullptr) {
+			if (Worker.hStartEvent != nullptr)
+				::CloseHandle(Worker.hStartEvent);
+			if (Worker.hDoneEvent != nullptr)
+				::CloseHandle(Worker.hDoneEvent);
+			return nullptr;
+		}
+		m_NumMergeWorkers++;
+	}
+
+	return &m_MergeWorkerList[Index];
+}
+
+void ConnectionLog::EndMergeWorkers()
+{
+	if (m_NumMergeWorkers == 0)
+		return;
+
+	HANDLE hThreadList[MAX_MERGE_THREADS - 1];
+
+	m_MergeAbort = true;
+	for (int i = 0; i < m_NumMergeWorkers; i++) {
+		::SetEvent(m_MergeWorkerList[i].hStartEvent);
+		hThreadList[i] = m_MergeWorkerList[i].hThread;
+	}
+	::WaitForMultipleObjects(m_NumMergeWorkers, hThreadList, TRUE, INFINITE);
+
+	for (int i = 0; i < m_NumMergeWorkers; i++) {
+		MergeWorker &Worker = m_MergeWorkerList[i];
+		::CloseHandle(Worker.hThread);
+		::CloseHandle(Worker.hStartEvent);
+		::CloseHandle(Worker.hDoneEvent);
+	}
+	m_NumMergeWorkers = 0;
+	m_MergeAbort = false;
+}
+
+DWORD WINAPI ConnectionLog::MergeThread(LPVOID pParam)
+{
+	MergeWorker *pWorker = static_cast<MergeWorker*>(pParam);
+	ConnectionLog *pThis = pWorker->pThis;
+
+	for (;;) {
+		::WaitForSingleObject(pWorker->hStartEvent, INFINITE);
+		if (pThis->m_MergeAbort)
+			break;
+		pThis->ProcessMergeContext(*pWorker->pContext);
+		::SetEvent(pWorker->hDoneEvent);
+	}
+
+	return 0;
+}
+
+void ConnectionLog::HashItems(const MergeContext &Context)
+{
+	const size_t NumPrevItems = Context.NumPrevItems;
+	const size_t PrevEnd = NumPrevItems * (Context.Shard + 1) / Context.NumShards;
+	for (size_t i = NumPrevItems * Context.Shard / Context.NumShards; i < PrevEnd; i++)
+		m_PrevHashList[i] = HashConnection(m_ItemList[i].Info);
+
+	const std::vector<ConnectionSnapshot::ItemInfo> &NewList = Context.pSnapshot->ItemList;
+	const size_t NewEnd = NewList.size() * (Context.Shard + 1) / Context.NumShards;
+	for (size_t i = NewList.size() * Context.Shard / Context.NumShards; i < NewEnd; i++)
+		m_NewHashList[i] = HashConnection(NewList[i].Info);
+}
+
+void ConnectionLog::MatchShard(const MergeContext &Context)
+{
+	const UINT NumShards = (UINT)Context.NumShards;
+	const UINT Shard = (UINT)Context.Shard;
+
+	std::vector<int> Members;
+	Members.reserve(Context.NumPrevItems / NumShards + 1);
+	for (size_t i = 0; i < Context.NumPrevItems; i++) {
+		if (m_PrevHashList[i] % NumShards == Shard)
+			Members.push_back((int)i);
+	}
+	if (Members.empty())
+		return;
+
+	size_t TableSize = 16;
+	while (TableSize < Members.size() * 2)
+		TableSize <<= 1;
+	const UINT TableMask = (UINT)TableSize - 1;
+
+	// Insert in reverse order so that each chain is in list order
+	std::vector<int> Head(TableSize, -1);
+	std::vector<int> Next(Members.size());
+	for (size_t i = Members.size(); i-- > 0;) {
+		const UINT Bucket = (m_PrevHashList[Members[i]] / NumShards) & TableMask;
+		Next[i] = Head[Bucket];
+		Head[Bucket] = (int)i;
+	}
+
+	const TimeAndTick &CurTime = Context.pSnapshot->Time;
+	const std::vector<ConnectionSnapshot::ItemInfo> &NewList = Context.pSnapshot->ItemList;
+	for (size_t i = 0; i < NewList.size(); i++) {
+		const UINT Hash = m_NewHashList[i];
+		if (Hash % NumShards != Shard)
+			continue;
+
+		int *pLink = &Head[(Hash / NumShards) & TableMask];
+		for (int j = *pLink; j >= 0; pLink = &Next[j], j = *pLink) {
+			const int Index = Members[j];
+			ItemInfo &Item = m_ItemList[Index];
+
+			if (m_PrevHashList[Index] == Hash && IsSameConnection(Item, NewList[i])) {
+				UpdateItem(Item, NewList[i], CurTime);
+				m_MatchList[i] = Index;
+				*pLink = Next[j];
+				break;
+			}
+		}
+	}
+}
+
+static ULONGLONG GetItemDuration(const ConnectionLog::ItemInfo &Item)
+{
+	if (Item.Info.CreateTimestamp > 0
+			&& (LONGLONG)Item.CreatedTime.Tick >= Item.ConnectionCreateTickCount)
+		return Item.UpdatedTime.Tick - Item.ConnectionCreateTickCount;
+	return Item.UpdatedTime.Tick - Item.CreatedTime.Tick;
+}
+
+static int GetDurationClass(ULONGLONG Duration)
+{
+	if (Duration < 1000)
+		return ConnectionLog::DURATION_CLASS_1SEC;
+	if (Duration < 10 * 1000)
+		return ConnectionLog::DURATION_CLASS_10SEC;
+	if (Duration < 60 * 1000)
+		return ConnectionLog::DURATION_CLASS_1MIN;
+	if (Duration < 10 * 60 * 1000)
+		return ConnectionLog::DURATION_CLASS_10MIN;
+	return ConnectionLog::DURATION_CLASS_LONG;
+}
+
+static bool IsFoldedItem(const ConnectionLog::ItemInfo &Item)
+{
+	return Item.NumConnections == 0;
+}
+
+// Folds connections closed in the last update into a recent entry of the same
+// process, protocol, remote address and remote port.
+// The current connections are at the front of the list, followed by the ones
+// that were closed since the previous update.
+void ConnectionLog::CoalesceClosedItems(size_t NumConnections, ULONGLONG CurTick)
+{
+	// The folded items are marked and removed together, so the index is updated once
+	size_t LastFolded = 0;
+
+	for (size_t i = NumConnections; i < m_ItemList.size(); i++) {
+		ItemInfo &Item = m_ItemList[i];
 
 		if (Item.UpdatedTime.Tick != m_UpdatedTime.Tick)
 			break;
-		if (Item.Info.RemoteAddress == Address) {
-			if (pHostName == nullptr)
-				pHostName = m_StringPool.Set(szHostName);
-			Item.pRemoteHostName = pHostName;
+		if (Item.NumConnections == 0
+				|| (Item.NumConnections == 1 && GetItemDuration(Item) >= m_CoalesceWindow))
+			continue;
+
+		for (size_t j = i + 1; j < m_ItemList.size(); j++) {
+			const ItemInfo &Old = m_ItemList[j];
+
+			if (CurTick - Old.UpdatedTime.Tick > m_CoalesceWindow)
+				break;
+			if (Old.NumConnections == 0
+					|| Old.Info.PID != Item.Info.PID
+					|| Old.Info.Protocol != Item.Info.Protocol
+					|| Old.Info.RemotePort != Item.Info.RemotePort
+					|| Old.Info.RemoteAddress != Item.Info.RemoteAddress
+					|| (Old.NumConnections == 1 && GetItemDuration(Old) >= m_CoalesceWindow))
+				continue;
+
+			if (Item.NumConnections == 1)
+				Item.DurationHistogram[GetDurationClass(GetItemDuration(Item))]++;
+			if (Old.NumConnections == 1)
+				Item.DurationHistogram[GetDurationClass(GetItemDuration(Old))]++;
+			else
+				for (int k = 0; k < NUM_DURATION_CLASSES; k++)
+					Item.DurationHistogram[k] += Old.DurationHistogram[k];
+			Item.NumConnections += Old.NumConnections;
+
+			Item.ID = Old.ID;
+			Item.CreatedTime = Old.CreatedTime;
+			Item.Info.CreateTimestamp = Old.Info.CreateTimestamp;
+			Item.ConnectionCreateTickCount = Old.ConnectionCreateTickCount;
+			if (Old.EnableStatistics
+					&& (Old.Statistics.Mask & ConnectionStatistics::MASK_BYTES) != 0) {
+				if (Item.EnableStatistics
+						&& (Item.Statistics.Mask & ConnectionStatistics::MASK_BYTES) != 0) {
+					Item.Statistics.InBytes += Old.Statistics.InBytes;
+					Item.Statistics.OutBytes += Old.Statistics.OutBytes;
+				} else {
+					Item.EnableStatistics = true;
+					Item.Statistics.Mask |= ConnectionStatistics::MASK_BYTES;
+					Item.Statistics.InBytes = Old.Statistics.InBytes;
+					Item.Statistics.OutBytes = Old.Statistics.OutBytes;
+				}
+			}
+			if (Item.MaxInBitsPerSecond < Old.MaxInBitsPerSecond)
+				Item.MaxInBitsPerSecond = Old.MaxInBitsPerSecond;
+			if (Item.MaxOutBitsPerSecond < Old.MaxOutBitsPerSecond)
+				Item.MaxOutBitsPerSecond = Old.MaxOutBitsPerSecond;
+			if (Item.pRemoteHostName == nullptr)
+				std::swap(Item.pRemoteHostName, m_ItemList[j].pRemoteHostName);
+			if (Item.pASOrganization == nullptr) {
+				Item.ASNumber = Old.ASNumber;
+				std::swap(Item.pASOrganization, m_ItemList[j].pASOrganization);
+			}
+
+			ReleaseItemStrings(m_ItemList[j]);
+			m_ItemList[j].NumConnections = 0;
+			if (LastFolded < j)
+				LastFolded = j;
+			break;
+		}
+	}
+
+	// The items before the last folded one are moved toward the end, as there are
+	// fewer of them than the ones after it.
+	if (LastFolded > 0) {
+		UnindexItems(0, LastFolded + 1);
+		const ItemList::reverse_iterator End =
+			std::remove_if(ItemList::reverse_iterator(m_ItemList.begin() + LastFolded + 1),
+						   m_ItemList.rend(), IsFoldedItem);
+		const size_t NumFolded = m_ItemList.rend() - End;
+		for (size_t i = 0; i < NumFolded; i++)
+			m_ItemList.pop_front();
+		IndexItems(0, LastFolded + 1 - NumFolded);
+	}
+}
+
+void ConnectionLog::TrimItems(size_t Max)
+{
+	while (m_ItemList.size() + m_NumColdItems > Max) {
+		const size_t Excess = m_ItemList.size() + m_NumColdItems - Max;
+
+		if (!m_ColdBlockList.empty()) {
+			ColdBlock &Block = m_ColdBlockList.back();
+
+			if (Block.NumItems <= Excess) {
+				m_NumColdItems -= Block.NumItems;
+				m_ColdDataSize -= Block.Data.size();
+				for (int i = 0; i < COLD_CACHE_BLOCKS; i++) {
+					if (m_ColdCache[i].Serial == Block.Serial) {
+						m_ColdCache[i].Serial = 0;
+						m_ColdCache[i].ItemList.clear();
+					}
+				}
+				for (std::vector<LPCTSTR>::const_iterator i = Block.StringList.begin();
+						i != Block.StringList.end(); i++)
+					m_StringPool.Release(*i);
+				m_ColdBlockList.pop_back();
+			} else {
+				// The oldest items are at the end of the block, so it is enough
+				// to shorten it without recompressing.
+				Block.NumItems -= Excess;
+				m_NumColdItems -= Excess;
+			}
+		} else {
+			UnindexItem(m_ItemList.back());
+			ReleaseItemStrings(m_ItemList.back());
+			m_ItemList.pop_back();
+		}
+	}
+}
+
+void ConnectionLog::ReleaseItemStrings(const ItemInfo &Item)
+{
+	m_StringPool.Release(Item.pProcessName);
+	m_StringPool.Release(Item.pProcessPath);
+	m_StringPool.Release(Item.pRemoteHostName);
+	m_StringPool.Release(Item.pASOrganization);
+}
+
+void ConnectionLog::IndexItem(ItemInfo &Item)
+{
+	if (!Item.Info.RemoteAddress.IsZero())
+		m_AddressIndex.insert(AddressIndex::value_type(Item.Info.RemoteAddress, &Item));
+}
+
+void ConnectionLog::UnindexItem(const ItemInfo &Item)
+{
+	if (Item.Info.RemoteAddress.IsZero())
+		return;
+
+	std::pair<AddressIndex::iterator, AddressIndex::iterator> Range =
+		m_AddressIndex.equal_range(Item.Info.RemoteAddress);
+	for (AddressIndex::iterator i = Range.first; i != Range.second; i++) {
+		if (i->second == &Item) {
+			m_AddressIndex.erase(i);
+			break;
+		}
+	}
+}
+
+void ConnectionLog::IndexItems(size_t First, size_t Last)
+{
+	for (size_t i = First; i < Last; i++)
+		IndexItem(m_ItemList[i]);
+}
+
+void ConnectionLog::UnindexItems(size_t First, size_t Last)
+{
+	for (size_t i = First; i < Last; i++)
+		UnindexItem(m_ItemList[i]);
+}
+
+bool ConnectionLog::CompressAgedItems(ULONGLONG CurTick)
+{
+	if (m_ItemList.size() < m_NumCurrentConnections + COLD_BLOCK_ITEMS)
+		return false;
+
+	// The list is sorted by updated time, so checking the newest item of the block is enough.
+	const ItemList::iterator First = m_ItemList.end() - COLD_BLOCK_ITEMS;
+	if (CurTick - First->UpdatedTime.Tick < m_ColdAge)
+		return false;
+
+	std::vector<ItemInfo> Items(First, m_ItemList.end());
+	std::vector<LPCTSTR> StringList;
+	StringList.reserve(Items.size() * 4);
+	for (std::vector<ItemInfo>::iterator i = Items.begin(); i != Items.end(); i++) {
+		if (i->pProcessName != nullptr)
+			StringList.push_back(i->pProcessName);
+		if (i->pProcessPath != nullptr)
+			StringList.push_back(i->pProcessPath);
+		if (i->pRemoteHostName != nullptr)
+			StringList.push_back(i->pRemoteHostName);
+		if (i->pASOrganization != nullptr)
+			StringList.push_back(i->pASOrganization);
+
+		// Clear the unused part of the strings for better compression
+		GeoIPManager::CityInfo &City = i->CityInfo;
+		if (!i->EnableCityInfo) {
+			::ZeroMemory(&City, sizeof(City));
+		} else {
+			const int Length = ::lstrlen(City.Country.Name);
+			::ZeroMemory(City.Country.Name + Length, sizeof(City.Country.Name) - Length * sizeof(TCHAR));
+			const int RegionLength = ::lstrlen(City.Region);
+			::ZeroMemory(City.Region + RegionLength, sizeof(City.Region) - RegionLength * sizeof(TCHAR));
+			const int CityLength = ::lstrlen(City.City);
+			::ZeroMemory(City.City + CityLength, sizeof(City.City) - CityLength * sizeof(TCHAR));
+		}
+	}
+
+	const uLong SourceSize = (uLong)(Items.size() * sizeof(ItemInfo));
+	uLongf DestSize = ::compressBound(SourceSize);
+	std::vector<BYTE> Data(DestSize);
+	if (::compress2(Data.data(), &DestSize,
+					reinterpret_cast<const Bytef*>(Items.data()), SourceSize,
+					Z_BEST_SPEED) != Z_OK) {
+		cvDebugTrace(TEXT("Failed to compress connection log items\n"));
+		return false;
+	}
+	Data.resize(DestSize);
+
+	m_ColdBlockList.push_front(ColdBlock());
+	ColdBlock &Block = m_ColdBlockList.front();
+	Block.Serial = ++m_ColdBlockSerial;
+	Block.NumItems = Items.size();
+	Block.Data.assign(Data.begin(), Data.end());
+
+	// The block keeps one reference to each string used by its items
+	std::sort(StringList.begin(), StringList.end());
+	for (size_t i = 1; i < StringList.size(); i++) {
+		if (StringList[i] == StringList[i - 1])
+			m_StringPool.Release(StringList[i]);
+	}
+	StringList.erase(std::unique(StringList.begin(), StringList.end()), StringList.end());
+	Block.StringList.swap(StringList);
+
+	m_ColdDataSize += Block.Data.size();
+	m_NumColdItems += Block.NumItems;
+	UnindexItems(m_ItemList.size() - COLD_BLOCK_ITEMS, m_ItemList.size());
+	m_ItemList.erase(First, m_ItemList.end());
+
+	return true;
+}
+
+const std::vector<ConnectionLog::ItemInfo> &ConnectionLog::GetColdItemList(const ColdBlock &Block) const
+{
+	ColdCache *pCache = nullptr;
+
+	for (int i = 0; i < COLD_CACHE_BLOCKS; i++) {
+		if (m_ColdCache[i].Serial == Block.Serial) {
+			pCache = &m_ColdCache[i];
+			break;
 		}
+		if (pCache == nullptr || m_ColdCache[i].LastUsed < pCache->LastUsed)
+			pCache = &m_ColdCache[i];
 	}
 
-	return pHostName != nullptr;
+	if (pCache->Serial != Block.Serial) {
+		pCache->Serial = Block.Serial;
+		if (!DecompressColdBlock(Block.Data, &pCache->ItemList)) {
+			cvDebugTrace(TEXT("Failed to decompress connection log items\n"));
+			cvDebugBreak();
+			::ZeroMemory(pCache->ItemList.data(), COLD_BLOCK_ITEMS * sizeof(ItemInfo));
+		}
+	}
+
+	pCache->LastUsed = ++m_ColdCacheClock;
+
+	return pCache->ItemList;
 }
 
 }	// namespace CV
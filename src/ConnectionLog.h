@@ -29,8 +29,12 @@
 
 
 #include <deque>
+#include <vector>
+#include <unordered_map>
+#include "SnapshotQueue.h"
 #include "StringPool.h"
 #include "GeoIPManager.h"
+#include "HostManager.h"
 
 
 namespace CV
@@ -40,6 +44,16 @@ class ProgramCore;
 class ConnectionLog
 {
 public:
+	enum
+	{
+		DURATION_CLASS_1SEC,
+		DURATION_CLASS_10SEC,
+		DURATION_CLASS_1MIN,
+		DURATION_CLASS_10MIN,
+		DURATION_CLASS_LONG,
+		NUM_DURATION_CLASSES
+	};
+
 	struct ItemInfo
 	{
 		ULONGLONG ID;
@@ -57,6 +71,10 @@ public:
 		LPCTSTR pRemoteHostName;
 		bool EnableCityInfo;
 		GeoIPManager::CityInfo CityInfo;
+		UINT ASNumber;
+		LPCTSTR pASOrganization;
+		unsigned int NumConnections;
+		unsigned int DurationHistogram[NUM_DURATION_CLASSES];
 	};
 
 	typedef std::deque<ItemInfo> ItemList;
@@ -68,21 +86,144 @@ public:
 	size_t GetMaxLog() const;
 	size_t NumItems() const;
 	size_t NumCurrentConnections() const;
+	size_t NumHotItems() const;
+	size_t NumColdItems() const;
+	size_t GetColdDataSize() const;
+	void SetColdAge(DWORD Age);
+	DWORD GetColdAge() const;
+	void SetCoalesceWindow(DWORD Window);
+	DWORD GetCoalesceWindow() const;
+	void SetMergeThreads(int Threads);
+	int GetMergeThreads() const;
 	const ItemList &GetItemList() const;
 	const ItemInfo &GetItemInfo(size_t Index) const;
-	void OnListUpdated();
+	size_t GetLiveStringSize() const;
+	size_t GetDeadStringSize() const;
+	size_t GetStringPoolSize() const;
+	UINT GetCollationRank(LPCTSTR pString) const;
+	LPCTSTR InternString(LPCTSTR pString);
+	bool RestoreItem(const ItemInfo &Item);
+	bool GetColdItemPosition(size_t ColdIndex, ULONGLONG *pSerial, size_t *pOffset) const;
+	bool FindColdItem(ULONGLONG Serial, size_t Offset, size_t *pColdIndex) const;
+	size_t NumColdBlocks() const;
+	void GetColdBlock(size_t Index, size_t *pNumItems, std::vector<BYTE> *pData,
+					  const std::vector<LPCTSTR> **ppStringList) const;
+	static bool DecompressColdBlock(const std::vector<BYTE> &Data, std::vector<ItemInfo> *pItemList);
+	void OnListUpdated(const ConnectionSnapshot &Snapshot);
 	ULONGLONG GetUpdatedTickCount() const;
 	const TimeAndTick &GetUpdatedTime() const;
-	bool OnHostNameFound(const IPAddress &Address);
+	void OnHostNamesFound(const std::vector<IPAddress> &AddressList,
+						  std::vector<IPAddress> *pFoundList);
 
 private:
+#ifdef _DEBUG
+	friend class ConnectionLogTest;
+#endif
+
+	enum
+	{
+		COLD_BLOCK_ITEMS			= 4096,
+		COLD_CACHE_BLOCKS			= 4,
+		MAX_MERGE_THREADS			= 8,
+		PARALLEL_MERGE_THRESHOLD	= 16384,
+		RECLAIM_CHUNKS_PER_UPDATE	= 4
+	};
+
+	enum MergePhase
+	{
+		MERGE_PHASE_HASH,
+		MERGE_PHASE_MATCH
+	};
+
+	struct MergeContext
+	{
+		ConnectionLog *pThis;
+		const ConnectionSnapshot *pSnapshot;
+		size_t NumPrevItems;
+		int NumShards;
+		int Shard;
+		MergePhase Phase;
+	};
+
+	// Workers are created when first needed, and wait for a context to process
+	struct MergeWorker
+	{
+		ConnectionLog *pThis;
+		HANDLE hThread;
+		HANDLE hStartEvent;
+		HANDLE hDoneEvent;
+		const MergeContext *pContext;
+	};
+
+	struct ColdBlock
+	{
+		ULONGLONG Serial;
+		size_t NumItems;
+		std::vector<BYTE> Data;
+		std::vector<LPCTSTR> StringList;
+	};
+
+	struct ColdCache
+	{
+		ULONGLONG Serial;
+		ULONGLONG LastUsed;
+		std::vector<ItemInfo> ItemList;
+	};
+
+	typedef std::deque<ColdBlock> ColdBlockList;
+
+	// The hot items are indexed by remote address, for setting found host names
+	typedef std::unordered_multimap<IPAddress, ItemInfo*, HostManager::AddressHash> AddressIndex;
+
+	void AddSnapshot(const ConnectionSnapshot &Snapshot);
+	void MatchItems(const ConnectionSnapshot &Snapshot, size_t NumPrevItems);
+	void RunMergePhase(MergeContext *pContextList, int NumThreads, MergePhase Phase);
+	void ProcessMergeContext(const MergeContext &Context);
+	void HashItems(const MergeContext &Context);
+	void MatchShard(const MergeContext &Context);
+	MergeWorker *GetMergeWorker(int Index);
+	void EndMergeWorkers();
+	static DWORD WINAPI MergeThread(LPVOID pParam);
+	void CoalesceClosedItems(size_t NumConnections, ULONGLONG CurTick);
+	void TrimItems(size_t Max);
+	void ReleaseItemStrings(const ItemInfo &Item);
+	void IndexItem(ItemInfo &Item);
+	void UnindexItem(const ItemInfo &Item);
+	void UnindexItems(size_t First, size_t Last);
+	void IndexItems(size_t First, size_t Last);
+	bool CompressAgedItems(ULONGLONG CurTick);
+	const std::vector<ItemInfo> &GetColdItemList(const ColdBlock &Block) const;
+
 	const ProgramCore &m_Core;
 	size_t m_MaxLog;
 	ULONGLONG m_IDCount;
 	ItemList m_ItemList;
+	AddressIndex m_AddressIndex;
 	size_t m_NumCurrentConnections;
 	TimeAndTick m_UpdatedTime;
 	StringPool m_StringPool;
+
+	DWORD m_CoalesceWindow;
+
+	int m_MergeThreads;
+	MergeWorker m_MergeWorkerList[MAX_MERGE_THREADS - 1];
+	int m_NumMergeWorkers;
+	volatile bool m_MergeAbort;
+	std::vector<UINT> m_PrevHashList;
+	std::vector<UINT> m_NewHashList;
+	std::vector<int> m_MatchList;
+
+	std::vector<IPAddress> m_CityAddressList;
+	std::vector<GeoIPManager::CityInfo*> m_CityInfoList;
+	std::vector<bool*> m_CityFoundList;
+
+	DWORD m_ColdAge;
+	ColdBlockList m_ColdBlockList;
+	size_t m_NumColdItems;
+	size_t m_ColdDataSize;
+	ULONGLONG m_ColdBlockSerial;
+	mutable ColdCache m_ColdCache[COLD_CACHE_BLOCKS];
+	mutable ULONGLONG m_ColdCacheClock;
 };
 
 }	// namespace CV
@@ -26,6 +26,7 @@
 
 #include "ConnectionViewer.h"
 #include <algorithm>
+#include <unordered_set>
 #include "ConnectionLogView.h"
 #include "Utility.h"
 #include "resource.h"
@@ -59,6 +60,9 @@ LPCTSTR ConnectionLogView::GetColumnName(int Column)
 		TEXT("OutBandwidth"),
 		TEXT("MaxInBandwidth"),
 		TEXT("MaxOutBandwidth"),
+		TEXT("Connections"),
+		TEXT("ASNumber"),
+		TEXT("Organization"),
 	};
 
 	cvStaticAssert(cvLengthOf(ColumnNameList) == NUM_COLUMN_TYPES);
@@ -71,6 +75,10 @@ LPCTSTR ConnectionLogView::GetColumnName(int Column)
 ConnectionLogView::ConnectionLogView(const ProgramCore &Core, const ConnectionLog &Log)
 	: m_Core(Core)
 	, m_Log(Log)
+	, m_NumColdItems(0)
+	, m_ColdItemSelected(false)
+	, m_SelectedColdSerial(0)
+	, m_SelectedColdOffset(0)
 	, m_NewItemBackColor(RGB(255, 255, 224))
 {
 	m_ScrollBeyondBottom = true;
@@ -94,6 +102,8 @@ ConnectionLogView::ConnectionLogView(const ProgramCore &Core, const ConnectionLo
 		{COLUMN_COUNTRY,				COLUMN_ALIGN_LEFT,		true,	2},
 		{COLUMN_CITY,					COLUMN_ALIGN_LEFT,		true,	8},
 		{COLUMN_LOCATION,				COLUMN_ALIGN_LEFT,		false,	8},
+		{COLUMN_AS_NUMBER,				COLUMN_ALIGN_LEFT,		false,	5},
+		{COLUMN_ORGANIZATION,			COLUMN_ALIGN_LEFT,		false,	12},
 		{COLUMN_STATE,					COLUMN_ALIGN_LEFT,		true,	8},
 		{COLUMN_DURATION,				COLUMN_ALIGN_LEFT,		true,	5},
 		{COLUMN_IN_BANDWIDTH,			COLUMN_ALIGN_RIGHT,		true,	5},
@@ -103,6 +113,7 @@ ConnectionLogView::ConnectionLogView(const ProgramCore &Core, const ConnectionLo
 		{COLUMN_IN_BYTES,				COLUMN_ALIGN_RIGHT,		true,	7},
 		{COLUMN_OUT_BYTES,				COLUMN_ALIGN_RIGHT,		true,	7},
 		{COLUMN_PROCESS_PATH,			COLUMN_ALIGN_LEFT,		true,	12},
+		{COLUMN_CONNECTIONS,			COLUMN_ALIGN_RIGHT,		false,	3},
 	};
 
 	cvStaticAssert(cvLengthOf(DefaultColumnList) == NUM_COLUMN_TYPES);
@@ -172,6 +183,9 @@ void ConnectionLogView::OnListUpdated()
 		m_ItemList.push_back(Item);
 	}
 
+	// Compressed items are always listed after the others in the log order.
+	m_NumColdItems = m_Log.NumColdItems();
+
 	SortItems();
 
 	SetScrollBar();
@@ -179,11 +193,38 @@ void ConnectionLogView::OnListUpdated()
 	Redraw();
 }
 
+void ConnectionLogView::OnHostNamesFound(const std::vector<IPAddress> &AddressList)
+{
+	const std::unordered_set<IPAddress, HostManager::AddressHash> AddressSet(AddressList.begin(), AddressList.end());
+	int First, Last;
+
+	GetVisibleItemRange(&First, &Last);
+	if (Last > NumHotItems())
+		Last = NumHotItems();
+	for (int i = First; i < Last; i++) {
+		if (AddressSet.find(m_ItemList[i].Iterator->Info.RemoteAddress) != AddressSet.end())
+			RedrawItem(i);
+	}
+}
+
 int ConnectionLogView::NumItems() const
+{
+	return (int)(m_ItemList.size() + m_NumColdItems);
+}
+
+// Compressed items are not updated, so only the rows before them can get host names
+int ConnectionLogView::NumHotItems() const
 {
 	return (int)m_ItemList.size();
 }
 
+const ConnectionLog::ItemInfo &ConnectionLogView::GetLogItem(int Row) const
+{
+	if ((size_t)Row < m_ItemList.size())
+		return *m_ItemList[Row].Iterator;
+	return m_Log.GetItemInfo(m_Log.NumHotItems() + (Row - m_ItemList.size()));
+}
+
 static BYTE ClampByte(int Value)
 {
 	return Value < 0 ? 0 : Value > 255 ? 255 : (BYTE)Value;
@@ -191,6 +232,9 @@ static BYTE ClampByte(int Value)
 
 bool ConnectionLogView::DrawItemBackground(HDC hdc, int Row, const RECT &rcBound)
 {
+	if ((size_t)Row >= m_ItemList.size())
+		return false;
+
 	const ItemInfo &Item = m_ItemList[Row];
 
 	if ((Item.Flags & ItemInfo::FLAG_NEW) != 0) {
@@ -216,11 +260,11 @@ bool ConnectionLogView::GetItemText(int Row, int Column, LPTSTR pText, int MaxTe
 {
 	pText[0] = '\0';
 
-	if (Row < 0 || (size_t)Row >= m_ItemList.size()
+	if (Row < 0 || Row >= NumItems()
 			|| Column < 0 || Column >= NUM_COLUMN_TYPES)
 		return false;
 
-	const ConnectionLog::ItemInfo &Item = *m_ItemList[Row].Iterator;
+	const ConnectionLog::ItemInfo &Item = GetLogItem(Row);
 
 	switch (Column) {
 	case COLUMN_CREATED_TIME:
@@ -354,6 +398,20 @@ bool ConnectionLogView::GetItemText(int Row, int Column, LPTSTR pText, int MaxTe
 		if (Item.MaxOutBitsPerSecond >= 0)
 			FormatInt64(Item.MaxOutBitsPerSecond / 8, pText, MaxTextLength);
 		break;
+
+	case COLUMN_CONNECTIONS:
+		UIntToStr(Item.NumConnections, pText, MaxTextLength);
+		break;
+
+	case COLUMN_AS_NUMBER:
+		if (Item.ASNumber != 0)
+			FormatString(pText, MaxTextLength, TEXT("AS%u"), Item.ASNumber);
+		break;
+
+	case COLUMN_ORGANIZATION:
+		if (Item.pASOrganization != nullptr)
+			::lstrcpyn(pText, Item.pASOrganization, MaxTextLength);
+		break;
 	}
 
 	return true;
@@ -363,11 +421,11 @@ bool ConnectionLogView::GetItemLongText(int Row, int Column, LPTSTR pText, int M
 {
 	pText[0] = '\0';
 
-	if (Row < 0 || (size_t)Row >= m_ItemList.size()
+	if (Row < 0 || Row >= NumItems()
 			|| Column < 0 || Column >= NUM_COLUMN_TYPES)
 		return false;
 
-	const ConnectionLog::ItemInfo &Item = *m_ItemList[Row].Iterator;
+	const ConnectionLog::ItemInfo &Item = GetLogItem(Row);
 
 	switch (Column) {
 	case COLUMN_COUNTRY:
@@ -384,6 +442,15 @@ bool ConnectionLogView::GetItemLongText(int Row, int Column, LPTSTR pText, int M
 						 Item.CityInfo.Longitude);
 		break;
 
+	case COLUMN_AS_NUMBER:
+		if (Item.ASNumber != 0 && Item.pASOrganization != nullptr)
+			FormatString(pText, MaxTextLength, TEXT("AS%u (%s)"),
+						 Item.ASNumber,
+						 Item.pASOrganization);
+		else
+			return GetItemText(Row, Column, pText, MaxTextLength);
+		break;
+
 	case COLUMN_IN_BYTES:
 		if (Item.EnableStatistics
 				&& (Item.Statistics.Mask & ConnectionStatistics::MASK_BYTES) != 0)
@@ -418,6 +485,20 @@ bool ConnectionLogView::GetItemLongText(int Row, int Column, LPTSTR pText, int M
 			FormatBandwidthLong(Item.MaxOutBitsPerSecond / 8, pText, MaxTextLength);
 		break;
 
+	case COLUMN_CONNECTIONS:
+		if (Item.NumConnections > 1)
+			FormatString(pText, MaxTextLength,
+						 TEXT("%u (<1s: %u, <10s: %u, <1m: %u, <10m: %u, 10m+: %u)"),
+						 Item.NumConnections,
+						 Item.DurationHistogram[ConnectionLog::DURATION_CLASS_1SEC],
+						 Item.DurationHistogram[ConnectionLog::DURATION_CLASS_10SEC],
+						 Item.DurationHistogram[ConnectionLog::DURATION_CLASS_1MIN],
+						 Item.DurationHistogram[ConnectionLog::DURATION_CLASS_10MIN],
+						 Item.DurationHistogram[ConnectionLog::DURATION_CLASS_LONG]);
+		else
+			UIntToStr(Item.NumConnections, pText, MaxTextLength);
+		break;
+
 	default:
 		return GetItemText(Row, Column, pText, MaxTextLength);
 	}
@@ -439,18 +520,28 @@ void ConnectionLogView::SetSpecialColors(COLORREF NewItemBackColor)
 
 bool ConnectionLogView::GetItemConnectionInfo(int Item, ConnectionInfo *pInfo) const
 {
-	if (Item < 0 || (size_t)Item >= m_ItemList.size())
+	if (Item < 0 || Item >= NumItems())
 		return false;
-	*pInfo = m_ItemList[Item].Iterator->Info;
+	*pInfo = GetLogItem(Item).Info;
 	return true;
 }
 
 bool ConnectionLogView::OnSelChange(int OldSel, int NewSel)
 {
-	if (OldSel >= 0)
-		m_ItemList[OldSel].Flags &= ~ItemInfo::FLAG_SELECTED;
-	if (NewSel >= 0)
-		m_ItemList[NewSel].Flags |= ItemInfo::FLAG_SELECTED;
+	if (OldSel >= 0) {
+		if ((size_t)OldSel < m_ItemList.size())
+			m_ItemList[OldSel].Flags &= ~ItemInfo::FLAG_SELECTED;
+		else
+			m_ColdItemSelected = false;
+	}
+	if (NewSel >= 0) {
+		if ((size_t)NewSel < m_ItemList.size())
+			m_ItemList[NewSel].Flags |= ItemInfo::FLAG_SELECTED;
+		else
+			m_ColdItemSelected =
+				m_Log.GetColdItemPosition(NewSel - m_ItemList.size(),
+										  &m_SelectedColdSerial, &m_SelectedColdOffset);
+	}
 	return true;
 }
 
@@ -461,12 +552,14 @@ template<typename T> int CompareValue(T Value1, T Value2)
 
 class LogItemCompare
 {
+	const ConnectionLog &m_Log;
 	const std::vector<int> &m_SortOrder;
 	bool m_Ascending;
 
 public:
-	LogItemCompare(const std::vector<int> &SortOrder, bool Ascending)
-		: m_SortOrder(SortOrder)
+	LogItemCompare(const ConnectionLog &Log, const std::vector<int> &SortOrder, bool Ascending)
+		: m_Log(Log)
+		, m_SortOrder(SortOrder)
 		, m_Ascending(Ascending)
 	{
 	}
@@ -492,7 +585,8 @@ public:
 			case ConnectionLogView::COLUMN_PROCESS_NAME:
 				if (Item1.pProcessName != nullptr) {
 					if (Item2.pProcessName != nullptr)
-						Cmp = ::lstrcmpi(Item1.pProcessName, Item2.pProcessName);
+						Cmp = CompareValue(m_Log.GetCollationRank(Item1.pProcessName),
+										   m_Log.GetCollationRank(Item2.pProcessName));
 					else
 						Cmp = -1;
 				} else if (Item2.pProcessName != nullptr)
@@ -502,7 +596,8 @@ public:
 			case ConnectionLogView::COLUMN_PROCESS_PATH:
 				if (Item1.pProcessPath != nullptr) {
 					if (Item2.pProcessPath != nullptr)
-						Cmp = ::lstrcmpi(Item1.pProcessPath, Item2.pProcessPath);
+						Cmp = CompareValue(m_Log.GetCollationRank(Item1.pProcessPath),
+										   m_Log.GetCollationRank(Item2.pProcessPath));
 					else
 						Cmp = -1;
 				} else if (Item2.pProcessPath != nullptr)
@@ -542,7 +637,8 @@ public:
 			case ConnectionLogView::COLUMN_REMOTE_HOST:
 				if (Item1.pRemoteHostName != nullptr) {
 					if (Item2.pRemoteHostName != nullptr)
-						Cmp = ::lstrcmpi(Item1.pRemoteHostName, Item2.pRemoteHostName);
+						Cmp = CompareValue(m_Log.GetCollationRank(Item1.pRemoteHostName),
+										   m_Log.GetCollationRank(Item2.pRemoteHostName));
 					else
 						Cmp = -1;
 				} else if (Item2.pRemoteHostName != nullptr)
@@ -693,6 +789,31 @@ public:
 				} else if (Item2.MaxOutBitsPerSecond >= 0)
 					Cmp = 1;
 				break;
+
+			case ConnectionLogView::COLUMN_CONNECTIONS:
+				Cmp = CompareValue(Item1.NumConnections, Item2.NumConnections);
+				break;
+
+			case ConnectionLogView::COLUMN_AS_NUMBER:
+				if (Item1.ASNumber != 0) {
+					if (Item2.ASNumber != 0)
+						Cmp = CompareValue(Item1.ASNumber, Item2.ASNumber);
+					else
+						Cmp = -1;
+				} else if (Item2.ASNumber != 0)
+					Cmp = 1;
+				break;
+
+			case ConnectionLogView::COLUMN_ORGANIZATION:
+				if (Item1.pASOrganization != nullptr) {
+					if (Item2.pASOrganization != nullptr)
+						Cmp = CompareValue(m_Log.GetCollationRank(Item1.pASOrganization),
+										   m_Log.GetCollationRank(Item2.pASOrganization));
+					else
+						Cmp = -1;
+				} else if (Item2.pASOrganization != nullptr)
+					Cmp = 1;
+				break;
 			}
 
 			if (Cmp != 0)
@@ -706,7 +827,7 @@ public:
 bool ConnectionLogView::SortItems()
 {
 	std::sort(m_ItemList.begin(), m_ItemList.end(),
-			  LogItemCompare(m_SortOrder, m_SortAscending));
+			  LogItemCompare(m_Log, m_SortOrder, m_SortAscending));
 
 	m_SelectedItem = -1;
 	for (size_t i = 0; i < m_ItemList.size(); i++) {
@@ -715,6 +836,14 @@ bool ConnectionLogView::SortItems()
 			break;
 		}
 	}
+	if (m_SelectedItem < 0 && m_ColdItemSelected) {
+		size_t Index;
+		if (m_Log.FindColdItem(m_SelectedColdSerial, m_SelectedColdOffset, &Index)
+				&& Index < m_NumColdItems)
+			m_SelectedItem = (int)(m_ItemList.size() + Index);
+		else
+			m_ColdItemSelected = false;
+	}
 
 	return true;
 }
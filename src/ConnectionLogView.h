@@ -62,6 +62,9 @@ public:
 		COLUMN_OUT_BANDWIDTH,
 		COLUMN_MAX_IN_BANDWIDTH,
 		COLUMN_MAX_OUT_BANDWIDTH,
+		COLUMN_CONNECTIONS,
+		COLUMN_AS_NUMBER,
+		COLUMN_ORGANIZATION,
 		COLUMN_TRAILER
 	};
 	enum { NUM_COLUMN_TYPES = COLUMN_TRAILER };
@@ -71,7 +74,9 @@ public:
 	ConnectionLogView(const ProgramCore &Core, const ConnectionLog &Log);
 	~ConnectionLogView();
 	void OnListUpdated();
+	void OnHostNamesFound(const std::vector<IPAddress> &AddressList);
 	int NumItems() const override;
+	int NumHotItems() const;
 	bool GetItemText(int Row, int Column, LPTSTR pText, int MaxTextLength) const override;
 	bool GetItemLongText(int Row, int Column, LPTSTR pText, int MaxTextLength) const override;
 	LPCTSTR GetColumnIDName(int ID) const override;
@@ -98,9 +103,15 @@ private:
 
 	friend class LogItemCompare;
 
+	const ConnectionLog::ItemInfo &GetLogItem(int Row) const;
+
 	const ProgramCore &m_Core;
 	const ConnectionLog &m_Log;
 	std::vector<ItemInfo> m_ItemList;
+	size_t m_NumColdItems;
+	bool m_ColdItemSelected;
+	ULONGLONG m_SelectedColdSerial;
+	size_t m_SelectedColdOffset;
 	COLORREF m_NewItemBackColor;
 };
 
@@ -27,6 +27,8 @@
 #include "ConnectionViewer.h"
 #include "MainForm.h"
 #include "MiscDialog.h"
+#include "DnsTestServer.h"
+#include "SelfTest.h"
 #include "resource.h"
 
 
@@ -46,6 +48,8 @@ private:
 	ProgramCore m_Core;
 	MainForm m_MainForm;
 	TCHAR m_szIniFileName[MAX_PATH];
+	TCHAR m_szSnapshotFileName[MAX_PATH];
+	TCHAR m_szHostCacheFileName[MAX_PATH];
 };
 
 ProgramMain::ProgramMain(HINSTANCE hinst)
@@ -56,6 +60,10 @@ ProgramMain::ProgramMain(HINSTANCE hinst)
 
 	::GetModuleFileName(nullptr, m_szIniFileName, cvLengthOf(m_szIniFileName));
 	::PathRenameExtension(m_szIniFileName, TEXT(".ini"));
+	::lstrcpy(m_szSnapshotFileName, m_szIniFileName);
+	::PathRenameExtension(m_szSnapshotFileName, TEXT(".snapshot"));
+	::lstrcpy(m_szHostCacheFileName, m_szIniFileName);
+	::PathRenameExtension(m_szHostCacheFileName, TEXT(".hostcache"));
 }
 
 ProgramMain::~ProgramMain()
@@ -81,6 +89,9 @@ bool ProgramMain::Initialize(int CmdShow)
 	if (GeoIPManager::FindDatabaseFile(szDirectory, szFileName, cvLengthOf(szFileName)))
 		::lstrcpy(m_Core.GetPreferences().Core.GeoIPDatabaseFileName,
 				  ::PathFindFileName(szFileName));
+	if (GeoIPManager::FindASDatabaseFile(szDirectory, szFileName, cvLengthOf(szFileName)))
+		::lstrcpy(m_Core.GetPreferences().Core.GeoIPASDatabaseFileName,
+				  ::PathFindFileName(szFileName));
 
 	Settings Setting;
 	if (Setting.Open(m_szIniFileName, TEXT("Settings"), Settings::OPEN_READ)) {
@@ -92,6 +103,12 @@ bool ProgramMain::Initialize(int CmdShow)
 
 	m_MainForm.ApplyPreferences(m_Core.GetPreferences());
 
+	m_Core.SetLogSnapshotFileName(m_szSnapshotFileName);
+	if (m_Core.GetPreferences().Log.SaveSnapshot)
+		m_Core.LoadLogSnapshot();
+	if (m_Core.GetPreferences().Core.ResolverCacheFile)
+		m_Core.OpenHostCacheFile(m_szHostCacheFileName);
+
 	if (!m_MainForm.Create()) {
 		ErrorDialog(nullptr, m_hInstance, IDS_ERROR_WINDOW_CREATE);
 		return false;
@@ -117,6 +134,10 @@ int ProgramMain::MainLoop()
 
 	::WSACleanup();
 
+	if (m_Core.GetPreferences().Log.SaveSnapshot)
+		m_Core.SaveLogSnapshot();
+	m_Core.CloseHostCacheFile();
+
 	Settings Setting;
 	if (Setting.Open(m_szIniFileName, TEXT("Settings"), Settings::OPEN_WRITE)) {
 		m_Core.SavePreferences(&Setting);
@@ -136,6 +157,28 @@ int APIENTRY _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
 {
 #ifdef _DEBUG
 	_CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF/* | _CRTDBG_CHECK_ALWAYS_DF*/);
+
+	// Runs the resolver against a stand-in server, and exits with 1 if it fails
+	if (::StrStrI(pszCmdLine, TEXT("/dnstest")) != nullptr) {
+		WSADATA WSAData;
+		::WSAStartup(MAKEWORD(2, 2), &WSAData);
+		const bool Passed = CV::TestDnsResolver();
+		::WSACleanup();
+		return Passed ? 0 : 1;
+	}
+
+	// Measures the host name lookups against a thread adding names
+	if (::StrStrI(pszCmdLine, TEXT("/hosttest")) != nullptr)
+		return CV::TestHostManager() ? 0 : 1;
+
+	// Compares the GeoIP lookups with libGeoIP, on the database named after the switch
+	LPCTSTR pGeoIPTest = ::StrStrI(pszCmdLine, TEXT("/geoiptest"));
+	if (pGeoIPTest != nullptr)
+		return CV::TestGeoIPManager(pGeoIPTest + 10) ? 0 : 1;
+
+	// Times the merge of large synthetic snapshots into the connection log
+	if (::StrStrI(pszCmdLine, TEXT("/logtest")) != nullptr)
+		return CV::TestConnectionLog() ? 0 : 1;
 #endif
 
 	::SetDllDirectory(TEXT(""));
@@ -0,0 +1,682 @@
+/******************************************************************************
+*                                                                             *
+*    DnsResolver.cpp                        Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "ConnectionViewer.h"
+#include <vector>
+#include <iphlpapi.h>
+#include "DnsResolver.h"
+
+#pragma comment(lib, "iphlpapi.lib")
+#pragma comment(lib, "advapi32.lib")
+
+
+namespace CV
+{
+
+enum
+{
+	DNS_PORT			= 53,
+	DNS_TYPE_PTR		= 12,
+	DNS_CLASS_IN		= 1,
+	DNS_FLAG_QR			= 0x8000,
+	DNS_FLAG_TC			= 0x0200,
+	DNS_FLAG_RD			= 0x0100,
+	DNS_OPCODE_MASK		= 0x7800,
+	DNS_RCODE_MASK		= 0x000F,
+	DNS_RCODE_SERVFAIL	= 2,
+	DNS_RCODE_REFUSED	= 5
+};
+
+static WORD GetWord(const BYTE *p)
+{
+	return (WORD)((p[0] << 8) | p[1]);
+}
+
+static DWORD GetDWord(const BYTE *p)
+{
+	return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | p[3];
+}
+
+static void PutWord(BYTE *p, WORD Value)
+{
+	p[0] = (BYTE)(Value >> 8);
+	p[1] = (BYTE)(Value & 0xFF);
+}
+
+static int PutLabel(BYTE *p, LPCSTR pLabel, int Length)
+{
+	p[0] = (BYTE)Length;
+	std::memcpy(p + 1, pLabel, Length);
+	return 1 + Length;
+}
+
+// Builds the question section of a PTR query for the address
+static int BuildQuestion(const IPAddress &Address, BYTE *pBuffer)
+{
+	static const char HexDigits[] = "0123456789abcdef";
+	BYTE *p = pBuffer;
+
+	if (Address.Type == IP_ADDRESS_V4) {
+		const BYTE *pBytes = reinterpret_cast<const BYTE*>(&Address.V4.Address);
+		for (int i = 3; i >= 0; i--) {
+			char szByte[4];
+			int Length = 0;
+			if (pBytes[i] >= 100)
+				szByte[Length++] = (char)('0' + pBytes[i] / 100);
+			if (pBytes[i] >= 10)
+				szByte[Length++] = (char)('0' + pBytes[i] / 10 % 10);
+			szByte[Length++] = (char)('0' + pBytes[i] % 10);
+			p += PutLabel(p, szByte, Length);
+		}
+		p += PutLabel(p, "in-addr", 7);
+	} else if (Address.Type == IP_ADDRESS_V6) {
+		for (int i = 15; i >= 0; i--) {
+			p += PutLabel(p, &HexDigits[Address.V6.Bytes[i] & 0x0F], 1);
+			p += PutLabel(p, &HexDigits[Address.V6.Bytes[i] >> 4], 1);
+		}
+		p += PutLabel(p, "ip6", 3);
+	} else {
+		return 0;
+	}
+	p += PutLabel(p, "arpa", 4);
+	*p++ = 0;
+	PutWord(p, DNS_TYPE_PTR);
+	PutWord(p + 2, DNS_CLASS_IN);
+	p += 4;
+
+	return (int)(p - pBuffer);
+}
+
+// Returns the position after the name, or -1 if it is malformed
+static int SkipName(const BYTE *pData, int Length, int Pos)
+{
+	while (Pos < Length) {
+		const BYTE Label = pData[Pos];
+		if (Label == 0)
+			return Pos + 1;
+		if ((Label & 0xC0) == 0xC0)
+			return Pos + 2 <= Length ? Pos + 2 : -1;
+		if ((Label & 0xC0) != 0)
+			return -1;
+		Pos += 1 + Label;
+	}
+	return -1;
+}
+
+// Decodes a possibly compressed name into a dotted string
+static bool ReadName(const BYTE *pData, int Length, int Pos, LPTSTR pName, int MaxName)
+{
+	int NameLength = 0;
+	int Jumps = 0;
+
+	while (Pos < Length) {
+		const BYTE Label = pData[Pos];
+		if (Label == 0) {
+			if (NameLength == 0)
+				return false;
+			pName[NameLength] = _T('\0');
+			return true;
+		}
+		if ((Label & 0xC0) == 0xC0) {
+			if (Pos + 2 > Length || ++Jumps > 64)
+				return false;
+			Pos = ((Label & 0x3F) << 8) | pData[Pos + 1];
+			continue;
+		}
+		if ((Label & 0xC0) != 0 || Pos + 1 + Label > Length)
+			return false;
+		if (NameLength + (NameLength > 0 ? 1 : 0) + Label >= MaxName)
+			return false;
+		if (NameLength > 0)
+			pName[NameLength++] = _T('.');
+		for (int i = 0; i < Label; i++) {
+			const BYTE c = pData[Pos + 1 + i];
+			pName[NameLength++] = c > 0x20 && c < 0x7F ? (TCHAR)c : _T('?');
+		}
+		Pos += 1 + Label;
+	}
+
+	return false;
+}
+
+static bool IsSameQuestion(const BYTE *p1, const BYTE *p2, int Length)
+{
+	for (int i = 0; i < Length; i++) {
+		BYTE c1 = p1[i], c2 = p2[i];
+		if (c1 >= 'A' && c1 <= 'Z')
+			c1 += 'a' - 'A';
+		if (c2 >= 'A' && c2 <= 'Z')
+			c2 += 'a' - 'A';
+		if (c1 != c2)
+			return false;
+	}
+	return true;
+}
+
+
+DnsResolver::DnsResolver()
+	: m_pEventHandler(nullptr)
+	, m_hThread(nullptr)
+	, m_hWakeEvent(nullptr)
+	, m_Abort(false)
+	, m_NumServers(0)
+	, m_ServerPort(DNS_PORT)
+	, m_hSocketEvent(WSA_INVALID_EVENT)
+	, m_IDSlotMap(0x10000, 0)
+	, m_NumUsedSlots(0)
+	, m_NextServer(0)
+	, m_hCryptProv(0)
+	, m_RandomPos(cvLengthOf(m_RandomPool))
+{
+	for (int i = 0; i < MAX_OUTSTANDING; i++) {
+		m_SlotList[i].Used = false;
+		m_SlotList[i].Socket = INVALID_SOCKET;
+	}
+}
+
+DnsResolver::~DnsResolver()
+{
+	Stop();
+}
+
+bool DnsResolver::Start(EventHandler *pEventHandler)
+{
+	if (m_hThread != nullptr)
+		return true;
+
+	if (m_NumServers == 0 && !LoadSystemServers())
+		return false;
+	if (m_hCryptProv == 0
+			&& !::CryptAcquireContext(&m_hCryptProv, nullptr, nullptr,
+									  PROV_RSA_FULL, CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
+		return false;
+
+	// All the sockets signal the same event
+	if (m_hSocketEvent == WSA_INVALID_EVENT) {
+		m_hSocketEvent = ::WSACreateEvent();
+		if (m_hSocketEvent == WSA_INVALID_EVENT)
+			return false;
+	}
+	if (m_hWakeEvent == nullptr) {
+		m_hWakeEvent = ::CreateEvent(nullptr, FALSE, FALSE, nullptr);
+		if (m_hWakeEvent == nullptr)
+			return false;
+	}
+
+	m_pEventHandler = pEventHandler;
+	m_NextServer = 0;
+	m_Abort = false;
+	m_hThread = ::CreateThread(nullptr, 0, ThreadProc, this, 0, nullptr);
+	if (m_hThread == nullptr)
+		return false;
+
+	return true;
+}
+
+void DnsResolver::Stop()
+{
+	if (m_hThread != nullptr) {
+		m_Abort = true;
+		::SetEvent(m_hWakeEvent);
+		if (::WaitForSingleObject(m_hThread, 10000) == WAIT_TIMEOUT)
+			::TerminateThread(m_hThread, -1);
+		::CloseHandle(m_hThread);
+		m_hThread = nullptr;
+	}
+
+	for (int i = 0; i < MAX_OUTSTANDING; i++) {
+		if (m_SlotList[i].Used) {
+			m_pEventHandler->OnQueryCancelled(m_SlotList[i].pParam);
+			FreeSlot(i);
+		}
+	}
+
+	m_Lock.Lock();
+	std::deque<QueuedQuery> Queue;
+	Queue.swap(m_QueryQueue);
+	m_Lock.Unlock();
+	for (std::deque<QueuedQuery>::iterator i = Queue.begin(); i != Queue.end(); i++)
+		m_pEventHandler->OnQueryCancelled(i->pParam);
+
+	if (m_hSocketEvent != WSA_INVALID_EVENT) {
+		::WSACloseEvent(m_hSocketEvent);
+		m_hSocketEvent = WSA_INVALID_EVENT;
+	}
+	if (m_hWakeEvent != nullptr) {
+		::CloseHandle(m_hWakeEvent);
+		m_hWakeEvent = nullptr;
+	}
+	if (m_hCryptProv != 0) {
+		::CryptReleaseContext(m_hCryptProv, 0);
+		m_hCryptProv = 0;
+	}
+}
+
+bool DnsResolver::IsRunning() const
+{
+	return m_hThread != nullptr;
+}
+
+// Servers can only be changed while the resolver is stopped.
+// If no server is set, the servers of the system are used.
+bool DnsResolver::SetServers(const IPAddress *pServerList, int NumServers)
+{
+	if (m_hThread != nullptr || NumServers < 0)
+		return false;
+
+	m_NumServers = min(NumServers, (int)MAX_SERVERS);
+	for (int i = 0; i < m_NumServers; i++)
+		m_ServerList[i] = pServerList[i];
+
+	return true;
+}
+
+int DnsResolver::NumServers() const
+{
+	return m_NumServers;
+}
+
+// The port of the servers, which is only changed to reach a test server
+bool DnsResolver::SetServerPort(WORD Port)
+{
+	if (m_hThread != nullptr || Port == 0)
+		return false;
+
+	m_ServerPort = Port;
+
+	return true;
+}
+
+bool DnsResolver::Query(const IPAddress &Address, void *pParam)
+{
+	if (m_hThread == nullptr)
+		return false;
+
+	QueuedQuery Queued;
+	Queued.Address = Address;
+	Queued.pParam = pParam;
+
+	m_Lock.Lock();
+	m_QueryQueue.push_back(Queued);
+	m_Lock.Unlock();
+	::SetEvent(m_hWakeEvent);
+
+	return true;
+}
+
+size_t DnsResolver::NumQueued() const
+{
+	BlockLock Lock(m_Lock);
+
+	return m_QueryQueue.size();
+}
+
+bool DnsResolver::LoadSystemServers()
+{
+	ULONG Size = 0;
+	if (::GetNetworkParams(nullptr, &Size) != ERROR_BUFFER_OVERFLOW)
+		return false;
+
+	std::vector<BYTE> Buffer(Size);
+	FIXED_INFO *pInfo = reinterpret_cast<FIXED_INFO*>(Buffer.data());
+	if (::GetNetworkParams(pInfo, &Size) != ERROR_SUCCESS)
+		return false;
+
+	m_NumServers = 0;
+	for (const IP_ADDR_STRING *p = &pInfo->DnsServerList;
+			p != nullptr && m_NumServers < MAX_SERVERS; p = p->Next) {
+		const ULONG Address = ::inet_addr(p->IpAddress.String);
+		if (Address != INADDR_NONE && Address != 0)
+			m_ServerList[m_NumServers++].SetV4Address(Address);
+	}
+
+	return m_NumServers > 0;
+}
+
+// Each query gets a socket bound to a random port, and connected to the server so that
+// only its responses are received. Together with the random ID, a spoofed response has
+// to guess 32 bits.
+SOCKET DnsResolver::OpenSocket(const IPAddress &Server)
+{
+	sockaddr_in Addr4;
+	sockaddr_in6 Addr6;
+	SOCKADDR *pSockAddr;
+	int SockAddrSize;
+
+	if (Server.Type == IP_ADDRESS_V4) {
+		::ZeroMemory(&Addr4, sizeof(Addr4));
+		Addr4.sin_family = AF_INET;
+		pSockAddr = reinterpret_cast<SOCKADDR*>(&Addr4);
+		SockAddrSize = sizeof(Addr4);
+	} else {
+		::ZeroMemory(&Addr6, sizeof(Addr6));
+		Addr6.sin6_family = AF_INET6;
+		pSockAddr = reinterpret_cast<SOCKADDR*>(&Addr6);
+		SockAddrSize = sizeof(Addr6);
+	}
+
+	SOCKET Socket = ::socket(pSockAddr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (Socket == INVALID_SOCKET)
+		return INVALID_SOCKET;
+
+	// The port is left to the system if the random ones are in use
+	bool Bound = false;
+	for (int i = 0; i < MAX_BIND_ATTEMPTS && !Bound; i++) {
+		const WORD Port = (WORD)(MIN_SOURCE_PORT + GetRandomWord() % (0x10000 - MIN_SOURCE_PORT));
+		if (Server.Type == IP_ADDRESS_V4)
+			Addr4.sin_port = ::htons(Port);
+		else
+			Addr6.sin6_port = ::htons(Port);
+		Bound = ::bind(Socket, pSockAddr, SockAddrSize) == 0;
+	}
+	if (!Bound) {
+		if (Server.Type == IP_ADDRESS_V4)
+			Addr4.sin_port = 0;
+		else
+			Addr6.sin6_port = 0;
+		if (::bind(Socket, pSockAddr, SockAddrSize) != 0) {
+			::closesocket(Socket);
+			return INVALID_SOCKET;
+		}
+	}
+
+	if (Server.Type == IP_ADDRESS_V4) {
+		Addr4.sin_port = ::htons(m_ServerPort);
+		Addr4.sin_addr.s_addr = Server.V4.Address;
+	} else {
+		Addr6.sin6_port = ::htons(m_ServerPort);
+		::memcpy(Addr6.sin6_addr.u.Byte, Server.V6.Bytes, 16);
+		Addr6.sin6_scope_id = Server.V6.ScopeID;
+	}
+	if (::connect(Socket, pSockAddr, SockAddrSize) != 0
+			|| ::WSAEventSelect(Socket, m_hSocketEvent, FD_READ) != 0) {
+		::closesocket(Socket);
+		return INVALID_SOCKET;
+	}
+
+	return Socket;
+}
+
+void DnsResolver::SendQueries()
+{
+	while (m_NumUsedSlots < MAX_OUTSTANDING) {
+		QueuedQuery Queued;
+
+		m_Lock.Lock();
+		if (m_QueryQueue.empty()) {
+			m_Lock.Unlock();
+			break;
+		}
+		Queued = m_QueryQueue.front();
+		m_QueryQueue.pop_front();
+		m_Lock.Unlock();
+
+		int Slot = 0;
+		while (m_SlotList[Slot].Used)
+			Slot++;
+
+		QuerySlot &Query = m_SlotList[Slot];
+		Query.QuestionLength = BuildQuestion(Queued.Address, Query.Question);
+		if (Query.QuestionLength == 0) {
+			m_pEventHandler->OnQueryComplete(Queued.pParam, nullptr, 0);
+			continue;
+		}
+		Query.Used = true;
+		Query.pParam = Queued.pParam;
+		Query.Attempts = 0;
+		Query.Server = m_NextServer;
+		m_NextServer = (m_NextServer + 1) % m_NumServers;
+		m_NumUsedSlots++;
+
+		if (!SendQuery(Slot)) {
+			m_pEventHandler->OnQueryFallback(Query.pParam);
+			FreeSlot(Slot);
+		}
+	}
+}
+
+bool DnsResolver::SendQuery(int Slot)
+{
+	QuerySlot &Query = m_SlotList[Slot];
+	BYTE Packet[DNS_HEADER_LENGTH + MAX_QUESTION_LENGTH];
+
+	// Every attempt uses a new port and ID, so a late response to the previous one is ignored
+	if (Query.Socket != INVALID_SOCKET) {
+		::closesocket(Query.Socket);
+		m_IDSlotMap[Query.ID] = 0;
+	}
+	Query.Socket = OpenSocket(m_ServerList[Query.Server]);
+	if (Query.Socket == INVALID_SOCKET)
+		return false;
+
+	// The map holds the slot index plus one for the IDs in use
+	do {
+		Query.ID = GetRandomWord();
+	} while (m_IDSlotMap[Query.ID] != 0);
+	m_IDSlotMap[Query.ID] = (WORD)(Slot + 1);
+
+	PutWord(Packet, Query.ID);
+	PutWord(Packet + 2, DNS_FLAG_RD);
+	PutWord(Packet + 4, 1);
+	PutWord(Packet + 6, 0);
+	PutWord(Packet + 8, 0);
+	PutWord(Packet + 10, 0);
+	std::memcpy(Packet + DNS_HEADER_LENGTH, Query.Question, Query.QuestionLength);
+
+	Query.Attempts++;
+	Query.SentTick = ::GetTickCount64();
+
+	const int Length = DNS_HEADER_LENGTH + Query.QuestionLength;
+	return ::send(Query.Socket, reinterpret_cast<const char*>(Packet), Length, 0) == Length;
+}
+
+// The event is reset first, as a datagram arriving afterwards signals it again
+void DnsResolver::ReceiveResponses()
+{
+	::WSAResetEvent(m_hSocketEvent);
+
+	for (int i = 0; i < MAX_OUTSTANDING; i++) {
+		// The socket is replaced when the query is retried, and closed when it completes
+		while (m_SlotList[i].Used) {
+			const SOCKET Socket = m_SlotList[i].Socket;
+			BYTE Packet[MAX_PACKET_LENGTH];
+			const int Length = ::recv(Socket, reinterpret_cast<char*>(Packet), sizeof(Packet), 0);
+			if (Length == SOCKET_ERROR) {
+				// WSAECONNRESET is reported for an ICMP port unreachable, and the query times out
+				if (::WSAGetLastError() == WSAECONNRESET)
+					continue;
+				break;
+			}
+			ProcessResponse(i, Packet, Length);
+			if (m_SlotList[i].Socket != Socket)
+				break;
+		}
+	}
+}
+
+void DnsResolver::ProcessResponse(int Slot, const BYTE *pData, int Length)
+{
+	if (Length < DNS_HEADER_LENGTH)
+		return;
+
+	const WORD ID = GetWord(pData);
+	if (m_IDSlotMap[ID] != Slot + 1)
+		return;
+	QuerySlot &Query = m_SlotList[Slot];
+
+	const WORD Flags = GetWord(pData + 2);
+	if ((Flags & DNS_FLAG_QR) == 0 || (Flags & DNS_OPCODE_MASK) != 0
+			|| GetWord(pData + 4) != 1
+			|| Length < DNS_HEADER_LENGTH + Query.QuestionLength
+			|| !IsSameQuestion(pData + DNS_HEADER_LENGTH, Query.Question, Query.QuestionLength))
+		return;
+
+	// A truncated response is retried by the system resolver, which can use TCP
+	if ((Flags & DNS_FLAG_TC) != 0) {
+		m_pEventHandler->OnQueryFallback(Query.pParam);
+		FreeSlot(Slot);
+		return;
+	}
+
+	const int RCode = Flags & DNS_RCODE_MASK;
+	if (RCode == DNS_RCODE_SERVFAIL || RCode == DNS_RCODE_REFUSED) {
+		if (Query.Attempts < MAX_ATTEMPTS) {
+			Query.Server = (Query.Server + 1) % m_NumServers;
+			if (SendQuery(Slot))
+				return;
+		}
+		m_pEventHandler->OnQueryComplete(Query.pParam, nullptr, 0);
+		FreeSlot(Slot);
+		return;
+	}
+
+	TCHAR szHostName[NI_MAXHOST];
+	DWORD TTL = 0;
+	bool Found = false;
+	if (RCode == 0) {
+		const int NumAnswers = GetWord(pData + 6);
+		int Pos = DNS_HEADER_LENGTH + Query.QuestionLength;
+
+		for (int i = 0; i < NumAnswers && !Found; i++) {
+			Pos = SkipName(pData, Length, Pos);
+			if (Pos < 0 || Pos + 10 > Length)
+				break;
+			const WORD Type = GetWord(pData + Pos);
+			const WORD Class = GetWord(pData + Pos + 2);
+			const DWORD RecordTTL = GetDWord(pData + Pos + 4);
+			const int DataLength = GetWord(pData + Pos + 8);
+			Pos += 10;
+			if (Pos + DataLength > Length)
+				break;
+			if (Type == DNS_TYPE_PTR && Class == DNS_CLASS_IN) {
+				Found = ReadName(pData, Pos + DataLength, Pos, szHostName, cvLengthOf(szHostName));
+				// The top bit set is treated as zero (RFC 2181)
+				TTL = (RecordTTL & 0x80000000) == 0 ? RecordTTL : 0;
+			}
+			Pos += DataLength;
+		}
+	}
+
+	m_pEventHandler->OnQueryComplete(Query.pParam, Found ? szHostName : nullptr, TTL);
+	FreeSlot(Slot);
+}
+
+// Unanswered queries are sent again to the next server
+void DnsResolver::CheckTimeouts()
+{
+	const ULONGLONG CurTick = ::GetTickCount64();
+
+	for (int i = 0; i < MAX_OUTSTANDING; i++) {
+		QuerySlot &Query = m_SlotList[i];
+
+		if (Query.Used && CurTick - Query.SentTick >= RETRY_INTERVAL) {
+			if (Query.Attempts < MAX_ATTEMPTS) {
+				Query.Server = (Query.Server + 1) % m_NumServers;
+				if (SendQuery(i))
+					continue;
+			}
+			m_pEventHandler->OnQueryComplete(Query.pParam, nullptr, 0);
+			FreeSlot(i);
+		}
+	}
+}
+
+void DnsResolver::FreeSlot(int Slot)
+{
+	QuerySlot &Query = m_SlotList[Slot];
+
+	if (Query.Socket != INVALID_SOCKET) {
+		::closesocket(Query.Socket);
+		Query.Socket = INVALID_SOCKET;
+		m_IDSlotMap[Query.ID] = 0;
+	}
+	Query.Used = false;
+	Query.pParam = nullptr;
+	m_NumUsedSlots--;
+}
+
+WORD DnsResolver::GetRandomWord()
+{
+	if (m_RandomPos + 2 > cvLengthOf(m_RandomPool)) {
+		if (!::CryptGenRandom(m_hCryptProv, sizeof(m_RandomPool), m_RandomPool)) {
+			LARGE_INTEGER Counter;
+			::QueryPerformanceCounter(&Counter);
+			for (int i = 0; i < cvLengthOf(m_RandomPool); i++)
+				m_RandomPool[i] ^= (BYTE)(Counter.LowPart >> ((i % 4) * 8));
+		}
+		m_RandomPos = 0;
+	}
+
+	const WORD Value = GetWord(&m_RandomPool[m_RandomPos]);
+	m_RandomPos += 2;
+	return Value;
+}
+
+DWORD DnsResolver::GetWaitTimeout() const
+{
+	if (m_NumUsedSlots == 0)
+		return INFINITE;
+
+	const ULONGLONG CurTick = ::GetTickCount64();
+	ULONGLONG Timeout = RETRY_INTERVAL;
+	for (int i = 0; i < MAX_OUTSTANDING; i++) {
+		const QuerySlot &Query = m_SlotList[i];
+		if (Query.Used) {
+			const ULONGLONG Elapsed = CurTick - Query.SentTick;
+			if (Elapsed >= RETRY_INTERVAL)
+				return 0;
+			if (RETRY_INTERVAL - Elapsed < Timeout)
+				Timeout = RETRY_INTERVAL - Elapsed;
+		}
+	}
+
+	return (DWORD)Timeout;
+}
+
+DWORD WINAPI DnsResolver::ThreadProc(LPVOID pParameter)
+{
+	DnsResolver *pThis = static_cast<DnsResolver*>(pParameter);
+	WSAEVENT EventList[2];
+
+	EventList[0] = pThis->m_hSocketEvent;
+	EventList[1] = pThis->m_hWakeEvent;
+
+	while (!pThis->m_Abort) {
+		const DWORD Result = ::WSAWaitForMultipleEvents(2, EventList, FALSE,
+														pThis->GetWaitTimeout(), FALSE);
+		if (pThis->m_Abort)
+			break;
+
+		if (Result == WSA_WAIT_EVENT_0)
+			pThis->ReceiveResponses();
+		pThis->CheckTimeouts();
+		pThis->SendQueries();
+	}
+
+	return 0;
+}
+
+}	// namespace CV
@@ -0,0 +1,137 @@
+/******************************************************************************
+*                                                                             *
+*    DnsResolver.h                          Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef CV_DNS_RESOLVER_H
+#define CV_DNS_RESOLVER_H
+
+
+#include <deque>
+#include <vector>
+#include "Utility.h"
+
+
+namespace CV
+{
+
+// Resolves PTR records asynchronously.
+// Queries are pipelined on a single thread, each sent from its own UDP socket.
+class DnsResolver
+{
+public:
+	// Called on the resolver thread, except OnQueryCancelled() which is called from Stop().
+	// TTL is the time to live of the PTR record in seconds.
+	cvAbstractClass(EventHandler)
+	{
+public:
+		virtual ~EventHandler() {}
+		virtual void OnQueryComplete(void *pParam, LPCTSTR pHostName, DWORD TTL) = 0;
+		virtual void OnQueryFallback(void *pParam) = 0;
+		virtual void OnQueryCancelled(void *pParam) = 0;
+	};
+
+	enum
+	{
+		MAX_SERVERS			= 4,
+		MAX_OUTSTANDING		= 256,
+		RETRY_INTERVAL		= 1000,
+		MAX_ATTEMPTS		= 3
+	};
+
+	DnsResolver();
+	~DnsResolver();
+	bool Start(EventHandler *pEventHandler);
+	void Stop();
+	bool IsRunning() const;
+	bool SetServers(const IPAddress *pServerList, int NumServers);
+	int NumServers() const;
+	bool SetServerPort(WORD Port);
+	bool Query(const IPAddress &Address, void *pParam);
+	size_t NumQueued() const;
+
+private:
+	enum
+	{
+		MAX_QUESTION_LENGTH	= 128,
+		MAX_PACKET_LENGTH	= 512,
+		DNS_HEADER_LENGTH	= 12,
+		MIN_SOURCE_PORT		= 1024,
+		MAX_BIND_ATTEMPTS	= 8
+	};
+
+	struct QueuedQuery
+	{
+		IPAddress Address;
+		void *pParam;
+	};
+
+	struct QuerySlot
+	{
+		bool Used;
+		WORD ID;
+		void *pParam;
+		SOCKET Socket;
+		int Server;
+		int Attempts;
+		ULONGLONG SentTick;
+		int QuestionLength;
+		BYTE Question[MAX_QUESTION_LENGTH];
+	};
+
+	bool LoadSystemServers();
+	SOCKET OpenSocket(const IPAddress &Server);
+	void SendQueries();
+	bool SendQuery(int Slot);
+	void ReceiveResponses();
+	void ProcessResponse(int Slot, const BYTE *pData, int Length);
+	void CheckTimeouts();
+	void FreeSlot(int Slot);
+	WORD GetRandomWord();
+	DWORD GetWaitTimeout() const;
+	static DWORD WINAPI ThreadProc(LPVOID pParameter);
+
+	EventHandler *m_pEventHandler;
+	HANDLE m_hThread;
+	HANDLE m_hWakeEvent;
+	volatile bool m_Abort;
+	mutable LocalLock m_Lock;
+	std::deque<QueuedQuery> m_QueryQueue;
+	IPAddress m_ServerList[MAX_SERVERS];
+	int m_NumServers;
+	WORD m_ServerPort;
+	WSAEVENT m_hSocketEvent;
+	QuerySlot m_SlotList[MAX_OUTSTANDING];
+	std::vector<WORD> m_IDSlotMap;
+	int m_NumUsedSlots;
+	int m_NextServer;
+	HCRYPTPROV m_hCryptProv;
+	BYTE m_RandomPool[256];
+	int m_RandomPos;
+};
+
+}	// namespace CV
+
+
+#endif	// ndef CV_DNS_RESOLVER_H
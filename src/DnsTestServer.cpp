@@ -0,0 +1,450 @@
+/******************************************************************************
+*                                                                             *
+*    DnsTestServer.cpp                      Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "ConnectionViewer.h"
+
+
+#ifdef _DEBUG
+
+
+#include "DnsTestServer.h"
+#include "DnsResolver.h"
+
+
+namespace CV
+{
+
+enum
+{
+	DNS_TYPE_PTR		= 12,
+	DNS_CLASS_IN		= 1,
+	DNS_FLAG_QR			= 0x8000,
+	DNS_FLAG_TC			= 0x0200,
+	DNS_FLAG_RD			= 0x0100,
+	DNS_FLAG_RA			= 0x0080,
+	DNS_RCODE_SERVFAIL	= 2,
+	DNS_RCODE_NXDOMAIN	= 3,
+	DNS_HEADER_LENGTH	= 12,
+	TEST_HOST_NAME_TTL	= 300
+};
+
+static const BYTE TestHostName[] = "\x04host\x07" "example\x03net";
+
+static WORD GetWord(const BYTE *p)
+{
+	return (WORD)((p[0] << 8) | p[1]);
+}
+
+static void PutWord(BYTE *p, WORD Value)
+{
+	p[0] = (BYTE)(Value >> 8);
+	p[1] = (BYTE)(Value & 0xFF);
+}
+
+
+DnsTestServer::DnsTestServer()
+	: m_Socket(INVALID_SOCKET)
+	, m_Port(0)
+	, m_hThread(nullptr)
+	, m_Abort(false)
+	, m_ResponseType(RESPONSE_NAME)
+	, m_Latency(0)
+	, m_LossRate(0)
+	, m_NumReceived(0)
+	, m_Random(12345)
+{
+}
+
+DnsTestServer::~DnsTestServer()
+{
+	Stop();
+}
+
+bool DnsTestServer::Start()
+{
+	if (m_hThread != nullptr)
+		return true;
+
+	m_Socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (m_Socket == INVALID_SOCKET)
+		return false;
+
+	sockaddr_in Addr;
+	int AddrSize = sizeof(Addr);
+	::ZeroMemory(&Addr, sizeof(Addr));
+	Addr.sin_family = AF_INET;
+	Addr.sin_addr.s_addr = ::htonl(INADDR_LOOPBACK);
+	if (::bind(m_Socket, reinterpret_cast<SOCKADDR*>(&Addr), sizeof(Addr)) != 0
+			|| ::getsockname(m_Socket, reinterpret_cast<SOCKADDR*>(&Addr), &AddrSize) != 0) {
+		Stop();
+		return false;
+	}
+	m_Port = ::ntohs(Addr.sin_port);
+
+	m_Abort = false;
+	m_hThread = ::CreateThread(nullptr, 0, ThreadProc, this, 0, nullptr);
+	if (m_hThread == nullptr) {
+		Stop();
+		return false;
+	}
+
+	return true;
+}
+
+void DnsTestServer::Stop()
+{
+	if (m_hThread != nullptr) {
+		m_Abort = true;
+		::WaitForSingleObject(m_hThread, INFINITE);
+		::CloseHandle(m_hThread);
+		m_hThread = nullptr;
+	}
+	if (m_Socket != INVALID_SOCKET) {
+		::closesocket(m_Socket);
+		m_Socket = INVALID_SOCKET;
+	}
+	m_PendingList.clear();
+}
+
+WORD DnsTestServer::GetPort() const
+{
+	return m_Port;
+}
+
+// LossRate is the percentage of queries that are not answered
+void DnsTestServer::SetResponse(ResponseType Type, DWORD Latency, int LossRate)
+{
+	BlockLock Lock(m_Lock);
+
+	m_ResponseType = Type;
+	m_Latency = Latency;
+	m_LossRate = LossRate;
+	m_NumReceived = 0;
+	m_PendingList.clear();
+}
+
+int DnsTestServer::NumReceived() const
+{
+	BlockLock Lock(m_Lock);
+
+	return m_NumReceived;
+}
+
+// Returns 0 if the query isn't answered. Must be called with the lock held.
+int DnsTestServer::BuildResponse(const BYTE *pQuery, int QueryLength, BYTE *pResponse)
+{
+	if (QueryLength < DNS_HEADER_LENGTH || (GetWord(pQuery + 2) & DNS_FLAG_QR) != 0
+			|| GetWord(pQuery + 4) != 1)
+		return 0;
+
+	int Pos = DNS_HEADER_LENGTH;
+	while (Pos < QueryLength && pQuery[Pos] != 0)
+		Pos += 1 + pQuery[Pos];
+	Pos += 1 + 4;
+	if (Pos > QueryLength || Pos + 12 + (int)sizeof(TestHostName) > MAX_PACKET_LENGTH || GetWord(pQuery + Pos - 4) != DNS_TYPE_PTR)
+		return 0;
+
+	m_Random = m_Random * 1103515245 + 12345;
+	if ((int)((m_Random >> 16) % 100) < m_LossRate)
+		return 0;
+
+	WORD Flags = DNS_FLAG_QR | DNS_FLAG_RD | DNS_FLAG_RA;
+	bool Answer = false;
+	switch (m_ResponseType) {
+	case RESPONSE_NAME:
+	case RESPONSE_WRONG_ID:
+	case RESPONSE_MALFORMED:
+		Answer = true;
+		break;
+	case RESPONSE_NXDOMAIN:
+		Flags |= DNS_RCODE_NXDOMAIN;
+		break;
+	case RESPONSE_SERVFAIL:
+		Flags |= DNS_RCODE_SERVFAIL;
+		break;
+	case RESPONSE_TRUNCATED:
+		Flags |= DNS_FLAG_TC;
+		break;
+	}
+
+	std::memcpy(pResponse, pQuery, Pos);
+	if (m_ResponseType == RESPONSE_WRONG_ID)
+		PutWord(pResponse, GetWord(pQuery) + 1);
+	PutWord(pResponse + 2, Flags);
+	PutWord(pResponse + 6, Answer ? 1 : 0);
+	PutWord(pResponse + 8, 0);
+	PutWord(pResponse + 10, 0);
+
+	if (Answer) {
+		// The owner name points to the question
+		BYTE *p = pResponse + Pos;
+		PutWord(p, 0xC000 | DNS_HEADER_LENGTH);
+		PutWord(p + 2, DNS_TYPE_PTR);
+		PutWord(p + 4, DNS_CLASS_IN);
+		PutWord(p + 6, 0);
+		PutWord(p + 8, TEST_HOST_NAME_TTL);
+		// A malformed record claims more data than the packet has
+		PutWord(p + 10, m_ResponseType == RESPONSE_MALFORMED ? 200 : sizeof(TestHostName));
+		std::memcpy(p + 12, TestHostName, sizeof(TestHostName));
+		Pos += 12 + sizeof(TestHostName);
+	}
+
+	return Pos;
+}
+
+DWORD WINAPI DnsTestServer::ThreadProc(LPVOID pParameter)
+{
+	DnsTestServer *pThis = static_cast<DnsTestServer*>(pParameter);
+
+	while (!pThis->m_Abort) {
+		const ULONGLONG CurTick = ::GetTickCount64();
+		DWORD Timeout = 50;
+
+		// The latency is the same for all the responses, so they are due in order
+		pThis->m_Lock.Lock();
+		while (!pThis->m_PendingList.empty() && pThis->m_PendingList.front().DueTick <= CurTick) {
+			const PendingResponse &Response = pThis->m_PendingList.front();
+			::sendto(pThis->m_Socket, reinterpret_cast<const char*>(Response.Packet), Response.Length, 0,
+					 reinterpret_cast<const SOCKADDR*>(&Response.Address), sizeof(Response.Address));
+			pThis->m_PendingList.pop_front();
+		}
+		if (!pThis->m_PendingList.empty() && pThis->m_PendingList.front().DueTick - CurTick < Timeout)
+			Timeout = (DWORD)(pThis->m_PendingList.front().DueTick - CurTick);
+		pThis->m_Lock.Unlock();
+
+		fd_set ReadSet;
+		FD_ZERO(&ReadSet);
+		FD_SET(pThis->m_Socket, &ReadSet);
+		timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = Timeout * 1000;
+		if (::select(0, &ReadSet, nullptr, nullptr, &tv) != 1)
+			continue;
+
+		BYTE Query[MAX_PACKET_LENGTH];
+		PendingResponse Response;
+		int AddrSize = sizeof(Response.Address);
+		const int Length = ::recvfrom(pThis->m_Socket, reinterpret_cast<char*>(Query), sizeof(Query), 0,
+									  reinterpret_cast<SOCKADDR*>(&Response.Address), &AddrSize);
+		if (Length == SOCKET_ERROR)
+			continue;
+
+		BlockLock Lock(pThis->m_Lock);
+		pThis->m_NumReceived++;
+		Response.Length = pThis->BuildResponse(Query, Length, Response.Packet);
+		Response.DueTick = ::GetTickCount64() + pThis->m_Latency;
+		if (Response.Length > 0)
+			pThis->m_PendingList.push_back(Response);
+	}
+
+	return 0;
+}
+
+
+class TestEventHandler
+	: public DnsResolver::EventHandler
+{
+public:
+	// RESULT_ANY is expected when some of the queries are lost
+	enum ResultType
+	{
+		RESULT_NONE,
+		RESULT_FOUND,
+		RESULT_NOT_FOUND,
+		RESULT_FALLBACK,
+		RESULT_CANCELLED,
+		RESULT_ANY
+	};
+
+	enum { MAX_QUERIES = 64 };
+
+	struct Result
+	{
+		ResultType Type;
+		DWORD TTL;
+		TCHAR szHostName[NI_MAXHOST];
+	};
+
+	TestEventHandler(int NumQueries)
+		: m_NumQueries(NumQueries)
+		, m_NumDone(0)
+	{
+		m_hDoneEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
+		for (int i = 0; i < MAX_QUERIES; i++)
+			m_ResultList[i].Type = RESULT_NONE;
+	}
+
+	~TestEventHandler()
+	{
+		::CloseHandle(m_hDoneEvent);
+	}
+
+	bool Wait(DWORD Timeout)
+	{
+		return ::WaitForSingleObject(m_hDoneEvent, Timeout) == WAIT_OBJECT_0;
+	}
+
+	const Result &GetResult(int Index) const { return m_ResultList[Index]; }
+
+	void OnQueryComplete(void *pParam, LPCTSTR pHostName, DWORD TTL) override
+	{
+		Result &Res = m_ResultList[(INT_PTR)pParam];
+		Res.TTL = TTL;
+		if (pHostName != nullptr)
+			::lstrcpyn(Res.szHostName, pHostName, cvLengthOf(Res.szHostName));
+		SetResult(Res, pHostName != nullptr ? RESULT_FOUND : RESULT_NOT_FOUND);
+	}
+
+	void OnQueryFallback(void *pParam) override
+	{
+		SetResult(m_ResultList[(INT_PTR)pParam], RESULT_FALLBACK);
+	}
+
+	void OnQueryCancelled(void *pParam) override
+	{
+		SetResult(m_ResultList[(INT_PTR)pParam], RESULT_CANCELLED);
+	}
+
+private:
+	void SetResult(Result &Res, ResultType Type)
+	{
+		Res.Type = Type;
+		if (::InterlockedIncrement(&m_NumDone) == m_NumQueries)
+			::SetEvent(m_hDoneEvent);
+	}
+
+	HANDLE m_hDoneEvent;
+	LONG m_NumQueries;
+	volatile LONG m_NumDone;
+	Result m_ResultList[MAX_QUERIES];
+};
+
+// Sends NumQueries queries for 192.0.2.x and 2001:db8::x, and checks that they all end with Expected
+static bool RunTest(LPCTSTR pName, DnsTestServer &Server, DnsTestServer::ResponseType Response,
+					DWORD Latency, int LossRate, int NumQueries,
+					TestEventHandler::ResultType Expected, int ExpectedReceived)
+{
+	Server.SetResponse(Response, Latency, LossRate);
+
+	DnsResolver *pResolver = new DnsResolver;
+	TestEventHandler Handler(NumQueries);
+	IPAddress ServerAddress;
+	ServerAddress.SetV4Address(::htonl(INADDR_LOOPBACK));
+	pResolver->SetServers(&ServerAddress, 1);
+	pResolver->SetServerPort(Server.GetPort());
+
+	bool Passed = pResolver->Start(&Handler);
+	const ULONGLONG StartTick = ::GetTickCount64();
+	for (int i = 0; i < NumQueries && Passed; i++) {
+		IPAddress Address;
+		if (i % 2 == 0) {
+			Address.SetV4Address(::htonl(0xC0000200 | i));
+		} else {
+			BYTE Bytes[16] = {0x20, 0x01, 0x0D, 0xB8};
+			Bytes[15] = (BYTE)i;
+			Address.SetV6Address(Bytes);
+		}
+		Passed = pResolver->Query(Address, (void*)(INT_PTR)i);
+	}
+
+	// Queries still outstanding are cancelled when the resolver is stopped
+	if (Passed && Expected != TestEventHandler::RESULT_CANCELLED)
+		Passed = Handler.Wait(DnsResolver::RETRY_INTERVAL * DnsResolver::MAX_ATTEMPTS + 2000);
+	else if (Passed)
+		::Sleep(100);
+	const ULONGLONG Elapsed = ::GetTickCount64() - StartTick;
+	pResolver->Stop();
+	delete pResolver;
+
+	for (int i = 0; i < NumQueries && Passed; i++) {
+		const TestEventHandler::Result &Res = Handler.GetResult(i);
+		if (Expected == TestEventHandler::RESULT_ANY)
+			Passed = Res.Type == TestEventHandler::RESULT_FOUND
+				|| Res.Type == TestEventHandler::RESULT_NOT_FOUND;
+		else if (Res.Type != Expected)
+			Passed = false;
+		else if (Expected == TestEventHandler::RESULT_FOUND)
+			Passed = ::lstrcmp(Res.szHostName, TEXT("host.example.net")) == 0
+				&& Res.TTL == TEST_HOST_NAME_TTL;
+	}
+	if (ExpectedReceived >= 0 && Server.NumReceived() != ExpectedReceived)
+		Passed = false;
+	// The queries are pipelined, so they are all answered within the latency of one
+	if (Expected == TestEventHandler::RESULT_FOUND && LossRate == 0
+			&& Elapsed >= DnsResolver::RETRY_INTERVAL)
+		Passed = false;
+
+	cvDebugTrace(TEXT("DnsResolver test %s : %s (%llu ms, %d received)\n"),
+				 pName, Passed ? TEXT("passed") : TEXT("FAILED"), Elapsed, Server.NumReceived());
+
+	return Passed;
+}
+
+bool TestDnsResolver()
+{
+	DnsTestServer Server;
+	if (!Server.Start()) {
+		cvDebugTrace(TEXT("DnsResolver test : The server could not be started\n"));
+		return false;
+	}
+
+	const int MaxAttempts = DnsResolver::MAX_ATTEMPTS;
+	bool Passed = true;
+
+	Passed &= RunTest(TEXT("name"), Server, DnsTestServer::RESPONSE_NAME,
+					  0, 0, 2, TestEventHandler::RESULT_FOUND, 2);
+	Passed &= RunTest(TEXT("pipelined"), Server, DnsTestServer::RESPONSE_NAME,
+					  200, 0, TestEventHandler::MAX_QUERIES, TestEventHandler::RESULT_FOUND,
+					  TestEventHandler::MAX_QUERIES);
+	Passed &= RunTest(TEXT("loss"), Server, DnsTestServer::RESPONSE_NAME,
+					  0, 50, TestEventHandler::MAX_QUERIES, TestEventHandler::RESULT_ANY, -1);
+	Passed &= RunTest(TEXT("timeout"), Server, DnsTestServer::RESPONSE_NAME,
+					  0, 100, 1, TestEventHandler::RESULT_NOT_FOUND, MaxAttempts);
+	Passed &= RunTest(TEXT("late"), Server, DnsTestServer::RESPONSE_NAME,
+					  DnsResolver::RETRY_INTERVAL * MaxAttempts, 0, 1,
+					  TestEventHandler::RESULT_NOT_FOUND, MaxAttempts);
+	Passed &= RunTest(TEXT("wrong ID"), Server, DnsTestServer::RESPONSE_WRONG_ID,
+					  0, 0, 1, TestEventHandler::RESULT_NOT_FOUND, MaxAttempts);
+	Passed &= RunTest(TEXT("NXDOMAIN"), Server, DnsTestServer::RESPONSE_NXDOMAIN,
+					  0, 0, 2, TestEventHandler::RESULT_NOT_FOUND, 2);
+	Passed &= RunTest(TEXT("SERVFAIL"), Server, DnsTestServer::RESPONSE_SERVFAIL,
+					  0, 0, 1, TestEventHandler::RESULT_NOT_FOUND, MaxAttempts);
+	Passed &= RunTest(TEXT("truncated"), Server, DnsTestServer::RESPONSE_TRUNCATED,
+					  0, 0, 1, TestEventHandler::RESULT_FALLBACK, 1);
+	Passed &= RunTest(TEXT("malformed"), Server, DnsTestServer::RESPONSE_MALFORMED,
+					  0, 0, 1, TestEventHandler::RESULT_NOT_FOUND, 1);
+	Passed &= RunTest(TEXT("cancelled"), Server, DnsTestServer::RESPONSE_NAME,
+					  0, 100, 4, TestEventHandler::RESULT_CANCELLED, -1);
+
+	Server.Stop();
+
+	return Passed;
+}
+
+}	// namespace CV
+
+
+#endif	// def _DEBUG
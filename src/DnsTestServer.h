@@ -0,0 +1,100 @@
+/******************************************************************************
+*                                                                             *
+*    DnsTestServer.h                        Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef CV_DNS_TEST_SERVER_H
+#define CV_DNS_TEST_SERVER_H
+
+
+#ifdef _DEBUG
+
+
+#include <deque>
+#include "Utility.h"
+
+
+namespace CV
+{
+
+// Stands in for a DNS server on the loopback address, to test DnsResolver against.
+// Every PTR query is answered the same way, after the latency, unless it is lost.
+class DnsTestServer
+{
+public:
+	enum ResponseType
+	{
+		RESPONSE_NAME,
+		RESPONSE_NXDOMAIN,
+		RESPONSE_SERVFAIL,
+		RESPONSE_TRUNCATED,
+		RESPONSE_WRONG_ID,
+		RESPONSE_MALFORMED
+	};
+
+	DnsTestServer();
+	~DnsTestServer();
+	bool Start();
+	void Stop();
+	WORD GetPort() const;
+	void SetResponse(ResponseType Type, DWORD Latency = 0, int LossRate = 0);
+	int NumReceived() const;
+
+private:
+	enum { MAX_PACKET_LENGTH = 512 };
+
+	struct PendingResponse
+	{
+		ULONGLONG DueTick;
+		sockaddr_in Address;
+		int Length;
+		BYTE Packet[MAX_PACKET_LENGTH];
+	};
+
+	int BuildResponse(const BYTE *pQuery, int QueryLength, BYTE *pResponse);
+	static DWORD WINAPI ThreadProc(LPVOID pParameter);
+
+	SOCKET m_Socket;
+	WORD m_Port;
+	HANDLE m_hThread;
+	volatile bool m_Abort;
+	mutable LocalLock m_Lock;
+	ResponseType m_ResponseType;
+	DWORD m_Latency;
+	int m_LossRate;
+	int m_NumReceived;
+	unsigned int m_Random;
+	std::deque<PendingResponse> m_PendingList;
+};
+
+// Runs DnsResolver against DnsTestServer, and returns false if any of the checks fail
+bool TestDnsResolver();
+
+}	// namespace CV
+
+
+#endif	// def _DEBUG
+
+
+#endif	// ndef CV_DNS_TEST_SERVER_H
@@ -25,9 +25,9 @@
 
 
 #include "ConnectionViewer.h"
+#include <algorithm>
 #include "GeoIPManager.h"
 #include "libGeoIP/GeoIP.h"
-#include "libGeoIP/GeoIPCity.h"
 
 #pragma comment(lib, "libGeoIP.lib")
 
@@ -35,76 +35,441 @@
 namespace CV
 {
 
-GeoIPManager::GeoIPManager()
-	: m_pGeoIP(nullptr)
-	, m_DatabaseEdition(0)
-#ifdef _DEBUG
-	, m_QueryCount(0)
-	, m_CacheHitCount(0)
+static const LPCTSTR V6_DATABASE_FILE_NAME = TEXT("GeoIPv6.dat");
+static const LPCTSTR MMDB_EXTENSION = TEXT(".mmdb");
+
+
+static GeoIP *OpenDatabase(LPCTSTR pFileName, int Flags)
+{
+#ifdef UNICODE
+	char szFileName[MAX_PATH];
+	if (::WideCharToMultiByte(CP_ACP, WC_NO_BEST_FIT_CHARS,
+							  pFileName, -1, szFileName, cvLengthOf(szFileName),
+							  nullptr, nullptr) <= 0)
+		return nullptr;
+	return ::GeoIP_open(szFileName, Flags);
+#else
+	return ::GeoIP_open(pFileName, Flags);
 #endif
+}
+
+// Reads the values of the two branches of a node of the trie
+static bool ReadTrieNode(const GeoIP *pGeoIP, unsigned int Offset, unsigned int Branch[2])
+{
+	const unsigned int RecordLength = pGeoIP->record_length;
+
+	if (((ULONGLONG)Offset + 1) * RecordLength * 2 > (ULONGLONG)pGeoIP->size)
+		return false;
+
+	const unsigned char *pNode = pGeoIP->cache + (size_t)Offset * RecordLength * 2;
+	for (int i = 0; i < 2; i++) {
+		const unsigned char *p = pNode + i * RecordLength;
+		unsigned int Value = 0;
+		for (int j = RecordLength - 1; j >= 0; j--)
+			Value = (Value << 8) | p[j];
+		Branch[i] = Value;
+	}
+
+	return true;
+}
+
+
+GeoIPManager::GeoIPManager()
+	: m_pDatabase(nullptr)
+	, m_pASDatabase(nullptr)
+	, m_GenerationCount(0)
+	, m_MapFile(true)
+	, m_hBuildThread(nullptr)
+	, m_AbortBuild(false)
+	, m_pBuildDatabase(nullptr)
+	, m_ReplaceDatabase(false)
+	, m_ReloadFailed(0)
+	, m_NumQueries(0)
 {
+	m_szReloadFileName[0] = _T('\0');
+	for (int i = 0; i < NUM_CACHE_SHARDS; i++) {
+		m_CacheShardList[i].MaxEntries = DEFAULT_CACHE_ENTRIES / NUM_CACHE_SHARDS;
+		m_CacheShardList[i].Hand = 0;
+		m_CacheShardList[i].Hits = 0;
+		m_CacheShardList[i].Misses = 0;
+		m_CacheShardList[i].Evicted = 0;
+	}
 }
 
 GeoIPManager::~GeoIPManager()
 {
 	Close();
+	CloseASDatabase();
 
-#ifdef _DEBUG
-	cvDebugTrace(TEXT("GeoIP Query %u / Cahce hit %u\n"),
-				 m_QueryCount, m_CacheHitCount);
-#endif
+	CacheStatistics Statistics;
+	GetCacheStatistics(&Statistics);
+	cvDebugTrace(TEXT("GeoIP Query %llu / Cache hit %llu / miss %llu / evicted %llu\n"),
+				 Statistics.Queries, Statistics.Hits,
+				 Statistics.Misses, Statistics.Evicted);
 }
 
 bool GeoIPManager::Open(LPCTSTR pFileName)
 {
 	Close();
 
-	cvDebugTrace(TEXT("Open GeoIP database \"%s\"\n"), pFileName);
+#ifdef _DEBUG
+	const ULONGLONG StartTick = ::GetTickCount64();
+#endif
 
-#ifdef UNICODE
-	char szFileName[MAX_PATH];
-	if (::WideCharToMultiByte(CP_ACP, WC_NO_BEST_FIT_CHARS,
-							  pFileName, -1, szFileName, cvLengthOf(szFileName),
-							  nullptr, nullptr) <= 0)
+	Database *pDatabase = LoadDatabase(pFileName);
+	if (pDatabase == nullptr)
 		return false;
+	SetDatabase(m_pDatabase, pDatabase);
+
+	// Building the lookup table reads the whole trie, which also prefetches the mapped pages.
+	// Until it is completed, the addresses are looked up by libGeoIP.
+	// The reference of the database is passed to the build thread.
+	// A MaxMind DB is looked up in place and needs no lookup table.
+	if (pDatabase->pGeoIP != nullptr)
+		StartBuild(pDatabase, false);
+	else
+		ReleaseDatabase(pDatabase);
+
+#ifdef _DEBUG
+	cvDebugTrace(TEXT("GeoIP database opened (%u ms)\n"),
+				 (UINT)(::GetTickCount64() - StartTick));
 #endif
-	m_pGeoIP = ::GeoIP_open(
-#ifdef UNICODE
-		szFileName,
-#else
-		pFileName,
-#endif
-		GEOIP_MEMORY_CACHE);
-	if (m_pGeoIP == nullptr)
-		return false;
 
-	m_DatabaseEdition = GeoIP_database_edition(m_pGeoIP);
-	if (m_DatabaseEdition != GEOIP_COUNTRY_EDITION
-			&& m_DatabaseEdition != GEOIP_CITY_EDITION_REV0
-			&& m_DatabaseEdition != GEOIP_CITY_EDITION_REV1) {
-		cvDebugTrace(TEXT("Unsupported GeoIP database edition (%d)\n"), m_DatabaseEdition);
-		Close();
+	return true;
+}
+
+// Replaces the current database when the new one has been loaded and its lookup table
+// has been built in the background. The lookups go on with the current database meanwhile,
+// and the ones in progress finish with it.
+// A mapped file is opened here, and false is returned if it fails. Otherwise the whole file
+// is read on the build thread, and a failure there is told by CheckReloadFailed().
+// If the new database fails, the current one is kept, and its lookup table is built again
+// if the build was aborted for the reload.
+bool GeoIPManager::Reload(LPCTSTR pFileName)
+{
+	if (!IsOpen())
+		return Open(pFileName);
+
+	cvDebugTrace(TEXT("Reload GeoIP database \"%s\"\n"), pFileName);
+
+	if (!m_MapFile) {
+		if (::lstrlen(pFileName) >= cvLengthOf(m_szReloadFileName))
+			return false;
+		EndBuild();
+		::lstrcpy(m_szReloadFileName, pFileName);
+		StartBuild(nullptr, true);
+		return true;
+	}
+
+	Database *pDatabase = LoadDatabase(pFileName);
+	if (pDatabase == nullptr) {
+		cvDebugTrace(TEXT("GeoIP database not reloaded\n"));
 		return false;
 	}
 
-	cvDebugTrace(TEXT("GeoIP database edition %d\n"), m_DatabaseEdition);
+	EndBuild();
+
+	// A MaxMind DB needs no lookup table
+	if (pDatabase->pGeoIP == nullptr) {
+		SetDatabase(m_pDatabase, pDatabase);
+		ReleaseDatabase(pDatabase);
+		return true;
+	}
+
+	StartBuild(pDatabase, true);
 
 	return true;
 }
 
+// Returns true once after a reload has failed on the build thread
+bool GeoIPManager::CheckReloadFailed()
+{
+	return ::InterlockedExchange(&m_ReloadFailed, 0) != 0;
+}
+
 void GeoIPManager::Close()
 {
-	if (m_pGeoIP != nullptr) {
-		::GeoIP_delete(m_pGeoIP);
-		m_pGeoIP = nullptr;
-		m_DatabaseEdition = 0;
+	EndBuild();
+	SetDatabase(m_pDatabase, nullptr);
+	for (int i = 0; i < NUM_CACHE_SHARDS; i++) {
+		CacheShard &Shard = m_CacheShardList[i];
+		BlockLock Lock(Shard.Lock);
+		Shard.List.clear();
+		Shard.Index.clear();
+		Shard.Hand = 0;
 	}
-	m_CityMap.clear();
 }
 
 bool GeoIPManager::IsOpen() const
 {
-	return m_pGeoIP != nullptr;
+	return m_pDatabase != nullptr;
+}
+
+static bool IsCityEdition(int Edition)
+{
+	return Edition == GEOIP_CITY_EDITION_REV0
+		|| Edition == GEOIP_CITY_EDITION_REV1;
+}
+
+GeoIPManager::Database *GeoIPManager::LoadDatabase(LPCTSTR pFileName)
+{
+	cvDebugTrace(TEXT("Open GeoIP database \"%s\"\n"), pFileName);
+
+	if (::lstrlen(pFileName) >= MAX_PATH)
+		return nullptr;
+
+	// A MaxMind DB is always mapped
+	if (::lstrcmpi(::PathFindExtension(pFileName), MMDB_EXTENSION) == 0) {
+		bool CityInfoAvailable;
+		MMDBReader *pReader = OpenMMDB(pFileName, &CityInfoAvailable);
+		if (pReader == nullptr)
+			return nullptr;
+
+		Database *pDatabase = new Database;
+		pDatabase->RefCount = 1;
+		pDatabase->Generation = (UINT)::InterlockedIncrement(&m_GenerationCount);
+		pDatabase->pGeoIP = nullptr;
+		pDatabase->pMMDB = pReader;
+		pDatabase->Edition = 0;
+		pDatabase->CityInfoAvailable = CityInfoAvailable;
+		::lstrcpy(pDatabase->szFileName, pFileName);
+		pDatabase->szV6FileName[0] = _T('\0');
+		pDatabase->pLookupTable = nullptr;
+		return pDatabase;
+	}
+
+	// A mapped file only reads the pages in use, and the pages are shared between processes
+	GeoIP *pGeoIP = nullptr;
+	if (m_MapFile)
+		pGeoIP = OpenDatabase(pFileName, GEOIP_MMAP_CACHE);
+	if (pGeoIP == nullptr)
+		pGeoIP = OpenDatabase(pFileName, GEOIP_MEMORY_CACHE);
+	if (pGeoIP == nullptr)
+		return nullptr;
+
+	// The records are decoded directly from the database image
+	const int Edition = GeoIP_database_edition(pGeoIP);
+	if ((Edition != GEOIP_COUNTRY_EDITION && !IsCityEdition(Edition))
+			|| pGeoIP->cache == nullptr) {
+		cvDebugTrace(TEXT("Unsupported GeoIP database edition (%d)\n"), Edition);
+		::GeoIP_delete(pGeoIP);
+		return nullptr;
+	}
+
+	cvDebugTrace(TEXT("GeoIP database edition %d (%s)\n"),
+				 Edition,
+				 (pGeoIP->flags & GEOIP_MMAP_CACHE) != 0 ? TEXT("mapped") : TEXT("loaded"));
+
+	Database *pDatabase = new Database;
+	pDatabase->RefCount = 1;
+	pDatabase->Generation = (UINT)::InterlockedIncrement(&m_GenerationCount);
+	pDatabase->pGeoIP = pGeoIP;
+	pDatabase->pMMDB = nullptr;
+	pDatabase->Edition = Edition;
+	pDatabase->CityInfoAvailable = IsCityEdition(Edition);
+	::lstrcpy(pDatabase->szFileName, pFileName);
+	pDatabase->pLookupTable = nullptr;
+
+	// The IPv6 database is optional and looked up next to the IPv4 one
+	LPTSTR pszV6FileName = pDatabase->szV6FileName;
+	::lstrcpy(pszV6FileName, pFileName);
+	::PathRemoveFileSpec(pszV6FileName);
+	if (::lstrlen(pszV6FileName) + 1 + ::lstrlen(V6_DATABASE_FILE_NAME) >= MAX_PATH
+			|| !::PathAppend(pszV6FileName, V6_DATABASE_FILE_NAME)
+			|| !::PathFileExists(pszV6FileName))
+		pszV6FileName[0] = _T('\0');
+
+	return pDatabase;
+}
+
+// The country and the city databases of GeoIP2 and GeoLite2 are supported
+MMDBReader *GeoIPManager::OpenMMDB(LPCTSTR pFileName, bool *pCityInfoAvailable)
+{
+	MMDBReader *pReader = new MMDBReader;
+
+	if (!pReader->Open(pFileName)) {
+		delete pReader;
+		return nullptr;
+	}
+
+	const LPCSTR pType = pReader->GetDatabaseType();
+	if (::StrStrIA(pType, "City") != nullptr) {
+		*pCityInfoAvailable = true;
+	} else if (::StrStrIA(pType, "Country") != nullptr) {
+		*pCityInfoAvailable = false;
+	} else {
+		cvDebugTrace(TEXT("Unsupported MaxMind DB type \"%hs\"\n"), pType);
+		delete pReader;
+		return nullptr;
+	}
+
+	return pReader;
+}
+
+// The AS number and the organization editions of GeoIP and GeoLite,
+// and the ASN and the ISP databases of GeoIP2 and GeoLite2 are supported
+GeoIPManager::Database *GeoIPManager::LoadASDatabase(LPCTSTR pFileName)
+{
+	cvDebugTrace(TEXT("Open GeoIP AS database \"%s\"\n"), pFileName);
+
+	if (::lstrlen(pFileName) >= MAX_PATH)
+		return nullptr;
+
+	GeoIP *pGeoIP = nullptr;
+	MMDBReader *pReader = nullptr;
+	int Edition = 0;
+
+	if (::lstrcmpi(::PathFindExtension(pFileName), MMDB_EXTENSION) == 0) {
+		pReader = new MMDBReader;
+		if (!pReader->Open(pFileName)) {
+			delete pReader;
+			return nullptr;
+		}
+		const LPCSTR pType = pReader->GetDatabaseType();
+		if (::StrStrIA(pType, "ASN") == nullptr && ::StrStrIA(pType, "ISP") == nullptr) {
+			cvDebugTrace(TEXT("Unsupported MaxMind DB type \"%hs\"\n"), pType);
+			delete pReader;
+			return nullptr;
+		}
+	} else {
+		if (m_MapFile)
+			pGeoIP = OpenDatabase(pFileName, GEOIP_MMAP_CACHE);
+		if (pGeoIP == nullptr)
+			pGeoIP = OpenDatabase(pFileName, GEOIP_MEMORY_CACHE);
+		if (pGeoIP == nullptr)
+			return nullptr;
+
+		Edition = GeoIP_database_edition(pGeoIP);
+		if ((Edition != GEOIP_ASNUM_EDITION
+					&& Edition != GEOIP_ORG_EDITION
+					&& Edition != GEOIP_ISP_EDITION)
+				|| pGeoIP->cache == nullptr) {
+			cvDebugTrace(TEXT("Unsupported GeoIP AS database edition (%d)\n"), Edition);
+			::GeoIP_delete(pGeoIP);
+			return nullptr;
+		}
+	}
+
+	Database *pDatabase = new Database;
+	pDatabase->RefCount = 1;
+	pDatabase->Generation = (UINT)::InterlockedIncrement(&m_GenerationCount);
+	pDatabase->pGeoIP = pGeoIP;
+	pDatabase->pMMDB = pReader;
+	pDatabase->Edition = Edition;
+	pDatabase->CityInfoAvailable = false;
+	::lstrcpy(pDatabase->szFileName, pFileName);
+	pDatabase->szV6FileName[0] = _T('\0');
+	pDatabase->pLookupTable = nullptr;
+
+	return pDatabase;
+}
+
+GeoIPManager::Database *GeoIPManager::AcquireDatabase(Database * const volatile &pSlot) const
+{
+	BlockLock Lock(m_DatabaseLock);
+
+	Database *pDatabase = pSlot;
+	if (pDatabase != nullptr)
+		::InterlockedIncrement(&pDatabase->RefCount);
+
+	return pDatabase;
+}
+
+void GeoIPManager::ReleaseDatabase(Database *pDatabase)
+{
+	if (::InterlockedDecrement(&pDatabase->RefCount) == 0) {
+		if (pDatabase->pGeoIP != nullptr)
+			::GeoIP_delete(pDatabase->pGeoIP);
+		delete pDatabase->pMMDB;
+		delete pDatabase->pLookupTable;
+		delete pDatabase;
+	}
+}
+
+// The previous database is freed when the last lookup using it is finished
+void GeoIPManager::SetDatabase(Database * volatile &pSlot, Database *pDatabase)
+{
+	if (pDatabase != nullptr)
+		::InterlockedIncrement(&pDatabase->RefCount);
+
+	m_DatabaseLock.Lock();
+	Database *pOldDatabase = pSlot;
+	pSlot = pDatabase;
+	m_DatabaseLock.Unlock();
+
+	if (pOldDatabase != nullptr)
+		ReleaseDatabase(pOldDatabase);
+}
+
+// The reference of the database is passed to the build thread
+void GeoIPManager::StartBuild(Database *pDatabase, bool Replace)
+{
+	m_pBuildDatabase = pDatabase;
+	m_ReplaceDatabase = Replace;
+	m_hBuildThread = ::CreateThread(nullptr, 0, BuildThread, this, 0, nullptr);
+	if (m_hBuildThread != nullptr)
+		::SetThreadPriority(m_hBuildThread, THREAD_PRIORITY_BELOW_NORMAL);
+	else
+		BuildThread(this);
+}
+
+void GeoIPManager::EndBuild()
+{
+	if (m_hBuildThread != nullptr) {
+		m_AbortBuild = true;
+		::WaitForSingleObject(m_hBuildThread, INFINITE);
+		::CloseHandle(m_hBuildThread);
+		m_hBuildThread = nullptr;
+		m_AbortBuild = false;
+	}
+}
+
+// Takes effect when the database is opened next time
+void GeoIPManager::SetMapFile(bool Map)
+{
+	m_MapFile = Map;
+}
+
+// The size is divided evenly between the shards
+void GeoIPManager::SetCacheSize(size_t MaxEntries)
+{
+	if (MaxEntries < MIN_CACHE_ENTRIES)
+		MaxEntries = MIN_CACHE_ENTRIES;
+	const size_t MaxShardEntries = MaxEntries / NUM_CACHE_SHARDS;
+
+	for (int i = 0; i < NUM_CACHE_SHARDS; i++) {
+		CacheShard &Shard = m_CacheShardList[i];
+		BlockLock Lock(Shard.Lock);
+
+		if (MaxShardEntries < Shard.List.size()) {
+			for (size_t j = MaxShardEntries; j < Shard.List.size(); j++) {
+				Shard.Index.erase(Shard.List[j].Record);
+				Shard.Evicted++;
+			}
+			Shard.List.resize(MaxShardEntries);
+			Shard.Hand = 0;
+		}
+		Shard.MaxEntries = MaxShardEntries;
+	}
+}
+
+void GeoIPManager::GetCacheStatistics(CacheStatistics *pStatistics) const
+{
+	pStatistics->Queries = (ULONGLONG)m_NumQueries;
+	pStatistics->Hits = 0;
+	pStatistics->Misses = 0;
+	pStatistics->Evicted = 0;
+	pStatistics->CacheEntries = 0;
+
+	for (int i = 0; i < NUM_CACHE_SHARDS; i++) {
+		CacheShard &Shard = m_CacheShardList[i];
+		BlockLock Lock(Shard.Lock);
+
+		pStatistics->Hits += Shard.Hits;
+		pStatistics->Misses += Shard.Misses;
+		pStatistics->Evicted += Shard.Evicted;
+		pStatistics->CacheEntries += Shard.List.size();
+	}
 }
 
 bool GeoIPManager::GetFileName(LPTSTR pFileName, int MaxFileName) const
@@ -112,27 +477,26 @@ bool GeoIPManager::GetFileName(LPTSTR pFileName, int MaxFileName) const
 	if (MaxFileName <= 0)
 		return false;
 	pFileName[0] = _T('\0');
-	if (m_pGeoIP == nullptr)
-		return false;
-#ifdef UNICODE
-	int Length = ::MultiByteToWideChar(CP_ACP, 0, m_pGeoIP->file_path, -1,
-									   pFileName, MaxFileName);
-	if (Length <= 0 || Length > MaxFileName)
-		return false;
-	::MultiByteToWideChar(CP_ACP, 0, m_pGeoIP->file_path, -1,
-						  pFileName, MaxFileName);
-#else
-	if (::lstrlenA(m_pGeoIP->file_path) >= MaxFileName)
+	Database *pDatabase = AcquireDatabase(m_pDatabase);
+	if (pDatabase == nullptr)
 		return false;
-	::lstrcpyA(pFileName, m_pGeoIP->file_path);
-#endif
-	return true;
+	bool Result = false;
+	if (::lstrlen(pDatabase->szFileName) < MaxFileName) {
+		::lstrcpy(pFileName, pDatabase->szFileName);
+		Result = true;
+	}
+	ReleaseDatabase(pDatabase);
+	return Result;
 }
 
 bool GeoIPManager::IsCityInfoAvailable() const
 {
-	return m_DatabaseEdition == GEOIP_CITY_EDITION_REV0
-		|| m_DatabaseEdition == GEOIP_CITY_EDITION_REV1;
+	Database *pDatabase = AcquireDatabase(m_pDatabase);
+	if (pDatabase == nullptr)
+		return false;
+	const bool Available = pDatabase->CityInfoAvailable;
+	ReleaseDatabase(pDatabase);
+	return Available;
 }
 
 static void AsciiToTChar(const char *pSrc, LPTSTR pTChar, int Length)
@@ -158,17 +522,47 @@ static void ISO_8859_1ToTChar(const char *pSrc, LPTSTR pTChar, int Length)
 		return;
 	}
 #ifdef UNICODE
+	// The code points of ISO-8859-1 are the same as Unicode
 	int i = 0;
 	for (const char *p = pSrc; *p != '\0' && i + 1 < Length; p++)
-		pTChar[i++] = *p;
+		pTChar[i++] = (BYTE)*p;
 	pTChar[i] = '\0';
 #else
-	WCHAR szTemp[MAX_CITY_NAME];
+	WCHAR szTemp[GeoIPManager::MAX_ORGANIZATION_NAME];
 	::MultiByteToWideChar(1252, 0, pSrc, -1, szTemp, cvLengthOf(szTemp));
 	::WideCharToMultiByte(CP_ACP, 0, szTemp, -1, pTChar, Length, nullptr, nullptr);
 #endif
 }
 
+static void ClearCityInfo(GeoIPManager::CityInfo *pInfo)
+{
+	pInfo->Country.Code2[0] = _T('\0');
+	pInfo->Country.Code3[0] = _T('\0');
+	pInfo->Country.Name[0] = _T('\0');
+	pInfo->Region[0] = _T('\0');
+	pInfo->City[0] = _T('\0');
+	pInfo->EnableLocation = false;
+	pInfo->Latitude = 0.0f;
+	pInfo->Longitude = 0.0f;
+}
+
+static bool IsLookupAddress(DWORD Address)
+{
+	return Address != CV_IP_ADDRESS_V4(0, 0, 0, 0)
+		&& Address != CV_IP_ADDRESS_V4(255, 255, 255, 255)
+		&& Address != CV_IP_ADDRESS_V4(127, 0, 0, 1);
+}
+
+static bool SetCountryInfo(unsigned int ID, GeoIPManager::CountryInfo *pInfo)
+{
+	if (ID == 0 || ID >= ::GeoIP_num_countries())
+		return false;
+	AsciiToTChar(GeoIP_country_code[ID], pInfo->Code2, cvLengthOf(pInfo->Code2));
+	AsciiToTChar(GeoIP_country_code3[ID], pInfo->Code3, cvLengthOf(pInfo->Code3));
+	AsciiToTChar(GeoIP_country_name[ID], pInfo->Name, cvLengthOf(pInfo->Name));
+	return true;
+}
+
 bool GeoIPManager::GetCountryInfo(const IPAddress &Address, CountryInfo *pInfo) const
 {
 	CityInfo City;
@@ -179,93 +573,836 @@ bool GeoIPManager::GetCountryInfo(const IPAddress &Address, CountryInfo *pInfo)
 	return true;
 }
 
+// The lookups may be called on any number of threads at once, also during Reload(),
+// but not during Open() or Close()
 bool GeoIPManager::GetCityInfo(const IPAddress &Address, CityInfo *pInfo) const
 {
-	pInfo->Country.Code2[0] = _T('\0');
-	pInfo->Country.Code3[0] = _T('\0');
-	pInfo->Country.Name[0] = _T('\0');
-	pInfo->Region[0] = _T('\0');
-	pInfo->City[0] = _T('\0');
-	pInfo->EnableLocation = false;
-	pInfo->Latitude = 0.0f;
-	pInfo->Longitude = 0.0f;
+	ClearCityInfo(pInfo);
+
+	Database *pDatabase = AcquireDatabase(m_pDatabase);
+	if (pDatabase == nullptr)
+		return false;
+
+	const bool Result = LookupCityInfo(*pDatabase, Address, pInfo);
+
+	ReleaseDatabase(pDatabase);
+
+	return Result;
+}
+
+bool GeoIPManager::LookupCityInfo(const Database &Db, const IPAddress &Address, CityInfo *pInfo) const
+{
+	if (Address.Type == IP_ADDRESS_V6) {
+		const IPv6Address &V6 = Address.V6;
 
-	if (m_pGeoIP == nullptr)
+		// IPv4-mapped addresses are looked up in the IPv4 database
+		if (V6.DWords[0] == 0 && V6.DWords[1] == 0 && V6.DWords[2] == ::htonl(0x0000FFFF)) {
+			IPAddress V4Address;
+			V4Address.SetV4Address(V6.DWords[3]);
+			return LookupCityInfo(Db, V4Address, pInfo);
+		}
+	}
+
+	if (Db.pMMDB != nullptr) {
+		if (Address.Type == IP_ADDRESS_V4 && !IsLookupAddress(Address.V4.Address))
+			return false;
+		::InterlockedIncrement64(&m_NumQueries);
+		return GetRecordInfo(Db, Db.pMMDB->Lookup(Address), pInfo);
+	}
+
+	if (Address.Type == IP_ADDRESS_V6) {
+		::InterlockedIncrement64(&m_NumQueries);
+
+		const LookupTable *pTable = Db.pLookupTable;
+		if (pTable == nullptr)
+			return false;
+		return SetCountryInfo(FindV6Record(*pTable, Address.V6), &pInfo->Country);
+	}
+
+	if (!IsLookupAddress(Address.V4.Address))
 		return false;
 
-	if (Address.Type != IP_ADDRESS_V4
-			|| Address.V4.Address == CV_IP_ADDRESS_V4(0, 0, 0, 0)
-			|| Address.V4.Address == CV_IP_ADDRESS_V4(255, 255, 255, 255)
-			|| Address.V4.Address == CV_IP_ADDRESS_V4(127, 0, 0, 1))
+	::InterlockedIncrement64(&m_NumQueries);
+
+	// The records are not cached until the lookup table is built
+	const LookupTable *pTable = Db.pLookupTable;
+	if (pTable == nullptr) {
+		UINT Value;
+		return SeekRecord(Db, ::ntohl(Address.V4.Address), &Value)
+			&& DecodeRecord(Db, Value, pInfo);
+	}
+
+	const UINT Range = FindRange(*pTable, ::ntohl(Address.V4.Address));
+
+	return GetRecordInfo(Db, pTable->RangeRecordList[Range], pInfo);
+}
+
+// The IPv4 addresses are looked up in address order, so that the addresses in the same range
+// share the result, and the index and the ranges of the lookups ahead are prefetched.
+void GeoIPManager::GetCityInfoBatch(const IPAddress *pAddressList, size_t Count,
+									CityInfo * const *ppInfoList, bool * const *ppFoundList) const
+{
+	typedef std::pair<DWORD, size_t> SortItem;
+
+	Database *pDatabase = AcquireDatabase(m_pDatabase);
+	const LookupTable *pTable = pDatabase != nullptr ? pDatabase->pLookupTable : nullptr;
+	std::vector<SortItem> SortList;
+
+	for (size_t i = 0; i < Count; i++) {
+		const IPAddress &Address = pAddressList[i];
+
+		if (pTable != nullptr
+				&& Address.Type == IP_ADDRESS_V4 && IsLookupAddress(Address.V4.Address)) {
+			SortList.push_back(SortItem(::ntohl(Address.V4.Address), i));
+		} else {
+			ClearCityInfo(ppInfoList[i]);
+			*ppFoundList[i] = pDatabase != nullptr
+				&& LookupCityInfo(*pDatabase, Address, ppInfoList[i]);
+		}
+	}
+	if (SortList.empty()) {
+		if (pDatabase != nullptr)
+			ReleaseDatabase(pDatabase);
+		return;
+	}
+
+	std::sort(SortList.begin(), SortList.end());
+
+	const std::vector<DWORD> &RangeStartList = pTable->RangeStartList;
+	const std::vector<UINT> &PrefixIndex = pTable->PrefixIndex;
+	const size_t LastRange = RangeStartList.size() - 1;
+	size_t Range = LastRange + 1;
+	UINT SharedRecord = NO_RECORD;
+	const CityInfo *pSharedInfo = nullptr;
+	bool SharedFound = false;
+
+	for (size_t i = 0; i < SortList.size(); i++) {
+		if (i + PREFETCH_DISTANCE * 2 < SortList.size()) {
+			const DWORD Ahead = SortList[i + PREFETCH_DISTANCE * 2].first;
+			PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, &PrefixIndex[Ahead >> (32 - PREFIX_BITS)]);
+		}
+		if (i + PREFETCH_DISTANCE < SortList.size()) {
+			const DWORD Ahead = SortList[i + PREFETCH_DISTANCE].first;
+			PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, &RangeStartList[PrefixIndex[Ahead >> (32 - PREFIX_BITS)]]);
+		}
+
+		const DWORD Address = SortList[i].first;
+		const size_t Index = SortList[i].second;
+		CityInfo *pInfo = ppInfoList[Index];
+
+		::InterlockedIncrement64(&m_NumQueries);
+
+		if (Range > LastRange || (Range < LastRange && Address >= RangeStartList[Range + 1]))
+			Range = FindRange(*pTable, Address);
+
+		const UINT Record = pTable->RangeRecordList[Range];
+		if (pSharedInfo != nullptr && Record == SharedRecord) {
+			*pInfo = *pSharedInfo;
+			*ppFoundList[Index] = SharedFound;
+		} else {
+			ClearCityInfo(pInfo);
+			SharedFound = GetRecordInfo(*pDatabase, Record, pInfo);
+			SharedRecord = Record;
+			pSharedInfo = pInfo;
+			*ppFoundList[Index] = SharedFound;
+		}
+	}
+
+	ReleaseDatabase(pDatabase);
+}
+
+// The record is the ID in the lookup table of a legacy database,
+// or the offset of the data of a MaxMind DB
+bool GeoIPManager::GetRecordInfo(const Database &Db, UINT Record, CityInfo *pInfo) const
+{
+	if (Record == NO_RECORD)
 		return false;
 
+	// The record IDs are dense, so the low bits spread them evenly over the shards
+	CacheShard &Shard = m_CacheShardList[Record & (NUM_CACHE_SHARDS - 1)];
+
+	Shard.Lock.Lock();
+	CityCacheIndex::iterator i = Shard.Index.find(Record);
+	if (i != Shard.Index.end()) {
+		CityCacheEntry &Entry = Shard.List[i->second];
+		if (Entry.Generation == Db.Generation) {
+			Entry.Referenced = true;
+			*pInfo = Entry.Info;
+			Shard.Hits++;
+			Shard.Lock.Unlock();
+			return true;
+		}
+	}
+	Shard.Misses++;
+	Shard.Lock.Unlock();
+
+	// Another thread may read the same record meanwhile, which is only redundant
+	if (Db.pMMDB != nullptr) {
+		if (!DecodeMMDBRecord(*Db.pMMDB, Record, pInfo))
+			return false;
+	} else {
+		if (!DecodeRecord(Db, Db.pLookupTable->RecordValueList[Record], pInfo))
+			return false;
+	}
+
+	BlockLock Lock(Shard.Lock);
+	StoreCityInfo(Shard, Db.Generation, Record, *pInfo);
+
+	return true;
+}
+
+// An entry of an older database is overwritten in place, and a newer one is kept.
+// Otherwise entries not referenced since the hand last passed them are replaced (CLOCK).
+// Must be called with the lock of the shard held.
+void GeoIPManager::StoreCityInfo(CacheShard &Shard, UINT Generation, UINT Record,
+								 const CityInfo &Info) const
+{
+	CityCacheIndex::iterator i = Shard.Index.find(Record);
+	if (i != Shard.Index.end()) {
+		CityCacheEntry &Entry = Shard.List[i->second];
+		if (Entry.Generation < Generation) {
+			Entry.Generation = Generation;
+			Entry.Referenced = false;
+			Entry.Info = Info;
+		}
+		return;
+	}
+
+	size_t Index;
+
+	if (Shard.List.size() < Shard.MaxEntries) {
+		Index = Shard.List.size();
+		Shard.List.push_back(CityCacheEntry());
+	} else {
+		while (true) {
+			if (Shard.Hand >= Shard.List.size())
+				Shard.Hand = 0;
+			CityCacheEntry &Entry = Shard.List[Shard.Hand];
+			if (!Entry.Referenced)
+				break;
+			Entry.Referenced = false;
+			Shard.Hand++;
+		}
+		Index = Shard.Hand++;
+		Shard.Index.erase(Shard.List[Index].Record);
+		Shard.Evicted++;
+	}
+
+	CityCacheEntry &Entry = Shard.List[Index];
+	Entry.Generation = Generation;
+	Entry.Record = Record;
+	Entry.Referenced = false;
+	Entry.Info = Info;
+	Shard.Index.insert(std::pair<UINT, size_t>(Record, Index));
+}
+
+DWORD WINAPI GeoIPManager::BuildThread(LPVOID pParam)
+{
+	GeoIPManager *pThis = static_cast<GeoIPManager*>(pParam);
+	Database *pDatabase = pThis->m_pBuildDatabase;
+
+	if (pDatabase == nullptr) {
+		pDatabase = pThis->LoadDatabase(pThis->m_szReloadFileName);
+		if (pDatabase == nullptr) {
+			pThis->OnReloadFailed();
+			return 1;
+		}
+	}
+
+	// A reloaded database replaces the current one only if the lookup table is built
+	if (pDatabase->pGeoIP != nullptr && !pThis->BuildLookupTable(pDatabase)) {
+		ReleaseDatabase(pDatabase);
+		if (pThis->m_ReplaceDatabase)
+			pThis->OnReloadFailed();
+		return 1;
+	}
+
+	if (pThis->m_ReplaceDatabase) {
+		pThis->SetDatabase(pThis->m_pDatabase, pDatabase);
+		cvDebugTrace(TEXT("GeoIP database reloaded (generation %u)\n"), pDatabase->Generation);
+	}
+
+	ReleaseDatabase(pDatabase);
+
+	return 0;
+}
+
+// Called on the build thread. Nothing is done if the build has been aborted by Close()
+// or another reload. The build of the current database may have been aborted for the reload,
+// so its lookup table is built here if it is missing.
+void GeoIPManager::OnReloadFailed()
+{
+	if (m_AbortBuild)
+		return;
+
+	cvDebugTrace(TEXT("GeoIP database not reloaded\n"));
+	::InterlockedExchange(&m_ReloadFailed, 1);
+
+	Database *pDatabase = AcquireDatabase(m_pDatabase);
+	if (pDatabase != nullptr) {
+		if (pDatabase->pGeoIP != nullptr && pDatabase->pLookupTable == nullptr)
+			BuildLookupTable(pDatabase);
+		ReleaseDatabase(pDatabase);
+	}
+}
+
+bool GeoIPManager::BuildLookupTable(Database *pDatabase) const
+{
 #ifdef _DEBUG
-	m_QueryCount++;
+	const ULONGLONG StartTick = ::GetTickCount64();
 #endif
 
-	CityMap::iterator i = m_CityMap.find(Address);
-	if (i != m_CityMap.end()) {
-		*pInfo = i->second;
+	LookupTable *pTable = new LookupTable;
+
+	if (!BuildRangeTable(*pDatabase, pTable)
+			|| (pDatabase->szV6FileName[0] != _T('\0')
+				&& !BuildV6Table(pDatabase->szV6FileName, pTable)
+				&& m_AbortBuild)) {
+		cvDebugTrace(TEXT("GeoIP lookup table not built\n"));
+		delete pTable;
+		return false;
+	}
+
 #ifdef _DEBUG
-		m_CacheHitCount++;
+	cvDebugTrace(TEXT("GeoIP ranges %u / records %u / IPv6 slots %u (%u ms)\n"),
+				 (UINT)pTable->RangeStartList.size(), (UINT)pTable->RecordValueList.size(),
+				 (UINT)pTable->V6SlotList.size(), (UINT)(::GetTickCount64() - StartTick));
 #endif
+
+	::InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(&pDatabase->pLookupTable), pTable);
+
+	return true;
+}
+
+// Flattens the trie of the database into a sorted list of ranges.
+// Adjacent ranges of the same record are merged, and the records are numbered in the order found.
+bool GeoIPManager::BuildRangeTable(const Database &Db, LookupTable *pTable) const
+{
+	const GeoIP *pGeoIP = Db.pGeoIP;
+	if (pGeoIP->cache == nullptr)
+		return false;
+
+	const unsigned int NumNodes = pGeoIP->databaseSegments[0];
+	if (NumNodes == 0)
+		return false;
+
+	struct NodeInfo
+	{
+		unsigned int Value;
+		int Depth;
+		DWORD Start;
+	};
+
+	typedef std::unordered_map<unsigned int, UINT> RecordMap;
+
+	RecordMap RecordIDMap;
+	NodeInfo Stack[34];
+	int StackDepth = 1;
+
+	Stack[0].Value = 0;
+	Stack[0].Depth = 0;
+	Stack[0].Start = 0;
+
+	while (StackDepth > 0) {
+		if (m_AbortBuild)
+			return false;
+
+		const NodeInfo Node = Stack[--StackDepth];
+
+		if (Node.Value >= NumNodes) {
+			UINT Record = NO_RECORD;
+
+			// The first value after the nodes means that the range has no record
+			if (Node.Value != NumNodes) {
+				RecordMap::iterator i = RecordIDMap.find(Node.Value);
+				if (i != RecordIDMap.end()) {
+					Record = i->second;
+				} else {
+					Record = (UINT)pTable->RecordValueList.size();
+					pTable->RecordValueList.push_back(Node.Value);
+					RecordIDMap.insert(std::pair<unsigned int, UINT>(Node.Value, Record));
+				}
+			}
+			if (pTable->RangeRecordList.empty() || pTable->RangeRecordList.back() != Record) {
+				pTable->RangeStartList.push_back(Node.Start);
+				pTable->RangeRecordList.push_back(Record);
+			}
+			continue;
+		}
+
+		if (Node.Depth >= 32)
+			return false;
+
+		unsigned int BranchList[2];
+		if (!ReadTrieNode(pGeoIP, Node.Value, BranchList))
+			return false;
+
+		// The right branch is pushed first so that the ranges are found in ascending order
+		for (int Branch = 1; Branch >= 0; Branch--) {
+			NodeInfo &Child = Stack[StackDepth++];
+			Child.Value = BranchList[Branch];
+			Child.Depth = Node.Depth + 1;
+			Child.Start = Node.Start | ((DWORD)Branch << (31 - Node.Depth));
+		}
+	}
+
+	const std::vector<DWORD> &RangeStartList = pTable->RangeStartList;
+	std::vector<UINT> &PrefixIndex = pTable->PrefixIndex;
+	PrefixIndex.resize(NUM_PREFIXES + 1);
+	size_t Range = 0;
+	for (UINT Prefix = 0; Prefix < NUM_PREFIXES; Prefix++) {
+		const DWORD Start = (DWORD)Prefix << (32 - PREFIX_BITS);
+		while (Range + 1 < RangeStartList.size() && RangeStartList[Range + 1] <= Start)
+			Range++;
+		PrefixIndex[Prefix] = (UINT)Range;
+	}
+	PrefixIndex[NUM_PREFIXES] = (UINT)(RangeStartList.size() - 1);
+
+	return true;
+}
+
+// The table must not be empty
+size_t GeoIPManager::FindRange(const LookupTable &Table, DWORD Address)
+{
+	// Only the ranges within the prefix of the address are searched
+	const UINT Prefix = Address >> (32 - PREFIX_BITS);
+	UINT First = Table.PrefixIndex[Prefix];
+	UINT Count = Table.PrefixIndex[Prefix + 1] - First + 1;
+
+	while (Count > 1) {
+		const UINT Half = Count / 2;
+		First = Table.RangeStartList[First + Half] <= Address ? First + Half : First;
+		Count -= Half;
+	}
+
+	return First;
+}
+
+// Only the slot table is kept, as the records of the IPv6 database are country IDs
+bool GeoIPManager::BuildV6Table(LPCTSTR pFileName, LookupTable *pTable) const
+{
+	cvDebugTrace(TEXT("Open GeoIP IPv6 database \"%s\"\n"), pFileName);
+
+	GeoIP *pGeoIP = OpenDatabase(pFileName, m_MapFile ? GEOIP_MMAP_CACHE : GEOIP_MEMORY_CACHE);
+	if (pGeoIP == nullptr)
+		return false;
+
+	bool Result = false;
+	const int Edition = GeoIP_database_edition(pGeoIP);
+	if (Edition == GEOIP_COUNTRY_EDITION_V6 && pGeoIP->cache != nullptr) {
+		pTable->V6SlotList.resize(NUM_PREFIXES, NO_RECORD);
+		Result = ExpandV6Node(pGeoIP, pTable, 0, 0, 0, PREFIX_BITS);
+		if (!Result)
+			pTable->V6SlotList.clear();
+	} else {
+		cvDebugTrace(TEXT("Unsupported GeoIP IPv6 database edition (%d)\n"), Edition);
+	}
+
+	::GeoIP_delete(pGeoIP);
+
+	return Result;
+}
+
+// Compiles the subtree of the binary trie at Value into the 1 << Bits slots from Slot.
+// A new node of 1 << V6_STRIDE_BITS slots is started every time Bits runs out,
+// so that a lookup takes a slot per byte of the address after the 16-bit prefix.
+bool GeoIPManager::ExpandV6Node(const GeoIPTag *pGeoIP, LookupTable *pTable,
+								UINT Slot, unsigned int Value, int Depth, int Bits) const
+{
+	std::vector<UINT> &SlotList = pTable->V6SlotList;
+	const unsigned int NumNodes = pGeoIP->databaseSegments[0];
+
+	if (Value >= NumNodes) {
+		const UINT Record = Value > NumNodes ? Value - NumNodes : NO_RECORD;
+		for (UINT i = 0; i < (1U << Bits); i++)
+			SlotList[Slot + i] = Record;
 		return true;
 	}
 
-	if (m_DatabaseEdition != GEOIP_CITY_EDITION_REV0
-			|| m_DatabaseEdition != GEOIP_CITY_EDITION_REV1) {
-		GeoIPRecord *pRecord = ::GeoIP_record_by_ipnum(m_pGeoIP, ::ntohl(Address.V4.Address));
-		if (pRecord == nullptr)
+	if (Bits == 0) {
+		if (Depth >= 128 || m_AbortBuild)
 			return false;
+		const UINT Node = (UINT)SlotList.size();
+		if (Node >= V6_NODE_FLAG)
+			return false;
+		SlotList.resize(Node + (1 << V6_STRIDE_BITS), NO_RECORD);
+		SlotList[Slot] = V6_NODE_FLAG | Node;
+		Slot = Node;
+		Bits = V6_STRIDE_BITS;
+	}
 
-		AsciiToTChar(pRecord->country_code,
-					 pInfo->Country.Code2, cvLengthOf(pInfo->Country.Code2));
-		AsciiToTChar(pRecord->country_code3,
-					 pInfo->Country.Code3, cvLengthOf(pInfo->Country.Code3));
-		AsciiToTChar(pRecord->country_name,
-					 pInfo->Country.Name, cvLengthOf(pInfo->Country.Name));
-		AsciiToTChar(pRecord->region,
-					 pInfo->Region, cvLengthOf(pInfo->Region));
-		ISO_8859_1ToTChar(pRecord->city,
-						  pInfo->City, cvLengthOf(pInfo->City));
-		pInfo->EnableLocation = true;
-		pInfo->Latitude = pRecord->latitude;
-		pInfo->Longitude = pRecord->longitude;
+	unsigned int BranchList[2];
+	if (!ReadTrieNode(pGeoIP, Value, BranchList))
+		return false;
 
-		::GeoIPRecord_delete(pRecord);
-	} else {
-		int ID;
-		//if (Address.Type == IP_ADDRESS_V4) {
-		ID = ::GeoIP_id_by_ipnum(m_pGeoIP, ::ntohl(Address.V4.Address));
-		/*} else if (Address.Type == IP_ADDRESS_V6) {
-			geoipv6_t Addr;
-			::CopyMemory(Addr.u.Byte, Address.V6.Bytes, 16);
-			ID = ::GeoIP_id_by_ipnum_v6(m_pGeoIP, &Addr);
-		} else {
+	return ExpandV6Node(pGeoIP, pTable, Slot, BranchList[0], Depth + 1, Bits - 1)
+		&& ExpandV6Node(pGeoIP, pTable, Slot + (1 << (Bits - 1)), BranchList[1], Depth + 1, Bits - 1);
+}
+
+UINT GeoIPManager::FindV6Record(const LookupTable &Table, const IPv6Address &Address)
+{
+	const std::vector<UINT> &SlotList = Table.V6SlotList;
+	if (SlotList.empty())
+		return NO_RECORD;
+
+	UINT Entry = SlotList[((UINT)Address.Bytes[0] << 8) | Address.Bytes[1]];
+	for (int i = 2; i < 16 && Entry != NO_RECORD && (Entry & V6_NODE_FLAG) != 0; i++)
+		Entry = SlotList[(Entry & ~V6_NODE_FLAG) + Address.Bytes[i]];
+
+	return Entry;
+}
+
+// Walks the trie as libGeoIP does, without its state of the last lookup.
+// pPrefixLength receives the length of the network block that the value covers.
+bool GeoIPManager::SeekRecord(const Database &Db, DWORD Address, UINT *pValue,
+							  int *pPrefixLength)
+{
+	const GeoIP *pGeoIP = Db.pGeoIP;
+	const unsigned int NumNodes = pGeoIP->databaseSegments[0];
+	unsigned int Value = 0;
+
+	for (int Depth = 31; Depth >= 0; Depth--) {
+		unsigned int BranchList[2];
+		if (!ReadTrieNode(pGeoIP, Value, BranchList))
 			return false;
-		}*/
-		if (ID == 0)
+		Value = BranchList[(Address >> Depth) & 1];
+		if (Value >= NumNodes) {
+			*pValue = Value;
+			if (pPrefixLength != nullptr)
+				*pPrefixLength = 32 - Depth;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Decodes the record at the value of the trie from the database image into the caller's
+// storage, instead of GeoIP_record_by_ipnum() which allocates the record and its strings.
+// The records of a country database are the country IDs.
+bool GeoIPManager::DecodeRecord(const Database &Db, UINT Value, CityInfo *pInfo)
+{
+	const GeoIP *pGeoIP = Db.pGeoIP;
+	const unsigned int NumNodes = pGeoIP->databaseSegments[0];
+
+	if (Value <= NumNodes)
+		return false;
+
+	if (!IsCityEdition(Db.Edition))
+		return SetCountryInfo(Value - NumNodes, &pInfo->Country);
+
+	// The records follow the nodes of the trie
+	const ULONGLONG Offset =
+		(ULONGLONG)Value + (2 * (ULONGLONG)pGeoIP->record_length - 1) * NumNodes;
+	if (Offset >= (ULONGLONG)pGeoIP->size)
+		return false;
+	const unsigned char *p = pGeoIP->cache + (size_t)Offset;
+	const unsigned char *pEnd = pGeoIP->cache + pGeoIP->size;
+
+	const unsigned int CountryID = *p++;
+	if (CountryID >= ::GeoIP_num_countries())
+		return false;
+	AsciiToTChar(GeoIP_country_code[CountryID],
+				 pInfo->Country.Code2, cvLengthOf(pInfo->Country.Code2));
+	AsciiToTChar(GeoIP_country_code3[CountryID],
+				 pInfo->Country.Code3, cvLengthOf(pInfo->Country.Code3));
+	AsciiToTChar(GeoIP_country_name[CountryID],
+				 pInfo->Country.Name, cvLengthOf(pInfo->Country.Name));
+
+	// The region, the city and the postal code are null-terminated
+	const unsigned char *pRegion = p;
+	const unsigned char *pCity = nullptr;
+	for (int i = 0; i < 3; i++) {
+		while (p < pEnd && *p != '\0')
+			p++;
+		if (p == pEnd)
 			return false;
-		AsciiToTChar(GeoIP_country_code[ID],
-					 pInfo->Country.Code2, cvLengthOf(pInfo->Country.Code2));
-		AsciiToTChar(GeoIP_country_code3[ID],
-					 pInfo->Country.Code3, cvLengthOf(pInfo->Country.Code3));
-		AsciiToTChar(GeoIP_country_name[ID],
-					 pInfo->Country.Name, cvLengthOf(pInfo->Country.Name));
+		p++;
+		if (i == 0)
+			pCity = p;
 	}
+	AsciiToTChar(reinterpret_cast<const char*>(pRegion), pInfo->Region, cvLengthOf(pInfo->Region));
+	ISO_8859_1ToTChar(reinterpret_cast<const char*>(pCity), pInfo->City, cvLengthOf(pInfo->City));
 
-	m_CityMap.insert(std::pair<IPAddress, CityInfo>(Address, *pInfo));
+	// The latitude and the longitude are 3 bytes each in little endian
+	if (pEnd - p >= 6) {
+		const UINT Latitude = p[0] | ((UINT)p[1] << 8) | ((UINT)p[2] << 16);
+		const UINT Longitude = p[3] | ((UINT)p[4] << 8) | ((UINT)p[5] << 16);
+		pInfo->EnableLocation = true;
+		pInfo->Latitude = (float)((double)Latitude / 10000.0 - 180.0);
+		pInfo->Longitude = (float)((double)Longitude / 10000.0 - 180.0);
+	}
 
 	return true;
 }
 
-bool GeoIPManager::FindDatabaseFile(LPCTSTR pDirectory, LPTSTR pFileName, int MaxFileName)
+// Only the fields used are decoded, directly from the mapped file
+bool GeoIPManager::DecodeMMDBRecord(const MMDBReader &Reader, UINT Offset, CityInfo *pInfo)
+{
+	static const LPCSTR CountryCodePath[]			= {"country", "iso_code", nullptr};
+	static const LPCSTR CountryNamePath[]			= {"country", "names", "en", nullptr};
+	static const LPCSTR RegisteredCountryCodePath[]	= {"registered_country", "iso_code", nullptr};
+	static const LPCSTR RegisteredCountryNamePath[]	= {"registered_country", "names", "en", nullptr};
+	static const LPCSTR RegionPath[]				= {"subdivisions", "0", "iso_code", nullptr};
+	static const LPCSTR CityPath[]					= {"city", "names", "en", nullptr};
+	static const LPCSTR LatitudePath[]				= {"location", "latitude", nullptr};
+	static const LPCSTR LongitudePath[]				= {"location", "longitude", nullptr};
+
+	MMDBReader::Value Val;
+
+	// Anonymous proxies and the like only have the registered country
+	if (Reader.GetValue(Offset, CountryCodePath, &Val)) {
+		MMDBReader::GetString(Val, pInfo->Country.Code2, cvLengthOf(pInfo->Country.Code2));
+		if (Reader.GetValue(Offset, CountryNamePath, &Val))
+			MMDBReader::GetString(Val, pInfo->Country.Name, cvLengthOf(pInfo->Country.Name));
+	} else if (Reader.GetValue(Offset, RegisteredCountryCodePath, &Val)) {
+		MMDBReader::GetString(Val, pInfo->Country.Code2, cvLengthOf(pInfo->Country.Code2));
+		if (Reader.GetValue(Offset, RegisteredCountryNamePath, &Val))
+			MMDBReader::GetString(Val, pInfo->Country.Name, cvLengthOf(pInfo->Country.Name));
+	} else {
+		return false;
+	}
+
+	// The 3-letter code is not in the MaxMind DB, and is taken from the table of libGeoIP
+	char szCode2[cvLengthOf(pInfo->Country.Code2)];
+	for (int i = 0; i < cvLengthOf(szCode2); i++)
+		szCode2[i] = (char)pInfo->Country.Code2[i];
+	for (unsigned int ID = 1; ID < ::GeoIP_num_countries(); ID++) {
+		if (::lstrcmpA(GeoIP_country_code[ID], szCode2) == 0) {
+			AsciiToTChar(GeoIP_country_code3[ID], pInfo->Country.Code3, cvLengthOf(pInfo->Country.Code3));
+			if (pInfo->Country.Name[0] == _T('\0'))
+				AsciiToTChar(GeoIP_country_name[ID], pInfo->Country.Name, cvLengthOf(pInfo->Country.Name));
+			break;
+		}
+	}
+
+	if (Reader.GetValue(Offset, RegionPath, &Val))
+		MMDBReader::GetString(Val, pInfo->Region, cvLengthOf(pInfo->Region));
+	if (Reader.GetValue(Offset, CityPath, &Val))
+		MMDBReader::GetString(Val, pInfo->City, cvLengthOf(pInfo->City));
+
+	double Latitude, Longitude;
+	if (Reader.GetValue(Offset, LatitudePath, &Val) && MMDBReader::GetDouble(Val, &Latitude)
+			&& Reader.GetValue(Offset, LongitudePath, &Val) && MMDBReader::GetDouble(Val, &Longitude)) {
+		pInfo->EnableLocation = true;
+		pInfo->Latitude = (float)Latitude;
+		pInfo->Longitude = (float)Longitude;
+	}
+
+	return true;
+}
+
+// The AS database is looked up in place, so it replaces the current one at once.
+// The lookups in progress finish with the previous one.
+bool GeoIPManager::OpenASDatabase(LPCTSTR pFileName)
+{
+	Database *pDatabase = LoadASDatabase(pFileName);
+	if (pDatabase == nullptr)
+		return false;
+
+	SetDatabase(m_pASDatabase, pDatabase);
+	ReleaseDatabase(pDatabase);
+	ClearASCache();
+
+	return true;
+}
+
+void GeoIPManager::CloseASDatabase()
+{
+	SetDatabase(m_pASDatabase, nullptr);
+	ClearASCache();
+}
+
+bool GeoIPManager::IsASDatabaseOpen() const
+{
+	return m_pASDatabase != nullptr;
+}
+
+bool GeoIPManager::GetASFileName(LPTSTR pFileName, int MaxFileName) const
+{
+	if (MaxFileName <= 0)
+		return false;
+	pFileName[0] = _T('\0');
+	Database *pDatabase = AcquireDatabase(m_pASDatabase);
+	if (pDatabase == nullptr)
+		return false;
+	bool Result = false;
+	if (::lstrlen(pDatabase->szFileName) < MaxFileName) {
+		::lstrcpy(pFileName, pDatabase->szFileName);
+		Result = true;
+	}
+	ReleaseDatabase(pDatabase);
+	return Result;
+}
+
+bool GeoIPManager::GetASInfo(const IPAddress &Address, ASInfo *pInfo) const
+{
+	pInfo->Number = 0;
+	pInfo->Organization[0] = _T('\0');
+
+	Database *pDatabase = AcquireDatabase(m_pASDatabase);
+	if (pDatabase == nullptr)
+		return false;
+
+	const bool Result = LookupASInfo(*pDatabase, Address, pInfo);
+
+	ReleaseDatabase(pDatabase);
+
+	return Result;
+}
+
+// The IPv4 addresses are cached by the network block found in the trie.
+// The IPv6 addresses are only looked up in a MaxMind DB, and are not cached.
+bool GeoIPManager::LookupASInfo(const Database &Db, const IPAddress &Address, ASInfo *pInfo) const
+{
+	DWORD V4Address;
+
+	if (Address.Type == IP_ADDRESS_V6) {
+		const IPv6Address &V6 = Address.V6;
+
+		if (V6.DWords[0] != 0 || V6.DWords[1] != 0 || V6.DWords[2] != ::htonl(0x0000FFFF)) {
+			if (Db.pMMDB == nullptr)
+				return false;
+			return DecodeMMDBASRecord(*Db.pMMDB, Db.pMMDB->Lookup(Address), pInfo);
+		}
+		V4Address = V6.DWords[3];
+	} else {
+		V4Address = Address.V4.Address;
+	}
+
+	if (!IsLookupAddress(V4Address))
+		return false;
+
+	const DWORD HostAddress = ::ntohl(V4Address);
+
+	m_ASCacheLock.Lock();
+	ASBlockMap::const_iterator i = m_ASBlockMap.upper_bound(HostAddress);
+	if (i != m_ASBlockMap.begin()) {
+		--i;
+		const ASBlock &Block = i->second;
+		if (Block.Last >= HostAddress && Block.Generation == Db.Generation) {
+			if (Block.Found) {
+				pInfo->Number = Block.Number;
+				if (Block.pOrganization != nullptr)
+					::lstrcpyn(pInfo->Organization, Block.pOrganization, cvLengthOf(pInfo->Organization));
+			}
+			m_ASCacheLock.Unlock();
+			return Block.Found;
+		}
+	}
+	m_ASCacheLock.Unlock();
+
+	int PrefixLength = 32;
+	ASBlock Block;
+
+	if (Db.pMMDB != nullptr) {
+		IPAddress LookupAddress;
+		LookupAddress.SetV4Address(V4Address);
+		Block.Found = DecodeMMDBASRecord(*Db.pMMDB,
+										 Db.pMMDB->Lookup(LookupAddress, &PrefixLength),
+										 pInfo);
+	} else {
+		UINT Value;
+		if (!SeekRecord(Db, HostAddress, &Value, &PrefixLength))
+			return false;
+		Block.Found = DecodeASRecord(Db, Value, pInfo);
+	}
+
+	const DWORD Mask = PrefixLength > 0 ? 0xFFFFFFFFU << (32 - PrefixLength) : 0;
+	Block.Last = (HostAddress & Mask) | ~Mask;
+	Block.Generation = Db.Generation;
+	Block.Number = pInfo->Number;
+
+	// The cache is started over when it is full, as the blocks are cheap to look up again
+	BlockLock Lock(m_ASCacheLock);
+	if (m_ASBlockMap.size() >= MAX_AS_BLOCKS) {
+		m_ASBlockMap.clear();
+		m_ASNamePool.Clear();
+	}
+	Block.pOrganization =
+		Block.Found && pInfo->Organization[0] != _T('\0') ?
+			m_ASNamePool.Set(pInfo->Organization) : nullptr;
+	m_ASBlockMap[HostAddress & Mask] = Block;
+
+	return Block.Found;
+}
+
+// The records of the AS number, the organization and the ISP editions are null-terminated
+// strings following the nodes of the trie. The AS number edition has the number first,
+// as "AS15169 Google Inc.".
+bool GeoIPManager::DecodeASRecord(const Database &Db, UINT Value, ASInfo *pInfo)
+{
+	const GeoIP *pGeoIP = Db.pGeoIP;
+	const unsigned int NumNodes = pGeoIP->databaseSegments[0];
+
+	if (Value <= NumNodes)
+		return false;
+
+	const ULONGLONG Offset =
+		(ULONGLONG)Value + (2 * (ULONGLONG)pGeoIP->record_length - 1) * NumNodes;
+	if (Offset >= (ULONGLONG)pGeoIP->size)
+		return false;
+	const char *p = reinterpret_cast<const char*>(pGeoIP->cache) + (size_t)Offset;
+
+	const size_t MaxLength = (size_t)min((ULONGLONG)pGeoIP->size - Offset, (ULONGLONG)MAX_ORG_RECORD);
+	size_t Length = 0;
+	while (Length < MaxLength && p[Length] != '\0')
+		Length++;
+	if (Length == MaxLength)
+		return false;
+
+	if (p[0] == 'A' && p[1] == 'S' && p[2] >= '0' && p[2] <= '9') {
+		UINT Number = 0;
+		for (p += 2; *p >= '0' && *p <= '9'; p++)
+			Number = Number * 10 + (*p - '0');
+		while (*p == ' ')
+			p++;
+		pInfo->Number = Number;
+	}
+	ISO_8859_1ToTChar(p, pInfo->Organization, cvLengthOf(pInfo->Organization));
+
+	return pInfo->Number != 0 || pInfo->Organization[0] != _T('\0');
+}
+
+// The ISP databases have the organization separately from the one of the AS
+bool GeoIPManager::DecodeMMDBASRecord(const MMDBReader &Reader, UINT Offset, ASInfo *pInfo)
+{
+	static const LPCSTR NumberPath[]			= {"autonomous_system_number", nullptr};
+	static const LPCSTR OrganizationPath[]		= {"autonomous_system_organization", nullptr};
+	static const LPCSTR ISPOrganizationPath[]	= {"organization", nullptr};
+
+	if (Offset == MMDBReader::NO_DATA)
+		return false;
+
+	MMDBReader::Value Val;
+	ULONGLONG Number;
+
+	if (Reader.GetValue(Offset, NumberPath, &Val)
+			&& MMDBReader::GetUInt(Val, &Number) && Number <= 0xFFFFFFFFULL)
+		pInfo->Number = (UINT)Number;
+	if (Reader.GetValue(Offset, OrganizationPath, &Val)
+			|| Reader.GetValue(Offset, ISPOrganizationPath, &Val))
+		MMDBReader::GetString(Val, pInfo->Organization, cvLengthOf(pInfo->Organization));
+
+	return pInfo->Number != 0 || pInfo->Organization[0] != _T('\0');
+}
+
+void GeoIPManager::ClearASCache()
+{
+	BlockLock Lock(m_ASCacheLock);
+	m_ASBlockMap.clear();
+	m_ASNamePool.Clear();
+}
+
+// Finds the first file of the list that exists in the directory
+static bool FindListedFile(LPCTSTR pDirectory, const LPCTSTR *pFileList, int NumFiles,
+						   LPTSTR pFileName, int MaxFileName)
 {
 	const int DirectoryLength = ::lstrlen(pDirectory);
 	TCHAR szMask[MAX_PATH];
-	if (DirectoryLength + 6 >= cvLengthOf(szMask))
+	if (DirectoryLength + 2 >= cvLengthOf(szMask))
 		return false;
-	::PathCombine(szMask, pDirectory, TEXT("*.dat"));
+	::PathCombine(szMask, pDirectory, TEXT("*"));
 
 	HANDLE hFind;
 	WIN32_FIND_DATA fd;
@@ -273,23 +1410,15 @@ bool GeoIPManager::FindDatabaseFile(LPCTSTR pDirectory, LPTSTR pFileName, int Ma
 	if (hFind == INVALID_HANDLE_VALUE)
 		return false;
 
-	struct {
-		LPCTSTR pFileName;
-		bool Found;
-	} FileList[] = {
-		{TEXT("GeoCity.dat"),		false},
-		{TEXT("GeoLiteCity.dat"),	false},
-		{TEXT("GeoIP.dat"),			false},
-	};
+	std::vector<bool> FoundList(NumFiles, false);
 
-	bool Found = false;
 	do {
 		if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) {
 			if (DirectoryLength + 1 +::lstrlen(fd.cFileName) < MaxFileName) {
-				for (int i = 0; i < cvLengthOf(FileList); i++) {
-					if (::lstrcmpi(FileList[i].pFileName, fd.cFileName) == 0) {
+				for (int i = 0; i < NumFiles; i++) {
+					if (::lstrcmpi(pFileList[i], fd.cFileName) == 0) {
 						cvDebugTrace(TEXT("GeoIP database found \"%s\"\n"), fd.cFileName);
-						FileList[i].Found = true;
+						FoundList[i] = true;
 						break;
 					}
 				}
@@ -298,9 +1427,9 @@ bool GeoIPManager::FindDatabaseFile(LPCTSTR pDirectory, LPTSTR pFileName, int Ma
 	} while (::FindNextFile(hFind, &fd));
 	::FindClose(hFind);
 
-	for (int i = 0; i < cvLengthOf(FileList); i++) {
-		if (FileList[i].Found) {
-			::PathCombine(pFileName, pDirectory, FileList[i].pFileName);
+	for (int i = 0; i < NumFiles; i++) {
+		if (FoundList[i]) {
+			::PathCombine(pFileName, pDirectory, pFileList[i]);
 			return true;
 		}
 	}
@@ -308,4 +1437,32 @@ bool GeoIPManager::FindDatabaseFile(LPCTSTR pDirectory, LPTSTR pFileName, int Ma
 	return false;
 }
 
+bool GeoIPManager::FindDatabaseFile(LPCTSTR pDirectory, LPTSTR pFileName, int MaxFileName)
+{
+	static const LPCTSTR FileList[] = {
+		TEXT("GeoIP2-City.mmdb"),
+		TEXT("GeoLite2-City.mmdb"),
+		TEXT("GeoCity.dat"),
+		TEXT("GeoLiteCity.dat"),
+		TEXT("GeoIP2-Country.mmdb"),
+		TEXT("GeoLite2-Country.mmdb"),
+		TEXT("GeoIP.dat"),
+	};
+
+	return FindListedFile(pDirectory, FileList, cvLengthOf(FileList), pFileName, MaxFileName);
+}
+
+bool GeoIPManager::FindASDatabaseFile(LPCTSTR pDirectory, LPTSTR pFileName, int MaxFileName)
+{
+	static const LPCTSTR FileList[] = {
+		TEXT("GeoIP2-ISP.mmdb"),
+		TEXT("GeoLite2-ASN.mmdb"),
+		TEXT("GeoIPISP.dat"),
+		TEXT("GeoIPOrg.dat"),
+		TEXT("GeoIPASNum.dat"),
+	};
+
+	return FindListedFile(pDirectory, FileList, cvLengthOf(FileList), pFileName, MaxFileName);
+}
+
 }	// namespace CV
@@ -28,7 +28,12 @@
 #define CV_GEOIP_MANAGER_H
 
 
+#include <vector>
 #include <map>
+#include <unordered_map>
+#include "Utility.h"
+#include "StringPool.h"
+#include "MMDBReader.h"
 
 
 struct GeoIPTag;
@@ -42,8 +47,9 @@ class GeoIPManager
 public:
 	enum
 	{
-		MAX_COUNTRY_NAME	= 64,
-		MAX_CITY_NAME		= 64
+		MAX_COUNTRY_NAME		= 64,
+		MAX_CITY_NAME			= 64,
+		MAX_ORGANIZATION_NAME	= 128
 	};
 
 	struct CountryInfo
@@ -63,28 +69,198 @@ public:
 		float Longitude;
 	};
 
+	// The number is 0 if the database only has the name of the organization
+	struct ASInfo
+	{
+		UINT Number;
+		TCHAR Organization[MAX_ORGANIZATION_NAME];
+	};
+
+	struct CacheStatistics
+	{
+		ULONGLONG Queries;
+		ULONGLONG Hits;
+		ULONGLONG Misses;
+		ULONGLONG Evicted;
+		size_t CacheEntries;
+	};
+
+	enum
+	{
+		MIN_CACHE_ENTRIES		= 256,
+		DEFAULT_CACHE_ENTRIES	= 4096
+	};
+
 	GeoIPManager();
 	~GeoIPManager();
 	bool Open(LPCTSTR pFileName);
+	bool Reload(LPCTSTR pFileName);
+	bool CheckReloadFailed();
 	void Close();
 	bool IsOpen() const;
+	void SetMapFile(bool Map);
+	void SetCacheSize(size_t MaxEntries);
+	void GetCacheStatistics(CacheStatistics *pStatistics) const;
 	bool GetFileName(LPTSTR pFileName, int MaxFileName) const;
 	bool IsCityInfoAvailable() const;
 	bool GetCountryInfo(const IPAddress &Address, CountryInfo *pInfo) const;
 	bool GetCityInfo(const IPAddress &Address, CityInfo *pInfo) const;
+	void GetCityInfoBatch(const IPAddress *pAddressList, size_t Count,
+						  CityInfo * const *ppInfoList, bool * const *ppFoundList) const;
+	bool OpenASDatabase(LPCTSTR pFileName);
+	void CloseASDatabase();
+	bool IsASDatabaseOpen() const;
+	bool GetASFileName(LPTSTR pFileName, int MaxFileName) const;
+	bool GetASInfo(const IPAddress &Address, ASInfo *pInfo) const;
 
 	static bool FindDatabaseFile(LPCTSTR pDirectory, LPTSTR pFileName, int MaxFileName);
+	static bool FindASDatabaseFile(LPCTSTR pDirectory, LPTSTR pFileName, int MaxFileName);
 
 private:
-	typedef std::map<IPAddress, CityInfo> CityMap;
-
-	GeoIPTag *m_pGeoIP;
-	int m_DatabaseEdition;
-	mutable CityMap m_CityMap;
 #ifdef _DEBUG
-	mutable UINT m_QueryCount;
-	mutable UINT m_CacheHitCount;
+	friend class GeoIPManagerTest;
 #endif
+
+	enum
+	{
+		PREFIX_BITS			= 16,
+		NUM_PREFIXES		= 1 << PREFIX_BITS,
+		V6_STRIDE_BITS		= 8,
+		V6_NODE_FLAG		= 0x80000000U,
+		PREFETCH_DISTANCE	= 4,
+		NUM_CACHE_SHARDS	= 8,
+		NO_RECORD			= 0xFFFFFFFFU,
+		MAX_AS_BLOCKS		= 16384,
+		MAX_ORG_RECORD		= 300
+	};
+
+	struct LookupTable
+	{
+		// The trie of the database flattened into sorted ranges, in host byte order.
+		// PrefixIndex[n] is the last range that contains the start of the prefix n.
+		std::vector<DWORD> RangeStartList;
+		std::vector<UINT> RangeRecordList;
+		std::vector<UINT> PrefixIndex;
+		// The value of each record in the trie, which locates the record data
+		std::vector<UINT> RecordValueList;
+
+		// The trie of the IPv6 database compiled into a multibit trie of country IDs.
+		// The first NUM_PREFIXES slots are indexed by the first 16 bits of the address,
+		// and the slots with V6_NODE_FLAG refer to the nodes indexed by the following bytes.
+		std::vector<UINT> V6SlotList;
+	};
+
+	// A loaded database. The lookups keep a reference while using it,
+	// so that a reloaded database can replace it at any time.
+	// Either pGeoIP for a legacy database or pMMDB for a MaxMind DB is set.
+	struct Database
+	{
+		volatile LONG RefCount;
+		UINT Generation;
+		GeoIPTag *pGeoIP;
+		MMDBReader *pMMDB;
+		int Edition;
+		bool CityInfoAvailable;
+		TCHAR szFileName[MAX_PATH];
+		TCHAR szV6FileName[MAX_PATH];
+		LookupTable * volatile pLookupTable;
+	};
+
+	struct CityCacheEntry
+	{
+		UINT Generation;
+		UINT Record;
+		bool Referenced;
+		CityInfo Info;
+	};
+
+	// A network block of the AS database, from the key of the map to Last in host byte order.
+	// The blocks without a record are also kept, as Found = false.
+	struct ASBlock
+	{
+		DWORD Last;
+		UINT Generation;
+		bool Found;
+		UINT Number;
+		LPCTSTR pOrganization;
+	};
+
+	typedef std::map<DWORD, ASBlock> ASBlockMap;
+
+	typedef std::vector<CityCacheEntry> CityCacheList;
+	typedef std::unordered_map<UINT, size_t> CityCacheIndex;
+
+	struct CacheShard
+	{
+		LocalLock Lock;
+		CityCacheList List;
+		CityCacheIndex Index;
+		size_t Hand;
+		size_t MaxEntries;
+		ULONGLONG Hits;
+		ULONGLONG Misses;
+		ULONGLONG Evicted;
+	};
+
+	Database *LoadDatabase(LPCTSTR pFileName);
+	static MMDBReader *OpenMMDB(LPCTSTR pFileName, bool *pCityInfoAvailable);
+	Database *LoadASDatabase(LPCTSTR pFileName);
+	Database *AcquireDatabase(Database * const volatile &pSlot) const;
+	static void ReleaseDatabase(Database *pDatabase);
+	void SetDatabase(Database * volatile &pSlot, Database *pDatabase);
+	void EndBuild();
+	void StartBuild(Database *pDatabase, bool Replace);
+	bool BuildLookupTable(Database *pDatabase) const;
+	void OnReloadFailed();
+	bool LookupCityInfo(const Database &Db, const IPAddress &Address, CityInfo *pInfo) const;
+	bool BuildRangeTable(const Database &Db, LookupTable *pTable) const;
+	static size_t FindRange(const LookupTable &Table, DWORD Address);
+	bool GetRecordInfo(const Database &Db, UINT Record, CityInfo *pInfo) const;
+	void StoreCityInfo(CacheShard &Shard, UINT Generation, UINT Record, const CityInfo &Info) const;
+	static bool SeekRecord(const Database &Db, DWORD Address, UINT *pValue,
+						   int *pPrefixLength = nullptr);
+	static bool DecodeRecord(const Database &Db, UINT Value, CityInfo *pInfo);
+	static bool DecodeMMDBRecord(const MMDBReader &Reader, UINT Offset, CityInfo *pInfo);
+	bool LookupASInfo(const Database &Db, const IPAddress &Address, ASInfo *pInfo) const;
+	static bool DecodeASRecord(const Database &Db, UINT Value, ASInfo *pInfo);
+	static bool DecodeMMDBASRecord(const MMDBReader &Reader, UINT Offset, ASInfo *pInfo);
+	void ClearASCache();
+	bool BuildV6Table(LPCTSTR pFileName, LookupTable *pTable) const;
+	bool ExpandV6Node(const GeoIPTag *pGeoIP, LookupTable *pTable,
+					  UINT Slot, unsigned int Value, int Depth, int Bits) const;
+	static UINT FindV6Record(const LookupTable &Table, const IPv6Address &Address);
+	static DWORD WINAPI BuildThread(LPVOID pParam);
+
+	// m_DatabaseLock is only held while taking a reference to m_pDatabase or m_pASDatabase
+	Database * volatile m_pDatabase;
+	Database * volatile m_pASDatabase;
+	mutable LocalLock m_DatabaseLock;
+	volatile LONG m_GenerationCount;
+	bool m_MapFile;
+
+	// The lookup table of m_pBuildDatabase is built on m_hBuildThread and published
+	// when completed. If m_ReplaceDatabase is set, m_pBuildDatabase has been reloaded
+	// and replaces the current database after the lookup table is built.
+	// If m_pBuildDatabase is null, m_szReloadFileName is loaded on the thread first.
+	// m_ReloadFailed is set when a reload fails on the thread.
+	HANDLE m_hBuildThread;
+	volatile bool m_AbortBuild;
+	Database *m_pBuildDatabase;
+	bool m_ReplaceDatabase;
+	TCHAR m_szReloadFileName[MAX_PATH];
+	volatile LONG m_ReloadFailed;
+
+	// The information of the records looked up, sharded by the record ID so that
+	// the threads looking up different records rarely wait for each other.
+	// The entries of the databases replaced are told by the generation.
+	mutable CacheShard m_CacheShardList[NUM_CACHE_SHARDS];
+	mutable volatile LONGLONG m_NumQueries;
+
+	// The results of the AS database by the network block of the trie, so that the addresses
+	// of a provider share an entry. The names of the organizations are interned in m_ASNamePool.
+	mutable LocalLock m_ASCacheLock;
+	mutable ASBlockMap m_ASBlockMap;
+	mutable StringPool m_ASNamePool;
 };
 
 }	// namespace CV
@@ -0,0 +1,488 @@
+/******************************************************************************
+*                                                                             *
+*    HostCacheFile.cpp                      Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "ConnectionViewer.h"
+#include <vector>
+#include "HostCacheFile.h"
+#include "Utility.h"
+
+
+namespace CV
+{
+
+enum
+{
+	HOST_CACHE_SIGNATURE	= 0x43485643,	// "CVHC"
+	HOST_CACHE_VERSION		= 1,
+	MAX_HOST_NAME_LENGTH	= 1024
+};
+
+struct HostCacheHeader
+{
+	DWORD Signature;
+	DWORD Version;
+	DWORD HeaderSize;
+	DWORD RecordSize;
+	DWORD CharSize;
+	DWORD NumSlots;
+	ULONGLONG FileSize;
+	ULONGLONG DataOffset;
+	ULONGLONG DataLength;
+	ULONGLONG NumEntries;
+	ULONGLONG DeadLength;
+};
+
+// Offset is the position in the data section in units of 8 bytes plus 1, and 0 for empty slots
+struct HostCacheSlot
+{
+	DWORD Hash;
+	DWORD Offset;
+};
+
+// Followed by the host name and a terminating null, padded to a multiple of 8 bytes.
+// NameLength is 0 for failed lookups.
+struct HostCacheRecord
+{
+	IPAddress Address;
+	FILETIME ResolvedTime;
+	DWORD TTL;
+	DWORD Failures;
+	DWORD NameLength;
+	DWORD Reserved;
+};
+
+// The index is stored in the file, so this must not depend on the build
+static UINT HashAddress(const IPAddress &Address)
+{
+	UINT Hash = 2166136261U;
+
+	if (Address.Type == IP_ADDRESS_V4) {
+		Hash = (Hash ^ Address.V4.Address) * 16777619U;
+	} else {
+		for (int i = 0; i < 16; i++)
+			Hash = (Hash ^ Address.V6.Bytes[i]) * 16777619U;
+		Hash = (Hash ^ Address.V6.ScopeID) * 16777619U;
+	}
+
+	return Hash;
+}
+
+static ULONGLONG GetRecordLength(ULONGLONG NameLength)
+{
+	return (sizeof(HostCacheRecord) + (NameLength + 1) * sizeof(TCHAR) + 7) & ~7ULL;
+}
+
+static HostCacheHeader &GetHeader(BYTE *pBase)
+{
+	return *reinterpret_cast<HostCacheHeader*>(pBase);
+}
+
+static HostCacheSlot *GetIndex(BYTE *pBase)
+{
+	return reinterpret_cast<HostCacheSlot*>(pBase + sizeof(HostCacheHeader));
+}
+
+static bool IsValidHeader(const HostCacheHeader &Header, ULONGLONG FileSize)
+{
+	return Header.Signature == HOST_CACHE_SIGNATURE
+		&& Header.Version == HOST_CACHE_VERSION
+		&& Header.HeaderSize == sizeof(HostCacheHeader)
+		&& Header.RecordSize == sizeof(HostCacheRecord)
+		&& Header.CharSize == sizeof(TCHAR)
+		&& Header.FileSize == FileSize
+		&& Header.NumSlots != 0
+		&& (Header.NumSlots & (Header.NumSlots - 1)) == 0
+		&& Header.DataOffset == sizeof(HostCacheHeader) + (ULONGLONG)Header.NumSlots * sizeof(HostCacheSlot)
+		&& Header.DataOffset <= FileSize
+		&& Header.DataLength <= FileSize - Header.DataOffset
+		&& Header.DeadLength <= Header.DataLength
+		&& Header.NumEntries <= Header.NumSlots;
+}
+
+// Records are checked as they are read, so that a broken file only loses its broken entries
+static const HostCacheRecord *GetRecord(BYTE *pBase, const HostCacheSlot &Slot)
+{
+	const HostCacheHeader &Header = GetHeader(pBase);
+	const ULONGLONG Offset = (ULONGLONG)(Slot.Offset - 1) * 8;
+
+	if (Slot.Offset == 0 || Offset + sizeof(HostCacheRecord) > Header.DataLength)
+		return nullptr;
+
+	const HostCacheRecord *pRecord =
+		reinterpret_cast<const HostCacheRecord*>(pBase + Header.DataOffset + Offset);
+	if (pRecord->NameLength > MAX_HOST_NAME_LENGTH
+			|| Offset + GetRecordLength(pRecord->NameLength) > Header.DataLength
+			|| (pRecord->Address.Type != IP_ADDRESS_V4 && pRecord->Address.Type != IP_ADDRESS_V6))
+		return nullptr;
+	if (reinterpret_cast<LPCTSTR>(pRecord + 1)[pRecord->NameLength] != _T('\0'))
+		return nullptr;
+
+	return pRecord;
+}
+
+// Returns the slot of the address, or the empty slot that it would be stored in
+static HostCacheSlot *FindSlot(BYTE *pBase, const IPAddress &Address, UINT Hash)
+{
+	const HostCacheHeader &Header = GetHeader(pBase);
+	HostCacheSlot *pIndex = GetIndex(pBase);
+	const DWORD Mask = Header.NumSlots - 1;
+
+	for (DWORD i = 0, Pos = Hash & Mask; i < Header.NumSlots; i++, Pos = (Pos + 1) & Mask) {
+		HostCacheSlot &Slot = pIndex[Pos];
+
+		if (Slot.Offset == 0)
+			return &Slot;
+		if (Slot.Hash == Hash) {
+			const HostCacheRecord *pRecord = GetRecord(pBase, Slot);
+			if (pRecord != nullptr && pRecord->Address == Address)
+				return &Slot;
+		}
+	}
+
+	return nullptr;
+}
+
+static bool IsExpired(const FILETIME &ResolvedTime, DWORD TTL, ULONGLONG CurTime)
+{
+	return FileTimeToUInt64(ResolvedTime) + (ULONGLONG)TTL * 10000000 <= CurTime;
+}
+
+
+HostCacheFile::HostCacheFile()
+	: m_hFile(INVALID_HANDLE_VALUE)
+	, m_pBase(nullptr)
+{
+	m_szFileName[0] = _T('\0');
+}
+
+HostCacheFile::~HostCacheFile()
+{
+	Close();
+}
+
+// A missing or broken file is created again empty.
+// Fails with ERROR_SHARING_VIOLATION if another process has the file open, see ReadRecords().
+bool HostCacheFile::Open(LPCTSTR pFileName)
+{
+	Close();
+
+	if (::lstrlen(pFileName) + 4 >= MAX_PATH)
+		return false;
+
+	m_hFile = ::CreateFile(pFileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+						   OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return false;
+	::lstrcpy(m_szFileName, pFileName);
+
+	LARGE_INTEGER FileSize;
+	if (::GetFileSizeEx(m_hFile, &FileSize)
+			&& (ULONGLONG)FileSize.QuadPart >= sizeof(HostCacheHeader)
+			&& (ULONGLONG)FileSize.QuadPart <= (SIZE_T)-1
+			&& Map((ULONGLONG)FileSize.QuadPart)) {
+		if (IsValidHeader(GetHeader(m_pBase), (ULONGLONG)FileSize.QuadPart))
+			return true;
+		Unmap();
+	}
+
+	if (!Initialize(INITIAL_SLOTS, INITIAL_DATA_SIZE)) {
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void HostCacheFile::Close()
+{
+	Unmap();
+	if (m_hFile != INVALID_HANDLE_VALUE) {
+		::CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+}
+
+bool HostCacheFile::Lookup(const IPAddress &Address, RecordInfo *pInfo, LPTSTR pHostName, int MaxLength) const
+{
+	if (m_pBase == nullptr)
+		return false;
+
+	const HostCacheSlot *pSlot = FindSlot(m_pBase, Address, HashAddress(Address));
+	if (pSlot == nullptr || pSlot->Offset == 0)
+		return false;
+	const HostCacheRecord *pRecord = GetRecord(m_pBase, *pSlot);
+
+	pInfo->ResolvedTime = pRecord->ResolvedTime;
+	pInfo->TTL = pRecord->TTL;
+	pInfo->Failures = pRecord->Failures;
+	if (pHostName != nullptr) {
+		if (pRecord->NameLength != 0)
+			::lstrcpyn(pHostName, reinterpret_cast<LPCTSTR>(pRecord + 1), MaxLength);
+		else
+			pHostName[0] = _T('\0');
+	}
+
+	return true;
+}
+
+// pHostName is nullptr for failed lookups.
+// The file is rebuilt without the stale records when the index or the data section is full.
+bool HostCacheFile::Write(const IPAddress &Address, const RecordInfo &Info, LPCTSTR pHostName)
+{
+	if (m_pBase == nullptr)
+		return false;
+
+	const ULONGLONG NameLength = pHostName != nullptr ? ::lstrlen(pHostName) : 0;
+	if (NameLength > MAX_HOST_NAME_LENGTH)
+		return false;
+
+	const HostCacheHeader &Header = GetHeader(m_pBase);
+	const ULONGLONG RecordLength = GetRecordLength(NameLength);
+	if ((Header.NumEntries + 1) * 2 > Header.NumSlots
+			|| Header.DataLength + RecordLength > Header.FileSize - Header.DataOffset) {
+		if (!Rebuild(Header.NumEntries + 1, Header.DataLength - Header.DeadLength + RecordLength))
+			return false;
+	}
+
+	return Append(Address, Info, pHostName);
+}
+
+ULONGLONG HostCacheFile::NumEntries() const
+{
+	if (m_pBase == nullptr)
+		return 0;
+	return GetHeader(m_pBase).NumEntries;
+}
+
+// Reads a copy of the file, which another process may be writing, and passes the valid records.
+// Expired records are passed too.
+bool HostCacheFile::ReadRecords(LPCTSTR pFileName, RecordEnumerator *pEnumerator)
+{
+	HANDLE hFile = ::CreateFile(pFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+								OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER FileSize;
+	std::vector<BYTE> Data;
+	bool OK = ::GetFileSizeEx(hFile, &FileSize)
+		&& (ULONGLONG)FileSize.QuadPart >= sizeof(HostCacheHeader)
+		&& (ULONGLONG)FileSize.QuadPart <= MAX_READ_SIZE;
+	if (OK) {
+		DWORD Read;
+		Data.resize((size_t)FileSize.QuadPart);
+		OK = ::ReadFile(hFile, Data.data(), (DWORD)Data.size(), &Read, nullptr) && Read == Data.size();
+	}
+	::CloseHandle(hFile);
+	if (!OK || !IsValidHeader(GetHeader(Data.data()), Data.size()))
+		return false;
+
+	BYTE *pBase = Data.data();
+	const HostCacheHeader &Header = GetHeader(pBase);
+	const HostCacheSlot *pIndex = GetIndex(pBase);
+
+	for (DWORD i = 0; i < Header.NumSlots; i++) {
+		const HostCacheRecord *pRecord = GetRecord(pBase, pIndex[i]);
+
+		if (pRecord != nullptr) {
+			RecordInfo Info;
+			Info.ResolvedTime = pRecord->ResolvedTime;
+			Info.TTL = pRecord->TTL;
+			Info.Failures = pRecord->Failures;
+			pEnumerator->OnRecord(pRecord->Address, Info,
+								  pRecord->NameLength != 0 ? reinterpret_cast<LPCTSTR>(pRecord + 1) : nullptr);
+		}
+	}
+
+	return true;
+}
+
+bool HostCacheFile::Create(LPCTSTR pFileName, ULONGLONG NumSlots, ULONGLONG DataSize)
+{
+	Close();
+
+	m_hFile = ::CreateFile(pFileName, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+						   CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return false;
+	::lstrcpyn(m_szFileName, pFileName, cvLengthOf(m_szFileName));
+
+	if (!Initialize(NumSlots, DataSize)) {
+		Close();
+		::DeleteFile(pFileName);
+		return false;
+	}
+
+	return true;
+}
+
+bool HostCacheFile::Initialize(ULONGLONG NumSlots, ULONGLONG DataSize)
+{
+	Unmap();
+
+	if (NumSlots > 0x80000000ULL)
+		return false;
+
+	const ULONGLONG DataOffset = sizeof(HostCacheHeader) + NumSlots * sizeof(HostCacheSlot);
+	const ULONGLONG FileSize = DataOffset + DataSize;
+	if (FileSize > (SIZE_T)-1 || DataSize / 8 >= 0xFFFFFFFFULL)
+		return false;
+
+	LARGE_INTEGER Pos;
+	Pos.QuadPart = (LONGLONG)FileSize;
+	if (!::SetFilePointerEx(m_hFile, Pos, nullptr, FILE_BEGIN)
+			|| !::SetEndOfFile(m_hFile)
+			|| !Map(FileSize))
+		return false;
+
+	HostCacheHeader &Header = GetHeader(m_pBase);
+	::ZeroMemory(m_pBase, (size_t)DataOffset);
+	Header.Signature = HOST_CACHE_SIGNATURE;
+	Header.Version = HOST_CACHE_VERSION;
+	Header.HeaderSize = sizeof(HostCacheHeader);
+	Header.RecordSize = sizeof(HostCacheRecord);
+	Header.CharSize = sizeof(TCHAR);
+	Header.NumSlots = (DWORD)NumSlots;
+	Header.FileSize = FileSize;
+	Header.DataOffset = DataOffset;
+
+	return true;
+}
+
+bool HostCacheFile::Map(ULONGLONG Size)
+{
+	HANDLE hMapping = ::CreateFileMapping(m_hFile, nullptr, PAGE_READWRITE,
+										  (DWORD)(Size >> 32), (DWORD)Size, nullptr);
+	if (hMapping == nullptr)
+		return false;
+	m_pBase = static_cast<BYTE*>(::MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)Size));
+	::CloseHandle(hMapping);
+
+	return m_pBase != nullptr;
+}
+
+void HostCacheFile::Unmap()
+{
+	if (m_pBase != nullptr) {
+		::UnmapViewOfFile(m_pBase);
+		m_pBase = nullptr;
+	}
+}
+
+// The record is written before the index and the header refer to it,
+// so an interrupted write leaves the previous record of the address in effect
+bool HostCacheFile::Append(const IPAddress &Address, const RecordInfo &Info, LPCTSTR pHostName)
+{
+	HostCacheHeader &Header = GetHeader(m_pBase);
+	const UINT Hash = HashAddress(Address);
+	HostCacheSlot *pSlot = FindSlot(m_pBase, Address, Hash);
+	if (pSlot == nullptr)
+		return false;
+
+	const ULONGLONG NameLength = pHostName != nullptr ? ::lstrlen(pHostName) : 0;
+	const ULONGLONG RecordLength = GetRecordLength(NameLength);
+	if (Header.DataLength + RecordLength > Header.FileSize - Header.DataOffset)
+		return false;
+
+	HostCacheRecord *pRecord =
+		reinterpret_cast<HostCacheRecord*>(m_pBase + Header.DataOffset + Header.DataLength);
+	::ZeroMemory(pRecord, (size_t)RecordLength);
+	pRecord->Address.Type = Address.Type;
+	if (Address.Type == IP_ADDRESS_V4)
+		pRecord->Address.V4 = Address.V4;
+	else
+		pRecord->Address.V6 = Address.V6;
+	pRecord->ResolvedTime = Info.ResolvedTime;
+	pRecord->TTL = Info.TTL;
+	pRecord->Failures = Info.Failures;
+	pRecord->NameLength = (DWORD)NameLength;
+	if (NameLength != 0)
+		::CopyMemory(pRecord + 1, pHostName, (size_t)NameLength * sizeof(TCHAR));
+
+	if (pSlot->Offset != 0) {
+		const HostCacheRecord *pOldRecord = GetRecord(m_pBase, *pSlot);
+		if (pOldRecord != nullptr)
+			Header.DeadLength += GetRecordLength(pOldRecord->NameLength);
+	} else {
+		Header.NumEntries++;
+	}
+	pSlot->Hash = Hash;
+	pSlot->Offset = (DWORD)(Header.DataLength / 8 + 1);
+	Header.DataLength += RecordLength;
+
+	return true;
+}
+
+// Copies the unexpired records to a new file, and replaces the file with it
+bool HostCacheFile::Rebuild(ULONGLONG MinEntries, ULONGLONG MinDataSize)
+{
+	ULONGLONG NumSlots = INITIAL_SLOTS;
+	while (NumSlots < MinEntries * 4)
+		NumSlots <<= 1;
+	const ULONGLONG DataSize = max(MinDataSize * 2, (ULONGLONG)INITIAL_DATA_SIZE);
+
+	TCHAR szFileName[MAX_PATH], szTempFileName[MAX_PATH];
+	::lstrcpy(szFileName, m_szFileName);
+	::lstrcpy(szTempFileName, m_szFileName);
+	::lstrcat(szTempFileName, TEXT(".tmp"));
+
+	HostCacheFile NewFile;
+	if (!NewFile.Create(szTempFileName, NumSlots, DataSize))
+		return false;
+
+	FILETIME CurFileTime;
+	::GetSystemTimeAsFileTime(&CurFileTime);
+	const ULONGLONG CurTime = FileTimeToUInt64(CurFileTime);
+
+	const HostCacheHeader &Header = GetHeader(m_pBase);
+	const HostCacheSlot *pIndex = GetIndex(m_pBase);
+
+	for (DWORD i = 0; i < Header.NumSlots; i++) {
+		const HostCacheRecord *pRecord = GetRecord(m_pBase, pIndex[i]);
+
+		if (pRecord != nullptr && !IsExpired(pRecord->ResolvedTime, pRecord->TTL, CurTime)) {
+			RecordInfo Info;
+			Info.ResolvedTime = pRecord->ResolvedTime;
+			Info.TTL = pRecord->TTL;
+			Info.Failures = pRecord->Failures;
+			NewFile.Append(pRecord->Address, Info,
+						   pRecord->NameLength != 0 ? reinterpret_cast<LPCTSTR>(pRecord + 1) : nullptr);
+		}
+	}
+
+	NewFile.Close();
+	Close();
+
+	if (!::MoveFileEx(szTempFileName, szFileName, MOVEFILE_REPLACE_EXISTING)) {
+		::DeleteFile(szTempFileName);
+		Open(szFileName);
+		return false;
+	}
+
+	return Open(szFileName);
+}
+
+}	// namespace CV
@@ -0,0 +1,88 @@
+/******************************************************************************
+*                                                                             *
+*    HostCacheFile.h                        Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef CV_HOST_CACHE_FILE_H
+#define CV_HOST_CACHE_FILE_H
+
+
+namespace CV
+{
+
+// Keeps resolved host names in a memory-mapped file across sessions.
+// Records are appended to the file, and an open addressing index in front of
+// them points to the latest record of each address, so that opening the file
+// doesn't read it and a lookup touches only a few pages.
+class HostCacheFile
+{
+public:
+	struct RecordInfo
+	{
+		FILETIME ResolvedTime;
+		DWORD TTL;
+		unsigned int Failures;
+	};
+
+	cvAbstractClass(RecordEnumerator)
+	{
+public:
+		virtual ~RecordEnumerator() {}
+		virtual void OnRecord(const IPAddress &Address, const RecordInfo &Info, LPCTSTR pHostName) = 0;
+	};
+
+	HostCacheFile();
+	~HostCacheFile();
+	bool Open(LPCTSTR pFileName);
+	void Close();
+	bool IsOpen() const { return m_pBase != nullptr; }
+	bool Lookup(const IPAddress &Address, RecordInfo *pInfo, LPTSTR pHostName, int MaxLength) const;
+	bool Write(const IPAddress &Address, const RecordInfo &Info, LPCTSTR pHostName);
+	ULONGLONG NumEntries() const;
+	static bool ReadRecords(LPCTSTR pFileName, RecordEnumerator *pEnumerator);
+
+private:
+	enum
+	{
+		INITIAL_SLOTS		= 4096,
+		INITIAL_DATA_SIZE	= 256 * 1024,
+		MAX_READ_SIZE		= 256 * 1024 * 1024
+	};
+
+	bool Create(LPCTSTR pFileName, ULONGLONG NumSlots, ULONGLONG DataSize);
+	bool Initialize(ULONGLONG NumSlots, ULONGLONG DataSize);
+	bool Map(ULONGLONG Size);
+	void Unmap();
+	bool Append(const IPAddress &Address, const RecordInfo &Info, LPCTSTR pHostName);
+	bool Rebuild(ULONGLONG MinEntries, ULONGLONG MinDataSize);
+
+	TCHAR m_szFileName[MAX_PATH];
+	HANDLE m_hFile;
+	BYTE *m_pBase;
+};
+
+}	// namespace CV
+
+
+#endif	// ndef CV_HOST_CACHE_FILE_H
@@ -31,40 +31,89 @@
 namespace CV
 {
 
+static int GetLatencyClass(ULONGLONG Latency)
+{
+	if (Latency < 10)
+		return HostManager::LATENCY_CLASS_10MSEC;
+	if (Latency < 100)
+		return HostManager::LATENCY_CLASS_100MSEC;
+	if (Latency < 1000)
+		return HostManager::LATENCY_CLASS_1SEC;
+	if (Latency < 10 * 1000)
+		return HostManager::LATENCY_CLASS_10SEC;
+	return HostManager::LATENCY_CLASS_LONG;
+}
+
+
+HostManager::HostRecord HostManager::m_Tombstone;
+
+
 HostManager::HostManager()
-	: m_Thread(nullptr)
-	, m_Event(nullptr)
+	: m_Semaphore(nullptr)
+	, m_Abort(false)
+	, m_MaxThreads(DEFAULT_RESOLVER_THREADS)
+	, m_IdleThreads(0)
+	, m_NumInFlight(0)
+	, m_AdmissionBudget(0)
+	, m_RemainingBudget(0)
+	, m_ResolveTimeout(0)
+	, m_CacheHand(0)
+	, m_MaxCacheEntries(DEFAULT_CACHE_ENTRIES)
+	, m_HostNameTTL(DEFAULT_HOST_NAME_TTL)
+	, m_NumNegativeEntries(0)
+	, m_pReadTable(nullptr)
+	, m_CacheFileOpen(false)
+	, m_UseAsyncResolver(false)
+	, m_NumAsyncServers(0)
 {
+	::ZeroMemory(&m_Statistics, sizeof(m_Statistics));
 }
 
 HostManager::~HostManager()
 {
 	EndThread();
+	ClearCache();
 }
 
 void HostManager::Clear()
 {
 	BlockLock Lock(m_Lock);
 
-	while (!m_GetHostQueue.empty()) {
-		delete m_GetHostQueue.front();
-		m_GetHostQueue.pop_front();
+	for (int i = 0; i < NUM_PRIORITIES; i++) {
+		GetHostQueue &Queue = m_GetHostQueue[i];
+
+		while (!Queue.empty()) {
+			QueuedRequest &Queued = Queue.front();
+			m_PendingMap.erase(Queued.pRequest->GetAddress());
+			delete Queued.pRequest;
+			Queue.pop_front();
+		}
 	}
 }
 
 void HostManager::EndThread()
 {
-	if (m_Thread != nullptr) {
+	// Queries cancelled here may be passed back to the threads, so stop it first
+	m_DnsResolver.Stop();
+
+	if (!m_ThreadList.empty()) {
 		m_Abort = true;
-		::SetEvent(m_Event);
-		if (::WaitForSingleObject(m_Thread, 10000) == WAIT_TIMEOUT)
-			::TerminateThread(m_Thread, -1);
-		::CloseHandle(m_Thread);
-		m_Thread = nullptr;
+		::ReleaseSemaphore(m_Semaphore, (LONG)m_ThreadList.size(), nullptr);
+		if (::WaitForMultipleObjects((DWORD)m_ThreadList.size(), m_ThreadList.data(),
+									 TRUE, 10000) == WAIT_TIMEOUT) {
+			for (size_t i = 0; i < m_ThreadList.size(); i++)
+				::TerminateThread(m_ThreadList[i], -1);
+		}
+		for (size_t i = 0; i < m_ThreadList.size(); i++)
+			::CloseHandle(m_ThreadList[i]);
+		m_ThreadList.clear();
+		m_IdleThreads = 0;
+		m_NumInFlight = 0;
+		m_PendingMap.clear();
 	}
-	if (m_Event != nullptr) {
-		::CloseHandle(m_Event);
-		m_Event = nullptr;
+	if (m_Semaphore != nullptr) {
+		::CloseHandle(m_Semaphore);
+		m_Semaphore = nullptr;
 	}
 	Clear();
 }
@@ -73,148 +122,934 @@ bool HostManager::GetHostName(Request *pRequest)
 {
 	BlockLock Lock(m_Lock);
 
-	HostMap::iterator i = m_HostMap.find(pRequest->GetAddress());
-	if (i != m_HostMap.end()) {
-		pRequest->OnHostFound(i->second.GetHostName());
+	const ULONGLONG CurTick = ::GetTickCount64();
+	const CacheEntry *pEntry = LookupCache(pRequest->GetAddress(), CurTick);
+	if (pEntry == nullptr)
+		pEntry = LoadCacheEntry(pRequest->GetAddress(), CurTick);
+	if (pEntry != nullptr) {
+		// Failed lookups are not repeated until the negative entry expires
+		if (pEntry->pRecord != nullptr)
+			pRequest->OnHostFound(pEntry->GetHostName());
+		else
+			m_Statistics.NegativeHits++;
 		delete pRequest;
 		return true;
 	}
 
-	for (GetHostQueue::iterator i = m_GetHostQueue.begin();
-			i != m_GetHostQueue.end(); i++) {
-		if (*(*i) == *pRequest) {
-			delete pRequest;
-			return true;
-		}
+	// The address is already queued or being resolved
+	PendingMap::iterator itPending = m_PendingMap.find(pRequest->GetAddress());
+	if (itPending != m_PendingMap.end()) {
+		itPending->second.RequestedTick = CurTick;
+		if (pRequest->GetPriority() < itPending->second.Priority)
+			PromoteRequest(pRequest->GetAddress(), itPending->second, pRequest->GetPriority(), CurTick);
+		delete pRequest;
+		return true;
 	}
 
-	if (m_Thread == nullptr) {
-		m_Abort = false;
-		if (m_Event == nullptr)
-			m_Event = ::CreateEvent(nullptr, FALSE, FALSE, nullptr);
-		else
-			::ResetEvent(m_Event);
-		m_Thread = ::CreateThread(nullptr, 0, ThreadProc, this, 0, nullptr);
-		if (m_Thread == nullptr) {
+	// Addresses over the budget are requested again in a later update
+	if (m_AdmissionBudget > 0) {
+		if (m_RemainingBudget <= 0) {
+			m_Statistics.Deferred++;
 			delete pRequest;
 			return false;
 		}
+		m_RemainingBudget--;
 	}
 
-	m_GetHostQueue.push_back(pRequest);
-	::SetEvent(m_Event);
+	QueuedRequest Queued;
+	Queued.pRequest = pRequest;
+	Queued.QueuedTick = CurTick;
+
+	PendingInfo Pending;
+	Pending.Priority = pRequest->GetPriority();
+	Pending.InFlight = false;
+	Pending.QueuedTick = CurTick;
+	Pending.RequestedTick = CurTick;
+	Pending.VisibleTick = Pending.Priority == PRIORITY_VISIBLE ? CurTick : 0;
+
+	// Queries are sent as soon as they are made, so the priority only affects the order within an update
+	if (m_UseAsyncResolver
+			&& (m_DnsResolver.IsRunning() || m_DnsResolver.Start(this))) {
+		QueuedRequest *pQueued = new QueuedRequest(Queued);
+		if (m_DnsResolver.Query(pRequest->GetAddress(), pQueued)) {
+			Pending.InFlight = true;
+			m_PendingMap.insert(std::pair<IPAddress, PendingInfo>(pRequest->GetAddress(), Pending));
+			m_NumInFlight++;
+			return true;
+		}
+		delete pQueued;
+	}
+
+	if (!QueueRequest(Queued, Pending.Priority)) {
+		delete pRequest;
+		return false;
+	}
+
+	m_PendingMap.insert(std::pair<IPAddress, PendingInfo>(pRequest->GetAddress(), Pending));
 
 	return true;
 }
 
+// Must be called on the same thread as Quiesce(), see FindHostName()
 bool HostManager::GetHostName(const IPAddress &Address, LPTSTR pHostName, int MaxLength) const
+{
+	LPCTSTR pName = FindHostName(Address);
+	if (pName == nullptr)
+		return false;
+	if (pHostName != nullptr)
+		::lstrcpyn(pHostName, pName, MaxLength);
+	return true;
+}
+
+// Looks up the name without taking the lock, so that the resolver never blocks the caller.
+// The returned name stays valid until the next Quiesce() call, and this must only be called
+// on the thread that calls Quiesce().
+LPCTSTR HostManager::FindHostName(const IPAddress &Address) const
 {
 	if (Address.Type == IP_ADDRESS_V4) {
 		if (Address.V4.Address == 0 || Address.V4.Address == 0xFFFFFFFF)
-			return false;
+			return nullptr;
 	} else if (Address.Type == IP_ADDRESS_V6) {
 		if (Address.V6.IsUnspecified())
-			return false;
+			return nullptr;
 	}
 
+	const ReadTable *pTable = m_pReadTable;
+	if (pTable == nullptr)
+		return nullptr;
+
+	const size_t Mask = pTable->Mask;
+	size_t Pos = AddressHash()(Address) & Mask;
+
+	for (size_t i = 0; i <= Mask; i++, Pos = (Pos + 1) & Mask) {
+		const HostRecord *pRecord = pTable->SlotList[Pos];
+
+		if (pRecord == nullptr)
+			break;
+		if (pRecord != &m_Tombstone && pRecord->Address == Address) {
+			if (::GetTickCount64() >= pRecord->ExpireTick)
+				return nullptr;
+			if (!pRecord->Referenced)
+				pRecord->Referenced = true;
+			return pRecord->szHostName;
+		}
+	}
+
+	return nullptr;
+}
+
+// Frees the records and tables replaced since the last call.
+// Must be called when none of the names returned by FindHostName() are in use.
+void HostManager::Quiesce()
+{
+	std::vector<BYTE*> RetiredList;
+
+	m_Lock.Lock();
+	RetiredList.swap(m_RetiredList);
+	m_Lock.Unlock();
+
+	for (std::vector<BYTE*>::iterator i = RetiredList.begin(); i != RetiredList.end(); i++)
+		delete [] *i;
+}
+
+// The enumerator is called with the lock held
+void HostManager::EnumHostNames(HostNameEnumerator *pEnumerator) const
+{
+	BlockLock Lock(m_Lock);
+
+	const ULONGLONG CurTick = ::GetTickCount64();
+
+	for (CacheList::const_iterator i = m_CacheList.begin(); i != m_CacheList.end(); i++) {
+		if (i->pRecord != nullptr && CurTick < i->ExpireTick)
+			pEnumerator->OnHostName(i->Address, i->GetHostName());
+	}
+}
+
+// Names added here expire after the default TTL
+bool HostManager::AddHostName(const IPAddress &Address, LPCTSTR pHostName)
+{
+	if (pHostName == nullptr || pHostName[0] == '\0')
+		return false;
+
 	BlockLock Lock(m_Lock);
 
-	HostMap::const_iterator i = m_HostMap.find(Address);
-	if (i == m_HostMap.end())
+	const CacheEntry *pEntry = LookupCache(Address, ::GetTickCount64());
+	if (pEntry != nullptr && pEntry->pRecord != nullptr)
 		return false;
-	if (pHostName != nullptr)
-		::lstrcpyn(pHostName, i->second.GetHostName(), MaxLength);
+
+	StoreHostName(Address, pHostName, 0);
+
 	return true;
 }
 
-DWORD WINAPI HostManager::ThreadProc(LPVOID pParameter)
+// Threads are added up to this number when requests are queued
+void HostManager::SetResolverThreads(int Threads)
 {
-	HostManager *pThis = static_cast<HostManager*>(pParameter);
+	BlockLock Lock(m_Lock);
 
-	while (true) {
-		::WaitForSingleObject(pThis->m_Event, INFINITE);
+	if (Threads <= 0)
+		Threads = DEFAULT_RESOLVER_THREADS;
+	else if (Threads > MAX_RESOLVER_THREADS)
+		Threads = MAX_RESOLVER_THREADS;
+	m_MaxThreads = Threads;
+}
+
+// Maximum number of requests admitted between BeginAdmission() calls, 0 for no limit
+void HostManager::SetAdmissionBudget(int Budget)
+{
+	BlockLock Lock(m_Lock);
+
+	m_AdmissionBudget = max(Budget, 0);
+	m_RemainingBudget = m_AdmissionBudget;
+}
+
+// Requests that have waited in the queue for longer than the timeout are dropped.
+// Lookups in flight can't be cancelled, so they are finished as failed by BeginAdmission()
+// and their results are not passed to the requests.
+void HostManager::SetResolveTimeout(DWORD Timeout)
+{
+	BlockLock Lock(m_Lock);
+
+	m_ResolveTimeout = Timeout;
+}
+
+// If pServers is nullptr or empty, the DNS servers of the system are used.
+// Lookups are passed to the threads when the resolver can't be used.
+// The resolver is only restarted when the settings change, as that cancels the queries in flight.
+void HostManager::SetAsyncResolver(bool Enable, LPCTSTR pServers)
+{
+	IPAddress ServerList[DnsResolver::MAX_SERVERS];
+	int NumServers = 0;
+
+	if (Enable && pServers != nullptr) {
+		TCHAR szServers[256];
+		::lstrcpyn(szServers, pServers, cvLengthOf(szServers));
+		LPTSTR p = szServers;
+		while (*p != _T('\0') && NumServers < cvLengthOf(ServerList)) {
+			LPTSTR pNext = p;
+			while (*pNext != _T('\0') && *pNext != _T(','))
+				pNext++;
+			const bool Last = *pNext == _T('\0');
+			*pNext = _T('\0');
+			if (ServerList[NumServers].Parse(p))
+				NumServers++;
+			if (Last)
+				break;
+			p = pNext + 1;
+		}
+	}
+
+	if (Enable == m_UseAsyncResolver && NumServers == m_NumAsyncServers) {
+		int i;
+		for (i = 0; i < NumServers; i++) {
+			if (ServerList[i] != m_AsyncServerList[i])
+				break;
+		}
+		if (i == NumServers)
+			return;
+	}
+
+	m_DnsResolver.Stop();
+	m_DnsResolver.SetServers(ServerList, NumServers);
+	for (int i = 0; i < NumServers; i++)
+		m_AsyncServerList[i] = ServerList[i];
+	m_NumAsyncServers = NumServers;
+
+	BlockLock Lock(m_Lock);
+
+	m_UseAsyncResolver = Enable;
+}
 
+// Entries over the new size are dropped when the cache is shrunk
+void HostManager::SetCacheSize(size_t MaxEntries)
+{
+	BlockLock Lock(m_Lock);
+
+	if (MaxEntries < MIN_CACHE_ENTRIES)
+		MaxEntries = MIN_CACHE_ENTRIES;
+	if (MaxEntries < m_CacheList.size()) {
+		for (size_t i = MaxEntries; i < m_CacheList.size(); i++) {
+			CacheEntry &Entry = m_CacheList[i];
+			m_CacheIndex.erase(Entry.Address);
+			SetEntryHostName(Entry, nullptr, 0);
+			m_NumNegativeEntries--;
+			m_Statistics.Evicted++;
+		}
+		m_CacheList.resize(MaxEntries);
+		m_CacheHand = 0;
+	}
+	m_MaxCacheEntries = MaxEntries;
+}
+
+// Maximum time in seconds that resolved names are kept, which also caps the TTL of the records
+void HostManager::SetHostNameTTL(DWORD TTL)
+{
+	BlockLock Lock(m_Lock);
+
+	m_HostNameTTL = max(TTL, (DWORD)MIN_HOST_NAME_TTL);
+}
+
+// Names are looked up in the file when they are requested, and are written to it as they are resolved.
+// The file lock is always taken before m_Lock.
+bool HostManager::OpenCacheFile(LPCTSTR pFileName)
+{
+	BlockLock FileLock(m_CacheFileLock);
+
+	if (m_CacheFile.Open(pFileName)) {
+		BlockLock Lock(m_Lock);
+		m_CacheFileOpen = true;
+		return true;
+	}
+
+	// Another instance is using the file, so its names are only copied to the memory cache
+	if (::GetLastError() == ERROR_SHARING_VIOLATION) {
+		cvDebugTrace(TEXT("Host cache file is in use, reading it only : %s\n"), pFileName);
+		HostCacheFile::ReadRecords(pFileName, this);
+	}
+
+	return false;
+}
+
+void HostManager::CloseCacheFile()
+{
+	FlushCacheWrites();
+
+	BlockLock FileLock(m_CacheFileLock);
+
+	m_Lock.Lock();
+	m_CacheFileOpen = false;
+	m_CacheWriteList.clear();
+	m_CacheWriteNames.clear();
+	m_Lock.Unlock();
+
+	m_CacheFile.Close();
+}
+
+void HostManager::BeginAdmission()
+{
+	BlockLock Lock(m_Lock);
+
+	m_RemainingBudget = m_AdmissionBudget;
+	ExpireInFlight(::GetTickCount64());
+}
+
+void HostManager::GetResolverStatistics(ResolverStatistics *pStatistics) const
+{
+	BlockLock Lock(m_Lock);
+
+	*pStatistics = m_Statistics;
+	pStatistics->QueueLength = GetQueueLength();
+	pStatistics->InFlight = m_NumInFlight;
+	pStatistics->NumThreads = (int)m_ThreadList.size();
+	pStatistics->CacheEntries = m_CacheList.size();
+	pStatistics->NegativeEntries = m_NumNegativeEntries;
+}
+
+// Expired entries are treated as absent, so that the next request refreshes them.
+// Must be called with the lock held.
+const HostManager::CacheEntry *HostManager::LookupCache(const IPAddress &Address, ULONGLONG CurTick) const
+{
+	CacheIndex::const_iterator i = m_CacheIndex.find(Address);
+	if (i == m_CacheIndex.end())
+		return nullptr;
+
+	const CacheEntry &Entry = m_CacheList[i->second];
+	if (CurTick >= Entry.ExpireTick)
+		return nullptr;
+	Entry.Referenced = true;
+
+	return &Entry;
+}
+
+// When the cache is full, the entry to be replaced is chosen in CLOCK order.
+// New entries are returned as negative entries.
+// Must be called with the lock held.
+HostManager::CacheEntry *HostManager::AllocCacheEntry(const IPAddress &Address, ULONGLONG CurTick)
+{
+	CacheIndex::iterator i = m_CacheIndex.find(Address);
+	if (i != m_CacheIndex.end()) {
+		CacheEntry &Entry = m_CacheList[i->second];
+		if (CurTick >= Entry.ExpireTick)
+			m_Statistics.Expired++;
+		return &Entry;
+	}
+
+	size_t Index;
+
+	if (m_CacheList.size() < m_MaxCacheEntries) {
+		Index = m_CacheList.size();
+		m_CacheList.push_back(CacheEntry());
+		m_CacheList[Index].pRecord = nullptr;
+		m_CacheList[Index].Failures = 0;
+		m_NumNegativeEntries++;
+	} else {
 		while (true) {
-			if (pThis->m_Abort)
-				goto Exit;
+			if (m_CacheHand >= m_CacheList.size())
+				m_CacheHand = 0;
+			CacheEntry &Entry = m_CacheList[m_CacheHand];
+			if ((!Entry.Referenced && (Entry.pRecord == nullptr || !Entry.pRecord->Referenced))
+					|| CurTick >= Entry.ExpireTick)
+				break;
+			Entry.Referenced = false;
+			if (Entry.pRecord != nullptr)
+				Entry.pRecord->Referenced = false;
+			m_CacheHand++;
+		}
+		Index = m_CacheHand++;
+
+		CacheEntry &Entry = m_CacheList[Index];
+		if (CurTick >= Entry.ExpireTick)
+			m_Statistics.Expired++;
+		else
+			m_Statistics.Evicted++;
+		m_CacheIndex.erase(Entry.Address);
+		SetEntryHostName(Entry, nullptr, CurTick);
+		Entry.Failures = 0;
+	}
+
+	CacheEntry &Entry = m_CacheList[Index];
+	Entry.Address = Address;
+	Entry.ExpireTick = CurTick;
+	Entry.Referenced = false;
+	m_CacheIndex.insert(std::pair<IPAddress, size_t>(Address, Index));
+
+	return &Entry;
+}
 
-			pThis->m_Lock.Lock();
-			if (pThis->m_GetHostQueue.empty()) {
-				pThis->m_Lock.Unlock();
+// TTL is in seconds, and is clamped to the range from MIN_HOST_NAME_TTL to m_HostNameTTL.
+// 0 uses m_HostNameTTL.
+// Must be called with the lock held.
+HostManager::CacheEntry *HostManager::StoreHostName(const IPAddress &Address, LPCTSTR pHostName, DWORD TTL)
+{
+	const ULONGLONG CurTick = ::GetTickCount64();
+	CacheEntry *pEntry = AllocCacheEntry(Address, CurTick);
+
+	if (TTL == 0 || TTL > m_HostNameTTL)
+		TTL = m_HostNameTTL;
+	else if (TTL < MIN_HOST_NAME_TTL)
+		TTL = MIN_HOST_NAME_TTL;
+
+	SetEntryHostName(*pEntry, pHostName, CurTick + (ULONGLONG)TTL * 1000);
+	pEntry->Failures = 0;
+
+	return pEntry;
+}
+
+// The negative entry of an address that keeps failing lives twice as long on each failure.
+// Must be called with the lock held.
+HostManager::CacheEntry *HostManager::StoreFailure(const IPAddress &Address)
+{
+	const ULONGLONG CurTick = ::GetTickCount64();
+	CacheEntry *pEntry = AllocCacheEntry(Address, CurTick);
+
+	if (pEntry->pRecord != nullptr)
+		pEntry->Failures = 0;
+	if (pEntry->Failures <= MAX_NEGATIVE_BACKOFF)
+		pEntry->Failures++;
+
+	const ULONGLONG TTL = min((ULONGLONG)NEGATIVE_TTL << (pEntry->Failures - 1),
+							  (ULONGLONG)m_HostNameTTL);
+	SetEntryHostName(*pEntry, nullptr, CurTick + TTL * 1000);
+
+	return pEntry;
+}
+
+// The record of the address in the cache file is copied to the memory cache if it hasn't expired.
+// The file is skipped while FlushCacheWrites() is writing it, rather than waiting for a rebuild.
+// Must be called with the lock held.
+const HostManager::CacheEntry *HostManager::LoadCacheEntry(const IPAddress &Address, ULONGLONG CurTick)
+{
+	HostCacheFile::RecordInfo Info;
+	TCHAR szHostName[NI_MAXHOST];
+
+	if (!m_CacheFileOpen || !m_CacheFileLock.TryLock())
+		return nullptr;
+	const bool Found = m_CacheFile.Lookup(Address, &Info, szHostName, cvLengthOf(szHostName));
+	m_CacheFileLock.Unlock();
+	if (!Found)
+		return nullptr;
+
+	FILETIME CurFileTime;
+	::GetSystemTimeAsFileTime(&CurFileTime);
+	const ULONGLONG CurTime = FileTimeToUInt64(CurFileTime);
+	const ULONGLONG ExpireTime = FileTimeToUInt64(Info.ResolvedTime) + (ULONGLONG)Info.TTL * 10000000;
+	if (ExpireTime <= CurTime)
+		return nullptr;
+
+	CacheEntry *pEntry = AllocCacheEntry(Address, CurTick);
+	// The remaining time is limited to the TTL in case the clock has been set back
+	SetEntryHostName(*pEntry, szHostName[0] != _T('\0') ? szHostName : nullptr,
+					 CurTick + min((ExpireTime - CurTime) / 10000, (ULONGLONG)Info.TTL * 1000));
+	pEntry->Failures = Info.Failures;
+	pEntry->Referenced = true;
+	m_Statistics.FileHits++;
+
+	return pEntry;
+}
+
+// The record is only queued, since writing may rebuild the whole file.
+// FlushCacheWrites() writes it after the lock is released.
+// Must be called with the lock held.
+void HostManager::WriteCacheEntry(const CacheEntry &Entry)
+{
+	if (!m_CacheFileOpen)
+		return;
+
+	const ULONGLONG CurTick = ::GetTickCount64();
+	CacheWrite Write;
+
+	Write.Address = Entry.Address;
+	::GetSystemTimeAsFileTime(&Write.Info.ResolvedTime);
+	Write.Info.TTL = Entry.ExpireTick > CurTick ? (DWORD)((Entry.ExpireTick - CurTick) / 1000) : 0;
+	Write.Info.Failures = Entry.Failures;
+	LPCTSTR pHostName = Entry.GetHostName();
+	if (pHostName != nullptr) {
+		Write.NameOffset = m_CacheWriteNames.size();
+		m_CacheWriteNames.insert(m_CacheWriteNames.end(), pHostName, pHostName + ::lstrlen(pHostName) + 1);
+	} else {
+		Write.NameOffset = NO_NAME;
+	}
+	m_CacheWriteList.push_back(Write);
+}
+
+// The file lock is held across the writes, so the records are written in the order they were queued.
+// Must be called without the lock held.
+void HostManager::FlushCacheWrites()
+{
+	std::vector<CacheWrite> WriteList;
+	std::vector<TCHAR> Names;
+
+	BlockLock FileLock(m_CacheFileLock);
+
+	m_Lock.Lock();
+	WriteList.swap(m_CacheWriteList);
+	Names.swap(m_CacheWriteNames);
+	m_Lock.Unlock();
+
+	for (std::vector<CacheWrite>::const_iterator i = WriteList.begin(); i != WriteList.end(); ++i) {
+		m_CacheFile.Write(i->Address, i->Info,
+						  i->NameOffset != NO_NAME ? &Names[i->NameOffset] : nullptr);
+	}
+}
+
+// The records of a cache file in use by another instance, see OpenCacheFile()
+void HostManager::OnRecord(const IPAddress &Address, const HostCacheFile::RecordInfo &Info, LPCTSTR pHostName)
+{
+	if (pHostName == nullptr)
+		return;
+
+	FILETIME CurFileTime;
+	::GetSystemTimeAsFileTime(&CurFileTime);
+	const ULONGLONG CurTime = FileTimeToUInt64(CurFileTime);
+	const ULONGLONG ExpireTime = FileTimeToUInt64(Info.ResolvedTime) + (ULONGLONG)Info.TTL * 10000000;
+	if (ExpireTime <= CurTime + 10000000)
+		return;
+
+	BlockLock Lock(m_Lock);
+	StoreHostName(Address, pHostName, (DWORD)min((ExpireTime - CurTime) / 10000000, (ULONGLONG)Info.TTL));
+}
+
+// No reader may be running
+void HostManager::ClearCache()
+{
+	for (CacheList::iterator i = m_CacheList.begin(); i != m_CacheList.end(); i++)
+		delete [] reinterpret_cast<BYTE*>(i->pRecord);
+	m_CacheList.clear();
+	m_CacheIndex.clear();
+	m_CacheHand = 0;
+	m_NumNegativeEntries = 0;
+
+	delete [] reinterpret_cast<BYTE*>(m_pReadTable);
+	m_pReadTable = nullptr;
+	for (std::vector<BYTE*>::iterator i = m_RetiredList.begin(); i != m_RetiredList.end(); i++)
+		delete [] *i;
+	m_RetiredList.clear();
+}
+
+// The record of the entry is replaced rather than modified, and the replaced record
+// is freed by Quiesce(), since FindHostName() may be reading it.
+// Must be called with the lock held.
+void HostManager::SetEntryHostName(CacheEntry &Entry, LPCTSTR pHostName, ULONGLONG ExpireTick)
+{
+	HostRecord *pOldRecord = Entry.pRecord;
+	HostRecord *pNewRecord = nullptr;
+
+	if (pHostName != nullptr) {
+		const int Length = ::lstrlen(pHostName);
+		pNewRecord = reinterpret_cast<HostRecord*>(new BYTE[sizeof(HostRecord) + Length * sizeof(TCHAR)]);
+		pNewRecord->Address = Entry.Address;
+		pNewRecord->ExpireTick = ExpireTick;
+		pNewRecord->Referenced = false;
+		::CopyMemory(pNewRecord->szHostName, pHostName, (Length + 1) * sizeof(TCHAR));
+	}
+
+	Entry.pRecord = pNewRecord;
+	Entry.ExpireTick = ExpireTick;
+	if (pOldRecord == nullptr && pNewRecord != nullptr)
+		m_NumNegativeEntries--;
+	else if (pOldRecord != nullptr && pNewRecord == nullptr)
+		m_NumNegativeEntries++;
+
+	if (pOldRecord == nullptr && pNewRecord == nullptr)
+		return;
+
+	ReadTable *pTable = m_pReadTable;
+	if (pTable == nullptr || (pTable->NumUsed + 1) * 4 > (pTable->Mask + 1) * 3) {
+		RebuildReadTable();
+	} else {
+		const size_t Mask = pTable->Mask;
+		size_t Pos = AddressHash()(Entry.Address) & Mask;
+		HostRecord * volatile *pTarget = nullptr;
+
+		for (size_t i = 0; i <= Mask; i++, Pos = (Pos + 1) & Mask) {
+			HostRecord *pRecord = pTable->SlotList[Pos];
+
+			if (pOldRecord != nullptr) {
+				if (pRecord == pOldRecord) {
+					pTarget = &pTable->SlotList[Pos];
+					break;
+				}
+			} else if (pRecord == nullptr || pRecord == &m_Tombstone) {
+				pTarget = &pTable->SlotList[Pos];
+				if (pRecord == nullptr)
+					pTable->NumUsed++;
 				break;
 			}
-			Request *pRequest = pThis->m_GetHostQueue.front();
-			pThis->m_GetHostQueue.pop_front();
-			pThis->m_Lock.Unlock();
+		}
 
-			sockaddr_in Addr4;
-			sockaddr_in6 Addr6;
-			SOCKADDR *pSockAddr;
-			socklen_t SockAddrSize;
-			const IPAddress &Address = pRequest->GetAddress();
-			if (Address.Type == IP_ADDRESS_V4) {
-				Addr4.sin_family = AF_INET;
-				Addr4.sin_port = ::htons(pRequest->GetPort());
-				Addr4.sin_addr.s_addr = Address.V4.Address;
-				pSockAddr = reinterpret_cast<SOCKADDR*>(&Addr4);
-				SockAddrSize = sizeof(Addr4);
-			} else if (Address.Type == IP_ADDRESS_V6) {
-				Addr6.sin6_family = AF_INET6;
-				Addr6.sin6_port = ::htons(pRequest->GetPort());
-				Addr6.sin6_flowinfo = 0;
-				::memcpy(Addr6.sin6_addr.u.Byte, Address.V6.Bytes, 16);
-				Addr6.sin6_scope_id = Address.V6.ScopeID;
-				pSockAddr = reinterpret_cast<SOCKADDR*>(&Addr6);
-				SockAddrSize = sizeof(Addr6);
-			} else {
-#ifdef _DEBUG
-				::DebugBreak();
-#endif
-				delete pRequest;
-				continue;
-			}
-			TCHAR szHostName[NI_MAXHOST];
-			if (::GetNameInfo(pSockAddr, SockAddrSize,
-							  szHostName, cvLengthOf(szHostName),
-							  nullptr, 0, 0) == 0) {
-				pThis->m_Lock.Lock();
-				pThis->m_HostMap.insert(
-					std::pair<IPAddress, HostInfo>(pRequest->GetAddress(), HostInfo(szHostName)));
-				pThis->m_Lock.Unlock();
-				pRequest->OnHostFound(szHostName);
+		// The old record should always be in the table, but it is rebuilt rather than
+		// writing through a slot that was not found
+		if (pTarget != nullptr)
+			::InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(pTarget),
+										 pNewRecord != nullptr ? pNewRecord : &m_Tombstone);
+		else
+			RebuildReadTable();
+	}
+
+	if (pOldRecord != nullptr)
+		m_RetiredList.push_back(reinterpret_cast<BYTE*>(pOldRecord));
+}
+
+// The table is sized so that it stays at most half full until the cache grows.
+// Must be called with the lock held.
+void HostManager::RebuildReadTable()
+{
+	size_t NumSlots = 64;
+	while (NumSlots < m_MaxCacheEntries * 2)
+		NumSlots <<= 1;
+
+	ReadTable *pTable = reinterpret_cast<ReadTable*>(
+		new BYTE[sizeof(ReadTable) + (NumSlots - 1) * sizeof(HostRecord*)]);
+	pTable->Mask = NumSlots - 1;
+	pTable->NumUsed = 0;
+	for (size_t i = 0; i < NumSlots; i++)
+		pTable->SlotList[i] = nullptr;
+
+	for (CacheList::const_iterator i = m_CacheList.begin(); i != m_CacheList.end(); i++) {
+		if (i->pRecord != nullptr) {
+			size_t Pos = AddressHash()(i->Address) & pTable->Mask;
+			while (pTable->SlotList[Pos] != nullptr)
+				Pos = (Pos + 1) & pTable->Mask;
+			pTable->SlotList[Pos] = i->pRecord;
+			pTable->NumUsed++;
+		}
+	}
+
+	ReadTable *pOldTable = m_pReadTable;
+	::InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(&m_pReadTable), pTable);
+	if (pOldTable != nullptr)
+		m_RetiredList.push_back(reinterpret_cast<BYTE*>(pOldTable));
+}
+
+// Must be called with the lock held
+bool HostManager::QueueRequest(const QueuedRequest &Queued, RequestPriority Priority)
+{
+	if (m_Semaphore == nullptr) {
+		m_Semaphore = ::CreateSemaphore(nullptr, 0, MAXLONG, nullptr);
+		if (m_Semaphore == nullptr)
+			return false;
+	}
+
+	if (m_ThreadList.empty())
+		m_Abort = false;
+	if (m_IdleThreads < (int)GetQueueLength() + 1
+			&& (int)m_ThreadList.size() < m_MaxThreads)
+		AddThread();
+	if (m_ThreadList.empty())
+		return false;
+
+	m_GetHostQueue[Priority].push_back(Queued);
+	::ReleaseSemaphore(m_Semaphore, 1, nullptr);
+
+	return true;
+}
+
+// A queued request is moved to the queue of the new priority.
+// Must be called with the lock held.
+void HostManager::PromoteRequest(const IPAddress &Address, PendingInfo &Pending,
+								 RequestPriority Priority, ULONGLONG CurTick)
+{
+	if (Priority == PRIORITY_VISIBLE && Pending.VisibleTick == 0)
+		Pending.VisibleTick = CurTick;
+
+	if (!Pending.InFlight) {
+		GetHostQueue &Queue = m_GetHostQueue[Pending.Priority];
+
+		for (GetHostQueue::iterator i = Queue.begin(); i != Queue.end(); i++) {
+			if (i->pRequest->GetAddress() == Address) {
+				m_GetHostQueue[Priority].push_back(*i);
+				Queue.erase(i);
+				m_Statistics.Promoted++;
+				break;
 			}
-			delete pRequest;
 		}
 	}
 
-Exit:
+	Pending.Priority = Priority;
+}
 
-	return 0;
+// Must be called with the lock held
+size_t HostManager::GetQueueLength() const
+{
+	size_t Length = 0;
+
+	for (int i = 0; i < NUM_PRIORITIES; i++)
+		Length += m_GetHostQueue[i].size();
+
+	return Length;
 }
 
+// Lookups in flight for longer than the timeout get a negative entry, so the address isn't
+// requested again while the lookup may still be stuck. See OnResolved() for the late results.
+// Must be called with the lock held.
+void HostManager::ExpireInFlight(ULONGLONG CurTick)
+{
+	if (m_ResolveTimeout == 0)
+		return;
 
-HostManager::HostInfo::HostInfo(LPCTSTR pHostName)
-	: m_pHostName(DuplicateString(pHostName))
+	for (PendingMap::iterator i = m_PendingMap.begin(); i != m_PendingMap.end();) {
+		if (i->second.InFlight && CurTick - i->second.QueuedTick >= m_ResolveTimeout) {
+			StoreFailure(i->first);
+			m_Statistics.TimedOut++;
+			i = m_PendingMap.erase(i);
+		} else {
+			i++;
+		}
+	}
+}
+
+bool HostManager::AddThread()
 {
+	HANDLE hThread = ::CreateThread(nullptr, 0, ThreadProc, this, 0, nullptr);
+	if (hThread == nullptr)
+		return false;
+
+	m_ThreadList.push_back(hThread);
+	m_IdleThreads++;
+
+	return true;
 }
 
-HostManager::HostInfo::HostInfo(const HostInfo &Src)
-	: m_pHostName(DuplicateString(Src.m_pHostName))
+void HostManager::ResolveRequest(const QueuedRequest &Queued)
 {
+	const Request *pRequest = Queued.pRequest;
+	sockaddr_in Addr4;
+	sockaddr_in6 Addr6;
+	SOCKADDR *pSockAddr;
+	socklen_t SockAddrSize;
+	const IPAddress &Address = pRequest->GetAddress();
+	if (Address.Type == IP_ADDRESS_V4) {
+		Addr4.sin_family = AF_INET;
+		Addr4.sin_port = ::htons(pRequest->GetPort());
+		Addr4.sin_addr.s_addr = Address.V4.Address;
+		pSockAddr = reinterpret_cast<SOCKADDR*>(&Addr4);
+		SockAddrSize = sizeof(Addr4);
+	} else if (Address.Type == IP_ADDRESS_V6) {
+		Addr6.sin6_family = AF_INET6;
+		Addr6.sin6_port = ::htons(pRequest->GetPort());
+		Addr6.sin6_flowinfo = 0;
+		::memcpy(Addr6.sin6_addr.u.Byte, Address.V6.Bytes, 16);
+		Addr6.sin6_scope_id = Address.V6.ScopeID;
+		pSockAddr = reinterpret_cast<SOCKADDR*>(&Addr6);
+		SockAddrSize = sizeof(Addr6);
+	} else {
+#ifdef _DEBUG
+		::DebugBreak();
+#endif
+		BlockLock Lock(m_Lock);
+		m_PendingMap.erase(Address);
+		m_NumInFlight--;
+		return;
+	}
+
+	const ULONGLONG StartTick = ::GetTickCount64();
+	TCHAR szHostName[NI_MAXHOST];
+	const bool Found = ::GetNameInfo(pSockAddr, SockAddrSize,
+									 szHostName, cvLengthOf(szHostName),
+									 nullptr, 0, 0) == 0;
+
+	OnResolved(Queued, Found ? szHostName : nullptr, 0, ::GetTickCount64() - StartTick);
 }
 
-HostManager::HostInfo::~HostInfo()
+void HostManager::OnResolved(const QueuedRequest &Queued, LPCTSTR pHostName, DWORD TTL,
+							 ULONGLONG Latency)
 {
-	delete [] m_pHostName;
+	const IPAddress &Address = Queued.pRequest->GetAddress();
+
+	m_Lock.Lock();
+	const ULONGLONG CurTick = ::GetTickCount64();
+	PendingMap::iterator itPending = m_PendingMap.find(Address);
+	// The address may have been requested again after this request timed out
+	if (itPending != m_PendingMap.end() && itPending->second.QueuedTick != Queued.QueuedTick)
+		itPending = m_PendingMap.end();
+	const bool Pending = itPending != m_PendingMap.end();
+	m_Statistics.LatencyHistogram[GetLatencyClass(Latency)]++;
+	if (m_ResolveTimeout != 0 && CurTick - Queued.QueuedTick >= m_ResolveTimeout) {
+		// Finished as timed out here, unless ExpireInFlight() already has.
+		// A late name is still cached, but it isn't passed to the request.
+		if (Pending)
+			m_Statistics.TimedOut++;
+		if (pHostName != nullptr)
+			WriteCacheEntry(*StoreHostName(Address, pHostName, TTL));
+		else if (Pending)
+			StoreFailure(Address);
+		pHostName = nullptr;
+	} else if (pHostName != nullptr) {
+		WriteCacheEntry(*StoreHostName(Address, pHostName, TTL));
+		m_Statistics.Resolved++;
+		// Time until the name of a visible row is shown
+		if (Pending && itPending->second.VisibleTick != 0)
+			m_Statistics.VisibleLatencyHistogram[GetLatencyClass(CurTick - itPending->second.VisibleTick)]++;
+	} else {
+		WriteCacheEntry(*StoreFailure(Address));
+		m_Statistics.Failed++;
+	}
+	if (Pending)
+		m_PendingMap.erase(itPending);
+	m_NumInFlight--;
+	m_Lock.Unlock();
+
+	FlushCacheWrites();
+
+	if (pHostName != nullptr)
+		Queued.pRequest->OnHostFound(pHostName);
 }
 
-HostManager::HostInfo &HostManager::HostInfo::operator=(const HostInfo &Src)
+void HostManager::OnQueryComplete(void *pParam, LPCTSTR pHostName, DWORD TTL)
 {
-	if (this != &Src) {
-		delete [] m_pHostName;
-		m_pHostName = DuplicateString(Src.m_pHostName);
+	QueuedRequest *pQueued = static_cast<QueuedRequest*>(pParam);
+
+	OnResolved(*pQueued, pHostName, TTL, ::GetTickCount64() - pQueued->QueuedTick);
+	delete pQueued->pRequest;
+	delete pQueued;
+}
+
+void HostManager::OnQueryFallback(void *pParam)
+{
+	QueuedRequest *pQueued = static_cast<QueuedRequest*>(pParam);
+
+	m_Lock.Lock();
+	m_NumInFlight--;
+	m_Statistics.Fallback++;
+	PendingMap::iterator itPending = m_PendingMap.find(pQueued->pRequest->GetAddress());
+	// Not requeued if the request has timed out
+	if (itPending != m_PendingMap.end() && itPending->second.QueuedTick != pQueued->QueuedTick)
+		itPending = m_PendingMap.end();
+	if (itPending == m_PendingMap.end()
+			|| !QueueRequest(*pQueued, itPending->second.Priority)) {
+		if (itPending != m_PendingMap.end())
+			m_PendingMap.erase(itPending);
+		delete pQueued->pRequest;
+	} else {
+		itPending->second.InFlight = false;
+	}
+	m_Lock.Unlock();
+
+	delete pQueued;
+}
+
+void HostManager::OnQueryCancelled(void *pParam)
+{
+	QueuedRequest *pQueued = static_cast<QueuedRequest*>(pParam);
+
+	m_Lock.Lock();
+	PendingMap::iterator itPending = m_PendingMap.find(pQueued->pRequest->GetAddress());
+	if (itPending != m_PendingMap.end() && itPending->second.QueuedTick == pQueued->QueuedTick)
+		m_PendingMap.erase(itPending);
+	m_NumInFlight--;
+	m_Lock.Unlock();
+
+	delete pQueued->pRequest;
+	delete pQueued;
+}
+
+DWORD WINAPI HostManager::ThreadProc(LPVOID pParameter)
+{
+	HostManager *pThis = static_cast<HostManager*>(pParameter);
+
+	while (true) {
+		::WaitForSingleObject(pThis->m_Semaphore, INFINITE);
+		if (pThis->m_Abort)
+			break;
+
+		pThis->m_Lock.Lock();
+		int Priority = 0;
+		while (Priority < NUM_PRIORITIES && pThis->m_GetHostQueue[Priority].empty())
+			Priority++;
+		if (Priority == NUM_PRIORITIES) {
+			pThis->m_Lock.Unlock();
+			continue;
+		}
+		GetHostQueue &Queue = pThis->m_GetHostQueue[Priority];
+		const QueuedRequest Queued = Queue.front();
+		Queue.pop_front();
+
+		// Requests that nobody has made again for a while are for closed connections
+		const ULONGLONG CurTick = ::GetTickCount64();
+		PendingMap::iterator itPending = pThis->m_PendingMap.find(Queued.pRequest->GetAddress());
+		bool Drop = true;
+		if (pThis->m_ResolveTimeout != 0
+				&& CurTick - Queued.QueuedTick >= pThis->m_ResolveTimeout) {
+			pThis->m_Statistics.TimedOut++;
+		} else if (itPending == pThis->m_PendingMap.end()
+				|| CurTick - itPending->second.RequestedTick >= STALE_REQUEST_AGE) {
+			pThis->m_Statistics.Cancelled++;
+		} else {
+			itPending->second.InFlight = true;
+			pThis->m_NumInFlight++;
+			Drop = false;
+		}
+		if (Drop && itPending != pThis->m_PendingMap.end())
+			pThis->m_PendingMap.erase(itPending);
+		pThis->m_IdleThreads--;
+		pThis->m_Lock.Unlock();
+
+		if (!Drop)
+			pThis->ResolveRequest(Queued);
+		delete Queued.pRequest;
+
+		pThis->m_Lock.Lock();
+		pThis->m_IdleThreads++;
+		pThis->m_Lock.Unlock();
+	}
+
+	return 0;
+}
+
+
+size_t HostManager::AddressHash::operator()(const IPAddress &Address) const
+{
+	UINT Hash = 2166136261U;
+
+	if (Address.Type == IP_ADDRESS_V4) {
+		Hash = (Hash ^ Address.V4.Address) * 16777619U;
+	} else {
+		for (int i = 0; i < 4; i++)
+			Hash = (Hash ^ Address.V6.DWords[i]) * 16777619U;
+		Hash = (Hash ^ Address.V6.ScopeID) * 16777619U;
 	}
-	return *this;
+
+	return Hash;
 }
 
 }	// namespace CV
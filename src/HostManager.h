@@ -28,8 +28,11 @@
 #define CV_HOST_MANAGER_H
 
 
-#include <map>
 #include <deque>
+#include <vector>
+#include <unordered_map>
+#include "DnsResolver.h"
+#include "HostCacheFile.h"
 #include "Utility.h"
 
 
@@ -37,14 +40,25 @@ namespace CV
 {
 
 class HostManager
+	: protected DnsResolver::EventHandler
+	, protected HostCacheFile::RecordEnumerator
 {
 public:
+	enum RequestPriority
+	{
+		PRIORITY_VISIBLE,
+		PRIORITY_ACTIVE,
+		PRIORITY_HISTORY,
+		NUM_PRIORITIES
+	};
+
 	cvAbstractClass(Request)
 	{
 public:
-		Request(const IPAddress & Address, WORD Port)
+		Request(const IPAddress & Address, WORD Port, RequestPriority Priority = PRIORITY_ACTIVE)
 			: m_Address(Address)
 			, m_Port(Port)
+			, m_Priority(Priority)
 		{
 		}
 		virtual ~Request() {}
@@ -59,10 +73,70 @@ public:
 		virtual void OnHostFound(LPCTSTR pHostName) {};
 		const IPAddress &GetAddress() const { return m_Address; }
 		const WORD GetPort() const { return m_Port; }
+		RequestPriority GetPriority() const { return m_Priority; }
 
 protected:
 		IPAddress m_Address;
 		WORD m_Port;
+		RequestPriority m_Priority;
+	};
+
+	cvAbstractClass(HostNameEnumerator)
+	{
+public:
+		virtual ~HostNameEnumerator() {}
+		virtual void OnHostName(const IPAddress &Address, LPCTSTR pHostName) = 0;
+	};
+
+	class AddressHash
+	{
+	public:
+		size_t operator()(const IPAddress &Address) const;
+	};
+
+	enum
+	{
+		LATENCY_CLASS_10MSEC,
+		LATENCY_CLASS_100MSEC,
+		LATENCY_CLASS_1SEC,
+		LATENCY_CLASS_10SEC,
+		LATENCY_CLASS_LONG,
+		NUM_LATENCY_CLASSES
+	};
+
+	struct ResolverStatistics
+	{
+		size_t QueueLength;
+		size_t InFlight;
+		int NumThreads;
+		ULONGLONG Resolved;
+		ULONGLONG Failed;
+		ULONGLONG TimedOut;
+		ULONGLONG Deferred;
+		ULONGLONG Fallback;
+		ULONGLONG LatencyHistogram[NUM_LATENCY_CLASSES];
+		size_t CacheEntries;
+		size_t NegativeEntries;
+		ULONGLONG Evicted;
+		ULONGLONG Expired;
+		ULONGLONG NegativeHits;
+		ULONGLONG FileHits;
+		ULONGLONG Cancelled;
+		ULONGLONG Promoted;
+		ULONGLONG VisibleLatencyHistogram[NUM_LATENCY_CLASSES];
+	};
+
+	enum
+	{
+		MAX_RESOLVER_THREADS		= 32,
+		DEFAULT_RESOLVER_THREADS	= 4,
+		MIN_CACHE_ENTRIES			= 256,
+		DEFAULT_CACHE_ENTRIES		= 16384,
+		MIN_HOST_NAME_TTL			= 60,
+		DEFAULT_HOST_NAME_TTL		= 60 * 60,
+		NEGATIVE_TTL				= 30,
+		MAX_NEGATIVE_BACKOFF		= 6,
+		STALE_REQUEST_AGE			= 30 * 1000
 	};
 
 	HostManager();
@@ -71,32 +145,142 @@ protected:
 	void EndThread();
 	bool GetHostName(Request *pRequest);
 	bool GetHostName(const IPAddress &Address, LPTSTR pHostName, int MaxLength) const;
+	LPCTSTR FindHostName(const IPAddress &Address) const;
+	void Quiesce();
+	void EnumHostNames(HostNameEnumerator *pEnumerator) const;
+	bool AddHostName(const IPAddress &Address, LPCTSTR pHostName);
+	void SetResolverThreads(int Threads);
+	void SetAdmissionBudget(int Budget);
+	void SetResolveTimeout(DWORD Timeout);
+	void SetAsyncResolver(bool Enable, LPCTSTR pServers = nullptr);
+	void SetCacheSize(size_t MaxEntries);
+	void SetHostNameTTL(DWORD TTL);
+	bool OpenCacheFile(LPCTSTR pFileName);
+	void CloseCacheFile();
+	void BeginAdmission();
+	void GetResolverStatistics(ResolverStatistics *pStatistics) const;
 
 private:
-	static DWORD WINAPI ThreadProc(LPVOID pParameter);
+	struct QueuedRequest
+	{
+		Request *pRequest;
+		ULONGLONG QueuedTick;
+	};
 
-	class HostInfo
+	// VisibleTick is when the address was first requested for a visible row, 0 if it hasn't been.
+	// QueuedTick is the same as that of the QueuedRequest, and tells it from a later request.
+	struct PendingInfo
 	{
-	public:
-		HostInfo(LPCTSTR pHostName);
-		HostInfo(const HostInfo &Src);
-		~HostInfo();
-		HostInfo &operator=(const HostInfo &Src);
-		LPCTSTR GetHostName() const { return m_pHostName; }
-
-	private:
-		LPTSTR m_pHostName;
+		RequestPriority Priority;
+		bool InFlight;
+		ULONGLONG QueuedTick;
+		ULONGLONG RequestedTick;
+		ULONGLONG VisibleTick;
+	};
+
+	// Published to FindHostName(), and not modified after that except for Referenced
+	struct HostRecord
+	{
+		IPAddress Address;
+		ULONGLONG ExpireTick;
+		mutable volatile bool Referenced;
+		TCHAR szHostName[1];
 	};
 
-	typedef std::map<IPAddress, HostInfo> HostMap;
-	typedef std::deque<Request*> GetHostQueue;
+	// Open addressing with linear probing, removed records are replaced with m_Tombstone
+	struct ReadTable
+	{
+		size_t Mask;
+		size_t NumUsed;
+		HostRecord * volatile SlotList[1];
+	};
+
+	// pRecord is nullptr for the negative entries of failed lookups
+	struct CacheEntry
+	{
+		IPAddress Address;
+		HostRecord *pRecord;
+		ULONGLONG ExpireTick;
+		unsigned int Failures;
+		mutable bool Referenced;
+
+		LPCTSTR GetHostName() const { return pRecord != nullptr ? pRecord->szHostName : nullptr; }
+	};
+
+	// NameOffset is the position of the name in m_CacheWriteNames, or NO_NAME for failures
+	struct CacheWrite
+	{
+		IPAddress Address;
+		HostCacheFile::RecordInfo Info;
+		size_t NameOffset;
+	};
+	static const size_t NO_NAME = (size_t)-1;
+
+	const CacheEntry *LookupCache(const IPAddress &Address, ULONGLONG CurTick) const;
+	CacheEntry *AllocCacheEntry(const IPAddress &Address, ULONGLONG CurTick);
+	CacheEntry *StoreHostName(const IPAddress &Address, LPCTSTR pHostName, DWORD TTL);
+	CacheEntry *StoreFailure(const IPAddress &Address);
+	const CacheEntry *LoadCacheEntry(const IPAddress &Address, ULONGLONG CurTick);
+	void WriteCacheEntry(const CacheEntry &Entry);
+	void FlushCacheWrites();
+	void ClearCache();
+	void SetEntryHostName(CacheEntry &Entry, LPCTSTR pHostName, ULONGLONG ExpireTick);
+	void RebuildReadTable();
+	bool AddThread();
+	bool QueueRequest(const QueuedRequest &Queued, RequestPriority Priority);
+	void PromoteRequest(const IPAddress &Address, PendingInfo &Pending,
+						RequestPriority Priority, ULONGLONG CurTick);
+	size_t GetQueueLength() const;
+	void ExpireInFlight(ULONGLONG CurTick);
+	void ResolveRequest(const QueuedRequest &Queued);
+	void OnResolved(const QueuedRequest &Queued, LPCTSTR pHostName, DWORD TTL, ULONGLONG Latency);
+
+// DnsResolver::EventHandler
+	void OnQueryComplete(void *pParam, LPCTSTR pHostName, DWORD TTL) override;
+	void OnQueryFallback(void *pParam) override;
+	void OnQueryCancelled(void *pParam) override;
+
+// HostCacheFile::RecordEnumerator
+	void OnRecord(const IPAddress &Address, const HostCacheFile::RecordInfo &Info, LPCTSTR pHostName) override;
+
+	static DWORD WINAPI ThreadProc(LPVOID pParameter);
+
+	typedef std::vector<CacheEntry> CacheList;
+	typedef std::unordered_map<IPAddress, size_t, AddressHash> CacheIndex;
+	typedef std::deque<QueuedRequest> GetHostQueue;
+	typedef std::unordered_map<IPAddress, PendingInfo, AddressHash> PendingMap;
 
-	HANDLE m_Thread;
-	HANDLE m_Event;
+	std::vector<HANDLE> m_ThreadList;
+	HANDLE m_Semaphore;
 	volatile bool m_Abort;
 	mutable LocalLock m_Lock;
-	HostMap m_HostMap;
-	GetHostQueue m_GetHostQueue;
+	CacheList m_CacheList;
+	CacheIndex m_CacheIndex;
+	size_t m_CacheHand;
+	size_t m_MaxCacheEntries;
+	DWORD m_HostNameTTL;
+	size_t m_NumNegativeEntries;
+	ReadTable * volatile m_pReadTable;
+	std::vector<BYTE*> m_RetiredList;
+	static HostRecord m_Tombstone;
+	HostCacheFile m_CacheFile;
+	mutable LocalLock m_CacheFileLock;
+	bool m_CacheFileOpen;
+	std::vector<CacheWrite> m_CacheWriteList;
+	std::vector<TCHAR> m_CacheWriteNames;
+	GetHostQueue m_GetHostQueue[NUM_PRIORITIES];
+	PendingMap m_PendingMap;
+	int m_MaxThreads;
+	int m_IdleThreads;
+	size_t m_NumInFlight;
+	int m_AdmissionBudget;
+	int m_RemainingBudget;
+	DWORD m_ResolveTimeout;
+	ResolverStatistics m_Statistics;
+	DnsResolver m_DnsResolver;
+	bool m_UseAsyncResolver;
+	IPAddress m_AsyncServerList[DnsResolver::MAX_SERVERS];
+	int m_NumAsyncServers;
 };
 
 }	// namespace CV
@@ -957,6 +957,8 @@ void ListView::Scroll(int XOffset, int YOffset)
 						 &rc, &rc, nullptr, nullptr, SW_INVALIDATE);
 	}
 	SetScrollBar();
+	if (YOffset != 0 && m_pEventHandler != nullptr)
+		m_pEventHandler->OnScrolled(this);
 }
 
 void ListView::SetScrollBar()
@@ -1137,6 +1139,24 @@ void ListView::RedrawItem(int Index) const
 	}
 }
 
+// Last is the index after the last row that is at least partly shown
+void ListView::GetVisibleItemRange(int *pFirst, int *pLast) const
+{
+	int First = m_ScrollTop, Last = m_ScrollTop;
+
+	if (m_Handle != nullptr && m_ItemHeight > 0) {
+		RECT rc;
+
+		::GetClientRect(m_Handle, &rc);
+		if (rc.bottom > m_HeaderHeight)
+			Last += (rc.bottom - m_HeaderHeight + m_ItemHeight - 1) / m_ItemHeight;
+	}
+
+	const int ItemCount = NumItems();
+	*pFirst = min(First, ItemCount);
+	*pLast = min(Last, ItemCount);
+}
+
 void ListView::RedrawHeader() const
 {
 	RECT rc;
@@ -75,6 +75,7 @@ public:
 		virtual void OnHeaderRButtonDown(ListView *pListView, int x, int y) {}
 		virtual void OnHeaderRButtonUp(ListView *pListView, int x, int y) {}
 		virtual void OnSelChanged(ListView *pListView) {}
+		virtual void OnScrolled(ListView *pListView) {}
 	};
 
 	static bool Initialize();
@@ -113,6 +114,7 @@ public:
 	void GetItemRect(int Index, RECT *pRect) const;
 	void GetSubItemRect(int Index, int Column, RECT *pRect) const;
 	void RedrawItem(int Index) const;
+	void GetVisibleItemRange(int *pFirst, int *pLast) const;
 
 protected:
 	enum { MAX_ITEM_TEXT = 256 };
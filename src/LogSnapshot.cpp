@@ -0,0 +1,636 @@
+/******************************************************************************
+*                                                                             *
+*    LogSnapshot.cpp                        Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "ConnectionViewer.h"
+#include <vector>
+#include <unordered_map>
+#include "LogSnapshot.h"
+#include "StringPool.h"
+#include "Utility.h"
+
+
+namespace CV
+{
+
+enum
+{
+	SNAPSHOT_SIGNATURE	= 0x534C5643,	// "CVLS"
+	SNAPSHOT_VERSION	= 2
+};
+
+static const UINT SNAPSHOT_NO_STRING = 0xFFFFFFFFU;
+
+struct SnapshotHeader
+{
+	DWORD Signature;
+	DWORD Version;
+	DWORD HeaderSize;
+	DWORD ItemSize;
+	DWORD HostSize;
+	DWORD CharSize;
+	ULONGLONG FileSize;
+	FILETIME SavedTime;
+	ULONGLONG NumItems;
+	ULONGLONG ItemOffset;
+	ULONGLONG NumHosts;
+	ULONGLONG HostOffset;
+	ULONGLONG NumStrings;
+	ULONGLONG StringIndexOffset;
+	ULONGLONG StringDataOffset;
+	ULONGLONG StringDataLength;
+};
+
+struct SnapshotItem
+{
+	ULONGLONG ID;
+	FILETIME CreatedTime;
+	FILETIME UpdatedTime;
+	ULONGLONG Duration;
+	LONGLONG ConnectionCreateOffset;
+	ConnectionInfo Info;
+	ConnectionStatistics Statistics;
+	LONGLONG MaxInBitsPerSecond;
+	LONGLONG MaxOutBitsPerSecond;
+	UINT ProcessName;
+	UINT ProcessPath;
+	UINT RemoteHostName;
+	UINT CountryCode2;
+	UINT CountryCode3;
+	UINT CountryName;
+	UINT Region;
+	UINT City;
+	float Latitude;
+	float Longitude;
+	UINT ASNumber;
+	UINT ASOrganization;
+	UINT NumConnections;
+	UINT DurationHistogram[ConnectionLog::NUM_DURATION_CLASSES];
+	BYTE EnableStatistics;
+	BYTE EnableCityInfo;
+	BYTE EnableLocation;
+	BYTE Reserved;
+};
+
+struct SnapshotHost
+{
+	IPAddress Address;
+	UINT HostName;
+};
+
+struct SnapshotString
+{
+	UINT Offset;
+	UINT Length;
+};
+
+
+class SnapshotStringTable
+{
+public:
+	UINT Add(LPCTSTR pString)
+	{
+		if (pString == nullptr)
+			return SNAPSHOT_NO_STRING;
+
+		// Pool handles are numbered from 1 in the order of addition
+		const StringPool::Handle String = m_Pool.Add(pString);
+		if (String > m_Index.size()) {
+			SnapshotString Info;
+			Info.Offset = (UINT)m_Data.size();
+			Info.Length = m_Pool.GetLength(String);
+			pString = m_Pool.Get(String);
+			m_Data.insert(m_Data.end(), pString, pString + Info.Length + 1);
+			m_Index.push_back(Info);
+		}
+		return String - 1;
+	}
+
+	const std::vector<SnapshotString> &GetIndex() const { return m_Index; }
+	const std::vector<TCHAR> &GetData() const { return m_Data; }
+
+private:
+	StringPool m_Pool;
+	std::vector<SnapshotString> m_Index;
+	std::vector<TCHAR> m_Data;
+};
+
+class SnapshotHostCollector : public HostManager::HostNameEnumerator
+{
+public:
+	SnapshotHostCollector(SnapshotStringTable &StringTable, std::vector<SnapshotHost> &HostList)
+		: m_StringTable(StringTable)
+		, m_HostList(HostList)
+	{
+	}
+
+	void OnHostName(const IPAddress &Address, LPCTSTR pHostName) override
+	{
+		SnapshotHost Host;
+
+		::ZeroMemory(&Host, sizeof(Host));
+		Host.Address = Address;
+		Host.HostName = m_StringTable.Add(pHostName);
+		m_HostList.push_back(Host);
+	}
+
+private:
+	SnapshotStringTable &m_StringTable;
+	std::vector<SnapshotHost> &m_HostList;
+};
+
+static bool WriteData(HANDLE hFile, const void *pData, size_t Size)
+{
+	const BYTE *p = static_cast<const BYTE*>(pData);
+
+	while (Size > 0) {
+		const DWORD WriteSize = (DWORD)min(Size, (size_t)(64 * 1024 * 1024));
+		DWORD Wrote;
+
+		if (!::WriteFile(hFile, p, WriteSize, &Wrote, nullptr) || Wrote != WriteSize)
+			return false;
+		p += WriteSize;
+		Size -= WriteSize;
+	}
+
+	return true;
+}
+
+struct SnapshotColdBlock
+{
+	size_t NumItems;
+	std::vector<BYTE> Data;
+};
+
+// The items still point to the strings of the log, which may be freed after the capture.
+// The pointers are only used as the keys of StringMap, which holds their indexes in the table.
+struct LogSnapshot::SaveData
+{
+	TCHAR szFileName[MAX_PATH];
+	std::vector<ConnectionLog::ItemInfo> ItemList;
+	std::vector<SnapshotColdBlock> ColdBlockList;
+	std::unordered_map<LPCTSTR, UINT> StringMap;
+	SnapshotStringTable StringTable;
+	std::vector<SnapshotHost> HostList;
+};
+
+static void AddItemString(std::unordered_map<LPCTSTR, UINT> &StringMap,
+						  SnapshotStringTable &StringTable, LPCTSTR pString)
+{
+	if (pString != nullptr && StringMap.find(pString) == StringMap.end())
+		StringMap.insert(std::pair<LPCTSTR, UINT>(pString, StringTable.Add(pString)));
+}
+
+static UINT GetItemString(const std::unordered_map<LPCTSTR, UINT> &StringMap, LPCTSTR pString)
+{
+	if (pString == nullptr)
+		return SNAPSHOT_NO_STRING;
+	std::unordered_map<LPCTSTR, UINT>::const_iterator i = StringMap.find(pString);
+	return i != StringMap.end() ? i->second : SNAPSHOT_NO_STRING;
+}
+
+static void ConvertItem(const ConnectionLog::ItemInfo &Item,
+						const std::unordered_map<LPCTSTR, UINT> &StringMap,
+						SnapshotStringTable &StringTable, SnapshotItem *pDest)
+{
+	SnapshotItem &Dest = *pDest;
+
+	::ZeroMemory(&Dest, sizeof(Dest));
+	Dest.ID = Item.ID;
+	Dest.CreatedTime = Item.CreatedTime.Time;
+	Dest.UpdatedTime = Item.UpdatedTime.Time;
+	Dest.Duration = Item.UpdatedTime.Tick - Item.CreatedTime.Tick;
+	if (Item.Info.CreateTimestamp > 0)
+		Dest.ConnectionCreateOffset = (LONGLONG)Item.CreatedTime.Tick - Item.ConnectionCreateTickCount;
+	Dest.Info = Item.Info;
+	Dest.Statistics = Item.Statistics;
+	Dest.MaxInBitsPerSecond = Item.MaxInBitsPerSecond;
+	Dest.MaxOutBitsPerSecond = Item.MaxOutBitsPerSecond;
+	Dest.ProcessName = GetItemString(StringMap, Item.pProcessName);
+	Dest.ProcessPath = GetItemString(StringMap, Item.pProcessPath);
+	Dest.RemoteHostName = GetItemString(StringMap, Item.pRemoteHostName);
+	Dest.EnableStatistics = Item.EnableStatistics;
+	Dest.EnableCityInfo = Item.EnableCityInfo;
+	if (Item.EnableCityInfo) {
+		Dest.CountryCode2 = StringTable.Add(Item.CityInfo.Country.Code2);
+		Dest.CountryCode3 = StringTable.Add(Item.CityInfo.Country.Code3);
+		Dest.CountryName = StringTable.Add(Item.CityInfo.Country.Name);
+		Dest.Region = StringTable.Add(Item.CityInfo.Region);
+		Dest.City = StringTable.Add(Item.CityInfo.City);
+		Dest.EnableLocation = Item.CityInfo.EnableLocation;
+		Dest.Latitude = Item.CityInfo.Latitude;
+		Dest.Longitude = Item.CityInfo.Longitude;
+	} else {
+		Dest.CountryCode2 = SNAPSHOT_NO_STRING;
+		Dest.CountryCode3 = SNAPSHOT_NO_STRING;
+		Dest.CountryName = SNAPSHOT_NO_STRING;
+		Dest.Region = SNAPSHOT_NO_STRING;
+		Dest.City = SNAPSHOT_NO_STRING;
+	}
+	Dest.ASNumber = Item.ASNumber;
+	Dest.ASOrganization = GetItemString(StringMap, Item.pASOrganization);
+	Dest.NumConnections = Item.NumConnections;
+	for (int j = 0; j < ConnectionLog::NUM_DURATION_CLASSES; j++)
+		Dest.DurationHistogram[j] = Item.DurationHistogram[j];
+}
+
+
+LogSnapshot::LogSnapshot()
+	: m_hSaveThread(nullptr)
+	, m_pSaveData(nullptr)
+	, m_SaveResult(false)
+{
+}
+
+LogSnapshot::~LogSnapshot()
+{
+	EndSave();
+}
+
+// Waits for a save in progress, then saves on the calling thread
+bool LogSnapshot::Save(LPCTSTR pFileName, const ConnectionLog &Log, const HostManager &Hosts)
+{
+	EndSave();
+
+	SaveData Data;
+	Capture(Log, Hosts, &Data);
+	return Write(pFileName, Data);
+}
+
+// Copies the log, and writes the file on a thread. Returns false if a save is still in progress.
+bool LogSnapshot::BeginSave(LPCTSTR pFileName, const ConnectionLog &Log, const HostManager &Hosts)
+{
+	if (IsSaving())
+		return false;
+	EndSave();
+
+	m_pSaveData = new SaveData;
+	::lstrcpyn(m_pSaveData->szFileName, pFileName, cvLengthOf(m_pSaveData->szFileName));
+	Capture(Log, Hosts, m_pSaveData);
+
+	m_SaveResult = false;
+	m_hSaveThread = ::CreateThread(nullptr, 0, SaveThread, this, 0, nullptr);
+	if (m_hSaveThread == nullptr) {
+		m_SaveResult = Write(m_pSaveData->szFileName, *m_pSaveData);
+		delete m_pSaveData;
+		m_pSaveData = nullptr;
+		return m_SaveResult;
+	}
+
+	return true;
+}
+
+bool LogSnapshot::IsSaving() const
+{
+	return m_hSaveThread != nullptr
+		&& ::WaitForSingleObject(m_hSaveThread, 0) == WAIT_TIMEOUT;
+}
+
+// Waits for the save started by BeginSave(), and returns whether it succeeded
+bool LogSnapshot::EndSave()
+{
+	if (m_hSaveThread != nullptr) {
+		::WaitForSingleObject(m_hSaveThread, INFINITE);
+		::CloseHandle(m_hSaveThread);
+		m_hSaveThread = nullptr;
+		delete m_pSaveData;
+		m_pSaveData = nullptr;
+	}
+
+	return m_SaveResult;
+}
+
+DWORD WINAPI LogSnapshot::SaveThread(LPVOID pParameter)
+{
+	LogSnapshot *pThis = static_cast<LogSnapshot*>(pParameter);
+
+	::SetThreadPriority(::GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+	pThis->m_SaveResult = Write(pThis->m_pSaveData->szFileName, *pThis->m_pSaveData);
+
+	return 0;
+}
+
+// Must be called on the thread that updates the log.
+// Cold blocks are copied compressed, and are decompressed by Write().
+void LogSnapshot::Capture(const ConnectionLog &Log, const HostManager &Hosts, SaveData *pData)
+{
+	const ConnectionLog::ItemList &HotList = Log.GetItemList();
+	pData->ItemList.assign(HotList.begin(), HotList.end());
+	for (std::vector<ConnectionLog::ItemInfo>::const_iterator i = pData->ItemList.begin();
+			i != pData->ItemList.end(); i++) {
+		AddItemString(pData->StringMap, pData->StringTable, i->pProcessName);
+		AddItemString(pData->StringMap, pData->StringTable, i->pProcessPath);
+		AddItemString(pData->StringMap, pData->StringTable, i->pRemoteHostName);
+		AddItemString(pData->StringMap, pData->StringTable, i->pASOrganization);
+	}
+
+	const size_t NumBlocks = Log.NumColdBlocks();
+	pData->ColdBlockList.resize(NumBlocks);
+	for (size_t i = 0; i < NumBlocks; i++) {
+		SnapshotColdBlock &Block = pData->ColdBlockList[i];
+		const std::vector<LPCTSTR> *pStringList;
+
+		Log.GetColdBlock(i, &Block.NumItems, &Block.Data, &pStringList);
+		for (std::vector<LPCTSTR>::const_iterator j = pStringList->begin(); j != pStringList->end(); j++)
+			AddItemString(pData->StringMap, pData->StringTable, *j);
+	}
+
+	SnapshotHostCollector Collector(pData->StringTable, pData->HostList);
+	Hosts.EnumHostNames(&Collector);
+}
+
+bool LogSnapshot::Write(LPCTSTR pFileName, SaveData &Data)
+{
+	SnapshotStringTable &StringTable = Data.StringTable;
+	const std::vector<SnapshotHost> &HostList = Data.HostList;
+	std::vector<SnapshotItem> ItemList;
+
+	size_t NumItems = Data.ItemList.size();
+	for (size_t i = 0; i < Data.ColdBlockList.size(); i++)
+		NumItems += Data.ColdBlockList[i].NumItems;
+	ItemList.resize(NumItems);
+
+	size_t Pos = 0;
+	for (size_t i = 0; i < Data.ItemList.size(); i++)
+		ConvertItem(Data.ItemList[i], Data.StringMap, StringTable, &ItemList[Pos++]);
+
+	std::vector<ConnectionLog::ItemInfo> ColdItemList;
+	for (size_t i = 0; i < Data.ColdBlockList.size(); i++) {
+		const SnapshotColdBlock &Block = Data.ColdBlockList[i];
+
+		if (!ConnectionLog::DecompressColdBlock(Block.Data, &ColdItemList)) {
+			cvDebugTrace(TEXT("Failed to decompress connection log items\n"));
+			return false;
+		}
+		for (size_t j = 0; j < Block.NumItems; j++)
+			ConvertItem(ColdItemList[j], Data.StringMap, StringTable, &ItemList[Pos++]);
+	}
+
+	const std::vector<SnapshotString> &StringIndex = StringTable.GetIndex();
+	const std::vector<TCHAR> &StringData = StringTable.GetData();
+
+	SnapshotHeader Header;
+	::ZeroMemory(&Header, sizeof(Header));
+	Header.Signature = SNAPSHOT_SIGNATURE;
+	Header.Version = SNAPSHOT_VERSION;
+	Header.HeaderSize = sizeof(SnapshotHeader);
+	Header.ItemSize = sizeof(SnapshotItem);
+	Header.HostSize = sizeof(SnapshotHost);
+	Header.CharSize = sizeof(TCHAR);
+	::GetSystemTimeAsFileTime(&Header.SavedTime);
+	Header.NumItems = ItemList.size();
+	Header.ItemOffset = sizeof(SnapshotHeader);
+	Header.NumHosts = HostList.size();
+	Header.HostOffset = Header.ItemOffset + ItemList.size() * sizeof(SnapshotItem);
+	Header.NumStrings = StringIndex.size();
+	Header.StringIndexOffset = Header.HostOffset + HostList.size() * sizeof(SnapshotHost);
+	Header.StringDataOffset = Header.StringIndexOffset + StringIndex.size() * sizeof(SnapshotString);
+	Header.StringDataLength = StringData.size();
+	Header.FileSize = Header.StringDataOffset + StringData.size() * sizeof(TCHAR);
+
+	// Write to a temporary file first so that a failure does not destroy the previous snapshot
+	TCHAR szTempFileName[MAX_PATH];
+	if (::lstrlen(pFileName) + 4 >= cvLengthOf(szTempFileName))
+		return false;
+	FormatString(szTempFileName, cvLengthOf(szTempFileName), TEXT("%s.tmp"), pFileName);
+
+	HANDLE hFile = ::CreateFile(szTempFileName, GENERIC_WRITE, 0, nullptr,
+							   CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	bool OK = WriteData(hFile, &Header, sizeof(Header))
+		&& (ItemList.empty()
+			|| WriteData(hFile, ItemList.data(), ItemList.size() * sizeof(SnapshotItem)))
+		&& (HostList.empty()
+			|| WriteData(hFile, HostList.data(), HostList.size() * sizeof(SnapshotHost)))
+		&& (StringIndex.empty()
+			|| WriteData(hFile, StringIndex.data(), StringIndex.size() * sizeof(SnapshotString)))
+		&& (StringData.empty()
+			|| WriteData(hFile, StringData.data(), StringData.size() * sizeof(TCHAR)));
+	::CloseHandle(hFile);
+
+	if (OK)
+		OK = ::MoveFileEx(szTempFileName, pFileName, MOVEFILE_REPLACE_EXISTING) != FALSE;
+	if (!OK)
+		::DeleteFile(szTempFileName);
+
+	cvDebugTrace(TEXT("Log snapshot saved : %llu items / %llu hosts / %llu strings\n"),
+				 Header.NumItems, Header.NumHosts, Header.NumStrings);
+
+	return OK;
+}
+
+
+// Strings are validated and interned when they are first referenced
+class SnapshotStringReader
+{
+public:
+	SnapshotStringReader(const BYTE *pBase, const SnapshotHeader &Header, ConnectionLog *pLog)
+		: m_pIndex(reinterpret_cast<const SnapshotString*>(pBase + Header.StringIndexOffset))
+		, m_NumStrings((size_t)Header.NumStrings)
+		, m_pData(reinterpret_cast<LPCTSTR>(pBase + Header.StringDataOffset))
+		, m_DataLength(Header.StringDataLength)
+		, m_pLog(pLog)
+		, m_StringList(m_NumStrings, nullptr)
+	{
+	}
+
+	bool Get(UINT Index, LPCTSTR *ppString)
+	{
+		if (Index == SNAPSHOT_NO_STRING) {
+			*ppString = nullptr;
+			return true;
+		}
+		if (Index >= m_NumStrings)
+			return false;
+		if (m_StringList[Index] == nullptr) {
+			const SnapshotString &String = m_pIndex[Index];
+			if ((ULONGLONG)String.Offset + String.Length >= m_DataLength
+					|| m_pData[String.Offset + String.Length] != _T('\0'))
+				return false;
+			m_StringList[Index] = m_pLog->InternString(m_pData + String.Offset);
+		}
+		*ppString = m_StringList[Index];
+		return true;
+	}
+
+	bool Get(UINT Index, LPTSTR pBuffer, int MaxLength)
+	{
+		LPCTSTR pString;
+
+		if (!Get(Index, &pString))
+			return false;
+		if (pString != nullptr)
+			::lstrcpyn(pBuffer, pString, MaxLength);
+		else
+			pBuffer[0] = _T('\0');
+		return true;
+	}
+
+private:
+	const SnapshotString *m_pIndex;
+	size_t m_NumStrings;
+	LPCTSTR m_pData;
+	ULONGLONG m_DataLength;
+	ConnectionLog *m_pLog;
+	std::vector<LPCTSTR> m_StringList;
+};
+
+static bool IsValidSection(const SnapshotHeader &Header,
+						   ULONGLONG Offset, ULONGLONG Count, ULONGLONG Size)
+{
+	return Offset >= sizeof(SnapshotHeader)
+		&& Offset <= Header.FileSize
+		&& Offset % sizeof(ULONGLONG) == 0
+		&& Count <= (Header.FileSize - Offset) / Size;
+}
+
+static ULONGLONG RestoreTick(ULONGLONG CurTick, ULONGLONG Age)
+{
+	return CurTick > Age ? CurTick - Age : 1;
+}
+
+bool LogSnapshot::Load(LPCTSTR pFileName, ConnectionLog *pLog, HostManager *pHosts)
+{
+	HANDLE hFile = ::CreateFile(pFileName, GENERIC_READ, FILE_SHARE_READ, nullptr,
+							   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER FileSize;
+	if (!::GetFileSizeEx(hFile, &FileSize)
+			|| (ULONGLONG)FileSize.QuadPart < sizeof(SnapshotHeader)
+			|| (ULONGLONG)FileSize.QuadPart > (SIZE_T)-1) {
+		::CloseHandle(hFile);
+		return false;
+	}
+
+	HANDLE hMapping = ::CreateFileMapping(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	::CloseHandle(hFile);
+	if (hMapping == nullptr)
+		return false;
+	const BYTE *pBase = static_cast<const BYTE*>(::MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+	::CloseHandle(hMapping);
+	if (pBase == nullptr)
+		return false;
+
+	// Only the layout is checked here, the contents are checked as they are read
+	const SnapshotHeader &Header = *reinterpret_cast<const SnapshotHeader*>(pBase);
+	if (Header.Signature != SNAPSHOT_SIGNATURE
+			|| Header.Version != SNAPSHOT_VERSION
+			|| Header.HeaderSize != sizeof(SnapshotHeader)
+			|| Header.ItemSize != sizeof(SnapshotItem)
+			|| Header.HostSize != sizeof(SnapshotHost)
+			|| Header.CharSize != sizeof(TCHAR)
+			|| Header.FileSize != (ULONGLONG)FileSize.QuadPart
+			|| !IsValidSection(Header, Header.ItemOffset, Header.NumItems, sizeof(SnapshotItem))
+			|| !IsValidSection(Header, Header.HostOffset, Header.NumHosts, sizeof(SnapshotHost))
+			|| !IsValidSection(Header, Header.StringIndexOffset, Header.NumStrings, sizeof(SnapshotString))
+			|| !IsValidSection(Header, Header.StringDataOffset, Header.StringDataLength, sizeof(TCHAR))) {
+		::UnmapViewOfFile(pBase);
+		return false;
+	}
+
+	SnapshotStringReader Strings(pBase, Header, pLog);
+	bool OK = true;
+
+	TimeAndTick CurTime;
+	CurTime.SetCurrent();
+	const ULONGLONG CurFileTime = FileTimeToUInt64(CurTime.Time);
+
+	const SnapshotItem *pItemList = reinterpret_cast<const SnapshotItem*>(pBase + Header.ItemOffset);
+	for (ULONGLONG i = 0; i < Header.NumItems; i++) {
+		const SnapshotItem &Src = pItemList[i];
+		ConnectionLog::ItemInfo Item;
+
+		const ULONGLONG UpdatedFileTime = FileTimeToUInt64(Src.UpdatedTime);
+		const ULONGLONG Age =
+			CurFileTime > UpdatedFileTime ? (CurFileTime - UpdatedFileTime) / 10000 : 0;
+
+		Item.ID = Src.ID;
+		Item.CreatedTime.Time = Src.CreatedTime;
+		Item.UpdatedTime.Time = Src.UpdatedTime;
+		Item.UpdatedTime.Tick = RestoreTick(CurTime.Tick, Age);
+		Item.CreatedTime.Tick = RestoreTick(Item.UpdatedTime.Tick, Src.Duration);
+		Item.Info = Src.Info;
+		Item.ConnectionCreateTickCount = (LONGLONG)Item.CreatedTime.Tick - Src.ConnectionCreateOffset;
+		Item.EnableStatistics = Src.EnableStatistics != 0;
+		Item.Statistics = Src.Statistics;
+		Item.MaxInBitsPerSecond = Src.MaxInBitsPerSecond;
+		Item.MaxOutBitsPerSecond = Src.MaxOutBitsPerSecond;
+		Item.hProcessIcon = nullptr;
+		Item.EnableCityInfo = Src.EnableCityInfo != 0;
+		Item.ASNumber = Src.ASNumber;
+		Item.NumConnections = Src.NumConnections;
+		for (int j = 0; j < ConnectionLog::NUM_DURATION_CLASSES; j++)
+			Item.DurationHistogram[j] = Src.DurationHistogram[j];
+
+		if (!Strings.Get(Src.ProcessName, &Item.pProcessName)
+				|| !Strings.Get(Src.ProcessPath, &Item.pProcessPath)
+				|| !Strings.Get(Src.RemoteHostName, &Item.pRemoteHostName)
+				|| !Strings.Get(Src.ASOrganization, &Item.pASOrganization)) {
+			OK = false;
+			break;
+		}
+
+		if (Item.EnableCityInfo) {
+			GeoIPManager::CityInfo &City = Item.CityInfo;
+			if (!Strings.Get(Src.CountryCode2, City.Country.Code2, cvLengthOf(City.Country.Code2))
+					|| !Strings.Get(Src.CountryCode3, City.Country.Code3, cvLengthOf(City.Country.Code3))
+					|| !Strings.Get(Src.CountryName, City.Country.Name, cvLengthOf(City.Country.Name))
+					|| !Strings.Get(Src.Region, City.Region, cvLengthOf(City.Region))
+					|| !Strings.Get(Src.City, City.City, cvLengthOf(City.City))) {
+				OK = false;
+				break;
+			}
+			City.EnableLocation = Src.EnableLocation != 0;
+			City.Latitude = Src.Latitude;
+			City.Longitude = Src.Longitude;
+		}
+
+		if (!pLog->RestoreItem(Item))
+			break;
+	}
+
+	if (OK) {
+		const SnapshotHost *pHostList = reinterpret_cast<const SnapshotHost*>(pBase + Header.HostOffset);
+		for (ULONGLONG i = 0; i < Header.NumHosts; i++) {
+			LPCTSTR pHostName;
+
+			if (!Strings.Get(pHostList[i].HostName, &pHostName)) {
+				OK = false;
+				break;
+			}
+			pHosts->AddHostName(pHostList[i].Address, pHostName);
+		}
+	}
+
+	::UnmapViewOfFile(pBase);
+
+	return OK;
+}
+
+}	// namespace CV
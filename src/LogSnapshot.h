@@ -0,0 +1,67 @@
+/******************************************************************************
+*                                                                             *
+*    LogSnapshot.h                          Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef CV_LOG_SNAPSHOT_H
+#define CV_LOG_SNAPSHOT_H
+
+
+#include "ConnectionLog.h"
+#include "HostManager.h"
+
+
+namespace CV
+{
+
+// Saves and restores the connection log and the host name cache.
+// Strings are stored once in a table and referenced by index, so the file
+// does not depend on the address it is mapped to.
+class LogSnapshot
+{
+public:
+	LogSnapshot();
+	~LogSnapshot();
+	bool Save(LPCTSTR pFileName, const ConnectionLog &Log, const HostManager &Hosts);
+	bool BeginSave(LPCTSTR pFileName, const ConnectionLog &Log, const HostManager &Hosts);
+	bool IsSaving() const;
+	bool EndSave();
+	static bool Load(LPCTSTR pFileName, ConnectionLog *pLog, HostManager *pHosts);
+
+private:
+	struct SaveData;
+
+	static void Capture(const ConnectionLog &Log, const HostManager &Hosts, SaveData *pData);
+	static bool Write(LPCTSTR pFileName, SaveData &Data);
+	static DWORD WINAPI SaveThread(LPVOID pParameter);
+
+	HANDLE m_hSaveThread;
+	SaveData *m_pSaveData;
+	volatile bool m_SaveResult;
+};
+
+}	// namespace CV
+
+
+#endif	// ndef CV_LOG_SNAPSHOT_H
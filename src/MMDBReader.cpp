@@ -0,0 +1,484 @@
+/******************************************************************************
+*                                                                             *
+*    MMDBReader.cpp                         Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "ConnectionViewer.h"
+#include "MMDBReader.h"
+
+
+namespace CV
+{
+
+// The metadata follows the last occurrence of this marker in the file
+static const BYTE METADATA_MARKER[] = {
+	0xAB, 0xCD, 0xEF, 'M', 'a', 'x', 'M', 'i', 'n', 'd', '.', 'c', 'o', 'm'
+};
+
+
+MMDBReader::MMDBReader()
+	: m_pBase(nullptr)
+{
+	Close();
+}
+
+MMDBReader::~MMDBReader()
+{
+	Close();
+}
+
+bool MMDBReader::Open(LPCTSTR pFileName)
+{
+	Close();
+
+	HANDLE hFile = ::CreateFile(pFileName, GENERIC_READ, FILE_SHARE_READ, nullptr,
+							   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER FileSize;
+	if (!::GetFileSizeEx(hFile, &FileSize)
+			|| (ULONGLONG)FileSize.QuadPart <= sizeof(METADATA_MARKER)
+			|| (ULONGLONG)FileSize.QuadPart > (SIZE_T)-1) {
+		::CloseHandle(hFile);
+		return false;
+	}
+
+	HANDLE hMapping = ::CreateFileMapping(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	::CloseHandle(hFile);
+	if (hMapping == nullptr)
+		return false;
+	m_pBase = static_cast<const BYTE*>(::MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+	::CloseHandle(hMapping);
+	if (m_pBase == nullptr)
+		return false;
+
+	const size_t Size = (size_t)FileSize.QuadPart;
+	size_t MarkerPos = Size - sizeof(METADATA_MARKER);
+	while (std::memcmp(m_pBase + MarkerPos, METADATA_MARKER, sizeof(METADATA_MARKER)) != 0) {
+		if (MarkerPos == 0 || Size - MarkerPos >= MAX_METADATA_SIZE) {
+			cvDebugTrace(TEXT("MaxMind DB metadata not found\n"));
+			Close();
+			return false;
+		}
+		MarkerPos--;
+	}
+	m_Metadata.pBase = m_pBase + MarkerPos + sizeof(METADATA_MARKER);
+	m_Metadata.Size = Size - MarkerPos - sizeof(METADATA_MARKER);
+
+	static const LPCSTR NodeCountPath[]		= {"node_count", nullptr};
+	static const LPCSTR RecordSizePath[]	= {"record_size", nullptr};
+	static const LPCSTR IPVersionPath[]		= {"ip_version", nullptr};
+	static const LPCSTR DatabaseTypePath[]	= {"database_type", nullptr};
+	Value Val;
+	ULONGLONG NodeCount, RecordSize, IPVersion;
+
+	if (!FindValue(m_Metadata, 0, NodeCountPath, &Val) || !GetUInt(Val, &NodeCount)
+			|| !FindValue(m_Metadata, 0, RecordSizePath, &Val) || !GetUInt(Val, &RecordSize)
+			|| !FindValue(m_Metadata, 0, IPVersionPath, &Val) || !GetUInt(Val, &IPVersion)
+			|| NodeCount == 0 || NodeCount >= NO_DATA
+			|| (RecordSize != 24 && RecordSize != 28 && RecordSize != 32)
+			|| (IPVersion != 4 && IPVersion != 6)) {
+		cvDebugTrace(TEXT("Invalid MaxMind DB metadata\n"));
+		Close();
+		return false;
+	}
+
+	// A node holds two records
+	const ULONGLONG TreeSize = NodeCount * RecordSize / 4;
+	if (TreeSize + DATA_SEPARATOR_SIZE > MarkerPos) {
+		Close();
+		return false;
+	}
+
+	m_NodeCount = (UINT)NodeCount;
+	m_RecordSize = (UINT)RecordSize;
+	m_IPVersion = (int)IPVersion;
+	m_Data.pBase = m_pBase + TreeSize + DATA_SEPARATOR_SIZE;
+	m_Data.Size = MarkerPos - (size_t)TreeSize - DATA_SEPARATOR_SIZE;
+
+	if (FindValue(m_Metadata, 0, DatabaseTypePath, &Val) && Val.Type == TYPE_STRING) {
+		const UINT Length = min(Val.Size, (UINT)cvLengthOf(m_szDatabaseType) - 1);
+		std::memcpy(m_szDatabaseType, Val.pData, Length);
+		m_szDatabaseType[Length] = '\0';
+	}
+
+	// The IPv4 addresses are in ::/96 of an IPv6 tree
+	m_IPv4StartNode = 0;
+	m_IPv4StartDepth = 0;
+	if (m_IPVersion == 6) {
+		while (m_IPv4StartDepth < 96 && m_IPv4StartNode < m_NodeCount) {
+			m_IPv4StartNode = ReadNode(m_IPv4StartNode, 0);
+			m_IPv4StartDepth++;
+		}
+	}
+
+	cvDebugTrace(TEXT("MaxMind DB \"%hs\" nodes %u / record size %u / IPv%d\n"),
+				 m_szDatabaseType, m_NodeCount, m_RecordSize, m_IPVersion);
+
+	return true;
+}
+
+void MMDBReader::Close()
+{
+	if (m_pBase != nullptr) {
+		::UnmapViewOfFile(m_pBase);
+		m_pBase = nullptr;
+	}
+	m_NodeCount = 0;
+	m_RecordSize = 0;
+	m_IPVersion = 0;
+	m_szDatabaseType[0] = '\0';
+	m_Data.pBase = nullptr;
+	m_Data.Size = 0;
+	m_Metadata.pBase = nullptr;
+	m_Metadata.Size = 0;
+	m_IPv4StartNode = 0;
+	m_IPv4StartDepth = 0;
+}
+
+// Returns the offset of the record in the data section, or NO_DATA if not found.
+// The prefix length is the number of bits of the address that determine the record.
+UINT MMDBReader::Lookup(const IPAddress &Address, int *pPrefixLength) const
+{
+	if (m_pBase == nullptr)
+		return NO_DATA;
+
+	const BYTE *pBytes;
+	int Bits;
+	UINT Node;
+
+	if (Address.Type == IP_ADDRESS_V4) {
+		pBytes = reinterpret_cast<const BYTE*>(&Address.V4.Address);
+		Bits = 32;
+		Node = m_IPv4StartNode;
+	} else {
+		if (m_IPVersion != 6)
+			return NO_DATA;
+		pBytes = Address.V6.Bytes;
+		Bits = 128;
+		Node = 0;
+	}
+
+	int Depth = 0;
+	for (; Depth < Bits && Node < m_NodeCount; Depth++)
+		Node = ReadNode(Node, (pBytes[Depth >> 3] >> (7 - (Depth & 7))) & 1);
+
+	if (pPrefixLength != nullptr)
+		*pPrefixLength = Depth;
+
+	// The node count itself means that the address has no record
+	if ((ULONGLONG)Node < (ULONGLONG)m_NodeCount + DATA_SEPARATOR_SIZE)
+		return NO_DATA;
+	const size_t Offset = Node - m_NodeCount - DATA_SEPARATOR_SIZE;
+	if (Offset >= m_Data.Size)
+		return NO_DATA;
+
+	return (UINT)Offset;
+}
+
+// The path is a list of map keys terminated by a null, and an array element
+// is specified by its index in decimal
+bool MMDBReader::GetValue(UINT Offset, const LPCSTR *ppPath, Value *pValue) const
+{
+	if (m_pBase == nullptr)
+		return false;
+	return FindValue(m_Data, Offset, ppPath, pValue);
+}
+
+// The string is truncated to fit in the buffer
+bool MMDBReader::GetString(const Value &Val, LPTSTR pString, int MaxLength)
+{
+	if (MaxLength <= 0)
+		return false;
+	pString[0] = _T('\0');
+	if (Val.Type != TYPE_STRING)
+		return false;
+
+	// A byte of UTF-8 is at most a character of UTF-16
+#ifdef UNICODE
+	int Length = (int)min(Val.Size, (UINT)MaxLength - 1);
+#else
+	WCHAR szTemp[256];
+	int Length = (int)min(Val.Size, (UINT)min(MaxLength, cvLengthOf(szTemp)) - 1);
+#endif
+	if (Length < (int)Val.Size) {
+		while (Length > 0 && (Val.pData[Length] & 0xC0) == 0x80)
+			Length--;
+	}
+	if (Length == 0)
+		return true;
+
+#ifdef UNICODE
+	Length = ::MultiByteToWideChar(CP_UTF8, 0, reinterpret_cast<LPCSTR>(Val.pData), Length,
+								   pString, MaxLength - 1);
+	if (Length <= 0)
+		return false;
+	pString[Length] = _T('\0');
+#else
+	Length = ::MultiByteToWideChar(CP_UTF8, 0, reinterpret_cast<LPCSTR>(Val.pData), Length,
+								   szTemp, cvLengthOf(szTemp) - 1);
+	if (Length <= 0)
+		return false;
+	szTemp[Length] = L'\0';
+	if (::WideCharToMultiByte(CP_ACP, 0, szTemp, -1, pString, MaxLength, nullptr, nullptr) <= 0) {
+		pString[0] = '\0';
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+bool MMDBReader::GetDouble(const Value &Val, double *pValue)
+{
+	if (Val.Type == TYPE_DOUBLE && Val.Size == 8) {
+		ULONGLONG Bits = 0;
+		for (int i = 0; i < 8; i++)
+			Bits = (Bits << 8) | Val.pData[i];
+		std::memcpy(pValue, &Bits, sizeof(double));
+		return true;
+	}
+	if (Val.Type == TYPE_FLOAT && Val.Size == 4) {
+		DWORD Bits = 0;
+		for (int i = 0; i < 4; i++)
+			Bits = (Bits << 8) | Val.pData[i];
+		float Float;
+		std::memcpy(&Float, &Bits, sizeof(float));
+		*pValue = Float;
+		return true;
+	}
+	return false;
+}
+
+bool MMDBReader::GetUInt(const Value &Val, ULONGLONG *pValue)
+{
+	if ((Val.Type != TYPE_UINT16 && Val.Type != TYPE_UINT32 && Val.Type != TYPE_INT32
+				&& Val.Type != TYPE_UINT64 && Val.Type != TYPE_UINT128)
+			|| Val.Size > 8)
+		return false;
+	ULONGLONG Number = 0;
+	for (UINT i = 0; i < Val.Size; i++)
+		Number = (Number << 8) | Val.pData[i];
+	*pValue = Number;
+	return true;
+}
+
+// Reads the control byte and the size of a field. A pointer is not followed.
+bool MMDBReader::ReadControl(const Section &Sec, size_t Offset, Control *pControl)
+{
+	const BYTE *p = Sec.pBase;
+	size_t Pos = Offset;
+
+	if (Pos >= Sec.Size)
+		return false;
+	const BYTE ControlByte = p[Pos++];
+	UINT Type = ControlByte >> 5;
+
+	if (Type == TYPE_POINTER) {
+		static const size_t PointerBias[4] = {0, 2048, 526336, 0};
+		const UINT SizeBits = (ControlByte >> 3) & 0x03;
+		if (SizeBits + 1 > Sec.Size - Pos)
+			return false;
+		size_t Pointer = SizeBits < 3 ? (ControlByte & 0x07) : 0;
+		for (UINT i = 0; i <= SizeBits; i++)
+			Pointer = (Pointer << 8) | p[Pos++];
+		pControl->Type = TYPE_POINTER;
+		pControl->Size = 0;
+		pControl->Offset = Pos;
+		pControl->Pointer = Pointer + PointerBias[SizeBits];
+		return true;
+	}
+
+	if (Type == TYPE_EXTENDED) {
+		if (Pos >= Sec.Size)
+			return false;
+		Type = 7 + p[Pos++];
+		if (Type < TYPE_INT32 || Type > TYPE_FLOAT)
+			return false;
+	}
+
+	UINT Size = ControlByte & 0x1F;
+	if (Size >= 29) {
+		static const UINT SizeBias[3] = {29, 285, 65821};
+		const UINT SizeBytes = Size - 28;
+		if (SizeBytes > Sec.Size - Pos)
+			return false;
+		UINT Extra = 0;
+		for (UINT i = 0; i < SizeBytes; i++)
+			Extra = (Extra << 8) | p[Pos++];
+		Size = SizeBias[SizeBytes - 1] + Extra;
+	}
+
+	// The size of the containers and the booleans is not in bytes
+	if (Type != TYPE_MAP && Type != TYPE_ARRAY && Type != TYPE_BOOLEAN
+			&& Size > Sec.Size - Pos)
+		return false;
+
+	pControl->Type = (ValueType)Type;
+	pControl->Size = Size;
+	pControl->Offset = Pos;
+	pControl->Pointer = 0;
+
+	return true;
+}
+
+// Reads a field, following a pointer
+bool MMDBReader::ReadValue(const Section &Sec, size_t Offset, Value *pValue)
+{
+	Control Ctrl;
+
+	if (!ReadControl(Sec, Offset, &Ctrl))
+		return false;
+	if (Ctrl.Type == TYPE_POINTER) {
+		// A pointer to a pointer is invalid
+		if (!ReadControl(Sec, Ctrl.Pointer, &Ctrl) || Ctrl.Type == TYPE_POINTER)
+			return false;
+	}
+
+	pValue->Type = Ctrl.Type;
+	pValue->Size = Ctrl.Size;
+	pValue->pData = Sec.pBase + Ctrl.Offset;
+
+	return true;
+}
+
+// Gets the offset of the field following the one at Offset
+bool MMDBReader::SkipValue(const Section &Sec, size_t Offset, size_t *pNext, int Depth)
+{
+	if (Depth > MAX_DEPTH)
+		return false;
+
+	Control Ctrl;
+	if (!ReadControl(Sec, Offset, &Ctrl))
+		return false;
+
+	size_t Next = Ctrl.Offset;
+
+	switch (Ctrl.Type) {
+	case TYPE_POINTER:
+	case TYPE_BOOLEAN:
+		break;
+
+	case TYPE_MAP:
+	case TYPE_ARRAY:
+		{
+			const ULONGLONG NumFields =
+				Ctrl.Type == TYPE_MAP ? (ULONGLONG)Ctrl.Size * 2 : (ULONGLONG)Ctrl.Size;
+			for (ULONGLONG i = 0; i < NumFields; i++) {
+				if (!SkipValue(Sec, Next, &Next, Depth + 1))
+					return false;
+			}
+		}
+		break;
+
+	default:
+		Next += Ctrl.Size;
+		break;
+	}
+
+	*pNext = Next;
+
+	return true;
+}
+
+bool MMDBReader::FindValue(const Section &Sec, size_t Offset, const LPCSTR *ppPath, Value *pValue)
+{
+	Value Val;
+
+	if (!ReadValue(Sec, Offset, &Val))
+		return false;
+
+	for (; *ppPath != nullptr; ppPath++) {
+		const LPCSTR pKey = *ppPath;
+		size_t Pos = Val.pData - Sec.pBase;
+
+		if (Val.Type == TYPE_MAP) {
+			const UINT KeyLength = ::lstrlenA(pKey);
+			UINT i;
+			for (i = 0; i < Val.Size; i++) {
+				Value Key;
+				if (!ReadValue(Sec, Pos, &Key) || Key.Type != TYPE_STRING
+						|| !SkipValue(Sec, Pos, &Pos, 0))
+					return false;
+				if (Key.Size == KeyLength && std::memcmp(Key.pData, pKey, KeyLength) == 0)
+					break;
+				if (!SkipValue(Sec, Pos, &Pos, 0))
+					return false;
+			}
+			if (i == Val.Size)
+				return false;
+		} else if (Val.Type == TYPE_ARRAY) {
+			if (*pKey == '\0')
+				return false;
+			UINT Index = 0;
+			for (LPCSTR p = pKey; *p != '\0'; p++) {
+				if (*p < '0' || *p > '9')
+					return false;
+				Index = Index * 10 + (*p - '0');
+				if (Index >= Val.Size)
+					return false;
+			}
+			for (UINT i = 0; i < Index; i++) {
+				if (!SkipValue(Sec, Pos, &Pos, 0))
+					return false;
+			}
+		} else {
+			return false;
+		}
+
+		if (!ReadValue(Sec, Pos, &Val))
+			return false;
+	}
+
+	*pValue = Val;
+
+	return true;
+}
+
+// The node must be in the tree
+UINT MMDBReader::ReadNode(UINT Node, int Bit) const
+{
+	const BYTE *p = m_pBase + (size_t)Node * m_RecordSize / 4;
+
+	switch (m_RecordSize) {
+	case 24:
+		p += Bit * 3;
+		return ((UINT)p[0] << 16) | ((UINT)p[1] << 8) | p[2];
+
+	case 28:
+		// The middle byte holds the high 4 bits of both records
+		if (Bit == 0)
+			return ((UINT)(p[3] & 0xF0) << 20) | ((UINT)p[0] << 16) | ((UINT)p[1] << 8) | p[2];
+		return ((UINT)(p[3] & 0x0F) << 24) | ((UINT)p[4] << 16) | ((UINT)p[5] << 8) | p[6];
+
+	case 32:
+		p += Bit * 4;
+		return ((UINT)p[0] << 24) | ((UINT)p[1] << 16) | ((UINT)p[2] << 8) | p[3];
+	}
+
+	return m_NodeCount;
+}
+
+}	// namespace CV
@@ -0,0 +1,131 @@
+/******************************************************************************
+*                                                                             *
+*    MMDBReader.h                           Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef CV_MMDB_READER_H
+#define CV_MMDB_READER_H
+
+
+namespace CV
+{
+
+// Reads a MaxMind DB (.mmdb) file in place.
+// The file is mapped, the search tree is walked directly and the fields are
+// decoded on demand from the data section, so that opening the file doesn't
+// read it and a lookup doesn't allocate.
+class MMDBReader
+{
+public:
+	enum ValueType
+	{
+		TYPE_EXTENDED,
+		TYPE_POINTER,
+		TYPE_STRING,
+		TYPE_DOUBLE,
+		TYPE_BYTES,
+		TYPE_UINT16,
+		TYPE_UINT32,
+		TYPE_MAP,
+		TYPE_INT32,
+		TYPE_UINT64,
+		TYPE_UINT128,
+		TYPE_ARRAY,
+		TYPE_CONTAINER,
+		TYPE_END_MARKER,
+		TYPE_BOOLEAN,
+		TYPE_FLOAT
+	};
+
+	// A value in the mapped file. The size of a map is the number of pairs,
+	// the size of an array is the number of elements and the size of a boolean is its value.
+	struct Value
+	{
+		ValueType Type;
+		UINT Size;
+		const BYTE *pData;
+	};
+
+	enum
+	{
+		NO_DATA	= 0xFFFFFFFFU
+	};
+
+	MMDBReader();
+	~MMDBReader();
+	bool Open(LPCTSTR pFileName);
+	void Close();
+	bool IsOpen() const { return m_pBase != nullptr; }
+	int GetIPVersion() const { return m_IPVersion; }
+	LPCSTR GetDatabaseType() const { return m_szDatabaseType; }
+	UINT Lookup(const IPAddress &Address, int *pPrefixLength = nullptr) const;
+	bool GetValue(UINT Offset, const LPCSTR *ppPath, Value *pValue) const;
+
+	static bool GetString(const Value &Val, LPTSTR pString, int MaxLength);
+	static bool GetDouble(const Value &Val, double *pValue);
+	static bool GetUInt(const Value &Val, ULONGLONG *pValue);
+
+private:
+	enum
+	{
+		MAX_METADATA_SIZE	= 128 * 1024,
+		DATA_SEPARATOR_SIZE	= 16,
+		MAX_DEPTH			= 32
+	};
+
+	struct Section
+	{
+		const BYTE *pBase;
+		size_t Size;
+	};
+
+	struct Control
+	{
+		ValueType Type;
+		UINT Size;
+		size_t Offset;
+		size_t Pointer;
+	};
+
+	static bool ReadControl(const Section &Sec, size_t Offset, Control *pControl);
+	static bool ReadValue(const Section &Sec, size_t Offset, Value *pValue);
+	static bool SkipValue(const Section &Sec, size_t Offset, size_t *pNext, int Depth);
+	static bool FindValue(const Section &Sec, size_t Offset, const LPCSTR *ppPath, Value *pValue);
+	UINT ReadNode(UINT Node, int Bit) const;
+
+	const BYTE *m_pBase;
+	UINT m_NodeCount;
+	UINT m_RecordSize;
+	int m_IPVersion;
+	char m_szDatabaseType[64];
+	Section m_Data;
+	Section m_Metadata;
+	UINT m_IPv4StartNode;
+	int m_IPv4StartDepth;
+};
+
+}	// namespace CV
+
+
+#endif	// ndef CV_MMDB_READER_H
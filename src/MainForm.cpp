@@ -127,6 +127,35 @@ public:
 };
 
 
+class HostNameRequest : public HostManager::Request
+{
+	HWND m_hwnd;
+	std::vector<IPAddress> &m_FoundHostList;
+	LocalLock &m_FoundHostLock;
+
+public:
+	HostNameRequest(const IPAddress &Address, WORD Port, HostManager::RequestPriority Priority,
+					HWND hwnd, std::vector<IPAddress> &FoundHostList, LocalLock &FoundHostLock)
+		: Request(Address, Port, Priority)
+		, m_hwnd(hwnd)
+		, m_FoundHostList(FoundHostList)
+		, m_FoundHostLock(FoundHostLock)
+	{
+	}
+
+	// The list is taken as a whole, so only the first name added to an empty list posts the message
+	void OnHostFound(LPCTSTR pHostName) override
+	{
+		m_FoundHostLock.Lock();
+		const bool Post = m_FoundHostList.empty();
+		m_FoundHostList.push_back(m_Address);
+		m_FoundHostLock.Unlock();
+		if (Post)
+			::PostMessage(m_hwnd, WM_APP_HOSTFOUND, 0, 0);
+	}
+};
+
+
 enum
 {
 	GRAPH_IN_BANDWIDTH,
@@ -510,8 +539,10 @@ bool MainForm::SetUpdateInterval(DWORD Interval)
 	if (Interval < USER_TIMER_MINIMUM || Interval > USER_TIMER_MAXIMUM)
 		return false;
 	if (Interval != m_UpdateInterval) {
-		if (m_Handle != nullptr && !m_Paused)
+		if (m_Handle != nullptr && !m_Paused) {
 			::SetTimer(m_Handle, TIMER_ID_UPDATE, Interval, nullptr);
+			m_Core.StartSampler(Interval);
+		}
 		m_UpdateInterval = Interval;
 	}
 	return true;
@@ -524,9 +555,11 @@ void MainForm::PauseUpdate(bool Pause)
 		if (m_Handle != nullptr) {
 			if (Pause) {
 				::KillTimer(m_Handle, TIMER_ID_UPDATE);
+				m_Core.StopSampler();
 			} else {
 				m_EnableNetworkIfStats = false;
 				::SetTimer(m_Handle, TIMER_ID_UPDATE, m_UpdateInterval, nullptr);
+				m_Core.StartSampler(m_UpdateInterval);
 			}
 			::CheckMenuItem(::GetMenu(m_Handle), CM_PAUSE,
 							(m_Paused ? MF_CHECKED : MF_UNCHECKED) | MF_BYCOMMAND);
@@ -821,8 +854,10 @@ LRESULT MainForm::OnMessage(HWND hwnd, UINT Msg, WPARAM wParam, LPARAM lParam)
 
 			SetGraphCaption();
 
-			if (!m_Paused)
+			if (!m_Paused) {
 				::SetTimer(hwnd, TIMER_ID_UPDATE, m_UpdateInterval, nullptr);
+				m_Core.StartSampler(m_UpdateInterval);
+			}
 		}
 		return 0;
 
@@ -1000,17 +1035,22 @@ LRESULT MainForm::OnMessage(HWND hwnd, UINT Msg, WPARAM wParam, LPARAM lParam)
 
 	case WM_APP_HOSTFOUND:
 		{
-			BlockLock Lock(m_FoundHostLock);
+			std::vector<IPAddress> AddressList, FoundList;
+
+			m_FoundHostLock.Lock();
+			AddressList.swap(m_FoundHostList);
+			m_FoundHostLock.Unlock();
 
-			while (!m_FoundHostList.empty()) {
-				if (m_Core.OnHostNameFound(m_FoundHostList.front()))
-					m_ListView.OnHostNameFound(m_FoundHostList.front());
-				m_FoundHostList.pop_front();
+			m_Core.OnHostNamesFound(AddressList, &FoundList);
+			if (!FoundList.empty()) {
+				m_ListView.OnHostNamesFound(FoundList);
+				m_LogView.OnHostNamesFound(FoundList);
 			}
 		}
 		return 0;
 
 	case WM_DESTROY:
+		m_Core.StopSampler();
 		m_Core.EndHostManager();
 
 		m_Tab.Destroy();
@@ -1707,6 +1747,12 @@ void MainForm::OnSelChanged(ListView *pListView)
 		SetPropertyListValues();
 }
 
+void MainForm::OnScrolled(ListView *pListView)
+{
+	if (m_ResolveAddresses && static_cast<Widget*>(pListView) == m_TabWidgetList[m_CurTab])
+		ResolveVisibleAddresses();
+}
+
 // GraphView::EventHandler
 void MainForm::OnRButtonUp(GraphView *pGraphView, int x, int y)
 {
@@ -1762,6 +1808,10 @@ int MainForm::ShowMessage(int TitleID, int HeaderID, int MessageID,
 
 void MainForm::UpdateStatus()
 {
+	// A GeoIP database reloaded in the background may have failed
+	if (m_Core.CheckGeoIPReloadFailed())
+		ShowMessage(IDS_ERROR_CAPTION, IDS_ERROR_GEOIP_OPEN, 0, TDCBF_OK_BUTTON, TD_ERROR_ICON);
+
 	m_Core.UpdateConnectionStatus();
 	const ULONGLONG CurTime = m_Core.GetUpdatedTickCount();
 
@@ -1869,48 +1919,72 @@ void MainForm::UpdateStatus()
 	m_UpdatedTime = CurTime;
 }
 
+// The visible rows are requested first, so that they are admitted before the others
 void MainForm::ResolveAddresses()
 {
+	ResolveVisibleAddresses();
+
 	const int NumConnections = m_Core.NumConnections();
 
 	for (int i = 0; i < NumConnections; i++) {
-		class GetHostNameRequest : public HostManager::Request
-		{
-			HWND m_hwnd;
-			std::deque<IPAddress> &m_FoundHostList;
-			LocalLock &m_FoundHostLock;
-
-		public:
-			GetHostNameRequest(const IPAddress &Address, WORD Port, HWND hwnd,
-							   std::deque<IPAddress> &FoundHostList, LocalLock &FoundHostLock)
-				: Request(Address, Port)
-				, m_hwnd(hwnd)
-				, m_FoundHostList(FoundHostList)
-				, m_FoundHostLock(FoundHostLock)
-			{
-			}
+		ConnectionInfo Info;
 
-			void OnHostFound(LPCTSTR pHostName) override
-			{
-				m_FoundHostLock.Lock();
-				m_FoundHostList.push_back(m_Address);
-				m_FoundHostLock.Unlock();
-				::PostMessage(m_hwnd, WM_APP_HOSTFOUND, 0, 0);
-			}
-		};
+		m_Core.GetConnectionInfo(i, &Info);
+		RequestHostName(Info, HostManager::PRIORITY_ACTIVE);
+	}
+
+	// The log rows a page above and below the visible ones are resolved ahead of scrolling
+	if (m_CurTab == TAB_CONNECTION_LOG) {
+		int First, Last;
+
+		m_LogView.GetVisibleItemRange(&First, &Last);
+		const int Page = Last - First;
+		ResolveLogAddresses(max(First - Page, 0), First, HostManager::PRIORITY_HISTORY);
+		ResolveLogAddresses(Last, Last + Page, HostManager::PRIORITY_HISTORY);
+	}
+}
+
+void MainForm::ResolveVisibleAddresses()
+{
+	int First, Last;
 
+	if (m_CurTab == TAB_CONNECTION_LIST) {
 		ConnectionInfo Info;
 
-		m_Core.GetConnectionInfo(i, &Info);
-		if (!Info.RemoteAddress.IsZero()
-				&& (Info.RemoteAddress.Type != IP_ADDRESS_V4
-					|| Info.RemoteAddress.V4.Address != 0xFFFFFFFF)
-				&& !m_Core.GetHostName(Info.RemoteAddress, nullptr, 0))
-			m_Core.GetHostName(new GetHostNameRequest(Info.RemoteAddress, Info.RemotePort,
-							   m_Handle, m_FoundHostList, m_FoundHostLock));
+		m_ListView.GetVisibleItemRange(&First, &Last);
+		for (int i = First; i < Last; i++) {
+			if (m_ListView.GetItemConnectionInfo(i, &Info))
+				RequestHostName(Info, HostManager::PRIORITY_VISIBLE);
+		}
+	} else if (m_CurTab == TAB_CONNECTION_LOG) {
+		m_LogView.GetVisibleItemRange(&First, &Last);
+		ResolveLogAddresses(First, Last, HostManager::PRIORITY_VISIBLE);
+	}
+}
+
+// The compressed rows keep the names they had, so they are not resolved
+void MainForm::ResolveLogAddresses(int First, int Last, HostManager::RequestPriority Priority)
+{
+	ConnectionInfo Info;
+
+	if (Last > m_LogView.NumHotItems())
+		Last = m_LogView.NumHotItems();
+	for (int i = First; i < Last; i++) {
+		if (m_LogView.GetItemConnectionInfo(i, &Info))
+			RequestHostName(Info, Priority);
 	}
 }
 
+void MainForm::RequestHostName(const ConnectionInfo &Info, HostManager::RequestPriority Priority)
+{
+	if (!Info.RemoteAddress.IsZero()
+			&& (Info.RemoteAddress.Type != IP_ADDRESS_V4
+				|| Info.RemoteAddress.V4.Address != 0xFFFFFFFF)
+			&& !m_Core.GetHostName(Info.RemoteAddress, nullptr, 0))
+		m_Core.GetHostName(new HostNameRequest(Info.RemoteAddress, Info.RemotePort, Priority,
+											   m_Handle, m_FoundHostList, m_FoundHostLock));
+}
+
 void MainForm::SetCurTabStatusText()
 {
 	TCHAR szFormat[128], szText[256];
@@ -2010,9 +2084,22 @@ bool MainForm::ApplyPreferences(const AllPreferences &Pref)
 
 	const size_t LogItems = m_Core.GetConnectionLog().NumItems();
 	m_Core.SetConnectionLogMax(Pref.Log.MaxLog);
+	m_Core.SetConnectionLogColdAge(Pref.Log.ColdAge * 1000);
+	m_Core.SetConnectionLogCoalesceWindow(Pref.Log.CoalesceWindow * 1000);
+	m_Core.SetConnectionLogMergeThreads(Pref.Log.MergeThreads);
+	m_Core.SetSnapshotQueueOverflowPolicy(Pref.Log.QueueBlock ?
+										  SnapshotQueue::OVERFLOW_BLOCK :
+										  SnapshotQueue::OVERFLOW_DROP_OLDEST);
 	if (LogItems > Pref.Log.MaxLog)
 		m_LogView.OnListUpdated();
 
+	m_Core.SetHostResolverThreads(Pref.Core.ResolverThreads);
+	m_Core.SetHostResolverBudget(Pref.Core.ResolverBudget);
+	m_Core.SetHostResolverTimeout(Pref.Core.ResolverTimeout * 1000);
+	m_Core.SetHostResolverAsync(Pref.Core.AsyncResolver, Pref.Core.ResolverServers);
+	m_Core.SetHostCacheSize(max(Pref.Core.ResolverCacheSize, 0));
+	m_Core.SetHostNameTTL(Pref.Core.ResolverCacheTTL);
+
 	m_InterfaceListView.SetFont(Pref.List.Font);
 	m_InterfaceListView.ShowGrid(Pref.List.ShowGrid);
 	m_InterfaceListView.SetColors(Pref.List.TextColor, Pref.List.GridColor,
@@ -2056,19 +2143,40 @@ bool MainForm::ApplyPreferences(const AllPreferences &Pref)
 	if (m_CurTab == TAB_GRAPH)
 		m_GraphView.Redraw();
 
+	// The preference may be a file name in the directory of the executable,
+	// and is compared by the full path that the database is opened with
 	if (Pref.Core.GeoIPDatabaseFileName[0] != _T('\0')) {
 		const GeoIPManager &Manager = m_Core.GetGeoIPManager();
+		TCHAR szFilePath[MAX_PATH];
 		bool Open;
 
-		if (Manager.IsOpen()) {
+		if (Manager.IsOpen()
+				&& ProgramCore::GetDatabaseFilePath(Pref.Core.GeoIPDatabaseFileName, szFilePath)) {
 			TCHAR szFileName[MAX_PATH];
 
 			Manager.GetFileName(szFileName, cvLengthOf(szFileName));
-			Open = ::lstrcmpi(szFileName, Pref.Core.GeoIPDatabaseFileName) != 0;
+			Open = ::lstrcmpi(szFileName, szFilePath) != 0;
+		} else
+			Open = true;
+		if (Open && !m_Core.OpenGeoIP(Pref.Core.GeoIPDatabaseFileName))
+			ShowMessage(IDS_ERROR_CAPTION, IDS_ERROR_GEOIP_OPEN, 0, TDCBF_OK_BUTTON, TD_ERROR_ICON);
+	}
+
+	if (Pref.Core.GeoIPASDatabaseFileName[0] != _T('\0')) {
+		const GeoIPManager &Manager = m_Core.GetGeoIPManager();
+		TCHAR szFilePath[MAX_PATH];
+		bool Open;
+
+		if (Manager.IsASDatabaseOpen()
+				&& ProgramCore::GetDatabaseFilePath(Pref.Core.GeoIPASDatabaseFileName, szFilePath)) {
+			TCHAR szFileName[MAX_PATH];
+
+			Manager.GetASFileName(szFileName, cvLengthOf(szFileName));
+			Open = ::lstrcmpi(szFileName, szFilePath) != 0;
 		} else
 			Open = true;
-		if (Open)
-			m_Core.OpenGeoIP(Pref.Core.GeoIPDatabaseFileName);
+		if (Open && !m_Core.OpenGeoIPAS(Pref.Core.GeoIPASDatabaseFileName))
+			ShowMessage(IDS_ERROR_CAPTION, IDS_ERROR_GEOIP_OPEN, 0, TDCBF_OK_BUTTON, TD_ERROR_ICON);
 	}
 
 	return true;
@@ -91,12 +91,16 @@ private:
 	void OnItemRButtonUp(ListView *pListView, int x, int y) override;
 	void OnHeaderRButtonUp(ListView *pListView, int x, int y) override;
 	void OnSelChanged(ListView *pListView) override;
+	void OnScrolled(ListView *pListView) override;
 	// GraphView::EventHandler
 	void OnRButtonUp(GraphView *pGraphView, int x, int y) override;
 
 	void OnCommand(int Command, int NotifyCode = 0);
 	void UpdateStatus();
 	void ResolveAddresses();
+	void ResolveVisibleAddresses();
+	void ResolveLogAddresses(int First, int Last, HostManager::RequestPriority Priority);
+	void RequestHostName(const ConnectionInfo &Info, HostManager::RequestPriority Priority);
 	void SetCurTabStatusText();
 	void SetPropertyListNames();
 	void SetPropertyListValues();
@@ -143,7 +147,7 @@ private:
 	ULONGLONG m_UpdatedTime;
 	bool m_EnableNetworkIfStats;
 	NetworkInterfaceStatistics m_NetworkIfStats;
-	std::deque<IPAddress> m_FoundHostList;
+	std::vector<IPAddress> m_FoundHostList;
 	LocalLock m_FoundHostLock;
 	int m_CurTab;
 	int m_SaveFilterIndex;
@@ -42,6 +42,17 @@ CorePreferences::CorePreferences()
 void CorePreferences::SetDefault()
 {
 	GeoIPDatabaseFileName[0] = '\0';
+	GeoIPASDatabaseFileName[0] = '\0';
+	GeoIPMapFile = true;
+	GeoIPCacheSize = 4096;
+	ResolverThreads = 4;
+	ResolverBudget = 64;
+	ResolverTimeout = 30;
+	AsyncResolver = false;
+	ResolverServers[0] = '\0';
+	ResolverCacheSize = 16384;
+	ResolverCacheTTL = 60 * 60;
+	ResolverCacheFile = false;
 }
 
 
@@ -72,6 +83,12 @@ LogPreferences::LogPreferences()
 void LogPreferences::SetDefault()
 {
 	MaxLog = 1000;
+	ColdAge = 0;
+	CoalesceWindow = 0;
+	MergeThreads = 0;
+	SaveSnapshot = false;
+	SnapshotInterval = 0;
+	QueueBlock = false;
 }
 
 
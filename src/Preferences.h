@@ -34,6 +34,17 @@ namespace CV
 struct CorePreferences
 {
 	TCHAR GeoIPDatabaseFileName[MAX_PATH];
+	TCHAR GeoIPASDatabaseFileName[MAX_PATH];
+	bool GeoIPMapFile;
+	int GeoIPCacheSize;
+	int ResolverThreads;
+	int ResolverBudget;
+	unsigned int ResolverTimeout;
+	bool AsyncResolver;
+	TCHAR ResolverServers[256];
+	int ResolverCacheSize;
+	unsigned int ResolverCacheTTL;
+	bool ResolverCacheFile;
 
 	CorePreferences();
 	void SetDefault();
@@ -58,6 +69,12 @@ struct ListPreferences
 struct LogPreferences
 {
 	unsigned int MaxLog;
+	unsigned int ColdAge;
+	unsigned int CoalesceWindow;
+	int MergeThreads;
+	bool SaveSnapshot;
+	unsigned int SnapshotInterval;
+	bool QueueBlock;
 
 	LogPreferences();
 	void SetDefault();
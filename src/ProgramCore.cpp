@@ -26,6 +26,7 @@
 
 #include "ConnectionViewer.h"
 #include "ProgramCore.h"
+#include "LogSnapshot.h"
 
 
 namespace CV
@@ -34,32 +35,219 @@ namespace CV
 #pragma warning(disable : 4355)
 
 ProgramCore::ProgramCore()
-	: m_ConnectionLog(*this)
+	: m_hSamplerThread(nullptr)
+	, m_hSamplerStopEvent(nullptr)
+	, m_SampleInterval(0)
+	, m_ConnectionLog(*this)
 	, m_hinstLanguage(::GetModuleHandle(nullptr))
+	, m_LastSnapshotTick(0)
+#ifdef _DEBUG
+	, m_LastTraceTick(0)
+#endif
 {
+	m_Snapshot.NumTCPConnections = 0;
+	m_Snapshot.NumUDPConnections = 0;
+	m_szLogSnapshotFileName[0] = _T('\0');
 }
 
 ProgramCore::~ProgramCore()
 {
+	StopSampler();
 }
 
 void ProgramCore::UpdateConnectionStatus()
 {
-	m_ConnectionStatus.Update();
+	// Sampled here while the sampler thread isn't running, as on the first update
+	if (m_hSamplerThread == nullptr)
+		SampleConnections();
+
 	m_InterfaceStatus.Update();
 
 	m_UpdatedTime.SetCurrent();
 
-	m_ProcessList.BeginUpdate();
+	// No host name found on the previous update is in use at this point
+	m_HostManager.Quiesce();
+	m_HostManager.BeginAdmission();
+
+	// Every snapshot taken since the last update is added to the log in order, and the newest
+	// one is left in m_Snapshot for the list. The buffers are swapped with the queue, so
+	// a steady-state update neither copies nor allocates.
+	ConnectionSnapshot *pSnapshot;
+	while ((pSnapshot = m_SnapshotQueue.BeginRead()) != nullptr) {
+		m_Snapshot.Time = pSnapshot->Time;
+		m_Snapshot.NumTCPConnections = pSnapshot->NumTCPConnections;
+		m_Snapshot.NumUDPConnections = pSnapshot->NumUDPConnections;
+		m_Snapshot.ItemList.swap(pSnapshot->ItemList);
+		m_SnapshotQueue.EndRead();
+
+		m_ProcessList.BeginUpdate();
+		for (size_t i = 0; i < m_Snapshot.ItemList.size(); i++)
+			m_ProcessList.UpdateProcessInfo(m_Snapshot.ItemList[i].Info.PID);
+		m_ProcessList.EndUpdate();
+
+		m_ConnectionLog.OnListUpdated(m_Snapshot);
+	}
+
+	if (m_Preferences.Log.SaveSnapshot && m_Preferences.Log.SnapshotInterval > 0) {
+		if (m_LastSnapshotTick == 0) {
+			m_LastSnapshotTick = m_UpdatedTime.Tick;
+		} else if (m_UpdatedTime.Tick - m_LastSnapshotTick >=
+				(ULONGLONG)m_Preferences.Log.SnapshotInterval * 1000) {
+			// The log is copied here and written on a thread, which is left to finish if it is slow
+			if (m_szLogSnapshotFileName[0] != _T('\0') && !m_LogSnapshot.IsSaving()) {
+				m_LogSnapshot.BeginSave(m_szLogSnapshotFileName, m_ConnectionLog, m_HostManager);
+				m_LastSnapshotTick = m_UpdatedTime.Tick;
+			}
+		}
+	}
+
+#ifdef _DEBUG
+	if (m_UpdatedTime.Tick - m_LastTraceTick >= STATISTICS_TRACE_INTERVAL) {
+		m_LastTraceTick = m_UpdatedTime.Tick;
+		TraceStatistics();
+	}
+#endif
+}
+
+// The connections are sampled on a thread at the interval, so that taking the tables
+// runs apart from the log on the UI thread. If the UI doesn't keep up, the snapshots
+// wait in the queue, and the overflow policy decides what happens when it is full.
+bool ProgramCore::StartSampler(DWORD Interval)
+{
+	m_SampleInterval = Interval;
+	if (m_hSamplerThread != nullptr)
+		return true;
+
+	if (m_hSamplerStopEvent == nullptr) {
+		m_hSamplerStopEvent = ::CreateEvent(nullptr, TRUE, FALSE, nullptr);
+		if (m_hSamplerStopEvent == nullptr)
+			return false;
+	} else {
+		::ResetEvent(m_hSamplerStopEvent);
+	}
+	m_SnapshotQueue.CancelWrite(false);
+
+	m_hSamplerThread = ::CreateThread(nullptr, 0, SamplerThread, this, 0, nullptr);
+	if (m_hSamplerThread == nullptr)
+		return false;
+
+	return true;
+}
+
+void ProgramCore::StopSampler()
+{
+	if (m_hSamplerThread != nullptr) {
+		::SetEvent(m_hSamplerStopEvent);
+		m_SnapshotQueue.CancelWrite(true);
+		::WaitForSingleObject(m_hSamplerThread, INFINITE);
+		::CloseHandle(m_hSamplerThread);
+		m_hSamplerThread = nullptr;
+		m_SnapshotQueue.CancelWrite(false);
+	}
+	if (m_hSamplerStopEvent != nullptr) {
+		::CloseHandle(m_hSamplerStopEvent);
+		m_hSamplerStopEvent = nullptr;
+	}
+}
+
+void ProgramCore::SetSnapshotQueueOverflowPolicy(SnapshotQueue::OverflowPolicy Policy)
+{
+	m_SnapshotQueue.SetOverflowPolicy(Policy);
+}
+
+void ProgramCore::GetSnapshotQueueStatistics(SnapshotQueue::QueueStatistics *pStatistics) const
+{
+	m_SnapshotQueue.GetStatistics(pStatistics);
+}
+
+// The producer of m_SnapshotQueue.
+// Returns false if the write is cancelled while waiting for the consumer.
+bool ProgramCore::SampleConnections()
+{
+	m_ConnectionStatus.Update();
+
+	ConnectionSnapshot *pSnapshot = m_SnapshotQueue.BeginWrite();
+	if (pSnapshot == nullptr)
+		return false;
+
 	const int NumConnections = m_ConnectionStatus.NumConnections();
+	pSnapshot->Time.SetCurrent();
+	pSnapshot->NumTCPConnections = m_ConnectionStatus.NumTCPConnections();
+	pSnapshot->NumUDPConnections = m_ConnectionStatus.NumUDPConnections();
+	pSnapshot->ItemList.resize(NumConnections);
 	for (int i = 0; i < NumConnections; i++) {
-		m_ProcessList.UpdateProcessInfo(m_ConnectionStatus.GetConnectionPID(i));
+		ConnectionSnapshot::ItemInfo &Item = pSnapshot->ItemList[i];
+
+		m_ConnectionStatus.GetConnectionInfo(i, &Item.Info);
+		Item.EnableStatistics = m_ConnectionStatus.GetConnectionStatistics(i, &Item.Statistics);
 	}
-	m_ProcessList.EndUpdate();
 
-	m_ConnectionLog.OnListUpdated();
+	m_SnapshotQueue.EndWrite();
+
+	return true;
 }
 
+DWORD WINAPI ProgramCore::SamplerThread(LPVOID pParameter)
+{
+	ProgramCore *pThis = static_cast<ProgramCore*>(pParameter);
+
+	while (::WaitForSingleObject(pThis->m_hSamplerStopEvent, pThis->m_SampleInterval) == WAIT_TIMEOUT) {
+		if (!pThis->SampleConnections())
+			break;
+	}
+
+	return 0;
+}
+
+#ifdef _DEBUG
+// The counters are written to the debugger output at STATISTICS_TRACE_INTERVAL
+void ProgramCore::TraceStatistics() const
+{
+	SnapshotQueue::QueueStatistics QueueStatistics;
+	m_SnapshotQueue.GetStatistics(&QueueStatistics);
+	cvDebugTrace(TEXT("Snapshot queue : depth %u (max %u) / pushed %llu / dropped %llu / blocked %llu\n"),
+				 QueueStatistics.Depth, QueueStatistics.MaxDepth,
+				 QueueStatistics.Pushed, QueueStatistics.Dropped, QueueStatistics.Blocked);
+
+	HostManager::ResolverStatistics ResolverStatistics;
+	m_HostManager.GetResolverStatistics(&ResolverStatistics);
+	cvDebugTrace(TEXT("Resolver : %d threads / queue %u / in flight %u / resolved %llu / failed %llu / timed out %llu / cancelled %llu\n"),
+				 ResolverStatistics.NumThreads,
+				 (UINT)ResolverStatistics.QueueLength, (UINT)ResolverStatistics.InFlight,
+				 ResolverStatistics.Resolved, ResolverStatistics.Failed,
+				 ResolverStatistics.TimedOut, ResolverStatistics.Cancelled);
+	cvDebugTrace(TEXT("Resolver : deferred %llu / fallback %llu / promoted %llu / negative hits %llu / file hits %llu\n"),
+				 ResolverStatistics.Deferred, ResolverStatistics.Fallback,
+				 ResolverStatistics.Promoted, ResolverStatistics.NegativeHits,
+				 ResolverStatistics.FileHits);
+	cvDebugTrace(TEXT("Host cache : %u entries (%u negative) / evicted %llu / expired %llu\n"),
+				 (UINT)ResolverStatistics.CacheEntries, (UINT)ResolverStatistics.NegativeEntries,
+				 ResolverStatistics.Evicted, ResolverStatistics.Expired);
+	cvDebugTrace(TEXT("Resolver latency (10ms/100ms/1s/10s/longer) : %llu %llu %llu %llu %llu / visible %llu %llu %llu %llu %llu\n"),
+				 ResolverStatistics.LatencyHistogram[HostManager::LATENCY_CLASS_10MSEC],
+				 ResolverStatistics.LatencyHistogram[HostManager::LATENCY_CLASS_100MSEC],
+				 ResolverStatistics.LatencyHistogram[HostManager::LATENCY_CLASS_1SEC],
+				 ResolverStatistics.LatencyHistogram[HostManager::LATENCY_CLASS_10SEC],
+				 ResolverStatistics.LatencyHistogram[HostManager::LATENCY_CLASS_LONG],
+				 ResolverStatistics.VisibleLatencyHistogram[HostManager::LATENCY_CLASS_10MSEC],
+				 ResolverStatistics.VisibleLatencyHistogram[HostManager::LATENCY_CLASS_100MSEC],
+				 ResolverStatistics.VisibleLatencyHistogram[HostManager::LATENCY_CLASS_1SEC],
+				 ResolverStatistics.VisibleLatencyHistogram[HostManager::LATENCY_CLASS_10SEC],
+				 ResolverStatistics.VisibleLatencyHistogram[HostManager::LATENCY_CLASS_LONG]);
+
+	GeoIPManager::CacheStatistics GeoIPStatistics;
+	m_GeoIPManager.GetCacheStatistics(&GeoIPStatistics);
+	cvDebugTrace(TEXT("GeoIP cache : %u entries / query %llu / hit %llu / miss %llu / evicted %llu\n"),
+				 (UINT)GeoIPStatistics.CacheEntries, GeoIPStatistics.Queries,
+				 GeoIPStatistics.Hits, GeoIPStatistics.Misses, GeoIPStatistics.Evicted);
+
+	cvDebugTrace(TEXT("Log strings : pool %u bytes / live %u bytes / dead %u bytes\n"),
+				 (UINT)m_ConnectionLog.GetStringPoolSize(),
+				 (UINT)m_ConnectionLog.GetLiveStringSize(),
+				 (UINT)m_ConnectionLog.GetDeadStringSize());
+}
+#endif
+
 ULONGLONG ProgramCore::GetUpdatedTickCount() const
 {
 	return m_UpdatedTime.Tick;
@@ -72,27 +260,38 @@ const TimeAndTick &ProgramCore::GetUpdatedTime() const
 
 int ProgramCore::NumConnections() const
 {
-	return m_ConnectionStatus.NumConnections();
+	return (int)m_Snapshot.ItemList.size();
 }
 
 int ProgramCore::NumTCPConnections() const
 {
-	return m_ConnectionStatus.NumTCPConnections();
+	return m_Snapshot.NumTCPConnections;
 }
 
 int ProgramCore::NumUDPConnections() const
 {
-	return m_ConnectionStatus.NumUDPConnections();
+	return m_Snapshot.NumUDPConnections;
 }
 
 bool ProgramCore::GetConnectionInfo(int Index, ConnectionInfo *pInfo) const
 {
-	return m_ConnectionStatus.GetConnectionInfo(Index, pInfo);
+	if (Index < 0 || (size_t)Index >= m_Snapshot.ItemList.size())
+		return false;
+
+	*pInfo = m_Snapshot.ItemList[Index].Info;
+
+	return true;
 }
 
 bool ProgramCore::GetConnectionStatistics(int Index, ConnectionStatistics *pStatistics) const
 {
-	return m_ConnectionStatus.GetConnectionStatistics(Index, pStatistics);
+	if (Index < 0 || (size_t)Index >= m_Snapshot.ItemList.size()
+			|| !m_Snapshot.ItemList[Index].EnableStatistics)
+		return false;
+
+	*pStatistics = m_Snapshot.ItemList[Index].Statistics;
+
+	return true;
 }
 
 const ConnectionLog &ProgramCore::GetConnectionLog() const
@@ -105,14 +304,51 @@ void ProgramCore::SetConnectionLogMax(size_t Max)
 	m_ConnectionLog.SetMaxLog(Max);
 }
 
+void ProgramCore::SetConnectionLogColdAge(DWORD Age)
+{
+	m_ConnectionLog.SetColdAge(Age);
+}
+
+void ProgramCore::SetConnectionLogCoalesceWindow(DWORD Window)
+{
+	m_ConnectionLog.SetCoalesceWindow(Window);
+}
+
+void ProgramCore::SetConnectionLogMergeThreads(int Threads)
+{
+	m_ConnectionLog.SetMergeThreads(Threads);
+}
+
 void ProgramCore::ClearConnectionLog()
 {
 	m_ConnectionLog.Clear();
 }
 
-bool ProgramCore::OnHostNameFound(const IPAddress &Address)
+void ProgramCore::SetLogSnapshotFileName(LPCTSTR pFileName)
 {
-	return m_ConnectionLog.OnHostNameFound(Address);
+	::lstrcpyn(m_szLogSnapshotFileName, pFileName, cvLengthOf(m_szLogSnapshotFileName));
+}
+
+bool ProgramCore::SaveLogSnapshot()
+{
+	if (m_szLogSnapshotFileName[0] == _T('\0'))
+		return false;
+
+	return m_LogSnapshot.Save(m_szLogSnapshotFileName, m_ConnectionLog, m_HostManager);
+}
+
+bool ProgramCore::LoadLogSnapshot()
+{
+	if (m_szLogSnapshotFileName[0] == _T('\0'))
+		return false;
+
+	return LogSnapshot::Load(m_szLogSnapshotFileName, &m_ConnectionLog, &m_HostManager);
+}
+
+void ProgramCore::OnHostNamesFound(const std::vector<IPAddress> &AddressList,
+								   std::vector<IPAddress> *pFoundList)
+{
+	m_ConnectionLog.OnHostNamesFound(AddressList, pFoundList);
 }
 
 int ProgramCore::NumNetworkInterfaces() const
@@ -165,25 +401,94 @@ bool ProgramCore::GetHostName(const IPAddress &Address, LPTSTR pHostName, int Ma
 	return m_HostManager.GetHostName(Address, pHostName, MaxLength);
 }
 
+LPCTSTR ProgramCore::FindHostName(const IPAddress &Address) const
+{
+	return m_HostManager.FindHostName(Address);
+}
+
 void ProgramCore::EndHostManager()
 {
 	m_HostManager.EndThread();
 }
 
-bool ProgramCore::OpenGeoIP(LPCTSTR pFileName)
+void ProgramCore::SetHostResolverThreads(int Threads)
+{
+	m_HostManager.SetResolverThreads(Threads);
+}
+
+void ProgramCore::SetHostResolverBudget(int Budget)
+{
+	m_HostManager.SetAdmissionBudget(Budget);
+}
+
+void ProgramCore::SetHostResolverTimeout(DWORD Timeout)
+{
+	m_HostManager.SetResolveTimeout(Timeout);
+}
+
+void ProgramCore::SetHostResolverAsync(bool Enable, LPCTSTR pServers)
+{
+	m_HostManager.SetAsyncResolver(Enable, pServers);
+}
+
+void ProgramCore::SetHostCacheSize(size_t MaxEntries)
+{
+	m_HostManager.SetCacheSize(MaxEntries);
+}
+
+void ProgramCore::SetHostNameTTL(DWORD TTL)
+{
+	m_HostManager.SetHostNameTTL(TTL);
+}
+
+bool ProgramCore::OpenHostCacheFile(LPCTSTR pFileName)
+{
+	return m_HostManager.OpenCacheFile(pFileName);
+}
+
+void ProgramCore::CloseHostCacheFile()
+{
+	m_HostManager.CloseCacheFile();
+}
+
+// A relative file name of a database is in the directory of the executable
+bool ProgramCore::GetDatabaseFilePath(LPCTSTR pFileName, LPTSTR pFilePath)
 {
 	if (::PathIsRelative(pFileName)) {
-		TCHAR szTemp[MAX_PATH], szFileName[MAX_PATH];
+		TCHAR szTemp[MAX_PATH];
 
 		::GetModuleFileName(nullptr, szTemp, cvLengthOf(szTemp));
 		::PathRemoveFileSpec(szTemp);
 		if (::lstrlen(szTemp) + 1 +::lstrlen(pFileName) >= MAX_PATH)
 			return false;
 		::PathAppend(szTemp, pFileName);
-		::PathCanonicalize(szFileName, szTemp);
-		return m_GeoIPManager.Open(szFileName);
+		::PathCanonicalize(pFilePath, szTemp);
+		return true;
 	}
-	return m_GeoIPManager.Open(pFileName);
+	if (::lstrlen(pFileName) >= MAX_PATH)
+		return false;
+	::lstrcpy(pFilePath, pFileName);
+	return true;
+}
+
+// A database already open is replaced once the new one has loaded and its lookup table is built
+// in the background, and the lookups go on meanwhile. Returns false if the new one fails to load
+// here. Without the file mapped, it is loaded in the background, and CheckGeoIPReloadFailed()
+// tells if that fails.
+bool ProgramCore::OpenGeoIP(LPCTSTR pFileName)
+{
+	m_GeoIPManager.SetMapFile(m_Preferences.Core.GeoIPMapFile);
+	m_GeoIPManager.SetCacheSize(max(m_Preferences.Core.GeoIPCacheSize, 0));
+
+	TCHAR szFileName[MAX_PATH];
+	if (!GetDatabaseFilePath(pFileName, szFileName))
+		return false;
+	return m_GeoIPManager.Reload(szFileName);
+}
+
+bool ProgramCore::CheckGeoIPReloadFailed()
+{
+	return m_GeoIPManager.CheckReloadFailed();
 }
 
 bool ProgramCore::GetGeoIPCountryInfo(const IPAddress &Address, GeoIPManager::CountryInfo *pInfo) const
@@ -196,6 +501,28 @@ bool ProgramCore::GetGeoIPCityInfo(const IPAddress &Address, GeoIPManager::CityI
 	return m_GeoIPManager.GetCityInfo(Address, pInfo);
 }
 
+void ProgramCore::GetGeoIPCityInfoBatch(const IPAddress *pAddressList, size_t Count,
+										GeoIPManager::CityInfo * const *ppInfoList,
+										bool * const *ppFoundList) const
+{
+	m_GeoIPManager.GetCityInfoBatch(pAddressList, Count, ppInfoList, ppFoundList);
+}
+
+bool ProgramCore::OpenGeoIPAS(LPCTSTR pFileName)
+{
+	m_GeoIPManager.SetMapFile(m_Preferences.Core.GeoIPMapFile);
+
+	TCHAR szFileName[MAX_PATH];
+	if (!GetDatabaseFilePath(pFileName, szFileName))
+		return false;
+	return m_GeoIPManager.OpenASDatabase(szFileName);
+}
+
+bool ProgramCore::GetGeoIPASInfo(const IPAddress &Address, GeoIPManager::ASInfo *pInfo) const
+{
+	return m_GeoIPManager.GetASInfo(Address, pInfo);
+}
+
 const GeoIPManager &ProgramCore::GetGeoIPManager() const
 {
 	return m_GeoIPManager;
@@ -231,6 +558,21 @@ bool ProgramCore::LoadPreferences(Settings *pSettings)
 	pSettings->Read(TEXT("GeoIP.Database"),
 					m_Preferences.Core.GeoIPDatabaseFileName,
 					cvLengthOf(m_Preferences.Core.GeoIPDatabaseFileName));
+	pSettings->Read(TEXT("GeoIP.ASDatabase"),
+					m_Preferences.Core.GeoIPASDatabaseFileName,
+					cvLengthOf(m_Preferences.Core.GeoIPASDatabaseFileName));
+	pSettings->Read(TEXT("GeoIP.MapFile"), &m_Preferences.Core.GeoIPMapFile);
+	pSettings->Read(TEXT("GeoIP.CacheSize"), &m_Preferences.Core.GeoIPCacheSize);
+	pSettings->Read(TEXT("Resolver.Threads"), &m_Preferences.Core.ResolverThreads);
+	pSettings->Read(TEXT("Resolver.Budget"), &m_Preferences.Core.ResolverBudget);
+	pSettings->Read(TEXT("Resolver.Timeout"), &m_Preferences.Core.ResolverTimeout);
+	pSettings->Read(TEXT("Resolver.Async"), &m_Preferences.Core.AsyncResolver);
+	pSettings->Read(TEXT("Resolver.Servers"),
+					m_Preferences.Core.ResolverServers,
+					cvLengthOf(m_Preferences.Core.ResolverServers));
+	pSettings->Read(TEXT("Resolver.CacheSize"), &m_Preferences.Core.ResolverCacheSize);
+	pSettings->Read(TEXT("Resolver.CacheTTL"), &m_Preferences.Core.ResolverCacheTTL);
+	pSettings->Read(TEXT("Resolver.CacheFile"), &m_Preferences.Core.ResolverCacheFile);
 
 	TCHAR szFontName[LF_FACESIZE];
 	if (pSettings->Read(TEXT("List.FontName"), szFontName, cvLengthOf(szFontName))
@@ -266,6 +608,12 @@ bool ProgramCore::LoadPreferences(Settings *pSettings)
 	unsigned int MaxLog;
 	if (pSettings->Read(TEXT("Log.Max"), &MaxLog))
 		m_Preferences.Log.MaxLog = MaxLog;
+	pSettings->Read(TEXT("Log.ColdAge"), &m_Preferences.Log.ColdAge);
+	pSettings->Read(TEXT("Log.CoalesceWindow"), &m_Preferences.Log.CoalesceWindow);
+	pSettings->Read(TEXT("Log.MergeThreads"), &m_Preferences.Log.MergeThreads);
+	pSettings->Read(TEXT("Log.Snapshot"), &m_Preferences.Log.SaveSnapshot);
+	pSettings->Read(TEXT("Log.SnapshotInterval"), &m_Preferences.Log.SnapshotInterval);
+	pSettings->Read(TEXT("Log.QueueBlock"), &m_Preferences.Log.QueueBlock);
 
 	pSettings->ReadColor(TEXT("Graph.BackColor"), &m_Preferences.Graph.BackColor);
 	pSettings->ReadColor(TEXT("Graph.GridColor"), &m_Preferences.Graph.GridColor);
@@ -294,6 +642,18 @@ bool ProgramCore::SavePreferences(Settings *pSettings) const
 {
 	pSettings->Write(TEXT("GeoIP.Database"),
 					 m_Preferences.Core.GeoIPDatabaseFileName);
+	pSettings->Write(TEXT("GeoIP.ASDatabase"),
+					 m_Preferences.Core.GeoIPASDatabaseFileName);
+	pSettings->Write(TEXT("GeoIP.MapFile"), m_Preferences.Core.GeoIPMapFile);
+	pSettings->Write(TEXT("GeoIP.CacheSize"), m_Preferences.Core.GeoIPCacheSize);
+	pSettings->Write(TEXT("Resolver.Threads"), m_Preferences.Core.ResolverThreads);
+	pSettings->Write(TEXT("Resolver.Budget"), m_Preferences.Core.ResolverBudget);
+	pSettings->Write(TEXT("Resolver.Timeout"), m_Preferences.Core.ResolverTimeout);
+	pSettings->Write(TEXT("Resolver.Async"), m_Preferences.Core.AsyncResolver);
+	pSettings->Write(TEXT("Resolver.Servers"), m_Preferences.Core.ResolverServers);
+	pSettings->Write(TEXT("Resolver.CacheSize"), m_Preferences.Core.ResolverCacheSize);
+	pSettings->Write(TEXT("Resolver.CacheTTL"), m_Preferences.Core.ResolverCacheTTL);
+	pSettings->Write(TEXT("Resolver.CacheFile"), m_Preferences.Core.ResolverCacheFile);
 
 	pSettings->Write(TEXT("List.FontName"), m_Preferences.List.Font.lfFaceName);
 	pSettings->Write(TEXT("List.FontHeight"), m_Preferences.List.Font.lfHeight);
@@ -308,6 +668,12 @@ bool ProgramCore::SavePreferences(Settings *pSettings) const
 	pSettings->WriteColor(TEXT("List.New.BackColor"), m_Preferences.List.NewBackColor);
 
 	pSettings->Write(TEXT("Log.Max"), (unsigned int)m_Preferences.Log.MaxLog);
+	pSettings->Write(TEXT("Log.ColdAge"), m_Preferences.Log.ColdAge);
+	pSettings->Write(TEXT("Log.CoalesceWindow"), m_Preferences.Log.CoalesceWindow);
+	pSettings->Write(TEXT("Log.MergeThreads"), m_Preferences.Log.MergeThreads);
+	pSettings->Write(TEXT("Log.Snapshot"), m_Preferences.Log.SaveSnapshot);
+	pSettings->Write(TEXT("Log.SnapshotInterval"), m_Preferences.Log.SnapshotInterval);
+	pSettings->Write(TEXT("Log.QueueBlock"), m_Preferences.Log.QueueBlock);
 
 	pSettings->WriteColor(TEXT("Graph.BackColor"), m_Preferences.Graph.BackColor);
 	pSettings->WriteColor(TEXT("Graph.GridColor"), m_Preferences.Graph.GridColor);
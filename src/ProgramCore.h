@@ -32,6 +32,7 @@
 #include "Process.h"
 #include "HostManager.h"
 #include "ConnectionLog.h"
+#include "LogSnapshot.h"
 #include "GeoIPManager.h"
 #include "FilterManager.h"
 #include "Preferences.h"
@@ -47,6 +48,10 @@ public:
 	ProgramCore();
 	~ProgramCore();
 	void UpdateConnectionStatus();
+	bool StartSampler(DWORD Interval);
+	void StopSampler();
+	void SetSnapshotQueueOverflowPolicy(SnapshotQueue::OverflowPolicy Policy);
+	void GetSnapshotQueueStatistics(SnapshotQueue::QueueStatistics *pStatistics) const;
 	ULONGLONG GetUpdatedTickCount() const;
 	const TimeAndTick &GetUpdatedTime() const;
 
@@ -58,8 +63,15 @@ public:
 
 	const ConnectionLog &GetConnectionLog() const;
 	void SetConnectionLogMax(size_t Max);
+	void SetConnectionLogColdAge(DWORD Age);
+	void SetConnectionLogCoalesceWindow(DWORD Window);
+	void SetConnectionLogMergeThreads(int Threads);
 	void ClearConnectionLog();
-	bool OnHostNameFound(const IPAddress &Address);
+	void SetLogSnapshotFileName(LPCTSTR pFileName);
+	bool SaveLogSnapshot();
+	bool LoadLogSnapshot();
+	void OnHostNamesFound(const std::vector<IPAddress> &AddressList,
+						  std::vector<IPAddress> *pFoundList);
 
 	int NumNetworkInterfaces() const;
 	const MIB_IF_ROW2 *GetNetworkInterfaceInfo(int Index) const;
@@ -73,12 +85,28 @@ public:
 
 	bool GetHostName(HostManager::Request *pRequest);
 	bool GetHostName(const IPAddress &Address, LPTSTR pHostName, int MaxLength) const;
+	LPCTSTR FindHostName(const IPAddress &Address) const;
 	void EndHostManager();
+	void SetHostResolverThreads(int Threads);
+	void SetHostResolverBudget(int Budget);
+	void SetHostResolverTimeout(DWORD Timeout);
+	void SetHostResolverAsync(bool Enable, LPCTSTR pServers);
+	void SetHostCacheSize(size_t MaxEntries);
+	void SetHostNameTTL(DWORD TTL);
+	bool OpenHostCacheFile(LPCTSTR pFileName);
+	void CloseHostCacheFile();
 
 	bool OpenGeoIP(LPCTSTR pFileName);
+	bool CheckGeoIPReloadFailed();
 	bool GetGeoIPCountryInfo(const IPAddress &Address, GeoIPManager::CountryInfo *pInfo) const;
 	bool GetGeoIPCityInfo(const IPAddress &Address, GeoIPManager::CityInfo *pInfo) const;
+	void GetGeoIPCityInfoBatch(const IPAddress *pAddressList, size_t Count,
+							   GeoIPManager::CityInfo * const *ppInfoList,
+							   bool * const *ppFoundList) const;
+	bool OpenGeoIPAS(LPCTSTR pFileName);
+	bool GetGeoIPASInfo(const IPAddress &Address, GeoIPManager::ASInfo *pInfo) const;
 	const GeoIPManager &GetGeoIPManager() const;
+	static bool GetDatabaseFilePath(LPCTSTR pFileName, LPTSTR pFilePath);
 
 	FilterManager &GetFilterManager();
 	const FilterManager &GetFilterManager() const;
@@ -92,7 +120,22 @@ public:
 	AllPreferences &GetPreferences();
 
 private:
+	enum { STATISTICS_TRACE_INTERVAL = 60 * 1000 };
+
+	bool SampleConnections();
+	static DWORD WINAPI SamplerThread(LPVOID pParameter);
+#ifdef _DEBUG
+	void TraceStatistics() const;
+#endif
+
+	// m_ConnectionStatus is only used by the producer of m_SnapshotQueue, which is
+	// the sampler thread while it is running. m_Snapshot is the newest snapshot read.
 	ConnectionStatus m_ConnectionStatus;
+	SnapshotQueue m_SnapshotQueue;
+	HANDLE m_hSamplerThread;
+	HANDLE m_hSamplerStopEvent;
+	volatile DWORD m_SampleInterval;
+	ConnectionSnapshot m_Snapshot;
 	NetworkInterfaceStatus m_InterfaceStatus;
 	ProcessList m_ProcessList;
 	HostManager m_HostManager;
@@ -101,6 +144,12 @@ private:
 	FilterManager m_FilterManager;
 	TimeAndTick m_UpdatedTime;
 	ULONGLONG m_UpdatedTickCount;
+	TCHAR m_szLogSnapshotFileName[MAX_PATH];
+	LogSnapshot m_LogSnapshot;
+	ULONGLONG m_LastSnapshotTick;
+#ifdef _DEBUG
+	ULONGLONG m_LastTraceTick;
+#endif
 	HINSTANCE m_hinstLanguage;
 	AllPreferences m_Preferences;
 };
@@ -0,0 +1,782 @@
+/******************************************************************************
+*                                                                             *
+*    SelfTest.cpp                           Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "ConnectionViewer.h"
+
+
+#ifdef _DEBUG
+
+
+#include <vector>
+#include <algorithm>
+#include <crtdbg.h>
+#include "SelfTest.h"
+#include "HostManager.h"
+#include "GeoIPManager.h"
+#include "ProgramCore.h"
+#include "Utility.h"
+#include "libGeoIP/GeoIP.h"
+#include "libGeoIP/GeoIPCity.h"
+
+
+namespace CV
+{
+
+enum
+{
+	TEST_DURATION			= 2000,
+	HOST_TEST_CACHE_ENTRIES	= 4096,
+	HOST_TEST_QUIESCE_READS	= 256,
+	GEOIP_TEST_ADDRESSES	= 200000,
+	GEOIP_TEST_ZIPF_POOL	= 65536,
+	GEOIP_TEST_V6_EDGES		= 1000,
+	GEOIP_TEST_RECORDS		= 20000,
+	LOG_TEST_MERGES			= 20,
+	LOG_TEST_CLOSED_RATIO	= 20,
+	MAX_TRACED_MISMATCHES	= 8
+};
+
+// The results of the timed loops are stored here, so that the loops are not optimized away
+static volatile UINT g_TimingSink;
+
+static unsigned int NextRandom(unsigned int *pRandom)
+{
+	*pRandom = *pRandom * 1103515245 + 12345;
+	return *pRandom >> 8;
+}
+
+static DWORD NextRandomAddress(unsigned int *pRandom)
+{
+	return (NextRandom(pRandom) << 16) ^ NextRandom(pRandom);
+}
+
+static volatile LONG g_NumAllocations;
+
+static int __cdecl CountAllocHook(int AllocType, void *pUserData, size_t Size, int BlockType,
+								  long RequestNumber, const unsigned char *pFileName, int LineNumber)
+{
+	if (AllocType == _HOOK_ALLOC || AllocType == _HOOK_REALLOC)
+		::InterlockedIncrement(&g_NumAllocations);
+	return TRUE;
+}
+
+// The strings of libGeoIP are in ISO-8859-1, whose code points are the same in Unicode.
+// The string decoded is truncated to MaxLength.
+static bool MatchGeoIPString(LPCTSTR pString, int MaxLength, const char *pGeoIPString)
+{
+	if (pGeoIPString == nullptr)
+		return pString[0] == _T('\0');
+
+	int i = 0;
+	for (; i + 1 < MaxLength && pGeoIPString[i] != '\0'; i++) {
+		if ((TBYTE)pString[i] != (BYTE)pGeoIPString[i])
+			return false;
+	}
+	return pString[i] == _T('\0');
+}
+
+static GeoIP *OpenTestDatabase(LPCTSTR pFileName)
+{
+#ifdef UNICODE
+	char szFileName[MAX_PATH];
+	if (::WideCharToMultiByte(CP_ACP, WC_NO_BEST_FIT_CHARS,
+							  pFileName, -1, szFileName, cvLengthOf(szFileName),
+							  nullptr, nullptr) <= 0)
+		return nullptr;
+	return ::GeoIP_open(szFileName, GEOIP_MEMORY_CACHE);
+#else
+	return ::GeoIP_open(pFileName, GEOIP_MEMORY_CACHE);
+#endif
+}
+
+static UINT GetElapsedNanoseconds(const LARGE_INTEGER &Start, const LARGE_INTEGER &End, size_t Count)
+{
+	LARGE_INTEGER Frequency;
+
+	::QueryPerformanceFrequency(&Frequency);
+	return (UINT)((double)(End.QuadPart - Start.QuadPart) * 1.0e9
+				  / ((double)Frequency.QuadPart * (double)Count));
+}
+
+static void GetTestHostName(DWORD Address, LPTSTR pHostName, int MaxLength)
+{
+	FormatString(pHostName, MaxLength, TEXT("host-%08x.example.net"), Address);
+}
+
+static void AddTestHostName(HostManager *pManager, DWORD Address)
+{
+	IPAddress HostAddress;
+	TCHAR szHostName[64];
+
+	HostAddress.SetV4Address(Address);
+	GetTestHostName(Address, szHostName, cvLengthOf(szHostName));
+	pManager->AddHostName(HostAddress, szHostName);
+}
+
+struct HostWriterContext
+{
+	HostManager *pManager;
+	volatile bool Stop;
+	volatile LONG NumWritten;
+};
+
+// Adds new names as fast as it can, so that the cache is full and entries are replaced
+static DWORD WINAPI HostWriterThread(LPVOID pParameter)
+{
+	HostWriterContext *pContext = static_cast<HostWriterContext*>(pParameter);
+
+	while (!pContext->Stop) {
+		AddTestHostName(pContext->pManager, 0x0A000000 + (DWORD)pContext->NumWritten);
+		::InterlockedIncrement(&pContext->NumWritten);
+	}
+
+	return 0;
+}
+
+// Looks up the recently added addresses for TEST_DURATION, and checks that the names found match.
+// Returns the number of lookups.
+static ULONGLONG ReadHostNames(HostManager &Manager, const HostWriterContext &Context,
+							   ULONGLONG *pFound, ULONGLONG *pMismatched)
+{
+	unsigned int Random = 12345;
+	ULONGLONG NumRead = 0;
+	const ULONGLONG StartTick = ::GetTickCount64();
+
+	*pFound = 0;
+	*pMismatched = 0;
+
+	while (::GetTickCount64() - StartTick < TEST_DURATION) {
+		for (int i = 0; i < HOST_TEST_QUIESCE_READS; i++) {
+			const DWORD NumWritten = (DWORD)Context.NumWritten;
+			const DWORD Address = 0x0A000000 + (NumWritten - NextRandom(&Random) % HOST_TEST_CACHE_ENTRIES);
+			IPAddress HostAddress;
+
+			HostAddress.SetV4Address(Address);
+			LPCTSTR pHostName = Manager.FindHostName(HostAddress);
+			if (pHostName != nullptr) {
+				TCHAR szExpected[64];
+
+				GetTestHostName(Address, szExpected, cvLengthOf(szExpected));
+				if (::lstrcmp(pHostName, szExpected) != 0)
+					(*pMismatched)++;
+				(*pFound)++;
+			}
+		}
+		NumRead += HOST_TEST_QUIESCE_READS;
+		Manager.Quiesce();
+	}
+
+	return NumRead;
+}
+
+// Measures FindHostName() alone, and then while a thread keeps adding names
+bool TestHostManager()
+{
+	HostManager Manager;
+	HostWriterContext Context;
+	ULONGLONG NumFound, NumMismatched;
+
+	Manager.SetCacheSize(HOST_TEST_CACHE_ENTRIES);
+	Context.pManager = &Manager;
+	Context.Stop = false;
+	Context.NumWritten = 0;
+
+	for (int i = 0; i < HOST_TEST_CACHE_ENTRIES; i++) {
+		AddTestHostName(&Manager, 0x0A000000 + (DWORD)Context.NumWritten);
+		Context.NumWritten++;
+	}
+
+	const ULONGLONG NumIdleRead = ReadHostNames(Manager, Context, &NumFound, &NumMismatched);
+	bool Passed = NumMismatched == 0 && NumFound > 0;
+	cvDebugTrace(TEXT("HostManager test idle : %s (%llu lookups/s, %llu found, %llu mismatched)\n"),
+				 Passed ? TEXT("passed") : TEXT("FAILED"),
+				 NumIdleRead * 1000 / TEST_DURATION, NumFound, NumMismatched);
+
+	HANDLE hThread = ::CreateThread(nullptr, 0, HostWriterThread, &Context, 0, nullptr);
+	if (hThread == nullptr) {
+		cvDebugTrace(TEXT("HostManager test : The writer thread could not be created\n"));
+		return false;
+	}
+	const LONG StartWritten = Context.NumWritten;
+	const ULONGLONG NumBusyRead = ReadHostNames(Manager, Context, &NumFound, &NumMismatched);
+	Context.Stop = true;
+	::WaitForSingleObject(hThread, INFINITE);
+	::CloseHandle(hThread);
+	Manager.Quiesce();
+
+	const bool BusyPassed = NumMismatched == 0;
+	cvDebugTrace(TEXT("HostManager test contended : %s (%llu lookups/s, %llu inserts/s, %llu found, %llu mismatched)\n"),
+				 BusyPassed ? TEXT("passed") : TEXT("FAILED"),
+				 NumBusyRead * 1000 / TEST_DURATION,
+				 (ULONGLONG)(Context.NumWritten - StartWritten) * 1000 / TEST_DURATION,
+				 NumFound, NumMismatched);
+
+	return Passed && BusyPassed;
+}
+
+// Checks the lookup tables that GeoIPManager builds, and the records it decodes, against libGeoIP
+class GeoIPManagerTest
+{
+public:
+	GeoIPManagerTest();
+	~GeoIPManagerTest();
+	bool Open(LPCTSTR pFileName);
+	bool TestRanges();
+	bool TestV6();
+	bool TestRecords();
+
+private:
+	typedef GeoIPManager::Database Database;
+	typedef GeoIPManager::LookupTable LookupTable;
+
+	void GetUniformAddressList(std::vector<DWORD> *pList);
+	void GetZipfAddressList(std::vector<DWORD> *pList);
+	bool CompareRanges(LPCTSTR pName, const std::vector<DWORD> &AddressList) const;
+	unsigned int GetGeoIPValue(DWORD Address) const;
+	void GetRandomV6Address(IPv6Address *pAddress);
+	bool CompareV6(LPCTSTR pName, GeoIP *pGeoIP, const std::vector<IPv6Address> &AddressList) const;
+	static bool CompareRecord(const GeoIPManager::CityInfo &Info, const GeoIPRecord &Record);
+
+	GeoIPManager m_Manager;
+	Database *m_pDatabase;
+	unsigned int m_Random;
+};
+
+GeoIPManagerTest::GeoIPManagerTest()
+	: m_pDatabase(nullptr)
+	, m_Random(12345)
+{
+}
+
+GeoIPManagerTest::~GeoIPManagerTest()
+{
+	if (m_pDatabase != nullptr)
+		GeoIPManager::ReleaseDatabase(m_pDatabase);
+}
+
+// Opens a legacy database, and waits for its lookup table to be built
+bool GeoIPManagerTest::Open(LPCTSTR pFileName)
+{
+	if (!m_Manager.Open(pFileName)) {
+		cvDebugTrace(TEXT("GeoIP test : \"%s\" could not be opened\n"), pFileName);
+		return false;
+	}
+	if (m_Manager.m_hBuildThread != nullptr)
+		::WaitForSingleObject(m_Manager.m_hBuildThread, INFINITE);
+
+	m_pDatabase = m_Manager.AcquireDatabase(m_Manager.m_pDatabase);
+	if (m_pDatabase == nullptr || m_pDatabase->pGeoIP == nullptr
+			|| m_pDatabase->pLookupTable == nullptr) {
+		cvDebugTrace(TEXT("GeoIP test : \"%s\" has no lookup table to test\n"), pFileName);
+		return false;
+	}
+
+	return true;
+}
+
+// The ranges are checked on addresses spread evenly and on addresses skewed to a few
+bool GeoIPManagerTest::TestRanges()
+{
+	std::vector<DWORD> AddressList;
+	bool Passed = true;
+
+	GetUniformAddressList(&AddressList);
+	Passed &= CompareRanges(TEXT("uniform"), AddressList);
+	GetZipfAddressList(&AddressList);
+	Passed &= CompareRanges(TEXT("Zipf"), AddressList);
+
+	return Passed;
+}
+
+void GeoIPManagerTest::GetUniformAddressList(std::vector<DWORD> *pList)
+{
+	pList->resize(GEOIP_TEST_ADDRESSES);
+	for (size_t i = 0; i < pList->size(); i++)
+		(*pList)[i] = NextRandomAddress(&m_Random);
+}
+
+// The address of the rank k in the pool is taken with the probability in proportion to 1/k
+void GeoIPManagerTest::GetZipfAddressList(std::vector<DWORD> *pList)
+{
+	std::vector<DWORD> Pool(GEOIP_TEST_ZIPF_POOL);
+	std::vector<double> SumList(GEOIP_TEST_ZIPF_POOL);
+	double Sum = 0.0;
+
+	for (size_t i = 0; i < Pool.size(); i++) {
+		Pool[i] = NextRandomAddress(&m_Random);
+		Sum += 1.0 / (double)(i + 1);
+		SumList[i] = Sum;
+	}
+
+	pList->resize(GEOIP_TEST_ADDRESSES);
+	for (size_t i = 0; i < pList->size(); i++) {
+		const double Point = Sum * (double)NextRandom(&m_Random) / (double)(1 << 24);
+		const size_t Rank = std::upper_bound(SumList.begin(), SumList.end(), Point) - SumList.begin();
+		(*pList)[i] = Pool[min(Rank, Pool.size() - 1)];
+	}
+}
+
+// The value of the trie that libGeoIP finds for the address in host byte order
+unsigned int GeoIPManagerTest::GetGeoIPValue(DWORD Address) const
+{
+	GeoIP *pGeoIP = m_pDatabase->pGeoIP;
+
+	if (m_pDatabase->Edition == GEOIP_COUNTRY_EDITION)
+		return (unsigned int)::GeoIP_id_by_ipnum(pGeoIP, Address) + pGeoIP->databaseSegments[0];
+
+	char szAddress[16];
+	::wsprintfA(szAddress, "%u.%u.%u.%u",
+				Address >> 24, (Address >> 16) & 0xFF, (Address >> 8) & 0xFF, Address & 0xFF);
+	return (unsigned int)::GeoIP_record_id_by_addr(pGeoIP, szAddress);
+}
+
+// The value found through the range table must be the one libGeoIP seeks in the trie,
+// and GeoIP_record_by_ipnum() must return a record exactly when the range has one.
+bool GeoIPManagerTest::CompareRanges(LPCTSTR pName, const std::vector<DWORD> &AddressList) const
+{
+	const LookupTable &Table = *m_pDatabase->pLookupTable;
+	GeoIP *pGeoIP = m_pDatabase->pGeoIP;
+	const unsigned int NumNodes = pGeoIP->databaseSegments[0];
+	const bool IsCity = m_pDatabase->Edition != GEOIP_COUNTRY_EDITION;
+	size_t NumMismatched = 0;
+
+	// The lookups are timed apart from the checks
+	LARGE_INTEGER Start, Middle, End;
+	UINT Sum = 0;
+	::QueryPerformanceCounter(&Start);
+	for (size_t i = 0; i < AddressList.size(); i++)
+		Sum += Table.RangeRecordList[GeoIPManager::FindRange(Table, AddressList[i])];
+	::QueryPerformanceCounter(&Middle);
+	for (size_t i = 0; i < AddressList.size(); i++) {
+		UINT Value;
+		if (GeoIPManager::SeekRecord(*m_pDatabase, AddressList[i], &Value))
+			Sum += Value;
+	}
+	::QueryPerformanceCounter(&End);
+
+	for (size_t i = 0; i < AddressList.size(); i++) {
+		const DWORD Address = AddressList[i];
+		const UINT Record = Table.RangeRecordList[GeoIPManager::FindRange(Table, Address)];
+		const unsigned int Value =
+			Record != GeoIPManager::NO_RECORD ? Table.RecordValueList[Record] : NumNodes;
+		const unsigned int Expected = GetGeoIPValue(Address);
+		bool Match = Value == Expected;
+
+		if (IsCity) {
+			GeoIPRecord *pRecord = ::GeoIP_record_by_ipnum(pGeoIP, Address);
+			if ((pRecord != nullptr) != (Record != GeoIPManager::NO_RECORD))
+				Match = false;
+			if (pRecord != nullptr)
+				::GeoIPRecord_delete(pRecord);
+		}
+
+		if (!Match && NumMismatched++ < MAX_TRACED_MISMATCHES)
+			cvDebugTrace(TEXT("GeoIP test ranges : %08x has %u, libGeoIP has %u\n"),
+						 Address, Value, Expected);
+	}
+
+	const bool Passed = NumMismatched == 0;
+	g_TimingSink = Sum;
+	cvDebugTrace(TEXT("GeoIP test ranges %s : %s (%u addresses, %u mismatched, table %u ns, trie %u ns)\n"),
+				 pName, Passed ? TEXT("passed") : TEXT("FAILED"),
+				 (UINT)AddressList.size(), (UINT)NumMismatched,
+				 GetElapsedNanoseconds(Start, Middle, AddressList.size()),
+				 GetElapsedNanoseconds(Middle, End, AddressList.size()));
+
+	return Passed;
+}
+
+// The addresses are taken from 2000::/3, as the rest is mostly unassigned
+void GeoIPManagerTest::GetRandomV6Address(IPv6Address *pAddress)
+{
+	BYTE Bytes[16];
+
+	for (int i = 0; i < 16; i++)
+		Bytes[i] = (BYTE)NextRandom(&m_Random);
+	Bytes[0] = (BYTE)(0x20 | (Bytes[0] & 0x1F));
+	pAddress->SetAddress(Bytes);
+	pAddress->ScopeID = 0;
+}
+
+// The slots of the multibit trie are checked on random addresses, and on the first and
+// the last addresses of the blocks of every prefix length around them. The blocks include
+// the 16-bit prefixes and the 8-bit strides of the slots, and the leaves of the binary trie.
+bool GeoIPManagerTest::TestV6()
+{
+	if (m_pDatabase->szV6FileName[0] == _T('\0')) {
+		cvDebugTrace(TEXT("GeoIP test IPv6 : skipped (no IPv6 database)\n"));
+		return true;
+	}
+	if (m_pDatabase->pLookupTable->V6SlotList.empty()) {
+		cvDebugTrace(TEXT("GeoIP test IPv6 : FAILED (the IPv6 table is not built)\n"));
+		return false;
+	}
+
+	GeoIP *pGeoIP = OpenTestDatabase(m_pDatabase->szV6FileName);
+	if (pGeoIP == nullptr) {
+		cvDebugTrace(TEXT("GeoIP test IPv6 : \"%s\" could not be opened\n"), m_pDatabase->szV6FileName);
+		return false;
+	}
+
+	std::vector<IPv6Address> AddressList(GEOIP_TEST_ADDRESSES);
+	for (size_t i = 0; i < AddressList.size(); i++)
+		GetRandomV6Address(&AddressList[i]);
+	bool Passed = CompareV6(TEXT("random"), pGeoIP, AddressList);
+
+	AddressList.clear();
+	for (int i = 0; i < GEOIP_TEST_V6_EDGES; i++) {
+		IPv6Address Base;
+		GetRandomV6Address(&Base);
+		for (int PrefixLength = 1; PrefixLength < 128; PrefixLength++) {
+			IPv6Address First = Base, Last = Base;
+			for (int Bit = PrefixLength; Bit < 128; Bit++) {
+				const BYTE Mask = (BYTE)(0x80 >> (Bit % 8));
+				First.Bytes[Bit / 8] &= ~Mask;
+				Last.Bytes[Bit / 8] |= Mask;
+			}
+			AddressList.push_back(First);
+			AddressList.push_back(Last);
+		}
+	}
+	Passed &= CompareV6(TEXT("edges"), pGeoIP, AddressList);
+
+	::GeoIP_delete(pGeoIP);
+
+	return Passed;
+}
+
+// FindV6Record() gives NO_RECORD where libGeoIP gives the country ID 0
+bool GeoIPManagerTest::CompareV6(LPCTSTR pName, GeoIP *pGeoIP,
+								 const std::vector<IPv6Address> &AddressList) const
+{
+	const LookupTable &Table = *m_pDatabase->pLookupTable;
+	size_t NumMismatched = 0;
+
+	LARGE_INTEGER Start, Middle, End;
+	UINT Sum = 0;
+	::QueryPerformanceCounter(&Start);
+	for (size_t i = 0; i < AddressList.size(); i++)
+		Sum += GeoIPManager::FindV6Record(Table, AddressList[i]);
+	::QueryPerformanceCounter(&Middle);
+	for (size_t i = 0; i < AddressList.size(); i++) {
+		geoipv6_t Address;
+		::CopyMemory(&Address, AddressList[i].Bytes, sizeof(Address));
+		Sum += (UINT)::GeoIP_id_by_ipnum_v6(pGeoIP, Address);
+	}
+	::QueryPerformanceCounter(&End);
+	g_TimingSink = Sum;
+
+	for (size_t i = 0; i < AddressList.size(); i++) {
+		const UINT Record = GeoIPManager::FindV6Record(Table, AddressList[i]);
+		const UINT ID = Record != GeoIPManager::NO_RECORD ? Record : 0;
+		geoipv6_t Address;
+		::CopyMemory(&Address, AddressList[i].Bytes, sizeof(Address));
+		const UINT Expected = (UINT)::GeoIP_id_by_ipnum_v6(pGeoIP, Address);
+
+		if (ID != Expected && NumMismatched++ < MAX_TRACED_MISMATCHES) {
+			const DWORD *pWords = AddressList[i].DWords;
+			cvDebugTrace(TEXT("GeoIP test IPv6 : %08x%08x%08x%08x has %u, libGeoIP has %u\n"),
+						 ::ntohl(pWords[0]), ::ntohl(pWords[1]), ::ntohl(pWords[2]), ::ntohl(pWords[3]),
+						 ID, Expected);
+		}
+	}
+
+	const bool Passed = NumMismatched == 0;
+	cvDebugTrace(TEXT("GeoIP test IPv6 %s : %s (%u addresses, %u mismatched, table %u ns, libGeoIP %u ns)\n"),
+				 pName, Passed ? TEXT("passed") : TEXT("FAILED"),
+				 (UINT)AddressList.size(), (UINT)NumMismatched,
+				 GetElapsedNanoseconds(Start, Middle, AddressList.size()),
+				 GetElapsedNanoseconds(Middle, End, AddressList.size()));
+
+	return Passed;
+}
+
+// The records are sampled evenly over the record list, and each one is looked up by libGeoIP
+// at the start of the first range that has it. The allocations are counted while decoding,
+// which must make none, and while libGeoIP looks up the same records.
+bool GeoIPManagerTest::TestRecords()
+{
+	if (m_pDatabase->Edition == GEOIP_COUNTRY_EDITION) {
+		cvDebugTrace(TEXT("GeoIP test records : skipped (country database)\n"));
+		return true;
+	}
+
+	const LookupTable &Table = *m_pDatabase->pLookupTable;
+	GeoIP *pGeoIP = m_pDatabase->pGeoIP;
+	const size_t NumRecords = Table.RecordValueList.size();
+	const size_t Step = max(NumRecords / GEOIP_TEST_RECORDS, (size_t)1);
+
+	std::vector<DWORD> RecordAddressList(NumRecords, 0);
+	std::vector<bool> RecordFoundList(NumRecords, false);
+	for (size_t i = 0; i < Table.RangeRecordList.size(); i++) {
+		const UINT Record = Table.RangeRecordList[i];
+		if (Record != GeoIPManager::NO_RECORD && !RecordFoundList[Record]) {
+			RecordAddressList[Record] = Table.RangeStartList[i];
+			RecordFoundList[Record] = true;
+		}
+	}
+
+	std::vector<GeoIPManager::CityInfo> InfoList((NumRecords + Step - 1) / Step);
+
+	// The storage is allocated before the hook is set
+	_CRT_ALLOC_HOOK OldHook = _CrtSetAllocHook(CountAllocHook);
+	g_NumAllocations = 0;
+	size_t NumDecoded = 0;
+	for (size_t Record = 0, i = 0; Record < NumRecords; Record += Step, i++) {
+		::ZeroMemory(&InfoList[i], sizeof(GeoIPManager::CityInfo));
+		if (GeoIPManager::DecodeRecord(*m_pDatabase, Table.RecordValueList[Record], &InfoList[i]))
+			NumDecoded++;
+	}
+	const LONG DecodeAllocations = g_NumAllocations;
+	g_NumAllocations = 0;
+	for (size_t Record = 0; Record < NumRecords; Record += Step) {
+		GeoIPRecord *pRecord = ::GeoIP_record_by_ipnum(pGeoIP, RecordAddressList[Record]);
+		if (pRecord != nullptr)
+			::GeoIPRecord_delete(pRecord);
+	}
+	const LONG GeoIPAllocations = g_NumAllocations;
+	_CrtSetAllocHook(OldHook);
+
+	size_t NumMismatched = 0;
+	for (size_t Record = 0, i = 0; Record < NumRecords; Record += Step, i++) {
+		if (!RecordFoundList[Record])
+			continue;
+		GeoIPRecord *pRecord = ::GeoIP_record_by_ipnum(pGeoIP, RecordAddressList[Record]);
+		if (pRecord == nullptr || !CompareRecord(InfoList[i], *pRecord)) {
+			if (NumMismatched++ < MAX_TRACED_MISMATCHES)
+				cvDebugTrace(TEXT("GeoIP test records : record %u at %08x, \"%s\" \"%s\" \"%s\"\n"),
+							 (UINT)Record, RecordAddressList[Record],
+							 InfoList[i].Country.Code2, InfoList[i].Region, InfoList[i].City);
+		}
+		if (pRecord != nullptr)
+			::GeoIPRecord_delete(pRecord);
+	}
+
+	const bool Passed = NumMismatched == 0 && DecodeAllocations == 0;
+	cvDebugTrace(TEXT("GeoIP test records : %s (%u records, %u decoded, %u mismatched, %d allocations, libGeoIP %d allocations)\n"),
+				 Passed ? TEXT("passed") : TEXT("FAILED"),
+				 (UINT)InfoList.size(), (UINT)NumDecoded, (UINT)NumMismatched,
+				 DecodeAllocations, GeoIPAllocations);
+
+	return Passed;
+}
+
+// Every field of CityInfo is compared with the one of GeoIPRecord
+bool GeoIPManagerTest::CompareRecord(const GeoIPManager::CityInfo &Info, const GeoIPRecord &Record)
+{
+	if (!MatchGeoIPString(Info.Country.Code2, cvLengthOf(Info.Country.Code2), Record.country_code)
+			|| !MatchGeoIPString(Info.Country.Code3, cvLengthOf(Info.Country.Code3), Record.country_code3)
+			|| !MatchGeoIPString(Info.Country.Name, cvLengthOf(Info.Country.Name), Record.country_name)
+			|| !MatchGeoIPString(Info.Region, cvLengthOf(Info.Region), Record.region)
+			|| !MatchGeoIPString(Info.City, cvLengthOf(Info.City), Record.city))
+		return false;
+
+	return Info.EnableLocation
+		&& Info.Latitude == Record.latitude
+		&& Info.Longitude == Record.longitude;
+}
+
+// Without a file name, the database next to the executable is tested
+bool TestGeoIPManager(LPCTSTR pArguments)
+{
+	TCHAR szFileName[MAX_PATH];
+	LPCTSTR p = pArguments;
+	int Length = 0;
+
+	while (*p == _T(' '))
+		p++;
+	const TCHAR Delimiter = *p == _T('"') ? *p++ : _T(' ');
+	while (*p != _T('\0') && *p != Delimiter && Length + 1 < cvLengthOf(szFileName))
+		szFileName[Length++] = *p++;
+	szFileName[Length] = _T('\0');
+
+	if (Length == 0) {
+		TCHAR szDirectory[MAX_PATH];
+		::GetModuleFileName(nullptr, szDirectory, cvLengthOf(szDirectory));
+		::PathRemoveFileSpec(szDirectory);
+		if (!GeoIPManager::FindDatabaseFile(szDirectory, szFileName, cvLengthOf(szFileName))) {
+			cvDebugTrace(TEXT("GeoIP test : No database found\n"));
+			return false;
+		}
+	}
+
+	GeoIPManagerTest Test;
+	if (!Test.Open(szFileName))
+		return false;
+
+	bool Passed = Test.TestRanges();
+	Passed &= Test.TestV6();
+	Passed &= Test.TestRecords();
+
+	return Passed;
+}
+
+
+// Times ConnectionLog::MatchItems() on synthetic snapshots, and checks that
+// every thread count finds the same matches
+class ConnectionLogTest
+{
+public:
+	ConnectionLogTest();
+	bool TestMerge(size_t NumConnections);
+
+private:
+	void MakeConnection(size_t Index, ConnectionSnapshot::ItemInfo *pItem) const;
+	void SetPrevItems(const ConnectionSnapshot &Snapshot);
+	bool CheckMatches(size_t NumConnections) const;
+
+	ProgramCore m_Core;
+	ConnectionLog m_Log;
+};
+
+ConnectionLogTest::ConnectionLogTest()
+	: m_Log(m_Core)
+{
+}
+
+// Each index makes a distinct connection
+void ConnectionLogTest::MakeConnection(size_t Index, ConnectionSnapshot::ItemInfo *pItem) const
+{
+	::ZeroMemory(pItem, sizeof(ConnectionSnapshot::ItemInfo));
+	pItem->Info.Protocol = (Index & 1) != 0 ? ConnectionProtocol::UDP : ConnectionProtocol::TCP;
+	pItem->Info.State = ConnectionState::ESTABLISHED;
+	pItem->Info.LocalAddress = IPAddress(IPv4Address(CV_IP_ADDRESS_V4(192, 168, 0, 1)));
+	pItem->Info.LocalPort = (WORD)(49152 + Index % 16384);
+	pItem->Info.RemoteAddress = IPAddress(IPv4Address(0x0A000000 + (DWORD)(Index / 16)));
+	pItem->Info.RemotePort = 443;
+	pItem->Info.PID = 1000 + (DWORD)(Index % 64);
+	pItem->Info.CreateTimestamp = 131000000000000000LL + (LONGLONG)Index;
+	pItem->EnableStatistics = true;
+	pItem->Statistics.Mask = ConnectionStatistics::MASK_BYTES | ConnectionStatistics::MASK_BANDWIDTH;
+	pItem->Statistics.OutBytes = Index;
+	pItem->Statistics.InBytes = Index * 2;
+}
+
+// The log holds the items of the previous update, in the order of the snapshot
+void ConnectionLogTest::SetPrevItems(const ConnectionSnapshot &Snapshot)
+{
+	m_Log.m_ItemList.clear();
+	for (size_t i = 0; i < Snapshot.ItemList.size(); i++) {
+		ConnectionLog::ItemInfo Item;
+
+		::ZeroMemory(&Item, sizeof(Item));
+		Item.ID = i + 1;
+		Item.Info = Snapshot.ItemList[i].Info;
+		Item.EnableStatistics = Snapshot.ItemList[i].EnableStatistics;
+		Item.Statistics = Snapshot.ItemList[i].Statistics;
+		Item.CreatedTime.Tick = 1000;
+		Item.UpdatedTime.Tick = 1000;
+		Item.NumConnections = 1;
+		m_Log.m_ItemList.push_back(Item);
+	}
+}
+
+// The snapshot drops every LOG_TEST_CLOSED_RATIO-th connection of the previous update,
+// and adds as many new ones at the end
+bool ConnectionLogTest::CheckMatches(size_t NumConnections) const
+{
+	for (size_t i = 0; i < NumConnections; i++) {
+		int Expected;
+		if (i >= NumConnections - NumConnections / LOG_TEST_CLOSED_RATIO)
+			Expected = -1;
+		else
+			Expected = (int)(i + i / (LOG_TEST_CLOSED_RATIO - 1));
+		if (m_Log.m_MatchList[i] != Expected)
+			return false;
+	}
+	return true;
+}
+
+bool ConnectionLogTest::TestMerge(size_t NumConnections)
+{
+	ConnectionSnapshot PrevSnapshot, Snapshot;
+
+	PrevSnapshot.ItemList.resize(NumConnections);
+	for (size_t i = 0; i < NumConnections; i++)
+		MakeConnection(i, &PrevSnapshot.ItemList[i]);
+	SetPrevItems(PrevSnapshot);
+
+	Snapshot.Time.Tick = 2000;
+	Snapshot.NumTCPConnections = (int)(NumConnections / 2);
+	Snapshot.NumUDPConnections = (int)(NumConnections - NumConnections / 2);
+	Snapshot.ItemList.reserve(NumConnections);
+	for (size_t i = 0; i < NumConnections; i++) {
+		if (i % LOG_TEST_CLOSED_RATIO != LOG_TEST_CLOSED_RATIO - 1)
+			Snapshot.ItemList.push_back(PrevSnapshot.ItemList[i]);
+	}
+	for (size_t i = NumConnections; Snapshot.ItemList.size() < NumConnections; i++) {
+		Snapshot.ItemList.push_back(ConnectionSnapshot::ItemInfo());
+		MakeConnection(i, &Snapshot.ItemList.back());
+	}
+
+	bool Passed = true;
+	ULONGLONG SingleTime = 0;
+
+	for (int NumThreads = 1; NumThreads <= 8; NumThreads *= 2) {
+		m_Log.SetMergeThreads(NumThreads);
+
+		// The workers are started by the first merge, which is not timed
+		m_Log.MatchItems(Snapshot, NumConnections);
+		const bool Matched = CheckMatches(NumConnections);
+
+		LARGE_INTEGER Start, End, Frequency;
+		::QueryPerformanceCounter(&Start);
+		for (int i = 0; i < LOG_TEST_MERGES; i++)
+			m_Log.MatchItems(Snapshot, NumConnections);
+		::QueryPerformanceCounter(&End);
+		::QueryPerformanceFrequency(&Frequency);
+
+		const ULONGLONG Time = (ULONGLONG)((End.QuadPart - Start.QuadPart) * 1000000
+										   / (Frequency.QuadPart * LOG_TEST_MERGES));
+		if (NumThreads == 1)
+			SingleTime = Time;
+		cvDebugTrace(TEXT("ConnectionLog test %llu connections, %d threads : %s (%llu us/merge, %llu.%02llu x)\n"),
+					 (ULONGLONG)NumConnections, NumThreads,
+					 Matched ? TEXT("passed") : TEXT("FAILED"), Time,
+					 Time > 0 ? SingleTime / Time : 0ULL,
+					 Time > 0 ? SingleTime * 100 / Time % 100 : 0ULL);
+		Passed &= Matched;
+	}
+
+	return Passed;
+}
+
+bool TestConnectionLog()
+{
+	static const size_t ConnectionsList[] = {20000, 50000, 200000};
+	ConnectionLogTest Test;
+	bool Passed = true;
+
+	for (size_t i = 0; i < cvLengthOf(ConnectionsList); i++)
+		Passed &= Test.TestMerge(ConnectionsList[i]);
+
+	return Passed;
+}
+
+}	// namespace CV
+
+
+#endif	// def _DEBUG
@@ -0,0 +1,50 @@
+/******************************************************************************
+*                                                                             *
+*    SelfTest.h                             Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef CV_SELF_TEST_H
+#define CV_SELF_TEST_H
+
+
+#ifdef _DEBUG
+
+
+namespace CV
+{
+
+// Each test writes its results to the debugger output, and returns false if any of the checks fail
+bool TestHostManager();
+// The file name of the database may follow in pArguments
+bool TestGeoIPManager(LPCTSTR pArguments);
+// Measures the merge of snapshots into the log on 1, 2, 4 and 8 threads
+bool TestConnectionLog();
+
+}	// namespace CV
+
+
+#endif	// def _DEBUG
+
+
+#endif	// ndef CV_SELF_TEST_H
@@ -0,0 +1,174 @@
+/******************************************************************************
+*                                                                             *
+*    SnapshotQueue.cpp                      Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+
+#include "ConnectionViewer.h"
+#include "SnapshotQueue.h"
+
+
+namespace CV
+{
+
+SnapshotQueue::SnapshotQueue()
+	: m_ReadPos(0)
+	, m_WritePos(0)
+	, m_CurReadPos(0)
+	, m_hReleaseEvent(::CreateEvent(nullptr, FALSE, FALSE, nullptr))
+	, m_OverflowPolicy(OVERFLOW_DROP_OLDEST)
+	, m_CancelWrite(false)
+	, m_MaxDepth(0)
+	, m_Pushed(0)
+	, m_Dropped(0)
+	, m_Blocked(0)
+{
+	for (int i = 0; i < QUEUE_SIZE; i++) {
+		m_SlotList[i].State = SLOT_FREE;
+		m_SlotList[i].Sequence = 0;
+	}
+}
+
+SnapshotQueue::~SnapshotQueue()
+{
+	if (m_hReleaseEvent != nullptr)
+		::CloseHandle(m_hReleaseEvent);
+}
+
+// May be called while the producer is running
+void SnapshotQueue::SetOverflowPolicy(OverflowPolicy Policy)
+{
+	m_OverflowPolicy = Policy;
+	::SetEvent(m_hReleaseEvent);
+}
+
+SnapshotQueue::OverflowPolicy SnapshotQueue::GetOverflowPolicy() const
+{
+	return m_OverflowPolicy;
+}
+
+void SnapshotQueue::GetStatistics(QueueStatistics *pStatistics) const
+{
+	pStatistics->Depth = (ULONG)m_WritePos - (ULONG)m_ReadPos;
+	pStatistics->MaxDepth = m_MaxDepth;
+	pStatistics->Pushed = m_Pushed;
+	pStatistics->Dropped = m_Dropped;
+	pStatistics->Blocked = m_Blocked;
+}
+
+// The returned slot must be published with EndWrite() before the next call.
+// Returns nullptr if the write is cancelled by CancelWrite() while blocked.
+ConnectionSnapshot *SnapshotQueue::BeginWrite()
+{
+	const ULONG WritePos = (ULONG)m_WritePos;
+	bool Blocked = false;
+
+	for (;;) {
+		if (m_CancelWrite)
+			return nullptr;
+
+		const ULONG ReadPos = (ULONG)m_ReadPos;
+
+		if (WritePos - ReadPos < QUEUE_SIZE)
+			break;
+
+		// The consumer claims a slot before reading it, so the oldest snapshot
+		// can be dropped only while it is still unclaimed.
+		if (m_OverflowPolicy == OVERFLOW_DROP_OLDEST) {
+			Slot &Oldest = m_SlotList[ReadPos % QUEUE_SIZE];
+			if (::InterlockedCompareExchange(&Oldest.State, SLOT_FREE, SLOT_READY) == SLOT_READY) {
+				::InterlockedExchange(&m_ReadPos, (LONG)(ReadPos + 1));
+				m_Dropped++;
+				continue;
+			}
+		}
+
+		if (!Blocked) {
+			m_Blocked++;
+			Blocked = true;
+		}
+		::WaitForSingleObject(m_hReleaseEvent, INFINITE);
+	}
+
+	ConnectionSnapshot *pSnapshot = &m_SlotList[WritePos % QUEUE_SIZE].Snapshot;
+	pSnapshot->ItemList.clear();
+	return pSnapshot;
+}
+
+void SnapshotQueue::EndWrite()
+{
+	const ULONG WritePos = (ULONG)m_WritePos;
+	Slot &CurSlot = m_SlotList[WritePos % QUEUE_SIZE];
+
+	CurSlot.Sequence = WritePos;
+	::InterlockedExchange(&CurSlot.State, SLOT_READY);
+	::InterlockedExchange(&m_WritePos, (LONG)(WritePos + 1));
+	m_Pushed++;
+
+	const unsigned int Depth = WritePos + 1 - (ULONG)m_ReadPos;
+	if (Depth > m_MaxDepth)
+		m_MaxDepth = Depth;
+}
+
+// Wakes up a producer blocked in BeginWrite(), and makes it return nullptr until reset
+void SnapshotQueue::CancelWrite(bool Cancel)
+{
+	m_CancelWrite = Cancel;
+	if (Cancel)
+		::SetEvent(m_hReleaseEvent);
+}
+
+// Returns nullptr if the queue is empty.
+// The snapshot must be released with EndRead() before the next call. Until then the consumer
+// may swap out its buffers, and the producer reuses whatever is left in them.
+ConnectionSnapshot *SnapshotQueue::BeginRead()
+{
+	for (;;) {
+		const ULONG ReadPos = (ULONG)m_ReadPos;
+
+		if (ReadPos == (ULONG)m_WritePos)
+			return nullptr;
+
+		Slot &CurSlot = m_SlotList[ReadPos % QUEUE_SIZE];
+		if (::InterlockedCompareExchange(&CurSlot.State, SLOT_READING, SLOT_READY) == SLOT_READY) {
+			if (CurSlot.Sequence == ReadPos) {
+				m_CurReadPos = ReadPos;
+				return &CurSlot.Snapshot;
+			}
+			// The snapshot was dropped and the slot reused by a newer one
+			::InterlockedExchange(&CurSlot.State, SLOT_READY);
+		}
+		::SwitchToThread();
+	}
+}
+
+void SnapshotQueue::EndRead()
+{
+	::InterlockedExchange(&m_SlotList[m_CurReadPos % QUEUE_SIZE].State, SLOT_FREE);
+	::InterlockedExchange(&m_ReadPos, (LONG)(m_CurReadPos + 1));
+	::SetEvent(m_hReleaseEvent);
+}
+
+}	// namespace CV
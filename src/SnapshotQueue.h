@@ -0,0 +1,124 @@
+/******************************************************************************
+*                                                                             *
+*    SnapshotQueue.h                        Copyright(c) 2010-2016 itow,y.    *
+*                                                                             *
+******************************************************************************/
+
+/*
+  Connection Viewer
+  Copyright(c) 2010-2016 itow,y.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+
+#ifndef CV_SNAPSHOT_QUEUE_H
+#define CV_SNAPSHOT_QUEUE_H
+
+
+#include <vector>
+#include "Connection.h"
+
+
+namespace CV
+{
+
+// A copy of the connection table taken by the sampler
+struct ConnectionSnapshot
+{
+	struct ItemInfo
+	{
+		ConnectionInfo Info;
+		bool EnableStatistics;
+		ConnectionStatistics Statistics;
+	};
+
+	TimeAndTick Time;
+	int NumTCPConnections;
+	int NumUDPConnections;
+	std::vector<ItemInfo> ItemList;
+};
+
+// Single-producer / single-consumer ring of connection snapshots.
+// The producer and the consumer may run on different threads without a lock.
+class SnapshotQueue
+{
+public:
+	enum OverflowPolicy
+	{
+		OVERFLOW_DROP_OLDEST,
+		OVERFLOW_BLOCK
+	};
+
+	struct QueueStatistics
+	{
+		unsigned int Depth;
+		unsigned int MaxDepth;
+		ULONGLONG Pushed;
+		ULONGLONG Dropped;
+		ULONGLONG Blocked;
+	};
+
+	SnapshotQueue();
+	~SnapshotQueue();
+	void SetOverflowPolicy(OverflowPolicy Policy);
+	OverflowPolicy GetOverflowPolicy() const;
+	void GetStatistics(QueueStatistics *pStatistics) const;
+
+	// Producer
+	ConnectionSnapshot *BeginWrite();
+	void EndWrite();
+	void CancelWrite(bool Cancel);
+
+	// Consumer
+	ConnectionSnapshot *BeginRead();
+	void EndRead();
+
+private:
+	enum { QUEUE_SIZE = 8 };
+
+	enum
+	{
+		SLOT_FREE,
+		SLOT_READY,
+		SLOT_READING
+	};
+
+	struct Slot
+	{
+		volatile LONG State;
+		ULONG Sequence;
+		ConnectionSnapshot Snapshot;
+	};
+
+	Slot m_SlotList[QUEUE_SIZE];
+	volatile LONG m_ReadPos;
+	volatile LONG m_WritePos;
+	ULONG m_CurReadPos;
+	HANDLE m_hReleaseEvent;
+	volatile OverflowPolicy m_OverflowPolicy;
+	volatile bool m_CancelWrite;
+	unsigned int m_MaxDepth;
+	ULONGLONG m_Pushed;
+	ULONGLONG m_Dropped;
+	ULONGLONG m_Blocked;
+};
+
+}	// namespace CV
+
+
+#endif	// ndef CV_SNAPSHOT_QUEUE_H
@@ -25,6 +25,7 @@
 
 
 #include "ConnectionViewer.h"
+#include <climits>
 #include "StringPool.h"
 #include "Utility.h"
 
@@ -32,7 +33,30 @@
 namespace CV
 {
 
-StringPool::StringPool()
+static UINT HashString(LPCTSTR pString, UINT *pLength)
+{
+	UINT Hash = 2166136261U;
+	LPCTSTR p;
+
+	for (p = pString; *p != _T('\0'); p++)
+		Hash = (Hash ^ (UINT)*p) * 16777619U;
+	*pLength = (UINT)(p - pString);
+
+	return Hash;
+}
+
+
+const StringPool::Handle StringPool::INVALID_HANDLE;
+const UINT StringPool::PINNED;
+
+StringPool::StringPool(bool Collation)
+	: m_CurChunk(PINNED)
+	, m_DataSize(0)
+	, m_StringSize(0)
+	, m_LiveSize(0)
+	, m_NumStrings(0)
+	, m_Collation(Collation)
+	, m_CollationSet(CollationLess(m_StringList))
 {
 }
 
@@ -43,43 +67,427 @@ StringPool::~StringPool()
 
 void StringPool::Clear()
 {
-	for (std::set<String>::iterator i = m_Set.begin(); i != m_Set.end(); i++) {
-		delete [] i->m_pString;
-	}
-	m_Set.clear();
+	for (std::vector<ChunkInfo>::iterator i = m_ChunkList.begin(); i != m_ChunkList.end(); i++)
+		delete [] i->pBuffer;
+	m_ChunkList.clear();
+	m_FreeChunkList.clear();
+	m_ReclaimList.clear();
+	m_CurChunk = PINNED;
+	m_DataSize = 0;
+	m_StringSize = 0;
+	m_LiveSize = 0;
+	m_NumStrings = 0;
+	m_StringList.clear();
+	m_FreeHandleList.clear();
+	m_Table.clear();
+	m_CollationSet.clear();
 }
 
 LPCTSTR StringPool::Set(LPCTSTR pString)
+{
+	return Get(Add(pString));
+}
+
+StringPool::Handle StringPool::Add(LPCTSTR pString)
 {
 	if (pString == nullptr)
+		return INVALID_HANDLE;
+
+	UINT Length;
+	const UINT Hash = HashString(pString, &Length);
+	size_t Pos;
+	Handle String = Find(pString, Hash, Length, &Pos);
+	if (String == INVALID_HANDLE)
+		String = Insert(pString, Hash, Length, Pos);
+	Reference(String, true);
+
+	return String;
+}
+
+LPCTSTR StringPool::Get(Handle String) const
+{
+	if (String == INVALID_HANDLE || String > m_StringList.size())
 		return nullptr;
+	return m_StringList[String - 1].pString;
+}
 
-	std::pair<std::set<String>::iterator, bool> Result =
-		m_Set.insert(String(const_cast<LPTSTR>(pString)));
-	if (Result.second)
-		Result.first->m_pString = DuplicateString(pString);
-	return Result.first->Get();
+int StringPool::GetLength(Handle String) const
+{
+	if (String == INVALID_HANDLE || String > m_StringList.size())
+		return 0;
+	return m_StringList[String - 1].Length;
 }
 
+LPCTSTR StringPool::Acquire(LPCTSTR pString)
+{
+	if (pString == nullptr)
+		return nullptr;
+
+	UINT Length;
+	const UINT Hash = HashString(pString, &Length);
+	size_t Pos;
+	Handle String = Find(pString, Hash, Length, &Pos);
+	if (String == INVALID_HANDLE)
+		String = Insert(pString, Hash, Length, Pos);
+	Reference(String, false);
 
-StringPool::String::String(LPTSTR pString)
-	: m_pString(pString)
+	return m_StringList[String - 1].pString;
+}
+
+// pString must be a string returned by this pool
+void StringPool::AddRef(LPCTSTR pString)
 {
+	if (pString != nullptr)
+		Reference(GetHandle(pString), false);
 }
 
-int StringPool::String::Compare(LPCTSTR pString) const
+void StringPool::Release(LPCTSTR pString)
 {
-	LPCTSTR p1, p2;
+	if (pString == nullptr)
+		return;
 
-	p1 = m_pString;
-	p2 = pString;
-	while (*p1 == *p2) {
-		if (*p1 == _T('\0'))
-			return 0;
-		p1++;
-		p2++;
+	StringInfo &Info = m_StringList[GetHandle(pString) - 1];
+	if (Info.RefCount == PINNED)
+		return;
+	if (Info.RefCount == 0) {
+		cvDebugTrace(TEXT("Unreferenced pooled string released\n"));
+		cvDebugBreak();
+		return;
 	}
-	return (int) * p1 - (int) * p2;
+	if (--Info.RefCount == 0) {
+		ChunkInfo &Chunk = m_ChunkList[Info.Chunk];
+
+		m_LiveSize -= (Info.Length + 1) * sizeof(TCHAR);
+		if (--Chunk.NumLiveStrings == 0)
+			m_ReclaimList.push_back(Info.Chunk);
+	}
+}
+
+// Ranks of strings equal ignoring case are the same.
+// Only valid for a pool with collation enabled.
+UINT StringPool::GetCollationRank(LPCTSTR pString) const
+{
+	return m_StringList[GetHandle(pString) - 1].Rank;
+}
+
+// Frees up to MaxChunks chunks that have no referenced strings.
+// A chunk may have been referenced again after it was queued, so it is checked here.
+size_t StringPool::Reclaim(size_t MaxChunks)
+{
+	size_t NumFreed = 0;
+
+	while (!m_ReclaimList.empty() && NumFreed < MaxChunks) {
+		const UINT Chunk = m_ReclaimList.back();
+		m_ReclaimList.pop_back();
+
+		if (m_ChunkList[Chunk].pBuffer != nullptr
+				&& m_ChunkList[Chunk].NumLiveStrings == 0
+				&& Chunk != m_CurChunk) {
+			FreeChunk(Chunk);
+			NumFreed++;
+		}
+	}
+
+	return NumFreed;
+}
+
+size_t StringPool::NumStrings() const
+{
+	return m_NumStrings;
+}
+
+size_t StringPool::GetDataSize() const
+{
+	return m_DataSize;
+}
+
+size_t StringPool::GetLiveSize() const
+{
+	return m_LiveSize;
+}
+
+// Unreferenced strings that are still in the pool
+size_t StringPool::GetDeadSize() const
+{
+	return m_StringSize - m_LiveSize;
+}
+
+StringPool::Handle StringPool::Find(LPCTSTR pString, UINT Hash, UINT Length, size_t *pPos) const
+{
+	if (m_Table.empty()) {
+		*pPos = 0;
+		return INVALID_HANDLE;
+	}
+
+	const size_t Mask = m_Table.size() - 1;
+	size_t Pos = Hash & Mask;
+
+	for (;;) {
+		const Slot &Entry = m_Table[Pos];
+
+		if (Entry.String == INVALID_HANDLE)
+			break;
+		if (Entry.Hash == Hash) {
+			const StringInfo &Info = m_StringList[Entry.String - 1];
+			if (Info.Length == Length
+					&& std::memcmp(Info.pString, pString, Length * sizeof(TCHAR)) == 0)
+				return Entry.String;
+		}
+		Pos = (Pos + 1) & Mask;
+	}
+
+	*pPos = Pos;
+
+	return INVALID_HANDLE;
+}
+
+StringPool::Handle StringPool::Insert(LPCTSTR pString, UINT Hash, UINT Length, size_t Pos)
+{
+	// Keep the load factor at most 1/2
+	if ((m_NumStrings + 1) * 2 > m_Table.size()) {
+		Rehash(max(m_Table.size() * 2, (size_t)MIN_TABLE_SIZE));
+		const size_t Mask = m_Table.size() - 1;
+		for (Pos = Hash & Mask; m_Table[Pos].String != INVALID_HANDLE; Pos = (Pos + 1) & Mask);
+	}
+
+	Handle String;
+	if (!m_FreeHandleList.empty()) {
+		String = m_FreeHandleList.back();
+		m_FreeHandleList.pop_back();
+	} else {
+		m_StringList.push_back(StringInfo());
+		String = (Handle)m_StringList.size();
+	}
+
+	// The handle is stored in front of the string so that it can be found from the pointer
+	UINT Chunk;
+	LPTSTR pBuffer = Allocate(HEADER_LENGTH + Length + 1, &Chunk);
+	*reinterpret_cast<Handle*>(pBuffer) = String;
+	LPTSTR pNewString = pBuffer + HEADER_LENGTH;
+	std::memcpy(pNewString, pString, (Length + 1) * sizeof(TCHAR));
+	m_ChunkList[Chunk].StringList.push_back(String);
+
+	StringInfo &Info = m_StringList[String - 1];
+	Info.pString = pNewString;
+	Info.Length = Length;
+	Info.Hash = Hash;
+	Info.Chunk = Chunk;
+	Info.RefCount = 0;
+	Info.Rank = 0;
+
+	m_Table[Pos].Hash = Hash;
+	m_Table[Pos].String = String;
+	m_NumStrings++;
+	m_StringSize += (Length + 1) * sizeof(TCHAR);
+
+	if (m_Collation)
+		AddCollation(String);
+
+	return String;
+}
+
+StringPool::Handle StringPool::GetHandle(LPCTSTR pString) const
+{
+	return *reinterpret_cast<const Handle*>(pString - HEADER_LENGTH);
+}
+
+void StringPool::Reference(Handle String, bool Pin)
+{
+	StringInfo &Info = m_StringList[String - 1];
+
+	if (Info.RefCount == PINNED)
+		return;
+	if (Info.RefCount == 0) {
+		m_LiveSize += (Info.Length + 1) * sizeof(TCHAR);
+		m_ChunkList[Info.Chunk].NumLiveStrings++;
+	}
+	if (Pin)
+		Info.RefCount = PINNED;
+	else
+		Info.RefCount++;
+}
+
+LPTSTR StringPool::Allocate(size_t Length, UINT *pChunk)
+{
+	// Keep the handles in front of the strings aligned
+	Length = (Length + HEADER_LENGTH - 1) / HEADER_LENGTH * HEADER_LENGTH;
+
+	// Strings longer than a chunk get a chunk of their own
+	if (Length > CHUNK_LENGTH) {
+		*pChunk = NewChunk(Length);
+		m_ChunkList[*pChunk].Size = Length;
+		return m_ChunkList[*pChunk].pBuffer;
+	}
+
+	if (m_CurChunk == PINNED || Length > CHUNK_LENGTH - m_ChunkList[m_CurChunk].Size) {
+		// The previous chunk may have become unreferenced while it was current
+		if (m_CurChunk != PINNED && m_ChunkList[m_CurChunk].NumLiveStrings == 0)
+			m_ReclaimList.push_back(m_CurChunk);
+		m_CurChunk = NewChunk(CHUNK_LENGTH);
+	}
+
+	ChunkInfo &Chunk = m_ChunkList[m_CurChunk];
+	LPTSTR pBuffer = Chunk.pBuffer + Chunk.Size;
+	Chunk.Size += Length;
+	*pChunk = m_CurChunk;
+
+	return pBuffer;
+}
+
+UINT StringPool::NewChunk(size_t Length)
+{
+	UINT Chunk;
+
+	if (!m_FreeChunkList.empty()) {
+		Chunk = m_FreeChunkList.back();
+		m_FreeChunkList.pop_back();
+	} else {
+		Chunk = (UINT)m_ChunkList.size();
+		m_ChunkList.push_back(ChunkInfo());
+	}
+
+	ChunkInfo &Info = m_ChunkList[Chunk];
+	Info.pBuffer = new TCHAR[Length];
+	Info.Size = 0;
+	Info.NumLiveStrings = 0;
+	Info.StringList.clear();
+	m_DataSize += Length * sizeof(TCHAR);
+
+	return Chunk;
+}
+
+void StringPool::FreeChunk(UINT Chunk)
+{
+	ChunkInfo &Info = m_ChunkList[Chunk];
+
+	for (std::vector<Handle>::const_iterator i = Info.StringList.begin(); i != Info.StringList.end(); i++) {
+		StringInfo &String = m_StringList[*i - 1];
+
+		RemoveSlot(*i);
+		if (m_Collation)
+			m_CollationSet.erase(*i);
+		m_StringSize -= (String.Length + 1) * sizeof(TCHAR);
+		String.pString = nullptr;
+		m_FreeHandleList.push_back(*i);
+		m_NumStrings--;
+	}
+
+	m_DataSize -= max(Info.Size, (size_t)CHUNK_LENGTH) * sizeof(TCHAR);
+	delete [] Info.pBuffer;
+	Info.pBuffer = nullptr;
+	Info.StringList.clear();
+	m_FreeChunkList.push_back(Chunk);
+}
+
+void StringPool::Rehash(size_t TableSize)
+{
+	std::vector<Slot> NewTable(TableSize);
+	const size_t Mask = TableSize - 1;
+
+	for (size_t i = 0; i < TableSize; i++)
+		NewTable[i].String = INVALID_HANDLE;
+
+	for (std::vector<Slot>::const_iterator i = m_Table.begin(); i != m_Table.end(); i++) {
+		if (i->String != INVALID_HANDLE) {
+			size_t Pos = i->Hash & Mask;
+			while (NewTable[Pos].String != INVALID_HANDLE)
+				Pos = (Pos + 1) & Mask;
+			NewTable[Pos] = *i;
+		}
+	}
+
+	m_Table.swap(NewTable);
+}
+
+// Removes the slot and shifts the following entries back, so that no tombstones are needed
+void StringPool::RemoveSlot(Handle String)
+{
+	const size_t Mask = m_Table.size() - 1;
+	size_t Pos = m_StringList[String - 1].Hash & Mask;
+
+	while (m_Table[Pos].String != String)
+		Pos = (Pos + 1) & Mask;
+
+	size_t Next = (Pos + 1) & Mask;
+	while (m_Table[Next].String != INVALID_HANDLE) {
+		const size_t Home = m_Table[Next].Hash & Mask;
+		// Move the entry if its home position is not in (Pos, Next]
+		if ((Next > Pos && (Home <= Pos || Home > Next))
+				|| (Next < Pos && Home <= Pos && Home > Next)) {
+			m_Table[Pos] = m_Table[Next];
+			Pos = Next;
+		}
+		Next = (Next + 1) & Mask;
+	}
+	m_Table[Pos].String = INVALID_HANDLE;
+}
+
+// Gives the new string a rank between its neighbors.
+// The ranks are spread evenly again when there is no room between them.
+void StringPool::AddCollation(Handle String)
+{
+	const CollationSet::iterator Pos = m_CollationSet.insert(String).first;
+	StringInfo &Info = m_StringList[String - 1];
+	UINT Lower = 0, Upper = UINT_MAX;
+
+	if (Pos != m_CollationSet.begin()) {
+		CollationSet::iterator Prev = Pos;
+		const StringInfo &PrevInfo = m_StringList[*--Prev - 1];
+		if (::lstrcmpi(PrevInfo.pString, Info.pString) == 0) {
+			Info.Rank = PrevInfo.Rank;
+			return;
+		}
+		Lower = PrevInfo.Rank;
+	}
+
+	CollationSet::iterator Next = Pos;
+	if (++Next != m_CollationSet.end()) {
+		const StringInfo &NextInfo = m_StringList[*Next - 1];
+		if (::lstrcmpi(NextInfo.pString, Info.pString) == 0) {
+			Info.Rank = NextInfo.Rank;
+			return;
+		}
+		Upper = NextInfo.Rank;
+	}
+
+	if (Upper - Lower >= 2)
+		Info.Rank = Lower + (Upper - Lower) / 2;
+	else
+		UpdateCollationRanks();
+}
+
+void StringPool::UpdateCollationRanks()
+{
+	size_t NumGroups = 0;
+	LPCTSTR pPrevString = nullptr;
+
+	for (CollationSet::const_iterator i = m_CollationSet.begin(); i != m_CollationSet.end(); i++) {
+		LPCTSTR pString = m_StringList[*i - 1].pString;
+		if (pPrevString == nullptr || ::lstrcmpi(pPrevString, pString) != 0)
+			NumGroups++;
+		pPrevString = pString;
+	}
+
+	const UINT Step = max((UINT)(UINT_MAX / (NumGroups + 1)), 1U);
+	UINT Rank = 0;
+	pPrevString = nullptr;
+	for (CollationSet::const_iterator i = m_CollationSet.begin(); i != m_CollationSet.end(); i++) {
+		StringInfo &Info = m_StringList[*i - 1];
+		if (pPrevString == nullptr || ::lstrcmpi(pPrevString, Info.pString) != 0)
+			Rank += Step;
+		Info.Rank = Rank;
+		pPrevString = Info.pString;
+	}
+}
+
+
+// Strings equal ignoring case are ordered by the handle, so that each handle has its own place
+bool StringPool::CollationLess::operator()(Handle String1, Handle String2) const
+{
+	const int Cmp = ::lstrcmpi(m_StringList[String1 - 1].pString, m_StringList[String2 - 1].pString);
+	if (Cmp != 0)
+		return Cmp < 0;
+	return String1 < String2;
 }
 
 }	// namespace CV
@@ -29,37 +29,112 @@
 
 
 #include <set>
+#include <vector>
 
 
 namespace CV
 {
 
+// Strings are stored in large chunks and looked up by an open addressing hash table.
+// Strings returned by Set() and Add() are kept until Clear() is called.
+// Strings returned by Acquire() are reference counted, and a chunk is freed by
+// Reclaim() once none of its strings is referenced.
+// If collation is enabled, each string has a rank in case-insensitive order,
+// so that sorting can compare the ranks instead of the strings.
 class StringPool
 {
 public:
-	StringPool();
+	typedef UINT Handle;
+	static const Handle INVALID_HANDLE = 0;
+
+	StringPool(bool Collation = false);
 	~StringPool();
 	void Clear();
 	LPCTSTR Set(LPCTSTR pString);
+	Handle Add(LPCTSTR pString);
+	LPCTSTR Get(Handle String) const;
+	int GetLength(Handle String) const;
+	LPCTSTR Acquire(LPCTSTR pString);
+	void AddRef(LPCTSTR pString);
+	void Release(LPCTSTR pString);
+	UINT GetCollationRank(LPCTSTR pString) const;
+	size_t Reclaim(size_t MaxChunks);
+	size_t NumStrings() const;
+	size_t GetDataSize() const;
+	size_t GetLiveSize() const;
+	size_t GetDeadSize() const;
 
 private:
-	class String
+	enum
+	{
+		CHUNK_LENGTH		= 32 * 1024,
+		MIN_TABLE_SIZE		= 256,
+		HEADER_LENGTH		= sizeof(Handle) / sizeof(TCHAR)
+	};
+
+	static const UINT PINNED = 0xFFFFFFFFU;
+
+	struct StringInfo
+	{
+		LPCTSTR pString;
+		UINT Length;
+		UINT Hash;
+		UINT Chunk;
+		UINT RefCount;
+		UINT Rank;
+	};
+
+	class CollationLess
 	{
-		mutable LPTSTR m_pString;
+		const std::vector<StringInfo> &m_StringList;
 
 	public:
-		String(LPTSTR pString);
-		LPCTSTR Get() const { return m_pString; }
-		int Compare(LPCTSTR pString) const;
-		bool operator<(const String &RVal) const
-		{
-			return Compare(RVal.m_pString) < 0;
-		}
-
-		friend class StringPool;
+		CollationLess(const std::vector<StringInfo> &StringList) : m_StringList(StringList) {}
+		bool operator()(Handle String1, Handle String2) const;
+	};
+
+	typedef std::set<Handle, CollationLess> CollationSet;
+
+	// The hash is kept in the slot so that most mismatches don't touch the string
+	struct Slot
+	{
+		UINT Hash;
+		Handle String;
+	};
+
+	struct ChunkInfo
+	{
+		LPTSTR pBuffer;
+		size_t Size;
+		size_t NumLiveStrings;
+		std::vector<Handle> StringList;
 	};
 
-	std::set<String> m_Set;
+	Handle Find(LPCTSTR pString, UINT Hash, UINT Length, size_t *pPos) const;
+	Handle Insert(LPCTSTR pString, UINT Hash, UINT Length, size_t Pos);
+	Handle GetHandle(LPCTSTR pString) const;
+	void Reference(Handle String, bool Pin);
+	LPTSTR Allocate(size_t Length, UINT *pChunk);
+	UINT NewChunk(size_t Length);
+	void FreeChunk(UINT Chunk);
+	void Rehash(size_t TableSize);
+	void RemoveSlot(Handle String);
+	void AddCollation(Handle String);
+	void UpdateCollationRanks();
+
+	std::vector<ChunkInfo> m_ChunkList;
+	std::vector<UINT> m_FreeChunkList;
+	std::vector<UINT> m_ReclaimList;
+	UINT m_CurChunk;
+	size_t m_DataSize;
+	size_t m_StringSize;
+	size_t m_LiveSize;
+	size_t m_NumStrings;
+	std::vector<StringInfo> m_StringList;
+	std::vector<Handle> m_FreeHandleList;
+	std::vector<Slot> m_Table;
+	bool m_Collation;
+	CollationSet m_CollationSet;
 };
 
 }	// namespace CV
@@ -106,6 +106,11 @@ public:
 		::EnterCriticalSection(&m_CriticalSection);
 	}
 
+	bool TryLock()
+	{
+		return ::TryEnterCriticalSection(&m_CriticalSection) != FALSE;
+	}
+
 	void Unlock()
 	{
 		::LeaveCriticalSection(&m_CriticalSection);
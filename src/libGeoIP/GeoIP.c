@@ -25,6 +25,8 @@ static geoipv6_t IPV6_NULL;
 #if !defined(_WIN32) 
 #include <netdb.h>
 #include <sys/mman.h>
+#else /* !defined(_WIN32) */ 
+#include <io.h> /* for _get_osfhandle */
 #endif /* !defined(_WIN32) */ 
 
 #include <errno.h>
@@ -758,6 +760,22 @@ GeoIP* GeoIP_open (const char * filename, int flags) {
 				free(gi);
 				return NULL;
 			    }
+#else
+			    /* The view keeps the mapping alive after its handle is closed */
+			    HANDLE hMapping = CreateFileMappingA((HANDLE)_get_osfhandle(fileno(gi->GeoIPDatabase)),
+								 NULL, PAGE_READONLY, 0, 0, NULL);
+			    gi->cache = NULL;
+			    if ( hMapping != NULL ) {
+				gi->cache = (unsigned char *) MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+				CloseHandle(hMapping);
+			    }
+			    if ( gi->cache == NULL ) {
+				fprintf(stderr,"Error mapping file %s\n",filename);
+				fclose(gi->GeoIPDatabase);
+				free(gi->file_path);
+				free(gi);
+				return NULL;
+			    }
 #endif
 			} else {
 			    gi->cache = (unsigned char *) malloc(sizeof(unsigned char) * buf.st_size);
@@ -816,6 +834,8 @@ void GeoIP_delete (GeoIP *gi) {
 	    if ( gi->flags & GEOIP_MMAP_CACHE ) {
 #if !defined(_WIN32)
 		munmap(gi->cache, gi->size);
+#else
+		UnmapViewOfFile(gi->cache);
 #endif
 	    } else {
 		free(gi->cache);
@@ -85,8 +85,10 @@
 #define CM_LISTCOLUMN_OUT_BANDWIDTH						(CM_LISTCOLUMN_FIRST+17)
 #define CM_LISTCOLUMN_MAX_IN_BANDWIDTH					(CM_LISTCOLUMN_FIRST+18)
 #define CM_LISTCOLUMN_MAX_OUT_BANDWIDTH					(CM_LISTCOLUMN_FIRST+19)
-#define CM_LISTCOLUMN_LAST								CM_LISTCOLUMN_MAX_OUT_BANDWIDTH
-#define CM_LOGCOLUMN_FIRST								420
+#define CM_LISTCOLUMN_AS_NUMBER							(CM_LISTCOLUMN_FIRST+20)
+#define CM_LISTCOLUMN_ORGANIZATION						(CM_LISTCOLUMN_FIRST+21)
+#define CM_LISTCOLUMN_LAST								CM_LISTCOLUMN_ORGANIZATION
+#define CM_LOGCOLUMN_FIRST								425
 #define CM_LOGCOLUMN_CREATE_TIME						(CM_LOGCOLUMN_FIRST+0)
 #define CM_LOGCOLUMN_UPDATE_TIME						(CM_LOGCOLUMN_FIRST+1)
 #define CM_LOGCOLUMN_PROCESS_NAME						(CM_LOGCOLUMN_FIRST+2)
@@ -109,7 +111,10 @@
 #define CM_LOGCOLUMN_OUT_BANDWIDTH						(CM_LOGCOLUMN_FIRST+19)
 #define CM_LOGCOLUMN_MAX_IN_BANDWIDTH					(CM_LOGCOLUMN_FIRST+20)
 #define CM_LOGCOLUMN_MAX_OUT_BANDWIDTH					(CM_LOGCOLUMN_FIRST+21)
-#define CM_LOGCOLUMN_LAST								CM_LOGCOLUMN_MAX_OUT_BANDWIDTH
+#define CM_LOGCOLUMN_CONNECTIONS						(CM_LOGCOLUMN_FIRST+22)
+#define CM_LOGCOLUMN_AS_NUMBER							(CM_LOGCOLUMN_FIRST+23)
+#define CM_LOGCOLUMN_ORGANIZATION						(CM_LOGCOLUMN_FIRST+24)
+#define CM_LOGCOLUMN_LAST								CM_LOGCOLUMN_ORGANIZATION
 #define CM_INTERFACECOLUMN_FIRST						450
 #define CM_INTERFACECOLUMN_INTERFACE_LUID				(CM_INTERFACECOLUMN_FIRST+0)
 #define CM_INTERFACECOLUMN_INTERFACE_INDEX				(CM_INTERFACECOLUMN_FIRST+1)
@@ -281,8 +286,10 @@
 #define IDS_CONNECTIONLIST_COLUMN_OUT_BANDWIDTH		(IDS_CONNECTIONLIST_COLUMN_FIRST+17)
 #define IDS_CONNECTIONLIST_COLUMN_MAX_IN_BANDWIDTH	(IDS_CONNECTIONLIST_COLUMN_FIRST+18)
 #define IDS_CONNECTIONLIST_COLUMN_MAX_OUT_BANDWIDTH	(IDS_CONNECTIONLIST_COLUMN_FIRST+19)
+#define IDS_CONNECTIONLIST_COLUMN_AS_NUMBER			(IDS_CONNECTIONLIST_COLUMN_FIRST+20)
+#define IDS_CONNECTIONLIST_COLUMN_ORGANIZATION		(IDS_CONNECTIONLIST_COLUMN_FIRST+21)
 
-#define IDS_CONNECTIONLOG_COLUMN_FIRST				2020
+#define IDS_CONNECTIONLOG_COLUMN_FIRST				2025
 #define IDS_CONNECTIONLOG_COLUMN_CREATE_TIME		(IDS_CONNECTIONLOG_COLUMN_FIRST+0)
 #define IDS_CONNECTIONLOG_COLUMN_UPDATE_TIME		(IDS_CONNECTIONLOG_COLUMN_FIRST+1)
 #define IDS_CONNECTIONLOG_COLUMN_PROCESS_NAME		(IDS_CONNECTIONLOG_COLUMN_FIRST+2)
@@ -305,6 +312,9 @@
 #define IDS_CONNECTIONLOG_COLUMN_OUT_BANDWIDTH		(IDS_CONNECTIONLOG_COLUMN_FIRST+19)
 #define IDS_CONNECTIONLOG_COLUMN_MAX_IN_BANDWIDTH	(IDS_CONNECTIONLOG_COLUMN_FIRST+20)
 #define IDS_CONNECTIONLOG_COLUMN_MAX_OUT_BANDWIDTH	(IDS_CONNECTIONLOG_COLUMN_FIRST+21)
+#define IDS_CONNECTIONLOG_COLUMN_CONNECTIONS		(IDS_CONNECTIONLOG_COLUMN_FIRST+22)
+#define IDS_CONNECTIONLOG_COLUMN_AS_NUMBER			(IDS_CONNECTIONLOG_COLUMN_FIRST+23)
+#define IDS_CONNECTIONLOG_COLUMN_ORGANIZATION		(IDS_CONNECTIONLOG_COLUMN_FIRST+24)
 
 #define IDS_INTERFACELIST_COLUMN_FIRST							2050
 #define IDS_INTERFACELIST_COLUMN_INTERFACE_LUID					(IDS_INTERFACELIST_COLUMN_FIRST+0)
@@ -424,6 +434,7 @@
 #define IDS_ERROR_FILTER_ALREADY_EXISTS_TITLE	3020
 #define IDS_ERROR_FILTER_ACCESS_DENIED_HEADER	3021
 #define IDS_ERROR_FILTER_ACCESS_DENIED			3022
+#define IDS_ERROR_GEOIP_OPEN					3023
 
 #define IDS_WHOIS_ERROR_FIRST					3100
 #define IDS_WHOIS_ERROR_GET_HOST				(IDS_WHOIS_ERROR_FIRST+1)